@@ -68,7 +68,7 @@ struct UploadsView: View {
                         .fill(.separator)
                         .frame(maxWidth: .infinity, maxHeight: 2)
                         .padding(EdgeInsets(top: -5, leading: 15, bottom: 0, trailing: 0))
-                    PhotoGridView(idealGridItemSize: $idealGridItemSize, minGridItemSize: minGridItemSize, mongoHolder: mongoHolder, appDelegate: appDelegate, filter: ["upload_id": .objectID(upload._id)], horizontalScroll: false)
+                    PhotoGridView(idealGridItemSize: $idealGridItemSize, minGridItemSize: minGridItemSize, mongoHolder: mongoHolder, appDelegate: appDelegate, filter: upload.filesFilter, horizontalScroll: false)
                         .frame(width: geometry.size.width)
                 }
             } else {
@@ -87,7 +87,7 @@ struct UploadsView: View {
                                             Button("Download") {
                                                 Task {
                                                     guard let client = mongoHolder.client else { return }
-                                                    for try await doc in try await client.db("media_organizer").collection("files").find(["upload_id": BSON.objectID(upload._id)], options: FindOptions(sort: ["time": -1])) {
+                                                    for try await doc in try await client.db("media_organizer").collection("files").find(upload.filesFilter, options: FindOptions(sort: ["time": -1])) {
                                                         if let item: MediaItem = try? BSONDecoder().decode(MediaItem.self, from: doc) {
                                                             DownloadManager.shared.download(item)
                                                         }
@@ -112,7 +112,7 @@ struct UploadsView: View {
                                         .fill(.separator)
                                         .frame(maxWidth: .infinity, maxHeight: 2)
                                         .padding(EdgeInsets(top: -5, leading: 15, bottom: 0, trailing: 0))
-                                    PhotoGridView(idealGridItemSize: $idealGridItemSize, minGridItemSize: minGridItemSize, mongoHolder: mongoHolder, appDelegate: appDelegate, filter: ["upload_id": .objectID(upload._id)], horizontalScroll: true)
+                                    PhotoGridView(idealGridItemSize: $idealGridItemSize, minGridItemSize: minGridItemSize, mongoHolder: mongoHolder, appDelegate: appDelegate, filter: upload.filesFilter, horizontalScroll: true)
                                         .frame(width: geometry.size.width, height: CGFloat(idealGridItemSize))
                                 }
                             }
@@ -15,6 +15,12 @@ struct Upload: Codable, Hashable, Identifiable {
 
     var _id: BSONObjectID
     var time: Date
+
+    //files this upload stored, and files already in the library that it was linked to through upload_ids
+    //(documents from before upload_ids only have upload_id)
+    var filesFilter: BSONDocument {
+        return ["$or": .array([.document(["upload_id": .objectID(_id)]), .document(["upload_ids": .objectID(_id)])])]
+    }
 }
 
 class UploadsViewModel: ObservableObject {
@@ -41,7 +47,7 @@ class UploadsViewModel: ObservableObject {
         for try await doc in try await uploadsCollection.find([:], options: options) {
             if let upload: Upload = try? BSONDecoder().decode(Upload.self, from: doc) {
                 uploads.append(upload)
-                let uploadCount = try await client.db("media_organizer").collection("files").countDocuments(["upload_id": BSON.objectID(upload._id)])
+                let uploadCount = try await client.db("media_organizer").collection("files").countDocuments(upload.filesFilter)
                 uploadCounts[upload._id] = uploadCount
             }
         }
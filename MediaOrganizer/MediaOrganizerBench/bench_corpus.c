@@ -0,0 +1,588 @@
+//
+//  bench_corpus.c
+//  MediaOrganizerBench
+//
+//  Created by John Bridge on 10/17/26.
+//
+
+#include "bench_corpus.h"
+#include <dirent.h>
+#include <strings.h>
+
+#define TIFF_BYTE 1
+#define TIFF_ASCII 2
+#define TIFF_SHORT 3
+#define TIFF_LONG 4
+#define TIFF_RATIONAL 5
+#define TIFF_UNDEFINED 7
+#define TIFF_SRATIONAL 10
+#define TIFF_MAX_NUMBERS 18
+
+//Growable output buffer, numbers are written in the byte order of the TIFF structure being built
+struct CorpusBuffer {
+    unsigned char* data;
+    size_t size;
+    size_t capacity;
+    bool big_endian;
+};
+
+//One IFD entry. Entries of an IFD must be in ascending tag order
+struct TIFFEntry {
+    uint16_t tag;
+    uint16_t type;
+    uint32_t count;
+    uint32_t numbers[TIFF_MAX_NUMBERS];    //SHORT/LONG values, or numerator/denominator pairs of (S)RATIONALs
+    const void* bytes;      //BYTE/ASCII/UNDEFINED contents
+};
+
+//Templates shared by every file of the corpus: only their EXIF differs
+struct CorpusTemplates {
+    unsigned char* image;       //full resolution JPEG, from its first marker after SOI
+    size_t image_size;
+    unsigned char* preview;     //complete JPEG
+    size_t preview_size;
+    unsigned char* exif_thumb;  //complete JPEG
+    size_t exif_thumb_size;
+    unsigned char* raw;         //16 bit little endian CFA data, 14 bits used
+    size_t raw_size;
+    int width;
+    int height;
+};
+
+void BenchCorpusOptions_setDefaults(BenchCorpusOptions options) {
+    options->files = BENCH_CORPUS_FILES;
+    options->files_per_folder = BENCH_CORPUS_FILES_PER_FOLDER;
+    options->raw_percent = BENCH_CORPUS_RAW_PERCENT;
+    options->width = BENCH_CORPUS_WIDTH;
+    options->shape = BENCH_CORPUS_CARD;
+}
+
+static uint32_t corpusRandom(uint32_t *state) {
+    uint32_t x = *state;
+    x ^= x << 13;
+    x ^= x >> 17;
+    x ^= x << 5;
+    *state = x;
+    return x;
+}
+
+static bool corpusReserve(struct CorpusBuffer *buffer, size_t size) {
+    if(buffer->size+size <= buffer->capacity)
+        return true;
+    size_t capacity = buffer->capacity > 0 ? buffer->capacity : 4096;
+    while(capacity < buffer->size+size)
+        capacity *= 2;
+    unsigned char* data = realloc(buffer->data, capacity);
+    if(data == NULL)
+        return false;
+    buffer->data = data;
+    buffer->capacity = capacity;
+    return true;
+}
+
+static bool corpusPutBytes(struct CorpusBuffer *buffer, const void* bytes, size_t size) {
+    if(!corpusReserve(buffer, size))
+        return false;
+    memcpy(buffer->data+buffer->size, bytes, size);
+    buffer->size += size;
+    return true;
+}
+
+static bool corpusPut16(struct CorpusBuffer *buffer, uint16_t value) {
+    unsigned char bytes[2];
+    bytes[buffer->big_endian ? 0 : 1] = (unsigned char) (value >> 8);
+    bytes[buffer->big_endian ? 1 : 0] = (unsigned char) value;
+    return corpusPutBytes(buffer, bytes, 2);
+}
+
+static bool corpusPut32(struct CorpusBuffer *buffer, uint32_t value) {
+    unsigned char bytes[4];
+    for(int i=0; i<4; i++)
+        bytes[buffer->big_endian ? 3-i : i] = (unsigned char) (value >> (8*i));
+    return corpusPutBytes(buffer, bytes, 4);
+}
+
+static size_t tiffTypeSize(uint16_t type) {
+    switch(type) {
+        case TIFF_SHORT:
+            return 2;
+        case TIFF_LONG:
+            return 4;
+        case TIFF_RATIONAL:
+        case TIFF_SRATIONAL:
+            return 8;
+        default:
+            return 1;
+    }
+}
+
+static void tiffNumbers(struct TIFFEntry *entry, uint16_t tag, uint16_t type, uint32_t count, const uint32_t* numbers) {
+    entry->tag = tag;
+    entry->type = type;
+    entry->count = count;
+    entry->bytes = NULL;
+    size_t numbers_count = type == TIFF_RATIONAL || type == TIFF_SRATIONAL ? count*2 : count;
+    memcpy(entry->numbers, numbers, numbers_count*sizeof(uint32_t));
+}
+
+static void tiffLong(struct TIFFEntry *entry, uint16_t tag, uint32_t value) {
+    tiffNumbers(entry, tag, TIFF_LONG, 1, &value);
+}
+
+static void tiffShort(struct TIFFEntry *entry, uint16_t tag, uint32_t value) {
+    tiffNumbers(entry, tag, TIFF_SHORT, 1, &value);
+}
+
+static void tiffRational(struct TIFFEntry *entry, uint16_t tag, uint32_t numerator, uint32_t denominator) {
+    uint32_t numbers[2] = {numerator, denominator};
+    tiffNumbers(entry, tag, TIFF_RATIONAL, 1, numbers);
+}
+
+static void tiffBytes(struct TIFFEntry *entry, uint16_t tag, uint16_t type, uint32_t count, const void* bytes) {
+    entry->tag = tag;
+    entry->type = type;
+    entry->count = count;
+    entry->bytes = bytes;
+}
+
+static void tiffAscii(struct TIFFEntry *entry, uint16_t tag, const char* str) {
+    tiffBytes(entry, tag, TIFF_ASCII, (uint32_t) strlen(str)+1, str);
+}
+
+//Bytes an IFD takes, including the values that don't fit in their entry
+static size_t tiffIFDSize(const struct TIFFEntry *entries, int count) {
+    size_t size = 2+12*(size_t) count+4;
+    for(int i=0; i<count; i++) {
+        size_t value_size = tiffTypeSize(entries[i].type)*entries[i].count;
+        if(value_size > 4)
+            size += (value_size+1) & ~(size_t) 1;
+    }
+    return size;
+}
+
+static bool tiffPutValue(struct CorpusBuffer *buffer, const struct TIFFEntry *entry) {
+    if(entry->bytes != NULL)
+        return corpusPutBytes(buffer, entry->bytes, entry->count);
+    bool result = true;
+    size_t numbers_count = entry->type == TIFF_RATIONAL || entry->type == TIFF_SRATIONAL ? entry->count*2 : entry->count;
+    for(size_t i=0; i<numbers_count && result; i++)
+        result = entry->type == TIFF_SHORT ? corpusPut16(buffer, (uint16_t) entry->numbers[i]) : corpusPut32(buffer, entry->numbers[i]);
+    return result;
+}
+
+//Writes the IFD at the end of buffer, its out of line values right after it. Offsets are from the start of buffer
+static bool tiffPutIFD(struct CorpusBuffer *buffer, const struct TIFFEntry *entries, int count, uint32_t next_ifd) {
+    size_t start = buffer->size;
+    size_t values = start+2+12*(size_t) count+4;
+    if(!corpusPut16(buffer, (uint16_t) count))
+        return false;
+    for(int i=0; i<count; i++) {
+        size_t value_size = tiffTypeSize(entries[i].type)*entries[i].count;
+        if(!corpusPut16(buffer, entries[i].tag) || !corpusPut16(buffer, entries[i].type) || !corpusPut32(buffer, entries[i].count))
+            return false;
+        if(value_size > 4) {
+            if(!corpusPut32(buffer, (uint32_t) values))
+                return false;
+            values += (value_size+1) & ~(size_t) 1;
+        } else {
+            //inline values are left aligned in the 4 bytes
+            size_t before = buffer->size;
+            if(!tiffPutValue(buffer, &entries[i]) || !corpusReserve(buffer, 4))
+                return false;
+            memset(buffer->data+buffer->size, 0, 4-(buffer->size-before));
+            buffer->size = before+4;
+        }
+    }
+    if(!corpusPut32(buffer, next_ifd))
+        return false;
+    for(int i=0; i<count; i++) {
+        size_t value_size = tiffTypeSize(entries[i].type)*entries[i].count;
+        if(value_size <= 4)
+            continue;
+        if(!tiffPutValue(buffer, &entries[i]))
+            return false;
+        if(value_size % 2 == 1 && !corpusPutBytes(buffer, "", 1))
+            return false;
+    }
+    return true;
+}
+
+//Smooth gradients with some grain, so the JPEGs compress to roughly the size of a photo's
+static bool corpusEncodeJPEG(int width, int height, uint32_t seed, unsigned char** out, size_t *out_size) {
+    struct jpeg_compress_struct cinfo;
+    struct jpeg_error_mgr jerr;
+    cinfo.err = jpeg_std_error(&jerr);
+    jpeg_create_compress(&cinfo);
+    unsigned char* mem = NULL;
+    unsigned long mem_size = 0;
+    jpeg_mem_dest(&cinfo, &mem, &mem_size);
+    cinfo.image_width = width;
+    cinfo.image_height = height;
+    cinfo.input_components = 3;
+    cinfo.in_color_space = JCS_RGB;
+    jpeg_set_defaults(&cinfo);
+    //cameras write EXIF in place of a JFIF header
+    cinfo.write_JFIF_header = FALSE;
+    jpeg_set_quality(&cinfo, BENCH_CORPUS_JPEG_QUALITY, TRUE);
+    JSAMPLE* row = malloc((size_t) width*3);
+    if(row == NULL) {
+        jpeg_destroy_compress(&cinfo);
+        free(mem);
+        return false;
+    }
+    jpeg_start_compress(&cinfo, TRUE);
+    uint32_t state = seed | 1;
+    while(cinfo.next_scanline < cinfo.image_height) {
+        int y = cinfo.next_scanline;
+        for(int x=0; x<width; x++) {
+            uint32_t grain = corpusRandom(&state);
+            row[x*3] = (JSAMPLE) (40 + x*160/width + (grain & 31));
+            row[x*3+1] = (JSAMPLE) (60 + y*140/height + ((grain >> 8) & 31));
+            row[x*3+2] = (JSAMPLE) (30 + (x+y)*120/(width+height) + ((grain >> 16) & 31));
+        }
+        JSAMPROW rows[1] = {row};
+        jpeg_write_scanlines(&cinfo, rows, 1);
+    }
+    jpeg_finish_compress(&cinfo);
+    jpeg_destroy_compress(&cinfo);
+    free(row);
+    *out = mem;
+    *out_size = mem_size;
+    return true;
+}
+
+static void free_CorpusTemplates(struct CorpusTemplates *templates) {
+    free(templates->image);
+    free(templates->preview);
+    free(templates->exif_thumb);
+    free(templates->raw);
+}
+
+static bool corpusCreateTemplates(struct CorpusTemplates *templates, BenchCorpusOptions options) {
+    memset(templates, 0, sizeof(struct CorpusTemplates));
+    templates->width = options->width;
+    templates->height = options->width*2/3;
+    unsigned char* image = NULL;
+    size_t image_size = 0;
+    if(!corpusEncodeJPEG(templates->width, templates->height, 1, &image, &image_size)
+       || !corpusEncodeJPEG(BENCH_CORPUS_PREVIEW_WIDTH, BENCH_CORPUS_PREVIEW_HEIGHT, 2, &templates->preview, &templates->preview_size)
+       || !corpusEncodeJPEG(BENCH_CORPUS_EXIF_THUMB_WIDTH, BENCH_CORPUS_EXIF_THUMB_HEIGHT, 3, &templates->exif_thumb, &templates->exif_thumb_size)) {
+        free(image);
+        free_CorpusTemplates(templates);
+        return false;
+    }
+    //each JPEG file gets its own APP1 between the SOI and the rest
+    templates->image_size = image_size-2;
+    templates->image = malloc(templates->image_size);
+    if(templates->image != NULL)
+        memcpy(templates->image, image+2, templates->image_size);
+    free(image);
+    templates->raw_size = (size_t) templates->width*templates->height*2;
+    templates->raw = malloc(templates->raw_size);
+    if(templates->image == NULL || templates->raw == NULL) {
+        free_CorpusTemplates(templates);
+        return false;
+    }
+    uint32_t state = 4;
+    for(int y=0; y<templates->height; y++) {
+        for(int x=0; x<templates->width; x++) {
+            uint32_t value = 512 + (uint32_t) x*8000/templates->width + (corpusRandom(&state) & 1023);
+            size_t offset = ((size_t) y*templates->width+x)*2;
+            templates->raw[offset] = (unsigned char) value;
+            templates->raw[offset+1] = (unsigned char) (value >> 8);
+        }
+    }
+    return true;
+}
+
+//EXIF IFD shared by both file types. strings must hold 20 bytes of date and 33 of unique id
+static int corpusExifEntries(struct TIFFEntry *entries, size_t index, int width, int height, struct tm *capture_date, char* date, char* unique_id) {
+    strftime(date, 20, "%Y:%m:%d %H:%M:%S", capture_date);
+    snprintf(unique_id, 33, "%016llx%016llx", (unsigned long long) index, (unsigned long long) index*0x9E3779B97F4A7C15ULL);
+    int count = 0;
+    tiffRational(&entries[count++], 33434, 1, 250);     //ExposureTime
+    tiffRational(&entries[count++], 33437, 28, 10);     //FNumber
+    tiffShort(&entries[count++], 34855, 400);           //ISOSpeedRatings
+    tiffAscii(&entries[count++], 36867, date);          //DateTimeOriginal
+    tiffRational(&entries[count++], 37386, 50, 1);      //FocalLength
+    tiffLong(&entries[count++], 40962, width);          //PixelXDimension
+    tiffLong(&entries[count++], 40963, height);         //PixelYDimension
+    tiffAscii(&entries[count++], 42016, unique_id);     //ImageUniqueID
+    tiffAscii(&entries[count++], 42036, "Bench 50mm F1.8");    //LensModel
+    return count;
+}
+
+static bool corpusWriteAll(int fd, const void* data, size_t size) {
+    const unsigned char* position = data;
+    while(size > 0) {
+        ssize_t written = write(fd, position, size);
+        if(written < 0 && errno == EINTR)
+            continue;
+        if(written <= 0)
+            return false;
+        position += written;
+        size -= (size_t) written;
+    }
+    return true;
+}
+
+static bool corpusWriteFile(const char* path, const void* first, size_t first_size, const void* second, size_t second_size, uint64_t *bytes) {
+    int fd = open(path, O_WRONLY|O_CREAT|O_TRUNC, 0644);
+    if(fd < 0) {
+        fprintf(stderr, "Could not create %s: %s\n", path, strerror(errno));
+        return false;
+    }
+    bool result = corpusWriteAll(fd, first, first_size) && corpusWriteAll(fd, second, second_size);
+    if(close(fd) != 0)
+        result = false;
+    if(!result)
+        fprintf(stderr, "Could not write %s\n", path);
+    *bytes += first_size+second_size;
+    return result;
+}
+
+//SOI, APP1 holding big endian EXIF with a thumbnail in IFD1, then the shared image
+static bool corpusWriteJPEG(const char* path, struct CorpusTemplates *templates, size_t index, struct tm *capture_date, uint64_t *bytes) {
+    struct TIFFEntry ifd0[4], exif[9], ifd1[3];
+    char date[20], unique_id[33];
+    int exif_count = corpusExifEntries(exif, index, templates->width, templates->height, capture_date, date, unique_id);
+    tiffAscii(&ifd0[0], 271, "MediaOrganizer");  //Make
+    tiffAscii(&ifd0[1], 272, "Bench JPEG");      //Model
+    tiffShort(&ifd0[2], 274, 1);                 //Orientation
+    tiffLong(&ifd0[3], 34665, 0);                //ExifIFD, set below
+    size_t ifd0_offset = 8;
+    size_t exif_offset = ifd0_offset+tiffIFDSize(ifd0, 4);
+    size_t ifd1_offset = exif_offset+tiffIFDSize(exif, exif_count);
+    size_t thumb_offset = ifd1_offset+tiffIFDSize(ifd1, 3);
+    ifd0[3].numbers[0] = (uint32_t) exif_offset;
+    tiffShort(&ifd1[0], 259, 6);                                     //Compression: old style JPEG
+    tiffLong(&ifd1[1], 513, (uint32_t) thumb_offset);                //JPEGInterchangeFormat
+    tiffLong(&ifd1[2], 514, (uint32_t) templates->exif_thumb_size);  //JPEGInterchangeFormatLength
+
+    struct CorpusBuffer buffer = {NULL, 0, 0, false};
+    bool result = corpusPutBytes(&buffer, "\xFF\xD8\xFF\xE1\0\0Exif\0\0", 12);
+    size_t tiff_start = buffer.size;
+    struct CorpusBuffer tiff = {NULL, 0, 0, true};
+    result = result && corpusPutBytes(&tiff, "MM\0*", 4) && corpusPut32(&tiff, (uint32_t) ifd0_offset)
+        && tiffPutIFD(&tiff, ifd0, 4, (uint32_t) ifd1_offset) && tiffPutIFD(&tiff, exif, exif_count, 0)
+        && tiffPutIFD(&tiff, ifd1, 3, 0) && corpusPutBytes(&tiff, templates->exif_thumb, templates->exif_thumb_size)
+        && corpusPutBytes(&buffer, tiff.data, tiff.size);
+    free(tiff.data);
+    //APP1 length counts itself and the payload, not the marker
+    size_t app1_length = buffer.size-tiff_start+8;
+    if(result && app1_length <= 0xFFFF) {
+        buffer.data[4] = (unsigned char) (app1_length >> 8);
+        buffer.data[5] = (unsigned char) app1_length;
+        result = corpusWriteFile(path, buffer.data, buffer.size, templates->image, templates->image_size, bytes);
+    } else {
+        result = false;
+    }
+    free(buffer.data);
+    return result;
+}
+
+//Little endian DNG: IFD0 is the JPEG preview, its SubIFD the uncompressed CFA image
+static bool corpusWriteDNG(const char* path, struct CorpusTemplates *templates, size_t index, struct tm *capture_date, uint64_t *bytes) {
+    static const unsigned char dng_version[4] = {1, 4, 0, 0};
+    static const unsigned char cfa_pattern[4] = {0, 1, 1, 2};
+    static const uint32_t bits_rgb[3] = {8, 8, 8};
+    static const uint32_t cfa_dim[2] = {2, 2};
+    static const uint32_t color_matrix[18] = {10000, 10000, 0, 10000, 0, 10000, 0, 10000, 10000, 10000, 0, 10000, 0, 10000, 0, 10000, 10000, 10000};
+    struct TIFFEntry ifd0[17], raw[12], exif[9];
+    char date[20], unique_id[33];
+    int exif_count = corpusExifEntries(exif, index, templates->width, templates->height, capture_date, date, unique_id);
+    int count = 0;
+    tiffLong(&ifd0[count++], 254, 1);                                   //NewSubFileType: preview
+    tiffLong(&ifd0[count++], 256, BENCH_CORPUS_PREVIEW_WIDTH);
+    tiffLong(&ifd0[count++], 257, BENCH_CORPUS_PREVIEW_HEIGHT);
+    tiffNumbers(&ifd0[count++], 258, TIFF_SHORT, 3, bits_rgb);          //BitsPerSample
+    tiffShort(&ifd0[count++], 259, 7);                                  //Compression: JPEG
+    tiffShort(&ifd0[count++], 262, 6);                                  //PhotometricInterpretation: YCbCr
+    tiffAscii(&ifd0[count++], 271, "MediaOrganizer");
+    tiffAscii(&ifd0[count++], 272, "Bench DNG");
+    tiffLong(&ifd0[count++], 273, 0);                                   //StripOffsets, set below
+    tiffShort(&ifd0[count++], 274, 1);
+    tiffShort(&ifd0[count++], 277, 3);                                  //SamplesPerPixel
+    tiffLong(&ifd0[count++], 278, BENCH_CORPUS_PREVIEW_HEIGHT);         //RowsPerStrip
+    tiffLong(&ifd0[count++], 279, (uint32_t) templates->preview_size);  //StripByteCounts
+    tiffLong(&ifd0[count++], 330, 0);                                   //SubIFDs, set below
+    tiffLong(&ifd0[count++], 34665, 0);                                 //ExifIFD, set below
+    tiffBytes(&ifd0[count++], 50706, TIFF_BYTE, 4, dng_version);
+    tiffNumbers(&ifd0[count++], 50721, TIFF_SRATIONAL, 9, color_matrix);   //ColorMatrix1
+    int raw_count = 0;
+    tiffLong(&raw[raw_count++], 254, 0);
+    tiffLong(&raw[raw_count++], 256, templates->width);
+    tiffLong(&raw[raw_count++], 257, templates->height);
+    tiffShort(&raw[raw_count++], 258, 16);
+    tiffShort(&raw[raw_count++], 259, 1);                               //uncompressed
+    tiffShort(&raw[raw_count++], 262, 32803);                           //CFA
+    tiffLong(&raw[raw_count++], 273, 0);                                //StripOffsets, set below
+    tiffShort(&raw[raw_count++], 277, 1);
+    tiffLong(&raw[raw_count++], 278, templates->height);
+    tiffLong(&raw[raw_count++], 279, (uint32_t) templates->raw_size);
+    tiffNumbers(&raw[raw_count++], 33421, TIFF_SHORT, 2, cfa_dim);      //CFARepeatPatternDim
+    tiffBytes(&raw[raw_count++], 33422, TIFF_BYTE, 4, cfa_pattern);     //CFAPattern: RGGB
+
+    size_t ifd0_offset = 8;
+    size_t exif_offset = ifd0_offset+tiffIFDSize(ifd0, count);
+    size_t raw_offset = exif_offset+tiffIFDSize(exif, exif_count);
+    size_t preview_offset = raw_offset+tiffIFDSize(raw, raw_count);
+    size_t data_offset = (preview_offset+templates->preview_size+15) & ~(size_t) 15;
+    ifd0[8].numbers[0] = (uint32_t) preview_offset;
+    ifd0[13].numbers[0] = (uint32_t) raw_offset;
+    ifd0[14].numbers[0] = (uint32_t) exif_offset;
+    raw[6].numbers[0] = (uint32_t) data_offset;
+
+    struct CorpusBuffer buffer = {NULL, 0, 0, false};
+    bool result = corpusPutBytes(&buffer, "II*\0", 4) && corpusPut32(&buffer, (uint32_t) ifd0_offset)
+        && tiffPutIFD(&buffer, ifd0, count, 0) && tiffPutIFD(&buffer, exif, exif_count, 0)
+        && tiffPutIFD(&buffer, raw, raw_count, 0) && corpusPutBytes(&buffer, templates->preview, templates->preview_size)
+        && corpusReserve(&buffer, data_offset-buffer.size);
+    if(result) {
+        memset(buffer.data+buffer.size, 0, data_offset-buffer.size);
+        buffer.size = data_offset;
+        result = corpusWriteFile(path, buffer.data, buffer.size, templates->raw, templates->raw_size, bytes);
+    }
+    free(buffer.data);
+    return result;
+}
+
+//mkdir -p
+static bool corpusMakeFolders(const char* path) {
+    char* copy = strdup(path);
+    if(copy == NULL)
+        return false;
+    bool result = true;
+    for(char* position = copy+1; result; position++) {
+        bool end = *position == '\0';
+        if(*position != '/' && !end)
+            continue;
+        *position = '\0';
+        if(mkdir(copy, 0755) != 0 && errno != EEXIST) {
+            fprintf(stderr, "Could not create %s: %s\n", copy, strerror(errno));
+            result = false;
+        }
+        if(end)
+            break;
+        *position = '/';
+    }
+    free(copy);
+    return result;
+}
+
+BenchCorpus new_BenchCorpus(const char* path, BenchCorpusOptions options) {
+    struct stat existing;
+    if(stat(path, &existing) == 0) {
+        fprintf(stderr, "%s already exists\n", path);
+        return NULL;
+    }
+    BenchCorpus corpus = calloc(1, sizeof(struct BenchCorpus));
+    if(corpus == NULL)
+        return NULL;
+    corpus->path = strdup(path);
+    struct CorpusTemplates templates;
+    if(corpus->path == NULL || !corpusMakeFolders(path) || !corpusCreateTemplates(&templates, options)) {
+        free_BenchCorpus(corpus);
+        return NULL;
+    }
+    size_t files_per_folder = options->files_per_folder > 0 ? options->files_per_folder : 1;
+    char folder[4096] = "";
+    char file_path[4096];
+    bool result = true;
+    for(size_t i=0; i<options->files && result; i++) {
+        struct tm capture_date = {0};
+        capture_date.tm_year = 2024-1900;
+        capture_date.tm_mday = 1+(int) (i/BENCH_CORPUS_FILES_PER_DAY);
+        capture_date.tm_hour = 8;
+        capture_date.tm_sec = (int) (i%BENCH_CORPUS_FILES_PER_DAY)*600;
+        time_t capture_time = timegm(&capture_date);
+        gmtime_r(&capture_time, &capture_date);
+
+        char next_folder[4096];
+        if(options->shape == BENCH_CORPUS_ARCHIVE)
+            snprintf(next_folder, sizeof(next_folder), "%s/%04d/%04d-%02d-%02d", path, capture_date.tm_year+1900, capture_date.tm_year+1900, capture_date.tm_mon+1, capture_date.tm_mday);
+        else
+            snprintf(next_folder, sizeof(next_folder), "%s/DCIM/%03zuBENCH", path, 100+i/files_per_folder);
+        if(strcmp(folder, next_folder) != 0) {
+            strcpy(folder, next_folder);
+            result = corpusMakeFolders(folder);
+            corpus->folders++;
+        }
+        //evenly spread, e.g. every other file at 50%
+        bool raw = (i+1)*options->raw_percent/100 > i*options->raw_percent/100;
+        if(snprintf(file_path, sizeof(file_path), "%s/IMG_%04zu.%s", folder, i+1, raw ? "DNG" : "JPG") >= (int) sizeof(file_path)) {
+            fprintf(stderr, "Corpus path too long: %s\n", folder);
+            result = false;
+        }
+        if(result && raw)
+            result = corpusWriteDNG(file_path, &templates, i, &capture_date, &corpus->bytes);
+        else if(result)
+            result = corpusWriteJPEG(file_path, &templates, i, &capture_date, &corpus->bytes);
+        if(result) {
+            corpus->files++;
+            if(raw)
+                corpus->raw_files++;
+            else
+                corpus->jpeg_files++;
+        }
+    }
+    free_CorpusTemplates(&templates);
+    if(!result) {
+        free_BenchCorpus(corpus);
+        return NULL;
+    }
+    return corpus;
+}
+
+static bool corpusCount(BenchCorpus corpus, const char* path) {
+    DIR* dir = opendir(path);
+    if(dir == NULL) {
+        fprintf(stderr, "Could not open %s: %s\n", path, strerror(errno));
+        return false;
+    }
+    bool result = true;
+    bool has_files = false;
+    struct dirent *dp;
+    while(result && (dp = readdir(dir)) != NULL) {
+        if(strcmp(dp->d_name, ".") == 0 || strcmp(dp->d_name, "..") == 0)
+            continue;
+        char child[4096];
+        snprintf(child, sizeof(child), "%s/%s", path, dp->d_name);
+        struct stat filestat;
+        if(stat(child, &filestat) != 0)
+            continue;
+        if(S_ISDIR(filestat.st_mode)) {
+            result = corpusCount(corpus, child);
+        } else if(S_ISREG(filestat.st_mode)) {
+            const char* extension = strrchr(dp->d_name, '.');
+            if(extension != NULL && strcasecmp(extension, ".dng") == 0)
+                corpus->raw_files++;
+            else
+                corpus->jpeg_files++;
+            corpus->files++;
+            corpus->bytes += (uint64_t) filestat.st_size;
+            has_files = true;
+        }
+    }
+    closedir(dir);
+    if(has_files)
+        corpus->folders++;
+    return result;
+}
+
+BenchCorpus BenchCorpus_open(const char* path) {
+    BenchCorpus corpus = calloc(1, sizeof(struct BenchCorpus));
+    if(corpus == NULL)
+        return NULL;
+    corpus->path = strdup(path);
+    if(corpus->path == NULL || !corpusCount(corpus, path)) {
+        free_BenchCorpus(corpus);
+        return NULL;
+    }
+    return corpus;
+}
+
+void free_BenchCorpus(BenchCorpus corpus) {
+    free(corpus->path);
+    free(corpus);
+}
@@ -0,0 +1,71 @@
+//
+//  bench_corpus.h
+//  MediaOrganizerBench
+//
+//  Created by John Bridge on 10/17/26.
+//
+
+#ifndef bench_corpus_h
+#define bench_corpus_h
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <time.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <jpeglib.h>
+
+#define BENCH_CORPUS_FILES 200
+//a camera starts a new DCIM folder every 9999 files, cards are usually organized far sooner than that
+#define BENCH_CORPUS_FILES_PER_FOLDER 100
+#define BENCH_CORPUS_RAW_PERCENT 50
+//full resolution of the generated images, 3:2 like most cameras
+#define BENCH_CORPUS_WIDTH 4000
+//the DNGs' embedded JPEG preview and the JPEGs' EXIF thumbnail
+#define BENCH_CORPUS_PREVIEW_WIDTH 1620
+#define BENCH_CORPUS_PREVIEW_HEIGHT 1080
+#define BENCH_CORPUS_EXIF_THUMB_WIDTH 160
+#define BENCH_CORPUS_EXIF_THUMB_HEIGHT 120
+#define BENCH_CORPUS_JPEG_QUALITY 92
+//capture dates start at 2024-01-01 and this many files share a day
+#define BENCH_CORPUS_FILES_PER_DAY 40
+
+typedef struct BenchCorpusOptions *BenchCorpusOptions;
+typedef struct BenchCorpus *BenchCorpus;
+
+typedef enum {
+    BENCH_CORPUS_CARD,      //DCIM/100BENCH, 101BENCH, ... as on a memory card
+    BENCH_CORPUS_ARCHIVE    //Year/Year-Month-Day/ folders as in a photo archive being re-imported
+} BenchCorpusShape;
+
+struct BenchCorpusOptions {
+    size_t files;
+    size_t files_per_folder;
+    int raw_percent;    //share of the files written as DNG, the rest are JPEGs
+    int width;          //height is 2/3 of it
+    BenchCorpusShape shape;
+};
+extern void BenchCorpusOptions_setDefaults(BenchCorpusOptions options);
+
+struct BenchCorpus {
+    char* path;
+    size_t files;
+    size_t raw_files;
+    size_t jpeg_files;
+    size_t folders;
+    uint64_t bytes;
+};
+//Writes the corpus into path, which must not exist yet. Every file has its own capture date and ImageUniqueID,
+//so no two of them have the same content hash
+extern BenchCorpus new_BenchCorpus(const char* path, BenchCorpusOptions options);
+//Counts the files and bytes of a corpus generated by an earlier run
+extern BenchCorpus BenchCorpus_open(const char* path);
+extern void free_BenchCorpus(BenchCorpus corpus);
+
+#endif /* bench_corpus_h */
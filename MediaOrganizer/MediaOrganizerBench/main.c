@@ -0,0 +1,251 @@
+//
+//  main.c
+//  MediaOrganizerBench
+//
+//  Created by John Bridge on 10/17/26.
+//
+
+//nftw on Linux, defined before any system header is included
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <unistd.h>
+#include <ftw.h>
+#include "organizer.h"
+#include "bench_corpus.h"
+#include "mock_sink.h"
+
+#define BENCH_STAGE_COUNT 9
+
+//Reported in pipeline order. scan includes stat'ing each file, exif is the header read within metadata,
+//db is queueing the document and store the time until its bulk write was executed
+static const char* bench_stages[BENCH_STAGE_COUNT] = {"scan", "metadata", "exif", "hash", "copy", "preview", "thumbnail", "db", "store"};
+
+static int removeEntry(const char* path, const struct stat* filestat, int type, struct FTW* ftw) {
+    return remove(path);
+}
+
+//rm -rf
+static bool removeTree(const char* path) {
+    struct stat filestat;
+    if(lstat(path, &filestat) != 0)
+        return errno == ENOENT;
+    return nftw(path, removeEntry, 16, FTW_DEPTH|FTW_PHYS) == 0;
+}
+
+static void printUsage(void) {
+    printf("Run ./MediaOrganizerBench [-n files] [-f files] [-r percent] [-x pixels] [-a] [-k] [-j threads] [-b files] [-L microseconds] [-o path] [-l label] <work directory>\n");
+    printf("  -n files    files in the generated corpus (default: %d)\n", BENCH_CORPUS_FILES);
+    printf("  -f files    files per DCIM folder (default: %d)\n", BENCH_CORPUS_FILES_PER_FOLDER);
+    printf("  -r percent  share of the files that are DNGs, the rest are JPEGs (default: %d)\n", BENCH_CORPUS_RAW_PERCENT);
+    printf("  -x pixels   width of the generated images, 3:2 (default: %d)\n", BENCH_CORPUS_WIDTH);
+    printf("  -a          lay the corpus out as a Year/Year-Month-Day archive instead of a memory card\n");
+    printf("  -k          keep using the corpus in the work directory if there is one, instead of generating it again\n");
+    printf("  -j threads  threads per CPU bound stage (default: number of cores)\n");
+    printf("  -b files    documents per bulk write (default: %d)\n", ORGANIZER_DB_BATCH_SIZE);
+    printf("  -L microseconds  round trip the mock database sink adds to each bulk write (default: 0)\n");
+    printf("  -o path     where to write the JSON results, - for stdout (default: <work directory>/results.json)\n");
+    printf("  -l label    stored with the results, e.g. the build being measured\n");
+}
+
+static void writeStage(FILE* out, LatencyHistogram histogram, const char* name, bool last) {
+    uint64_t count = histogram != NULL ? LatencyHistogram_count(histogram) : 0;
+    fprintf(out, "    \"%s\": {\"count\": %llu", name, (unsigned long long) count);
+    if(count > 0) {
+        fprintf(out, ", \"mean_ms\": %.3f, \"p50_ms\": %.3f, \"p99_ms\": %.3f, \"max_ms\": %.3f",
+                LatencyHistogram_mean(histogram)/1e6, LatencyHistogram_percentile(histogram, 50)/1e6,
+                LatencyHistogram_percentile(histogram, 99)/1e6, LatencyHistogram_max(histogram)/1e6);
+    }
+    fprintf(out, "}%s\n", last ? "" : ",");
+}
+
+static void writeResults(FILE* out, const char* label, BenchCorpus corpus, Organizer organizer, MockSink sink, unsigned int sink_latency_us, bool completed, double seconds) {
+    char timestamp[32];
+    time_t now = time(NULL);
+    struct tm utc;
+    gmtime_r(&now, &utc);
+    strftime(timestamp, sizeof(timestamp), "%Y-%m-%dT%H:%M:%SZ", &utc);
+    fprintf(out, "{\n");
+    fprintf(out, "  \"label\": \"");
+    //quotes and backslashes would end the string early
+    for(const char* c = label; *c != '\0'; c++) {
+        if(*c == '"' || *c == '\\')
+            fputc('\\', out);
+        if((unsigned char) *c >= 0x20)
+            fputc(*c, out);
+    }
+    fprintf(out, "\",\n");
+    fprintf(out, "  \"timestamp\": \"%s\",\n", timestamp);
+    fprintf(out, "  \"completed\": %s,\n", completed ? "true" : "false");
+    fprintf(out, "  \"corpus\": {\"files\": %zu, \"raw_files\": %zu, \"jpeg_files\": %zu, \"folders\": %zu, \"bytes\": %llu},\n",
+            corpus->files, corpus->raw_files, corpus->jpeg_files, corpus->folders, (unsigned long long) corpus->bytes);
+    fprintf(out, "  \"config\": {\"threads\": %d, \"io_threads\": %d, \"scan_threads\": %d, \"db_batch_size\": %zu, \"db_threads\": %d, \"sink_latency_us\": %u},\n",
+            organizer->thread_count, organizer->io_thread_count, organizer->scan_thread_count, organizer->db_batch_size, organizer->db_thread_count, sink_latency_us);
+    fprintf(out, "  \"seconds\": %.3f,\n", seconds);
+    fprintf(out, "  \"files_per_second\": %.2f,\n", seconds > 0 ? corpus->files/seconds : 0);
+    fprintf(out, "  \"mb_per_second\": %.2f,\n", seconds > 0 ? corpus->bytes/1e6/seconds : 0);
+    fprintf(out, "  \"stages\": {\n");
+    for(int i=0; i<BENCH_STAGE_COUNT; i++)
+        writeStage(out, Metrics_histogram(organizer->metrics, bench_stages[i]), bench_stages[i], i == BENCH_STAGE_COUNT-1);
+    fprintf(out, "  },\n");
+    fprintf(out, "  \"sink\": {\"documents\": %zu, \"bulk_writes\": %zu, \"bytes\": %llu}\n", sink->documents, sink->bulk_writes, (unsigned long long) sink->bytes);
+    fprintf(out, "}\n");
+}
+
+int main(int argc, char * argv[]) {
+    struct BenchCorpusOptions corpus_options;
+    BenchCorpusOptions_setDefaults(&corpus_options);
+    bool keep_corpus = false;
+    int thread_count = 0;
+    int batch_size = ORGANIZER_DB_BATCH_SIZE;
+    int sink_latency_us = 0;
+    const char* output_path = NULL;
+    const char* label = "";
+    int opt;
+    while((opt = getopt(argc, argv, "n:f:r:x:akj:b:L:o:l:")) != -1) {
+        switch(opt) {
+            case 'n':
+                corpus_options.files = (size_t) atol(optarg);
+                if(atol(optarg) < 1) {
+                    printf("-n requires a positive number of files\n");
+                    return 1;
+                }
+                break;
+            case 'f':
+                corpus_options.files_per_folder = (size_t) atol(optarg);
+                if(atol(optarg) < 1) {
+                    printf("-f requires a positive number of files\n");
+                    return 1;
+                }
+                break;
+            case 'r':
+                corpus_options.raw_percent = atoi(optarg);
+                if(corpus_options.raw_percent < 0 || corpus_options.raw_percent > 100) {
+                    printf("-r requires a percentage between 0 and 100\n");
+                    return 1;
+                }
+                break;
+            case 'x':
+                corpus_options.width = atoi(optarg);
+                if(corpus_options.width < 3*BENCH_CORPUS_EXIF_THUMB_WIDTH || corpus_options.width > 16000) {
+                    printf("-x requires a width between %d and 16000\n", 3*BENCH_CORPUS_EXIF_THUMB_WIDTH);
+                    return 1;
+                }
+                break;
+            case 'a':
+                corpus_options.shape = BENCH_CORPUS_ARCHIVE;
+                break;
+            case 'k':
+                keep_corpus = true;
+                break;
+            case 'j':
+                thread_count = atoi(optarg);
+                if(thread_count < 1) {
+                    printf("-j requires a positive thread count\n");
+                    return 1;
+                }
+                break;
+            case 'b':
+                batch_size = atoi(optarg);
+                if(batch_size < 1) {
+                    printf("-b requires a positive number of files\n");
+                    return 1;
+                }
+                break;
+            case 'L':
+                sink_latency_us = atoi(optarg);
+                if(sink_latency_us < 0) {
+                    printf("-L requires a latency in microseconds\n");
+                    return 1;
+                }
+                break;
+            case 'o':
+                output_path = optarg;
+                break;
+            case 'l':
+                label = optarg;
+                break;
+            default:
+                printUsage();
+                return 1;
+        }
+    }
+    if(argc - optind != 1) {
+        printf("Program requires a work directory.\n");
+        printUsage();
+        return 1;
+    }
+    const char* work_path = argv[optind];
+    if(mkdir(work_path, 0755) != 0 && errno != EEXIST) {
+        fprintf(stderr, "Could not create %s: %s\n", work_path, strerror(errno));
+        return 1;
+    }
+    char corpus_path[4096], library_path[4096], results_path[4096];
+    snprintf(corpus_path, sizeof(corpus_path), "%s/corpus", work_path);
+    snprintf(library_path, sizeof(library_path), "%s/library", work_path);
+    snprintf(results_path, sizeof(results_path), "%s/results.json", work_path);
+
+    //the corpus is written before timing starts. Its pages are still cached, drop the page cache first to measure a cold read
+    BenchCorpus corpus = NULL;
+    struct stat existing;
+    if(keep_corpus && stat(corpus_path, &existing) == 0) {
+        corpus = BenchCorpus_open(corpus_path);
+    } else if(removeTree(corpus_path)) {
+        uint64_t started = Metrics_now();
+        corpus = new_BenchCorpus(corpus_path, &corpus_options);
+        if(corpus != NULL)
+            fprintf(stderr, "Generated %zu files (%zu DNG, %zu JPEG, %.1f MB) in %.1fs\n", corpus->files, corpus->raw_files, corpus->jpeg_files, corpus->bytes/1e6, (Metrics_now()-started)/1e9);
+    }
+    if(corpus == NULL || corpus->files == 0) {
+        fprintf(stderr, "No corpus to organize in %s\n", corpus_path);
+        if(corpus != NULL)
+            free_BenchCorpus(corpus);
+        return 1;
+    }
+    if(!removeTree(library_path) || mkdir(library_path, 0755) != 0) {
+        fprintf(stderr, "Could not empty %s\n", library_path);
+        free_BenchCorpus(corpus);
+        return 1;
+    }
+
+    MockSink sink = new_MockSink((unsigned int) sink_latency_us);
+    Organizer organizer = sink != NULL ? new_Organizer(corpus_path, library_path, NULL) : NULL;
+    if(organizer == NULL) {
+        if(sink != NULL)
+            free_MockSink(sink);
+        free_BenchCorpus(corpus);
+        return 1;
+    }
+    organizer->db_sink = MockSink_execute;
+    organizer->db_sink_context = sink;
+    if(thread_count > 0)
+        organizer->thread_count = thread_count;
+    organizer->db_batch_size = batch_size;
+    //every run starts from an empty library
+    organizer->resume = false;
+    //every timed function, not just the stages reported below, ends up in mediaorganizer.prom/.json
+    organizer->metrics_directory = (char*) work_path;
+    organizer->metrics_interval = 0;
+
+    Logger_start(LOG_LEVEL_INFO);
+    uint64_t started = Metrics_now();
+    bool completed = organize(organizer);
+    double seconds = (Metrics_now()-started)/1e9;
+    Logger_stop();
+    fprintf(stderr, "Organized %zu files (%.1f MB) in %.2fs: %.1f files/s, %.1f MB/s\n", corpus->files, corpus->bytes/1e6, seconds, corpus->files/seconds, corpus->bytes/1e6/seconds);
+
+    const char* path = output_path != NULL ? output_path : results_path;
+    FILE* out = strcmp(path, "-") == 0 ? stdout : fopen(path, "w");
+    int status = 0;
+    if(out == NULL) {
+        fprintf(stderr, "Could not write %s: %s\n", path, strerror(errno));
+        status = 1;
+    } else {
+        writeResults(out, label, corpus, organizer, sink, (unsigned int) sink_latency_us, completed, seconds);
+        if(out != stdout)
+            fclose(out);
+    }
+    free_Organizer(organizer);
+    free_MockSink(sink);
+    free_BenchCorpus(corpus);
+    return status;
+}
@@ -0,0 +1,55 @@
+//
+//  mock_sink.c
+//  MediaOrganizerBench
+//
+//  Created by John Bridge on 10/17/26.
+//
+
+#include "mock_sink.h"
+
+MockSink new_MockSink(unsigned int latency_us) {
+    MockSink sink = malloc(sizeof(struct MockSink));
+    if(sink == NULL)
+        return NULL;
+    sink->latency_us = latency_us;
+    sink->documents = 0;
+    sink->bulk_writes = 0;
+    sink->bytes = 0;
+    pthread_mutex_init(&sink->lock, NULL);
+    return sink;
+}
+
+void free_MockSink(MockSink sink) {
+    pthread_mutex_destroy(&sink->lock);
+    free(sink);
+}
+
+bool MockSink_execute(void* context, MongoWriteOp batch, size_t count, bson_error_t *error) {
+    MockSink sink = context;
+    size_t size = 0;
+    for(MongoWriteOp op = batch; op != NULL; op = op->next)
+        size += op->document->len + (op->selector != NULL ? op->selector->len : 0);
+    unsigned char* message = malloc(size > 0 ? size : 1);
+    if(message == NULL) {
+        snprintf(error->message, sizeof(error->message), "mock sink out of memory");
+        return false;
+    }
+    size_t position = 0;
+    for(MongoWriteOp op = batch; op != NULL; op = op->next) {
+        if(op->selector != NULL) {
+            memcpy(message+position, bson_get_data(op->selector), op->selector->len);
+            position += op->selector->len;
+        }
+        memcpy(message+position, bson_get_data(op->document), op->document->len);
+        position += op->document->len;
+    }
+    free(message);
+    if(sink->latency_us > 0)
+        usleep(sink->latency_us);
+    pthread_mutex_lock(&sink->lock);
+    sink->documents += count;
+    sink->bulk_writes++;
+    sink->bytes += size;
+    pthread_mutex_unlock(&sink->lock);
+    return true;
+}
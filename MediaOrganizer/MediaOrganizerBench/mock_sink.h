@@ -0,0 +1,38 @@
+//
+//  mock_sink.h
+//  MediaOrganizerBench
+//
+//  Created by John Bridge on 10/17/26.
+//
+
+#ifndef mock_sink_h
+#define mock_sink_h
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include "mongo_tools.h"
+
+typedef struct MockSink *MockSink;
+
+//In-process stand-in for the files collection, handed to the MongoBatchWriter in place of a server.
+//Each bulk write is copied into one contiguous message the way the driver would serialize it, then
+//latency_us is slept to stand in for the round trip
+struct MockSink {
+    unsigned int latency_us;
+    size_t documents;
+    size_t bulk_writes;
+    uint64_t bytes;
+    pthread_mutex_t lock;
+};
+extern MockSink new_MockSink(unsigned int latency_us);
+extern void free_MockSink(MockSink sink);
+
+//MongoBatchWriterExecuteFn
+extern bool MockSink_execute(void* sink, MongoWriteOp batch, size_t count, bson_error_t *error);
+
+#endif /* mock_sink_h */
@@ -0,0 +1,140 @@
+//
+//  content_hash.c
+//  MediaOrganizerCLI
+//
+//  Created by John Bridge on 10/17/26.
+//
+
+#include "content_hash.h"
+
+#define XXH_PRIME64_1 0x9E3779B185EBCA87ULL
+#define XXH_PRIME64_2 0xC2B2AE3D27D4EB4FULL
+#define XXH_PRIME64_3 0x165667B19E3779F9ULL
+#define XXH_PRIME64_4 0x85EBCA77C2B2AE63ULL
+#define XXH_PRIME64_5 0x27D4EB2F165667C5ULL
+
+static inline uint64_t contentHashRotl(uint64_t value, int bits) {
+    return (value << bits) | (value >> (64-bits));
+}
+
+//input is little endian regardless of the host
+static inline uint64_t contentHashRead64(const unsigned char* p) {
+    return (uint64_t)p[0] | (uint64_t)p[1] << 8 | (uint64_t)p[2] << 16 | (uint64_t)p[3] << 24
+        | (uint64_t)p[4] << 32 | (uint64_t)p[5] << 40 | (uint64_t)p[6] << 48 | (uint64_t)p[7] << 56;
+}
+
+static inline uint32_t contentHashRead32(const unsigned char* p) {
+    return (uint32_t)p[0] | (uint32_t)p[1] << 8 | (uint32_t)p[2] << 16 | (uint32_t)p[3] << 24;
+}
+
+static inline uint64_t contentHashRound(uint64_t accumulator, uint64_t input) {
+    accumulator += input*XXH_PRIME64_2;
+    accumulator = contentHashRotl(accumulator, 31);
+    return accumulator*XXH_PRIME64_1;
+}
+
+static inline uint64_t contentHashMergeRound(uint64_t hash, uint64_t accumulator) {
+    hash ^= contentHashRound(0, accumulator);
+    return hash*XXH_PRIME64_1+XXH_PRIME64_4;
+}
+
+//consumes one 32 byte stripe
+static inline void contentHashStripe(ContentHash hash, const unsigned char* p) {
+    for(int i=0; i<4; i++)
+        hash->accumulators[i] = contentHashRound(hash->accumulators[i], contentHashRead64(p+i*8));
+}
+
+void ContentHash_init(ContentHash hash) {
+    hash->total_length = 0;
+    hash->accumulators[0] = XXH_PRIME64_1+XXH_PRIME64_2;
+    hash->accumulators[1] = XXH_PRIME64_2;
+    hash->accumulators[2] = 0;
+    hash->accumulators[3] = -XXH_PRIME64_1;
+    hash->buffered = 0;
+}
+
+void ContentHash_update(ContentHash hash, const void* data, size_t length) {
+    const unsigned char* p = data;
+    const unsigned char* end = p+length;
+    hash->total_length += length;
+    if(hash->buffered+length < 32) {
+        memcpy(hash->buffer+hash->buffered, p, length);
+        hash->buffered += length;
+        return;
+    }
+    if(hash->buffered > 0) {
+        size_t fill = 32-hash->buffered;
+        memcpy(hash->buffer+hash->buffered, p, fill);
+        contentHashStripe(hash, hash->buffer);
+        p += fill;
+        hash->buffered = 0;
+    }
+    while(p+32 <= end) {
+        contentHashStripe(hash, p);
+        p += 32;
+    }
+    if(p < end) {
+        memcpy(hash->buffer, p, end-p);
+        hash->buffered = end-p;
+    }
+}
+
+uint64_t ContentHash_digest(ContentHash hash) {
+    uint64_t h;
+    uint64_t *v = hash->accumulators;
+    if(hash->total_length >= 32) {
+        h = contentHashRotl(v[0], 1)+contentHashRotl(v[1], 7)+contentHashRotl(v[2], 12)+contentHashRotl(v[3], 18);
+        for(int i=0; i<4; i++)
+            h = contentHashMergeRound(h, v[i]);
+    } else {
+        h = v[2]+XXH_PRIME64_5;
+    }
+    h += hash->total_length;
+    
+    const unsigned char* p = hash->buffer;
+    const unsigned char* end = p+hash->buffered;
+    while(p+8 <= end) {
+        h ^= contentHashRound(0, contentHashRead64(p));
+        h = contentHashRotl(h, 27)*XXH_PRIME64_1+XXH_PRIME64_4;
+        p += 8;
+    }
+    if(p+4 <= end) {
+        h ^= (uint64_t) contentHashRead32(p)*XXH_PRIME64_1;
+        h = contentHashRotl(h, 23)*XXH_PRIME64_2+XXH_PRIME64_3;
+        p += 4;
+    }
+    while(p < end) {
+        h ^= (*p)*XXH_PRIME64_5;
+        h = contentHashRotl(h, 11)*XXH_PRIME64_1;
+        p++;
+    }
+    
+    h ^= h >> 33;
+    h *= XXH_PRIME64_2;
+    h ^= h >> 29;
+    h *= XXH_PRIME64_3;
+    h ^= h >> 32;
+    return h;
+}
+
+bool ContentHash_file(int fd, unsigned char* buffer, size_t buffer_size, uint64_t *digest) {
+    struct ContentHash hash;
+    ContentHash_init(&hash);
+    while(true) {
+        ssize_t got = read(fd, buffer, buffer_size);
+        if(got < 0) {
+            if(errno == EINTR)
+                continue;
+            return false;
+        }
+        if(got == 0)
+            break;
+        ContentHash_update(&hash, buffer, got);
+    }
+    *digest = ContentHash_digest(&hash);
+    return true;
+}
+
+void ContentHash_toHex(uint64_t digest, char hex[CONTENT_HASH_HEX_SIZE]) {
+    snprintf(hex, CONTENT_HASH_HEX_SIZE, "%016llx", (unsigned long long) digest);
+}
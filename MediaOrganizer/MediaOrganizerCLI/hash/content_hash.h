@@ -0,0 +1,41 @@
+//
+//  content_hash.h
+//  MediaOrganizerCLI
+//
+//  Created by John Bridge on 10/17/26.
+//
+
+#ifndef content_hash_h
+#define content_hash_h
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+//bytes read per call while hashing a file
+#define CONTENT_HASH_BUFFER_SIZE (1 << 20)
+//hex digest plus '\0'
+#define CONTENT_HASH_HEX_SIZE 17
+
+typedef struct ContentHash *ContentHash;
+
+//Streaming XXH64 (seed 0). Digests match the reference xxHash implementation on any byte order
+struct ContentHash {
+    uint64_t total_length;
+    uint64_t accumulators[4];
+    unsigned char buffer[32];
+    size_t buffered;
+};
+extern void ContentHash_init(ContentHash hash);
+extern void ContentHash_update(ContentHash hash, const void* data, size_t length);
+extern uint64_t ContentHash_digest(ContentHash hash);
+
+//Hashes fd from its current offset to EOF using buffer for the reads. Returns false on a read error
+extern bool ContentHash_file(int fd, unsigned char* buffer, size_t buffer_size, uint64_t *digest);
+extern void ContentHash_toHex(uint64_t digest, char hex[CONTENT_HASH_HEX_SIZE]);
+
+#endif /* content_hash_h */
@@ -0,0 +1,397 @@
+//
+//  exif_reader.c
+//  MediaOrganizerCLI
+//
+//  Created by John Bridge on 10/17/26.
+//
+
+#include "exif_reader.h"
+
+#define TIFF_TYPE_BYTE 1
+#define TIFF_TYPE_ASCII 2
+#define TIFF_TYPE_SHORT 3
+#define TIFF_TYPE_LONG 4
+#define TIFF_TYPE_RATIONAL 5
+#define TIFF_TYPE_SRATIONAL 10
+#define TIFF_TYPE_IFD 13
+
+typedef enum {
+    TIFF_IFD_IMAGE,     //IFD0, the IFDs chained after it and SubIFDs
+    TIFF_IFD_EXIF,
+    TIFF_IFD_GPS
+} TIFFIFDKind;
+
+//A TIFF structure in memory. Offsets in it are relative to data, every read is bounds checked against size
+struct TIFFView {
+    const unsigned char *data;
+    size_t size;
+    bool big_endian;
+};
+
+//What the IFDs of one file add up to
+struct TIFFState {
+    ImageDataParams params;
+    int ifd_count;
+    bool orientation_read;
+    uint32_t width;     //largest full resolution image
+    uint32_t height;
+    char date_time[20];     //DateTimeOriginal, "YYYY:MM:DD HH:MM:SS"
+    char offset_time[7];    //OffsetTimeOriginal, "+HH:MM"
+};
+
+//Values are assembled byte by byte in the file's byte order, so the host's byte order doesn't matter
+static uint16_t tiffShort(const struct TIFFView *tiff, size_t offset) {
+    const unsigned char *p = &tiff->data[offset];
+    return tiff->big_endian ? (uint16_t) (p[0] << 8 | p[1]) : (uint16_t) (p[1] << 8 | p[0]);
+}
+
+static uint32_t tiffLong(const struct TIFFView *tiff, size_t offset) {
+    const unsigned char *p = &tiff->data[offset];
+    if(tiff->big_endian)
+        return (uint32_t) p[0] << 24 | (uint32_t) p[1] << 16 | (uint32_t) p[2] << 8 | p[3];
+    return (uint32_t) p[3] << 24 | (uint32_t) p[2] << 16 | (uint32_t) p[1] << 8 | p[0];
+}
+
+static size_t tiffTypeSize(uint16_t type) {
+    switch(type) {
+        case TIFF_TYPE_SHORT:
+        case 8:     //SSHORT
+            return 2;
+        case TIFF_TYPE_LONG:
+        case 9:     //SLONG
+        case 11:    //FLOAT
+        case TIFF_TYPE_IFD:
+            return 4;
+        case TIFF_TYPE_RATIONAL:
+        case TIFF_TYPE_SRATIONAL:
+        case 12:    //DOUBLE
+            return 8;
+        default:    //BYTE, ASCII, SBYTE, UNDEFINED
+            return 1;
+    }
+}
+
+//Where the value of the 12 byte entry at entry starts: inline if it fits in 4 bytes, else at the offset stored there.
+//Returns false if the value doesn't lie inside the view
+static bool tiffValueOffset(const struct TIFFView *tiff, size_t entry, uint16_t type, uint32_t count, size_t *value) {
+    size_t size = tiffTypeSize(type);
+    if(count == 0 || count > tiff->size/size)
+        return false;
+    *value = size*count <= 4 ? entry+8 : tiffLong(tiff, entry+8);
+    return *value <= tiff->size && size*count <= tiff->size-*value;
+}
+
+//The index-th value of a BYTE, SHORT or LONG entry
+static uint32_t tiffUnsigned(const struct TIFFView *tiff, uint16_t type, size_t value, uint32_t index) {
+    if(type == TIFF_TYPE_SHORT)
+        return tiffShort(tiff, value+index*2);
+    if(type == TIFF_TYPE_LONG || type == TIFF_TYPE_IFD)
+        return tiffLong(tiff, value+index*4);
+    return tiff->data[value+index];
+}
+
+static float tiffRational(const struct TIFFView *tiff, uint16_t type, size_t value, uint32_t index) {
+    if(type != TIFF_TYPE_RATIONAL && type != TIFF_TYPE_SRATIONAL)
+        return (float) tiffUnsigned(tiff, type, value, index);
+    uint32_t numerator = tiffLong(tiff, value+index*8);
+    uint32_t denominator = tiffLong(tiff, value+index*8+4);
+    if(denominator == 0)
+        return 0;
+    if(type == TIFF_TYPE_SRATIONAL)
+        return (float) ((double) (int32_t) numerator/(int32_t) denominator);
+    return (float) ((double) numerator/denominator);
+}
+
+//Copies an ASCII value up to its NUL, without the trailing spaces some cameras pad with
+static void tiffString(const struct TIFFView *tiff, size_t value, uint32_t count, char* out, size_t out_size) {
+    size_t length = 0;
+    while(length < count && length < out_size-1 && tiff->data[value+length] != '\0') {
+        out[length] = (char) tiff->data[value+length];
+        length++;
+    }
+    while(length > 0 && out[length-1] == ' ')
+        length--;
+    out[length] = '\0';
+}
+
+static bool readIFD(const struct TIFFView *tiff, size_t offset, TIFFIFDKind kind, struct TIFFState *state, uint32_t *next);
+
+//Follows an IFD offset found in another IFD, and for image IFDs the chain after it
+static void readIFDChain(const struct TIFFView *tiff, uint32_t offset, TIFFIFDKind kind, struct TIFFState *state) {
+    while(offset != 0 && state->ifd_count < EXIF_READER_MAX_IFDS) {
+        uint32_t next = 0;
+        if(!readIFD(tiff, offset, kind, state, &next) || kind != TIFF_IFD_IMAGE)
+            return;
+        offset = next;
+    }
+}
+
+static void readImageEntry(const struct TIFFView *tiff, uint16_t tag, uint16_t type, uint32_t count, size_t value, struct TIFFState *state, uint32_t *subfile_type, uint32_t *width, uint32_t *height) {
+    ImageDataParams params = state->params;
+    switch(tag) {
+        case 0x00FE:    //NewSubfileType, 1 marks reduced resolution copies
+            *subfile_type = tiffUnsigned(tiff, type, value, 0);
+            break;
+        case 0x0100:
+            *width = tiffUnsigned(tiff, type, value, 0);
+            break;
+        case 0x0101:
+            *height = tiffUnsigned(tiff, type, value, 0);
+            break;
+        case 0x010F:
+            if(type == TIFF_TYPE_ASCII && params->make[0] == '\0')
+                tiffString(tiff, value, count, params->make, sizeof(params->make));
+            break;
+        case 0x0110:
+            if(type == TIFF_TYPE_ASCII && params->model[0] == '\0')
+                tiffString(tiff, value, count, params->model, sizeof(params->model));
+            break;
+        case 0x0112:    //Orientation, as LibRAW's flip
+            if(!state->orientation_read) {
+                params->flip = "50132467"[tiffUnsigned(tiff, type, value, 0) & 7]-'0';
+                state->orientation_read = true;
+            }
+            break;
+        case 0x014A:    //SubIFDs, where NEF, ARW and DNG keep the raw image
+            for(uint32_t i=0; i<count && i<4; i++)
+                readIFDChain(tiff, tiffUnsigned(tiff, type, value, i), TIFF_IFD_IMAGE, state);
+            break;
+        case 0x8769:
+            readIFDChain(tiff, tiffUnsigned(tiff, type, value, 0), TIFF_IFD_EXIF, state);
+            break;
+        case 0x8825:
+            readIFDChain(tiff, tiffUnsigned(tiff, type, value, 0), TIFF_IFD_GPS, state);
+            break;
+    }
+}
+
+static void readExifEntry(const struct TIFFView *tiff, uint16_t tag, uint16_t type, uint32_t count, size_t value, struct TIFFState *state, uint32_t *width, uint32_t *height) {
+    ImageDataParams params = state->params;
+    switch(tag) {
+        case 0x829A:
+            params->shutter_speed = tiffRational(tiff, type, value, 0);
+            break;
+        case 0x829D:
+            params->aperture = tiffRational(tiff, type, value, 0);
+            break;
+        case 0x8827:    //ISOSpeedRatings
+            params->iso_speed = tiffUnsigned(tiff, type, value, 0);
+            break;
+        case 0x9003:
+            if(type == TIFF_TYPE_ASCII)
+                tiffString(tiff, value, count, state->date_time, sizeof(state->date_time));
+            break;
+        case 0x9011:
+            if(type == TIFF_TYPE_ASCII)
+                tiffString(tiff, value, count, state->offset_time, sizeof(state->offset_time));
+            break;
+        case 0x920A:
+            params->focal_length = tiffRational(tiff, type, value, 0);
+            break;
+        case 0xA002:    //PixelXDimension, the image size of a JPEG
+            *width = tiffUnsigned(tiff, type, value, 0);
+            break;
+        case 0xA003:
+            *height = tiffUnsigned(tiff, type, value, 0);
+            break;
+        case 0xA434:
+            if(type == TIFF_TYPE_ASCII)
+                tiffString(tiff, value, count, params->lensname, sizeof(params->lensname));
+            break;
+    }
+}
+
+static void readGPSEntry(const struct TIFFView *tiff, uint16_t tag, uint16_t type, uint32_t count, size_t value, struct TIFFState *state) {
+    ImageDataParams params = state->params;
+    switch(tag) {
+        case 0x0001:
+            params->latitude_ref = (char) tiff->data[value];
+            break;
+        case 0x0002:
+            for(uint32_t i=0; i<count && i<3; i++)
+                params->latitude[i] = tiffRational(tiff, type, value, i);
+            break;
+        case 0x0003:
+            params->longitude_ref = (char) tiff->data[value];
+            break;
+        case 0x0004:
+            for(uint32_t i=0; i<count && i<3; i++)
+                params->longitude[i] = tiffRational(tiff, type, value, i);
+            break;
+        case 0x0005:
+            params->altitude_ref = (char) tiff->data[value];
+            break;
+        case 0x0006:
+            params->altitude = tiffRational(tiff, type, value, 0);
+            break;
+    }
+}
+
+static bool readIFD(const struct TIFFView *tiff, size_t offset, TIFFIFDKind kind, struct TIFFState *state, uint32_t *next) {
+    state->ifd_count++;
+    if(offset < 8 || offset > tiff->size-2)
+        return false;
+    uint16_t entry_count = tiffShort(tiff, offset);
+    if((size_t) entry_count*12+6 > tiff->size-offset)
+        return false;
+    uint32_t subfile_type = 0, width = 0, height = 0;
+    for(uint16_t i=0; i<entry_count; i++) {
+        size_t entry = offset+2+(size_t) i*12;
+        uint16_t tag = tiffShort(tiff, entry);
+        uint16_t type = tiffShort(tiff, entry+2);
+        uint32_t count = tiffLong(tiff, entry+4);
+        size_t value;
+        if(!tiffValueOffset(tiff, entry, type, count, &value))
+            continue;
+        if(kind == TIFF_IFD_IMAGE)
+            readImageEntry(tiff, tag, type, count, value, state, &subfile_type, &width, &height);
+        else if(kind == TIFF_IFD_EXIF)
+            readExifEntry(tiff, tag, type, count, value, state, &width, &height);
+        else
+            readGPSEntry(tiff, tag, type, count, value, state);
+    }
+    if((subfile_type & 1) == 0 && (uint64_t) width*height > (uint64_t) state->width*state->height) {
+        state->width = width;
+        state->height = height;
+    }
+    *next = tiffLong(tiff, offset+2+(size_t) entry_count*12);
+    return true;
+}
+
+//"YYYY:MM:DD HH:MM:SS", with an optional "+HH:MM" offset from UTC
+static bool parseCaptureTime(const char* date_time, const char* offset_time, struct tm *date, time_t *time) {
+    memset(date, 0, sizeof(struct tm));
+    if(sscanf(date_time, "%4d:%2d:%2d %2d:%2d:%2d", &date->tm_year, &date->tm_mon, &date->tm_mday, &date->tm_hour, &date->tm_min, &date->tm_sec) != 6
+       || date->tm_year < 1900 || date->tm_mon < 1 || date->tm_mon > 12 || date->tm_mday < 1 || date->tm_mday > 31) {
+        date->tm_mday = 0;
+        return false;
+    }
+    date->tm_year -= 1900;
+    date->tm_mon -= 1;
+    struct tm normalized = *date;
+    int offset_hours, offset_minutes;
+    if((offset_time[0] == '+' || offset_time[0] == '-') && sscanf(&offset_time[1], "%2d:%2d", &offset_hours, &offset_minutes) == 2) {
+        int offset = (offset_hours*60+offset_minutes)*60;
+        *time = timegm(&normalized)-(offset_time[0] == '-' ? -offset : offset);
+    } else {
+        normalized.tm_isdst = -1;
+        *time = mktime(&normalized);
+    }
+    return true;
+}
+
+static bool tiffHeader(const unsigned char* data, size_t size, struct TIFFView *tiff) {
+    if(data == NULL || size < 8)
+        return false;
+    tiff->data = data;
+    tiff->size = size;
+    if(tiff->data[0] == 'I' && tiff->data[1] == 'I')
+        tiff->big_endian = false;
+    else if(tiff->data[0] == 'M' && tiff->data[1] == 'M')
+        tiff->big_endian = true;
+    else
+        return false;
+    //42, or the variants ORF ("RO") and RW2 (0x55) use for the same structure
+    uint16_t magic = tiffShort(tiff, 2);
+    return magic == 42 || magic == 0x4F52 || magic == 0x55;
+}
+
+//Finds the TIFF header of a raw, or of the EXIF segment of a JPEG
+static bool findTIFF(const unsigned char* data, size_t size, struct TIFFView *tiff) {
+    size_t offset = 0, length = size;
+    if(size >= 2 && data[0] == 0xFF && data[1] == 0xD8) {
+        if(!ExifReader_findJPEGSegment(data, size, 0xE1, "Exif\0", 6, &offset, &length) || length < 18)
+            return false;
+        offset += 10;
+        length -= 10;
+    }
+    return tiffHeader(&data[offset], length, tiff);
+}
+
+//A CR3 keeps IFD0, the EXIF IFD and the GPS IFD as separate TIFF structures in its CMT1, CMT2 and CMT4 boxes
+static bool readCR3(const unsigned char* data, size_t size, struct TIFFState *state) {
+    struct CR3Layout layout;
+    struct TIFFView tiff;
+    uint32_t next = 0;
+    if(!RAW_parseCR3(data, size, &layout) || !tiffHeader(layout.cmt[0], layout.cmt_size[0], &tiff) || !readIFD(&tiff, tiffLong(&tiff, 4), TIFF_IFD_IMAGE, state, &next))
+        return false;
+    if(tiffHeader(layout.cmt[1], layout.cmt_size[1], &tiff))
+        readIFD(&tiff, tiffLong(&tiff, 4), TIFF_IFD_EXIF, state, &next);
+    if(tiffHeader(layout.cmt[3], layout.cmt_size[3], &tiff))
+        readIFD(&tiff, tiffLong(&tiff, 4), TIFF_IFD_GPS, state, &next);
+    return true;
+}
+
+int ExifReader_readFile(const char* path, ImageDataParams params, struct tm *capture_date, time_t *capture_time) {
+    memset(params, 0, sizeof(struct ImageDataParams));
+    capture_date->tm_mday = 0;
+    int fd = open(path, O_RDONLY);
+    if(fd < 0)
+        return -1;
+    struct stat filestat;
+    if(fstat(fd, &filestat) != 0 || filestat.st_size < 8) {
+        close(fd);
+        return -1;
+    }
+    size_t size = (size_t) filestat.st_size;
+    const unsigned char* data = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if(data == MAP_FAILED)
+        return -1;
+    //no readahead: only the pages the header and IFDs are on get read, not the whole raw
+    posix_madvise((void*) data, size, POSIX_MADV_RANDOM);
+
+    int result = 0;
+    struct TIFFView tiff;
+    uint32_t next = 0;
+    struct TIFFState state = {params, 0, false, 0, 0, "", ""};
+    if(findTIFF(data, size, &tiff)) {
+        if(readIFD(&tiff, tiffLong(&tiff, 4), TIFF_IFD_IMAGE, &state, &next))
+            readIFDChain(&tiff, next, TIFF_IFD_IMAGE, &state);
+        else
+            result = -3;
+    } else if(!readCR3(data, size, &state)) {
+        result = -2;
+    }
+    if(result == 0) {
+        params->width = state.width > UINT16_MAX ? UINT16_MAX : (uint16_t) state.width;
+        params->height = state.height > UINT16_MAX ? UINT16_MAX : (uint16_t) state.height;
+        parseCaptureTime(state.date_time, state.offset_time, capture_date, capture_time);
+    }
+    munmap((void*) data, size);
+    return result;
+}
+
+//Lengths are read as the big endian byte pairs they are in the stream, so this doesn't depend on the host's byte order
+bool ExifReader_findJPEGSegment(const unsigned char* data, size_t size, unsigned char marker, const char* signature, size_t signature_size, size_t *offset, size_t *length) {
+    if(size < 4 || data[0] != 0xFF || data[1] != 0xD8)
+        return false;
+    size_t position = 2;
+    while(position+4 <= size) {
+        if(data[position] != 0xFF)
+            return false;
+        //any number of 0xFF fill bytes may come before a marker
+        while(position+4 <= size && data[position+1] == 0xFF)
+            position++;
+        if(position+4 > size)
+            return false;
+        unsigned char current = data[position+1];
+        if(current == 0xDA || current == 0xD9)
+            return false;
+        //TEM and RSTn have no length field
+        if(current == 0x01 || (current >= 0xD0 && current <= 0xD7)) {
+            position += 2;
+            continue;
+        }
+        size_t segment_size = ((size_t) data[position+2] << 8) | data[position+3];
+        if(segment_size < 2 || position+2+segment_size > size)
+            return false;
+        if(current == marker && (signature == NULL || (segment_size-2 >= signature_size && memcmp(&data[position+4], signature, signature_size) == 0))) {
+            *offset = position;
+            *length = 2+segment_size;
+            return true;
+        }
+        position += 2+segment_size;
+    }
+    return false;
+}
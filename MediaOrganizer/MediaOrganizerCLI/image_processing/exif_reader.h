@@ -0,0 +1,38 @@
+//
+//  exif_reader.h
+//  MediaOrganizerCLI
+//
+//  Created by John Bridge on 10/17/26.
+//
+
+#ifndef exif_reader_h
+#define exif_reader_h
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include "image_tools.h"
+
+//IFDs followed per file (IFD chain, SubIFDs, EXIF and GPS), guards against offset loops in damaged files
+#define EXIF_READER_MAX_IFDS 32
+
+//Reads ImageDataParams straight from the TIFF structure of a TIFF based raw (DNG, NEF, ARW, CR2, ...), the
+//EXIF segment of a JPEG or the CMT boxes of a CR3. The file is mmap'd and only the pages holding the header
+//and IFDs are touched. Either byte order. *capture_date and *capture_time get EXIF DateTimeOriginal (wall clock as recorded, and
+//as a time using OffsetTimeOriginal or else the local time zone); capture_date->tm_mday is 0 if there is none.
+//Returns 0, -1 if the file can't be mapped, -2 if it has no TIFF structure, -3 if IFD0 is damaged
+extern int ExifReader_readFile(const char* path, ImageDataParams params, struct tm *capture_date, time_t *capture_time);
+
+//Finds the first marker segment before the scan whose payload starts with signature (any payload if NULL).
+//*offset is where its 0xFF is, *length covers marker, length field and payload
+extern bool ExifReader_findJPEGSegment(const unsigned char* data, size_t size, unsigned char marker, const char* signature, size_t signature_size, size_t *offset, size_t *length);
+
+#endif /* exif_reader_h */
@@ -0,0 +1,180 @@
+//
+//  image_resize.c
+//  MediaOrganizerCLI
+//
+//  Created by John Bridge on 10/17/26.
+//
+
+#include "image_resize.h"
+
+//weights are Q14, the vertical pass leaves Q8 values so the horizontal sums fit in 32 bits
+#define RESIZE_WEIGHT_BITS 14
+#define RESIZE_INTERMEDIATE_BITS 8
+
+typedef struct ResizeTaps *ResizeTaps;
+
+//For each output index, the run of input indices it covers and their weights (summing to 1<<RESIZE_WEIGHT_BITS)
+struct ResizeTaps {
+    int *start;
+    int *count;
+    uint16_t *weights;  //max_taps per output index
+    int max_taps;
+};
+
+static void free_ResizeTaps(ResizeTaps taps) {
+    free(taps->start);
+    free(taps->count);
+    free(taps->weights);
+}
+
+static bool resizeTapsInit(ResizeTaps taps, int src_size, int dst_size) {
+    double scale = (double) src_size/dst_size;
+    taps->max_taps = (int) scale+2;
+    taps->start = malloc(sizeof(int)*dst_size);
+    taps->count = malloc(sizeof(int)*dst_size);
+    taps->weights = calloc((size_t) dst_size*taps->max_taps, sizeof(uint16_t));
+    if(taps->start == NULL || taps->count == NULL || taps->weights == NULL) {
+        free_ResizeTaps(taps);
+        return false;
+    }
+    const int one = 1 << RESIZE_WEIGHT_BITS;
+    for(int i=0; i<dst_size; i++) {
+        double begin = i*scale;
+        double end = (i+1)*scale;
+        int first = (int) begin;
+        int last = (int) end;
+        if(last >= src_size || (double) last == end)
+            last--;
+        if(last >= src_size)
+            last = src_size-1;
+        uint16_t *weights = &taps->weights[(size_t) i*taps->max_taps];
+        int total = 0;
+        int heaviest = 0;
+        for(int j=first; j<=last; j++) {
+            double covered_begin = j > begin ? j : begin;
+            double covered_end = j+1 < end ? j+1 : end;
+            int weight = (int) ((covered_end-covered_begin)/scale*one+0.5);
+            weights[j-first] = (uint16_t) weight;
+            total += weight;
+            if(weight > weights[heaviest])
+                heaviest = j-first;
+        }
+        //rounding leftovers go to the heaviest tap so flat areas stay exactly flat
+        weights[heaviest] += one-total;
+        taps->start[i] = first;
+        taps->count[i] = last-first+1;
+    }
+    return true;
+}
+
+bool ImageResize_area(const unsigned char* src, int src_width, int src_height, unsigned char* dst, int dst_width, int dst_height, int components) {
+    if(dst_width <= 0 || dst_height <= 0 || dst_width > src_width || dst_height > src_height)
+        return false;
+    if(dst_width == src_width && dst_height == src_height) {
+        memcpy(dst, src, (size_t) src_width*src_height*components);
+        return true;
+    }
+    struct ResizeTaps rows, columns;
+    if(!resizeTapsInit(&rows, src_height, dst_height))
+        return false;
+    if(!resizeTapsInit(&columns, src_width, dst_width)) {
+        free_ResizeTaps(&rows);
+        return false;
+    }
+    size_t src_stride = (size_t) src_width*components;
+    uint32_t *accumulator = malloc(sizeof(uint32_t)*src_stride);
+    uint16_t *row = malloc(sizeof(uint16_t)*src_stride);
+    if(accumulator == NULL || row == NULL) {
+        free(accumulator);
+        free(row);
+        free_ResizeTaps(&rows);
+        free_ResizeTaps(&columns);
+        return false;
+    }
+    const int shift = RESIZE_WEIGHT_BITS-RESIZE_INTERMEDIATE_BITS;
+    const int final_shift = RESIZE_WEIGHT_BITS+RESIZE_INTERMEDIATE_BITS;
+    for(int y=0; y<dst_height; y++) {
+        //vertical pass: weighted sum of the covered input rows, full width
+        memset(accumulator, 0, sizeof(uint32_t)*src_stride);
+        const uint16_t *row_weights = &rows.weights[(size_t) y*rows.max_taps];
+        for(int t=0; t<rows.count[y]; t++) {
+            const unsigned char *src_row = src+(size_t) (rows.start[y]+t)*src_stride;
+            uint32_t weight = row_weights[t];
+            for(size_t x=0; x<src_stride; x++)
+                accumulator[x] += src_row[x]*weight;
+        }
+        for(size_t x=0; x<src_stride; x++)
+            row[x] = (uint16_t) ((accumulator[x]+(1u << (shift-1))) >> shift);
+        
+        //horizontal pass over the Q8 row
+        unsigned char *dst_row = dst+(size_t) y*dst_width*components;
+        for(int x=0; x<dst_width; x++) {
+            const uint16_t *column_weights = &columns.weights[(size_t) x*columns.max_taps];
+            const uint16_t *pixel = &row[(size_t) columns.start[x]*components];
+            for(int c=0; c<components; c++) {
+                uint32_t sum = 0;
+                for(int t=0; t<columns.count[x]; t++)
+                    sum += pixel[t*components+c]*(uint32_t) column_weights[t];
+                uint32_t value = (sum+(1u << (final_shift-1))) >> final_shift;
+                dst_row[x*components+c] = (unsigned char) (value > 255 ? 255 : value);
+            }
+        }
+    }
+    free(accumulator);
+    free(row);
+    free_ResizeTaps(&rows);
+    free_ResizeTaps(&columns);
+    return true;
+}
+
+void ImageResize_fit(int width, int height, int max_size, int *fit_width, int *fit_height) {
+    int long_edge = width > height ? width : height;
+    if(max_size <= 0 || long_edge <= max_size) {
+        *fit_width = width;
+        *fit_height = height;
+        return;
+    }
+    *fit_width = (int) ((long long) width*max_size/long_edge);
+    *fit_height = (int) ((long long) height*max_size/long_edge);
+    if(*fit_width < 1)
+        *fit_width = 1;
+    if(*fit_height < 1)
+        *fit_height = 1;
+}
+
+bool ImageResize_toRGB8(const unsigned char* src, int bits, int colors, size_t pixel_count, unsigned char* dst) {
+    if((bits != 8 && bits != 16) || (colors != 1 && colors != 3))
+        return false;
+    if(bits == 8 && colors == 3) {
+        memcpy(dst, src, pixel_count*3);
+    } else if(bits == 8) {
+        for(size_t i=0; i<pixel_count; i++) {
+            dst[i*3] = src[i];
+            dst[i*3+1] = src[i];
+            dst[i*3+2] = src[i];
+        }
+    } else {
+        //the high byte is the second of each pair on little endian hosts
+        const uint16_t probe = 1;
+        const unsigned char* high = *(const unsigned char*) &probe == 1 ? src+1 : src;
+        if(colors == 3) {
+            for(size_t i=0; i<pixel_count*3; i++)
+                dst[i] = high[i*2];
+        } else {
+            for(size_t i=0; i<pixel_count; i++) {
+                dst[i*3] = high[i*2];
+                dst[i*3+1] = high[i*2];
+                dst[i*3+2] = high[i*2];
+            }
+        }
+    }
+    return true;
+}
+
+void ImageResize_swap16(unsigned char* data, size_t count) {
+    for(size_t i=0; i<count; i++) {
+        unsigned char low = data[i*2];
+        data[i*2] = data[i*2+1];
+        data[i*2+1] = low;
+    }
+}
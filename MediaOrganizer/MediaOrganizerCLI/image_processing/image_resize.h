@@ -0,0 +1,33 @@
+//
+//  image_resize.h
+//  MediaOrganizerCLI
+//
+//  Created by John Bridge on 10/17/26.
+//
+
+#ifndef image_resize_h
+#define image_resize_h
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+
+//Downscales an interleaved 8 bit image (components per pixel) with an area filter: every output pixel is the
+//average of the input area it covers, partially covered pixels weighted by coverage. Only shrinks, in both axes.
+//The inner loops are plain loops over contiguous rows so the compiler vectorizes them
+extern bool ImageResize_area(const unsigned char* src, int src_width, int src_height, unsigned char* dst, int dst_width, int dst_height, int components);
+
+//Size that fits width x height into a box of max_size on its long edge, keeping the aspect ratio. Never upscales
+extern void ImageResize_fit(int width, int height, int max_size, int *fit_width, int *fit_height);
+
+//Converts an interleaved 8 or 16 bit RGB or mono bitmap to 8 bit RGB. 16 bit samples are in host byte order (as LibRAW
+//leaves them) and keep their high byte, so byte swap and depth conversion are one gather of every other byte.
+//Mono is spread to all three channels. Like the resizer, plain loops over contiguous data the compiler vectorizes
+extern bool ImageResize_toRGB8(const unsigned char* src, int bits, int colors, size_t pixel_count, unsigned char* dst);
+
+//Swaps the bytes of count 16 bit samples in place, e.g. host to network order for PPM output
+extern void ImageResize_swap16(unsigned char* data, size_t count);
+
+#endif /* image_resize_h */
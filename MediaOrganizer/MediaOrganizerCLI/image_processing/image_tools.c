@@ -6,6 +6,102 @@
 //
 
 #include "image_tools.h"
+#include "exif_reader.h"
+
+//libjpeg's own error_exit calls exit(), from whichever worker thread hit the bad file
+static void imageJPEGErrorExit(j_common_ptr info) {
+    char message[JMSG_LENGTH_MAX];
+    (*info->err->format_message)(info, message);
+    Log(LOG_LEVEL_WARNING, "libjpeg: %s\n", message);
+    longjmp(((struct ImageJPEGError*) info->err)->jump, 1);
+}
+
+//warnings about corrupt data, which libjpeg would otherwise print to stderr directly
+static void imageJPEGOutputMessage(j_common_ptr info) {
+    char message[JMSG_LENGTH_MAX];
+    (*info->err->format_message)(info, message);
+    Log(LOG_LEVEL_DEBUG, "libjpeg: %s\n", message);
+}
+
+static struct jpeg_error_mgr* imageJPEGError(struct ImageJPEGError *error) {
+    jpeg_std_error(&error->manager);
+    error->manager.error_exit = imageJPEGErrorExit;
+    error->manager.output_message = imageJPEGOutputMessage;
+    return &error->manager;
+}
+
+static void imageJPEGInitDestination(j_compress_ptr cinfo) {
+    struct ImageJPEGDestination *destination = (struct ImageJPEGDestination*) cinfo->dest;
+    destination->buffer = malloc(IMAGE_JPEG_BUFFER_SIZE);
+    if(destination->buffer == NULL)
+        ERREXIT1(cinfo, JERR_OUT_OF_MEMORY, 0);
+    destination->size = IMAGE_JPEG_BUFFER_SIZE;
+    destination->manager.next_output_byte = destination->buffer;
+    destination->manager.free_in_buffer = destination->size;
+}
+
+//Called with the whole buffer full
+static boolean imageJPEGEmptyBuffer(j_compress_ptr cinfo) {
+    struct ImageJPEGDestination *destination = (struct ImageJPEGDestination*) cinfo->dest;
+    unsigned char* buffer = realloc(destination->buffer, destination->size*2);
+    if(buffer == NULL)
+        ERREXIT1(cinfo, JERR_OUT_OF_MEMORY, 1);
+    destination->buffer = buffer;
+    destination->manager.next_output_byte = buffer+destination->size;
+    destination->manager.free_in_buffer = destination->size;
+    destination->size *= 2;
+    return TRUE;
+}
+
+//the encoded length is size-free_in_buffer, RAW_encodeJPEG takes it from there
+static void imageJPEGTermDestination(j_compress_ptr cinfo) {
+}
+
+ImageContext new_ImageContext(void) {
+    ImageContext context = malloc(sizeof(struct ImageContext));
+    if(context==NULL)
+        return NULL;
+    context->raw_data = libraw_init(0);
+    if(context->raw_data==NULL) {
+        free(context);
+        return NULL;
+    }
+    context->decompress.err = imageJPEGError(&context->decompress_err);
+    context->compress.err = imageJPEGError(&context->compress_err);
+    //only fails when out of memory
+    if(setjmp(context->decompress_err.jump)) {
+        libraw_close(context->raw_data);
+        free(context);
+        return NULL;
+    }
+    jpeg_create_decompress(&context->decompress);
+    if(setjmp(context->compress_err.jump)) {
+        jpeg_destroy_decompress(&context->decompress);
+        libraw_close(context->raw_data);
+        free(context);
+        return NULL;
+    }
+    jpeg_create_compress(&context->compress);
+    context->compress_dest.manager.init_destination = imageJPEGInitDestination;
+    context->compress_dest.manager.empty_output_buffer = imageJPEGEmptyBuffer;
+    context->compress_dest.manager.term_destination = imageJPEGTermDestination;
+    context->compress_dest.buffer = NULL;
+    context->compress_dest.size = 0;
+    context->compress.dest = &context->compress_dest.manager;
+    context->io = NULL;
+    context->thumb_sizes[0] = IMAGE_THUMB_SIZE;
+    context->thumb_sizes[1] = IMAGE_THUMB_TINY_SIZE;
+    context->thumb_size_count = 2;
+    context->thumb_quality = IMAGE_THUMB_QUALITY;
+    return context;
+}
+
+void free_ImageContext(ImageContext context) {
+    jpeg_destroy_decompress(&context->decompress);
+    jpeg_destroy_compress(&context->compress);
+    libraw_close(context->raw_data);
+    free(context);
+}
 
 ImageData new_ImageData(const char* name, const char* path) {
     ImageData holder = malloc(sizeof(struct ImageData));
@@ -13,301 +109,545 @@ ImageData new_ImageData(const char* name, const char* path) {
         return NULL;
     holder->original_path = path;
     holder->name = name;
+    holder->prev_extension = NULL;
+    holder->preview = NULL;
+    holder->bitmap = NULL;
+    holder->bitmap_width = 0;
+    holder->bitmap_height = 0;
     holder->params = NULL;
     return holder;
 }
 
-int RAW_initializeDataHolder(ImageData data_holder) {
-    if(data_holder==NULL)
-        return -9;
-    libraw_data_t *raw_data = libraw_init(0);
-    if(libraw_open_file(raw_data, data_holder->original_path) != LIBRAW_SUCCESS)
+//Params RAW_readHeaderParams couldn't find in the TIFF structure: most raws only name the lens in their maker notes,
+//and JPEGs rarely record their size in EXIF
+static void fillMissingParams(ImageDataParams params, libraw_data_t *raw_data) {
+    if(params->lensname[0] == '\0')
+        snprintf(params->lensname, sizeof(params->lensname), "%s", raw_data->lens.Lens);
+    if(params->focal_length == 0)
+        params->focal_length = raw_data->lens.makernotes.CurFocal;
+    if(params->width == 0 || params->height == 0) {
+        params->width = raw_data->sizes.iwidth;
+        params->height = raw_data->sizes.iheight;
+    }
+}
+
+//A LibRAW style JPEG image holding a copy of jpeg, so previews that don't come from LibRAW are freed the same way
+//(libraw_dcraw_clear_mem, which is free())
+static libraw_processed_image_t* newJPEGImage(const unsigned char* jpeg, size_t size) {
+    libraw_processed_image_t *image = malloc(sizeof(libraw_processed_image_t)+size);
+    if(image == NULL)
+        return NULL;
+    memset(image, 0, sizeof(libraw_processed_image_t));
+    image->type = LIBRAW_IMAGE_JPEG;
+    image->data_size = (unsigned int) size;
+    memcpy(image->data, jpeg, size);
+    return image;
+}
+
+//Bitmap previews become a JPEG preview like everyone else's: converted to 8 bit RGB, filtered down to
+//IMAGE_PREVIEW_SIZE and encoded. The RGB is kept so the thumbnails are filtered from it without a decode
+static int convertBitmapPreview(ImageData data_holder, ImageContext context) {
+    libraw_processed_image_t *bitmap = data_holder->preview;
+    size_t pixel_count = (size_t) bitmap->width*bitmap->height;
+    if((bitmap->bits != 8 && bitmap->bits != 16) || pixel_count == 0 || bitmap->data_size < pixel_count*bitmap->colors*(bitmap->bits/8))
         return -1;
-    
-    libraw_unpack_thumb(raw_data);
-    libraw_dcraw_process(raw_data);
-    int err;
-    libraw_processed_image_t *thumb = libraw_dcraw_make_mem_thumb(raw_data, &err);
-    
-    data_holder->prev_extension = thumb->type == LIBRAW_THUMBNAIL_JPEG ? "jpg" : "ppm";
-    data_holder->raw_data = raw_data;
-    libraw_dcraw_clear_mem(thumb);
-    //data_holder->preview = thumb;
+    unsigned char* rgb = malloc(pixel_count*3);
+    if(rgb == NULL || !ImageResize_toRGB8(bitmap->data, bitmap->bits, bitmap->colors, pixel_count, rgb)) {
+        free(rgb);
+        return -1;
+    }
+    int width, height;
+    ImageResize_fit(bitmap->width, bitmap->height, IMAGE_PREVIEW_SIZE, &width, &height);
+    if(width != bitmap->width || height != bitmap->height) {
+        unsigned char* resized = malloc((size_t) width*height*3);
+        if(resized == NULL || !ImageResize_area(rgb, bitmap->width, bitmap->height, resized, width, height, 3)) {
+            free(resized);
+            free(rgb);
+            return -1;
+        }
+        free(rgb);
+        rgb = resized;
+    }
+    unsigned char *jpeg = NULL;
+    unsigned long jpeg_size;
+    if(RAW_encodeJPEG(context, rgb, width, height, IMAGE_PREVIEW_QUALITY, &jpeg, &jpeg_size) != 0) {
+        free(rgb);
+        return -1;
+    }
+    libraw_processed_image_t *preview = newJPEGImage(jpeg, jpeg_size);
+    free(jpeg);
+    if(preview == NULL) {
+        free(rgb);
+        return -1;
+    }
+    libraw_dcraw_clear_mem(bitmap);
+    data_holder->preview = preview;
+    data_holder->prev_extension = "jpg";
+    data_holder->bitmap = rgb;
+    data_holder->bitmap_width = width;
+    data_holder->bitmap_height = height;
     return 0;
 }
 
+static bool isCR3(const char* name) {
+    size_t length = strlen(name);
+    return length > 4 && strcasecmp(&name[length-4], ".cr3") == 0;
+}
+
+//Opens the file once and unpacks only the embedded preview. The image is never demosaiced:
+//preview, thumbnail and (unless RAW_readHeaderParams already read them) EXIF params all come from this single LibRAW state.
+//The preview and params are copied out, so the context is free for the next file once this returns
+int RAW_initializeDataHolder(ImageData data_holder, ImageContext context) {
+    if(data_holder==NULL || context==NULL)
+        return -9;
+    //CR3s whose params the header reader got are done without LibRAW
+    if(data_holder->params != NULL && isCR3(data_holder->name) && RAW_extractCR3Preview(data_holder) == 0)
+        return 0;
+    libraw_data_t *raw_data = context->raw_data;
+    int result = 0;
+    if(libraw_open_file(raw_data, data_holder->original_path) != LIBRAW_SUCCESS) {
+        result = -1;
+    } else if(libraw_unpack_thumb(raw_data) != LIBRAW_SUCCESS) {
+        result = -2;
+    } else {
+        int err;
+        libraw_processed_image_t *thumb = libraw_dcraw_make_mem_thumb(raw_data, &err);
+        if(thumb==NULL) {
+            result = -3;
+        } else {
+            data_holder->prev_extension = thumb->type == LIBRAW_IMAGE_JPEG ? "jpg" : "ppm";
+            data_holder->preview = thumb;
+            if(data_holder->params == NULL)
+                RAW_setImageDataParams(data_holder, raw_data);
+            else
+                fillMissingParams(data_holder->params, raw_data);
+        }
+    }
+    //recycle rather than close so the context's LibRAW instance can be reused for the next file
+    libraw_recycle_datastream(raw_data);
+    libraw_recycle(raw_data);
+    //if this fails the bitmap is still written out as a PPM preview, just without thumbnails
+    if(result == 0 && data_holder->preview->type == LIBRAW_IMAGE_BITMAP)
+        convertBitmapPreview(data_holder, context);
+    return result;
+}
+
+//ISO base media box types and the uuids of Canon's metadata box (in moov) and preview box (top level)
+#define CR3_BOX(a, b, c, d) ((uint32_t) (a) << 24 | (uint32_t) (b) << 16 | (uint32_t) (c) << 8 | (uint32_t) (d))
+static const unsigned char cr3_canon_uuid[16] = {0x85, 0xc0, 0xb6, 0x87, 0x82, 0x0f, 0x11, 0xe0, 0x81, 0x11, 0xf4, 0xce, 0x46, 0x2b, 0x6a, 0x48};
+static const unsigned char cr3_preview_uuid[16] = {0xea, 0xf4, 0x2b, 0x5e, 0x1c, 0x98, 0x4b, 0x88, 0xb9, 0xfb, 0xb7, 0xdc, 0x40, 0x6e, 0x4d, 0x16};
+
+static uint32_t cr3Long(const unsigned char* p) {
+    return (uint32_t) p[0] << 24 | (uint32_t) p[1] << 16 | (uint32_t) p[2] << 8 | p[3];
+}
+
+//Reads the header of the box at *offset, if it lies inside end. *payload is where its contents start
+//(after the uuid of uuid boxes), *next where the following box starts
+static bool cr3Box(const unsigned char* data, size_t end, size_t offset, uint32_t *type, size_t *payload, size_t *next) {
+    if(offset > end || end-offset < 8)
+        return false;
+    uint64_t size = cr3Long(&data[offset]);
+    *type = cr3Long(&data[offset+4]);
+    *payload = offset+8;
+    if(size == 1) {
+        //64 bit size after the type
+        if(end-offset < 16)
+            return false;
+        size = (uint64_t) cr3Long(&data[offset+8]) << 32 | cr3Long(&data[offset+12]);
+        *payload = offset+16;
+    } else if(size == 0) {
+        size = end-offset;
+    }
+    if(size < *payload-offset || size > end-offset)
+        return false;
+    if(*type == CR3_BOX('u', 'u', 'i', 'd'))
+        *payload += 16;
+    *next = offset+(size_t) size;
+    return *payload <= *next;
+}
+
+//A JPEG sized box of THMB or PRVW: jpeg_size at size_offset, the JPEG right after it. Only accepted if it starts with SOI
+static void cr3JPEG(const unsigned char* data, size_t payload, size_t next, size_t size_offset, const unsigned char** jpeg, size_t *jpeg_size) {
+    if(next-payload < size_offset+6)
+        return;
+    size_t size = cr3Long(&data[payload+size_offset]);
+    size_t start = payload+size_offset+4;
+    //version 1 THMB boxes have 4 more bytes before the JPEG
+    if(start+2 <= next && !(data[start] == 0xFF && data[start+1] == 0xD8))
+        start += 4;
+    if(size < 2 || start > next || size > next-start || data[start] != 0xFF || data[start+1] != 0xD8)
+        return;
+    *jpeg = &data[start];
+    *jpeg_size = size;
+}
+
+//Walks the box tree of a CR3: moov/uuid(Canon) holds THMB and CMT1-CMT4, a top level uuid box holds PRVW.
+//Only box headers are read, so for an mmap'd file only the pages they are on are touched, never mdat
+bool RAW_parseCR3(const unsigned char* data, size_t size, CR3Layout layout) {
+    memset(layout, 0, sizeof(struct CR3Layout));
+    uint32_t type;
+    size_t payload, next;
+    if(!cr3Box(data, size, 0, &type, &payload, &next) || type != CR3_BOX('f', 't', 'y', 'p') || next-payload < 4 || cr3Long(&data[payload]) != CR3_BOX('c', 'r', 'x', ' '))
+        return false;
+    for(size_t offset = next; cr3Box(data, size, offset, &type, &payload, &next); offset = next) {
+        if(type == CR3_BOX('m', 'o', 'o', 'v')) {
+            size_t moov_end = next;
+            size_t child_payload, child_next;
+            for(size_t child = payload; cr3Box(data, moov_end, child, &type, &child_payload, &child_next); child = child_next) {
+                if(type != CR3_BOX('u', 'u', 'i', 'd') || memcmp(&data[child_payload-16], cr3_canon_uuid, 16) != 0)
+                    continue;
+                size_t canon_end = child_next;
+                size_t box_payload, box_next;
+                for(size_t box = child_payload; cr3Box(data, canon_end, box, &type, &box_payload, &box_next); box = box_next) {
+                    if(type == CR3_BOX('T', 'H', 'M', 'B')) {
+                        //version/flags, width, height, then the JPEG's size
+                        cr3JPEG(data, box_payload, box_next, 8, &layout->thumb, &layout->thumb_size);
+                    } else if(type >= CR3_BOX('C', 'M', 'T', '1') && type <= CR3_BOX('C', 'M', 'T', '4')) {
+                        int index = (int) (type-CR3_BOX('C', 'M', 'T', '1'));
+                        layout->cmt[index] = &data[box_payload];
+                        layout->cmt_size[index] = box_next-box_payload;
+                    }
+                }
+            }
+        } else if(type == CR3_BOX('u', 'u', 'i', 'd') && memcmp(&data[payload-16], cr3_preview_uuid, 16) == 0) {
+            //8 bytes of unknown purpose, then the PRVW box
+            size_t box_payload, box_next;
+            if(cr3Box(data, next, payload+8, &type, &box_payload, &box_next) && type == CR3_BOX('P', 'R', 'V', 'W'))
+                //reserved fields, width, height, another reserved field, then the JPEG's size
+                cr3JPEG(data, box_payload, box_next, 12, &layout->preview, &layout->preview_size);
+        }
+    }
+    return true;
+}
+#undef CR3_BOX
+
+//Takes the preview of a CR3 straight from its PRVW box (THMB if there is none), without setting up LibRAW.
+//The JPEG is copied out of the mapping, so the rest of the pipeline can't tell the difference
+int RAW_extractCR3Preview(ImageData data_holder) {
+    int fd = open(data_holder->original_path, O_RDONLY);
+    if(fd < 0)
+        return -1;
+    struct stat filestat;
+    if(fstat(fd, &filestat) != 0 || filestat.st_size < 16) {
+        close(fd);
+        return -1;
+    }
+    size_t size = (size_t) filestat.st_size;
+    const unsigned char* data = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if(data == MAP_FAILED)
+        return -1;
+    posix_madvise((void*) data, size, POSIX_MADV_RANDOM);
+    
+    int result = -2;
+    struct CR3Layout layout;
+    if(RAW_parseCR3(data, size, &layout)) {
+        const unsigned char* jpeg = layout.preview != NULL ? layout.preview : layout.thumb;
+        size_t jpeg_size = layout.preview != NULL ? layout.preview_size : layout.thumb_size;
+        libraw_processed_image_t *preview = jpeg != NULL ? newJPEGImage(jpeg, jpeg_size) : NULL;
+        if(preview != NULL) {
+            data_holder->preview = preview;
+            data_holder->prev_extension = "jpg";
+            result = 0;
+        }
+    }
+    munmap((void*) data, size);
+    return result;
+}
+
+void RAW_releasePreview(ImageData data) {
+    if(data->preview != NULL)
+        libraw_dcraw_clear_mem(data->preview);
+    data->preview = NULL;
+    free(data->bitmap);
+    data->bitmap = NULL;
+}
+
 void free_ImageData(ImageData data) {
-    libraw_recycle_datastream(data->raw_data);
-    libraw_recycle(data->raw_data);
-    libraw_close(data->raw_data);
-    if(data->params != NULL)
-        free(data->params);
+    RAW_releasePreview(data);
     free(data);
 }
 
-int RAW_setImageDataParams(ImageData data_holder) {
-    ImageDataParams params = (ImageDataParams) malloc(sizeof(struct ImageDataParams));
-    if(params==NULL)
-        return -1;
-    params->height = data_holder->raw_data->sizes.iheight;
-    params->width = data_holder->raw_data->sizes.iwidth;
-    params->flip = data_holder->raw_data->sizes.flip;
+//EXIF params from the header pages of the file alone, see ExifReader_readFile. No LibRAW state is set up
+int RAW_readHeaderParams(ImageData data_holder, struct tm *capture_date, time_t *capture_time) {
+    int result = ExifReader_readFile(data_holder->original_path, &data_holder->params_data, capture_date, capture_time);
+    if(result != 0)
+        return result;
+    data_holder->params = &data_holder->params_data;
+    return 0;
+}
+
+int RAW_setImageDataParams(ImageData data_holder, libraw_data_t *raw_data) {
+    ImageDataParams params = &data_holder->params_data;
+    params->height = raw_data->sizes.iheight;
+    params->width = raw_data->sizes.iwidth;
+    params->flip = raw_data->sizes.flip;
     
     //Record lens data
-    params->lensname = data_holder->raw_data->lens.Lens;
-    params->focal_length = data_holder->raw_data->lens.makernotes.CurFocal;
-    //params->aperture = data_holder->params->aperture;
-    //data_holder->raw_data->
-    //params->aperture = data_holder->raw_data->lens.makernotes.CurAp;
-    params->aperture = data_holder->raw_data->other.aperture;
+    snprintf(params->lensname, sizeof(params->lensname), "%s", raw_data->lens.Lens);
+    params->focal_length = raw_data->lens.makernotes.CurFocal;
+    //params->aperture = raw_data->lens.makernotes.CurAp;
+    params->aperture = raw_data->other.aperture;
     
     //record camera data
-    params->make = data_holder->raw_data->idata.make;
-    params->model = data_holder->raw_data->idata.model;
-    params->shutter_speed = data_holder->raw_data->other.shutter;
-    params->iso_speed = data_holder->raw_data->other.iso_speed;
+    snprintf(params->make, sizeof(params->make), "%s", raw_data->idata.make);
+    snprintf(params->model, sizeof(params->model), "%s", raw_data->idata.model);
+    params->shutter_speed = raw_data->other.shutter;
+    params->iso_speed = raw_data->other.iso_speed;
     
     //set latitude/longitude arrays
     for(int i=0;i<3;i++) {
-        params->latitude[i] = data_holder->raw_data->other.parsed_gps.latitude[i];
-        params->longitude[i] = data_holder->raw_data->other.parsed_gps.longitude[i];
+        params->latitude[i] = raw_data->other.parsed_gps.latitude[i];
+        params->longitude[i] = raw_data->other.parsed_gps.longitude[i];
     }
-    params->latitude_ref = data_holder->raw_data->other.parsed_gps.latref;
-    params->longitude_ref = data_holder->raw_data->other.parsed_gps.longref;
-    params->altitude = data_holder->raw_data->other.parsed_gps.altitude;
-    params->altitude_ref = data_holder->raw_data->other.parsed_gps.altref;
+    params->latitude_ref = raw_data->other.parsed_gps.latref;
+    params->longitude_ref = raw_data->other.parsed_gps.longref;
+    params->altitude = raw_data->other.parsed_gps.altitude;
+    params->altitude_ref = raw_data->other.parsed_gps.altref;
     data_holder->params = params;
     return 0;
 }
 
-//CREDIT: libjpeg example.c
-int RAW_createThumbFile(ImageData data_holder, const char* output_path) {
-    RAW_setImageDataParams(data_holder);
-    libraw_dcraw_process(data_holder->raw_data);
-    int err;
-    libraw_processed_image_t *prev = libraw_dcraw_make_mem_thumb(data_holder->raw_data, &err);
-    if (prev->type != LIBRAW_IMAGE_JPEG) {
-        return -3;
+//Decodes a JPEG straight from memory. Of the DCT scales n/8 the decoder supports, picks the smallest that still
+//covers a max_size box, so the IDCT does most of the downscaling. Returns an RGB buffer the caller frees
+unsigned char* RAW_decodeJPEGScaled(ImageContext context, const unsigned char* data, size_t size, int max_size, int *width, int *height) {
+    struct jpeg_decompress_struct *info = &context->decompress;
+    unsigned char * volatile pixels = NULL;
+    //a corrupt stream can fail anywhere from the header to the last scanline
+    if(setjmp(context->decompress_err.jump)) {
+        jpeg_abort_decompress(info);
+        free(pixels);
+        return NULL;
     }
-    struct jpeg_decompress_struct info;
-    struct jpeg_error_mgr j_err;
-    
-    unsigned long int imgWidth, imgHeight;
-    
-    unsigned long int dwBufferBytes;
-    unsigned char* lpData;
-    
-    unsigned char* lpRowBuffer[1];
-    
-    FILE* fHandle;
-    fHandle = fmemopen(prev->data, prev->data_size, "rb");
-    
-    uint16_t readTag;
-    fread(&readTag,2,1,fHandle);
-    //TODO: make exif reader/writer endian-independent
-    //LITTLE ENDIAN ONLY RN vvvv
-    readTag = (readTag << 8) | (readTag >> 8);
-    unsigned char* exifData = NULL;
-    uint16_t exifData_size=0;
-    if(readTag==0xFFD8) {
-        while(readTag != 0xFFE1 && readTag != 0xFFD9) {
-            fread(&readTag,2,1,fHandle);
-            readTag = (readTag << 8) | (readTag >> 8);
-        }
-        if(readTag==0xFFE1) {
-            fread(&readTag,2,1,fHandle);
-            readTag = (readTag << 8) | (readTag >> 8);
-            exifData_size=readTag;
-            fseek(fHandle,-2L,SEEK_CUR);
-            exifData=malloc(exifData_size);
-            fread(exifData, readTag, 1, fHandle);
-        } else if(readTag==0xFFD9) {
-            printf("EOF w/ no APP1 Block");
-        }
-    } else {
-        printf("not valid JPEG, file starts with 2byte tag: %x",readTag);
+    jpeg_mem_src(info, data, (unsigned long) size);
+    if(jpeg_read_header(info, TRUE) != JPEG_HEADER_OK) {
+        jpeg_abort_decompress(info);
+        return NULL;
     }
-    
-    fseek(fHandle, 0, SEEK_SET);
-    if(fHandle == NULL) {
+    if(info->jpeg_color_space == JCS_CMYK || info->jpeg_color_space == JCS_YCCK) {
+        jpeg_abort_decompress(info);
+        return NULL;
+    }
+    int target_width, target_height;
+    ImageResize_fit(info->image_width, info->image_height, max_size, &target_width, &target_height);
+    //IFAST IDCT, color conversion and plain upsampling all have SIMD paths in libjpeg-turbo
+    info->out_color_space = JCS_RGB;
+    info->dct_method = JDCT_IFAST;
+    info->do_fancy_upsampling = FALSE;
+    info->do_block_smoothing = FALSE;
+    info->scale_denom = 8;
+    for(info->scale_num = 1; info->scale_num < 8; info->scale_num++) {
+        jpeg_calc_output_dimensions(info);
+        if(info->output_width >= target_width && info->output_height >= target_height)
+            break;
+    }
+    jpeg_start_decompress(info);
+    *width = info->output_width;
+    *height = info->output_height;
+    size_t row_stride = (size_t) info->output_width*info->output_components;
+    pixels = malloc(row_stride*info->output_height);
+    if(pixels == NULL) {
+        jpeg_abort_decompress(info);
+        return NULL;
+    }
+    while(info->output_scanline < info->output_height) {
+        JSAMPROW row = &pixels[row_stride*info->output_scanline];
+        jpeg_read_scanlines(info, &row, 1);
+    }
+    jpeg_finish_decompress(info);
+    return pixels;
+}
+
+//Encodes an RGB buffer into a malloc'd JPEG (*out, *out_size), caller frees. Returns 0 or -1
+int RAW_encodeJPEG(ImageContext context, const unsigned char* pixels, int width, int height, int quality, unsigned char** out, unsigned long* out_size) {
+    struct jpeg_compress_struct *cinfo = &context->compress;
+    struct ImageJPEGDestination *destination = &context->compress_dest;
+    *out = NULL;
+    *out_size = 0;
+    destination->buffer = NULL;
+    if(setjmp(context->compress_err.jump)) {
+        //the destination holds whatever buffer the encode had grown into, the caller never got it
+        jpeg_abort_compress(cinfo);
+        free(destination->buffer);
+        destination->buffer = NULL;
         return -1;
     }
-    
-    info.err = jpeg_std_error(&j_err);
-    jpeg_create_decompress(&info);
-    
-    jpeg_stdio_src(&info, fHandle);
-    jpeg_read_header(&info, TRUE);
-    
-    info.dct_method = JDCT_IFAST;
-    info.dither_mode = JDITHER_ORDERED;
-    info.scale_num = 1;
-    info.scale_denom = 8;
-    info.two_pass_quantize = TRUE;
-    
-    jpeg_start_decompress(&info);
-    imgWidth = info.output_width;
-    imgHeight = info.output_height;
-    
-    dwBufferBytes = imgWidth * imgHeight * 3;
-    lpData = (unsigned char*)malloc(sizeof(unsigned char)*dwBufferBytes);
-    
-    while(info.output_scanline < info.output_height) {
-        lpRowBuffer[0] = (unsigned char *)(&lpData[3*info.output_width*info.output_scanline]);
-                jpeg_read_scanlines(&info, lpRowBuffer, 1);
+    cinfo->image_width = width;
+    cinfo->image_height = height;
+    cinfo->input_components = 3;
+    cinfo->in_color_space = JCS_RGB;
+    jpeg_set_defaults(cinfo);
+    cinfo->dct_method = JDCT_IFAST;
+    jpeg_set_quality(cinfo, quality, TRUE);
+    jpeg_start_compress(cinfo, TRUE);
+    size_t row_stride = (size_t) width*3;
+    while(cinfo->next_scanline < cinfo->image_height) {
+        JSAMPROW row = (JSAMPROW) &pixels[row_stride*cinfo->next_scanline];
+        jpeg_write_scanlines(cinfo, &row, 1);
     }
-    
-    jpeg_finish_decompress(&info);
-    jpeg_destroy_decompress(&info);
-    fclose(fHandle);
-    libraw_dcraw_clear_mem(prev);
-    
-    //CREDIT: libjpeg example.c for sizeable amount of the rest of this function
-    
-    struct jpeg_compress_struct cinfo;
-    
-    struct jpeg_error_mgr jerr;
-    unsigned char *mem = NULL;
-    unsigned long mem_size;
-    
-    FILE * outfile;        /* target file */
-    JSAMPROW row_pointer[1];    /* pointer to JSAMPLE row[s] */
-    int row_stride;        /* physical row width in image buffer */
-    cinfo.err = jpeg_std_error(&jerr);
-    
-    jpeg_create_compress(&cinfo);
-    
-    jpeg_mem_dest(&cinfo, &mem, &mem_size);
+    jpeg_finish_compress(cinfo);
+    *out = destination->buffer;
+    *out_size = destination->size-destination->manager.free_in_buffer;
+    destination->buffer = NULL;
+    return 0;
+}
 
-    cinfo.image_width = info.output_width;
-    cinfo.image_height = info.output_height;
-    cinfo.input_components = 3;        /* # of color components per pixel */
-    cinfo.in_color_space = JCS_RGB;
+//Writes an encoded thumbnail with the preview's EXIF segment in place of its JFIF one. Nothing is copied:
+//SOI, the EXIF segment (still inside the preview) and the rest of the encoded stream go out as one gathered write
+static int writeThumbWithExif(ImageContext context, unsigned char* mem, unsigned long mem_size, const struct iovec *exif, const char* output_path) {
+    struct iovec out_iov[3];
+    int iov_count = 1;
+    out_iov[0].iov_base = mem;
+    out_iov[0].iov_len = mem_size;
+    if(exif->iov_len > 0 && mem_size >= 2) {
+        //libjpeg puts APP0 right after SOI
+        size_t rest = 2;
+        size_t app0_offset, app0_length;
+        if(ExifReader_findJPEGSegment(mem, mem_size, 0xE0, NULL, 0, &app0_offset, &app0_length) && app0_offset == 2)
+            rest += app0_length;
+        out_iov[0].iov_len = 2;
+        out_iov[1] = *exif;
+        out_iov[2].iov_base = mem+rest;
+        out_iov[2].iov_len = mem_size-rest;
+        iov_count = 3;
+    }
+    if(IOBackend_writeFile(context->io, AT_FDCWD, output_path, out_iov, iov_count) != 0) {
+        Log(LOG_LEVEL_ERROR, "can't write %s\n", output_path);
+        return -1;
+    }
+    return 0;
+}
 
-    jpeg_set_defaults(&cinfo);
+//Works out the thumbnail sizes for the preview from its header alone, in context->thumb_sizes order.
+//The first size is always made; the others are skipped if the preview is not larger than them. Returns the count
+int RAW_planThumbnails(ImageData data_holder, ImageContext context, struct ImageRendition renditions[IMAGE_MAX_THUMB_SIZES]) {
+    libraw_processed_image_t *prev = data_holder->preview;
+    if (prev == NULL || prev->type != LIBRAW_IMAGE_JPEG) {
+        return -3;
+    }
+    struct jpeg_decompress_struct *info = &context->decompress;
+    if(setjmp(context->decompress_err.jump)) {
+        jpeg_abort_decompress(info);
+        return -1;
+    }
+    jpeg_mem_src(info, prev->data, prev->data_size);
+    if(jpeg_read_header(info, TRUE) != JPEG_HEADER_OK) {
+        jpeg_abort_decompress(info);
+        return -1;
+    }
+    int width = info->image_width;
+    int height = info->image_height;
+    jpeg_abort_decompress(info);
+    int long_edge = width > height ? width : height;
+    int count = 0;
+    for(int i=0; i<context->thumb_size_count; i++) {
+        if(i > 0 && context->thumb_sizes[i] >= long_edge)
+            continue;
+        renditions[count].size = context->thumb_sizes[i];
+        ImageResize_fit(width, height, context->thumb_sizes[i], &renditions[count].width, &renditions[count].height);
+        count++;
+    }
+    return count;
+}
 
-    jpeg_set_quality(&cinfo, 90, TRUE);
-    
-    /* TRUE ensures that we will write a complete interchange-JPEG file.
-     * Pass TRUE unless you are very sure of what you're doing.
-     */
-    jpeg_start_compress(&cinfo, TRUE);
-    
-    row_stride = info.output_width * 3;    /* JSAMPLEs per row in image_buffer */
-    
-    while (cinfo.next_scanline < cinfo.image_height) {
-        row_pointer[0] = & lpData[cinfo.next_scanline * row_stride];
-        (void) jpeg_write_scanlines(&cinfo, row_pointer, 1);
+//All planned thumbnails from one decode: the preview is decoded at the DCT scale that covers the largest of them,
+//then each is area filtered from the next larger one and encoded. paths[i] is the output for renditions[i]
+int RAW_createThumbFiles(ImageData data_holder, ImageContext context, struct ImageRendition *renditions, char** paths, int count) {
+    libraw_processed_image_t *prev = data_holder->preview;
+    if (prev == NULL || prev->type != LIBRAW_IMAGE_JPEG || count <= 0) {
+        return -3;
     }
-    
-    jpeg_finish_compress(&cinfo);
-    jpeg_destroy_compress(&cinfo);
-    
-    free(lpData);
-    /* After finish_compress, we can close the output file. */
-    if ((outfile = fopen(output_path, "wb")) == NULL) {
-        fprintf(stderr, "can't open %s\n", output_path);
-        exit(1);
-    }
-    if(exifData_size>0) {
-        FILE* buffer_stream = fmemopen(mem, mem_size, "rb");
-        //copy EXIF data tag to output file if exists in original thumbnail
-        uint16_t readTag_2;
-        fread(&readTag_2,2,1,buffer_stream);
-        readTag_2 = (readTag_2 << 8) | (readTag_2 >> 8);
-        while(readTag_2 != 0xFFE0 && readTag_2 != 0xFFD9) {
-            readTag_2 = (readTag_2 << 8) | (readTag_2 >> 8);
-            fwrite(&readTag_2, 2, 1, outfile);
-            
-            fread(&readTag_2,2,1,buffer_stream);
-            readTag_2 = (readTag_2 << 8) | (readTag_2 >> 8);
-        }
-        if(readTag_2==0xFFE0) {
-            fread(&readTag_2,2,1,buffer_stream);
-            readTag_2 = (readTag_2 << 8) | (readTag_2 >> 8);
-            fseek(buffer_stream, (readTag_2-2), SEEK_CUR);
-            
-            fputc(0xFF, outfile);fputc(0xE1, outfile);
-            fwrite(exifData,exifData_size,1,outfile);
-        } else if(readTag_2==0xFFD9) {
-            fwrite(&readTag_2,2,1,outfile);
-        } else {
-            
+    //largest first, so each rendition can be filtered down from the previous one
+    int order[IMAGE_MAX_THUMB_SIZES];
+    for(int i=0; i<count; i++) {
+        int j = i;
+        while(j > 0 && renditions[order[j-1]].width*renditions[order[j-1]].height < renditions[i].width*renditions[i].height) {
+            order[j] = order[j-1];
+            j--;
         }
-        char gotten_char = fgetc(buffer_stream);
-        while(feof(buffer_stream)==0) {
-            fputc(gotten_char,outfile);
-            gotten_char = fgetc(buffer_stream);
+        order[j] = i;
+    }
+    int largest = renditions[order[0]].width > renditions[order[0]].height ? renditions[order[0]].width : renditions[order[0]].height;
+    
+    //previews encoded from a bitmap still have it, at the preview's size
+    int source_width = data_holder->bitmap_width;
+    int source_height = data_holder->bitmap_height;
+    unsigned char* source = data_holder->bitmap;
+    if(source == NULL)
+        source = RAW_decodeJPEGScaled(context, prev->data, prev->data_size, largest, &source_width, &source_height);
+    if(source == NULL) {
+        return -1;
+    }
+    //the preview's EXIF segment, used in place by every thumbnail
+    struct iovec exif = {NULL, 0};
+    size_t exif_offset, exif_length;
+    if(ExifReader_findJPEGSegment(prev->data, prev->data_size, 0xE1, "Exif\0", 6, &exif_offset, &exif_length)) {
+        exif.iov_base = &prev->data[exif_offset];
+        exif.iov_len = exif_length;
+    }
+    int result = 0;
+    for(int i=0; i<count && result == 0; i++) {
+        ImageRendition rendition = &renditions[order[i]];
+        if(rendition->width != source_width || rendition->height != source_height) {
+            unsigned char* resized = malloc((size_t) rendition->width*rendition->height*3);
+            if(resized == NULL || !ImageResize_area(source, source_width, source_height, resized, rendition->width, rendition->height, 3)) {
+                free(resized);
+                result = -1;
+                break;
+            }
+            if(source != data_holder->bitmap)
+                free(source);
+            source = resized;
+            source_width = rendition->width;
+            source_height = rendition->height;
         }
-        fclose(buffer_stream);
-        free(exifData);
-    } else {
-        fwrite(mem, mem_size, 1, outfile);
+        unsigned char *mem = NULL;
+        unsigned long mem_size;
+        result = RAW_encodeJPEG(context, source, source_width, source_height, context->thumb_quality, &mem, &mem_size);
+        if(result == 0)
+            result = writeThumbWithExif(context, mem, mem_size, &exif, paths[order[i]]);
+        free(mem);
     }
-    fclose(outfile);
-    free(mem);
-    
-    /* Step 7: release JPEG compression object */
-    jpeg_destroy_compress(&cinfo);
-    
-    return 0;
+    if(source != data_holder->bitmap)
+        free(source);
+    return result;
 }
 
-void RAW_createPreviewFile(ImageData data_holder, const char* output_path) {
-    libraw_dcraw_process(data_holder->raw_data);
-    int err;
-    libraw_processed_image_t *thumb = libraw_dcraw_make_mem_thumb(data_holder->raw_data, &err);
-    write_prev(thumb, output_path);
-    libraw_dcraw_clear_mem(thumb);
+int RAW_createPreviewFile(ImageData data_holder, ImageContext context, const char* output_path) {
+    return write_prev(data_holder->preview, context->io, output_path);
 }
 
-void write_prev(libraw_processed_image_t *img, const char *output_path){
+int write_prev(libraw_processed_image_t *img, IOBackend io, const char *output_path){
     if (!img)
-        return;
+        return -1;
 
-    if (img->type == LIBRAW_IMAGE_BITMAP) {
-        write_ppm(img, output_path);
-    } else if (img->type == LIBRAW_IMAGE_JPEG) {
-        FILE *f = fopen(output_path, "wb");
-        if (!f)
-            return;
-        fwrite(img->data, img->data_size, 1, f);
-        fclose(f);
+    if (img->type == LIBRAW_IMAGE_BITMAP)
+        return write_ppm(img, io, output_path);
+    if (img->type == LIBRAW_IMAGE_JPEG) {
+        struct iovec iov = {img->data, img->data_size};
+        return IOBackend_writeFile(io, AT_FDCWD, output_path, &iov, 1);
     }
+    return -1;
 }
 
-void write_ppm(libraw_processed_image_t *img, const char *output_path) {
+int write_ppm(libraw_processed_image_t *img, IOBackend io, const char *output_path) {
     if (!img)
-        return;
+        return -1;
     // type SHOULD be LIBRAW_IMAGE_BITMAP, but we'll check
     if (img->type != LIBRAW_IMAGE_BITMAP)
-        return;
+        return -1;
     if (img->colors != 3 && img->colors != 1)
     {
-        printf("Only monochrome and 3-color images supported for PPM output\n");
-        return;
+        Log(LOG_LEVEL_WARNING, "Only monochrome and 3-color images supported for PPM output\n");
+        return -1;
     }
     
-    FILE *f = fopen(output_path, "wb");
-    if (!f)
-        return;
-    fprintf(f, "P%d\n%d %d\n%d\n", img->colors/2 + 5, img->width, img->height, (1 << img->bits) - 1);
-    /*
-     NOTE:
-     data in img->data is not converted to network byte order.
-     So, we should swap values on some architectures for dcraw compatibility
-     (unfortunately, xv cannot display 16-bit PPMs with network byte order data
-     */
-#define SWAP(a, b)                                                             \
-{                                                                            \
-a ^= b;                                                                    \
-a ^= (b ^= a);                                                             \
-}
+    char header[64];
+    int header_size = snprintf(header, sizeof(header), "P%d\n%d %d\n%d\n", img->colors/2 + 5, img->width, img->height, (1 << img->bits) - 1);
+    //LibRAW leaves 16 bit samples in host order, PPM wants them big endian
     if (img->bits == 16 && htons(0x55aa) != 0x55aa)
-        for (unsigned i = 0; i < img->data_size-1; i += 2)
-            SWAP(img->data[i], img->data[i + 1]);
-#undef SWAP
+        ImageResize_swap16(img->data, img->data_size/2);
     
-    fwrite(img->data, img->data_size, 1, f);
-    fclose(f);
+    struct iovec iov[2] = {{header, header_size}, {img->data, img->data_size}};
+    return IOBackend_writeFile(io, AT_FDCWD, output_path, iov, 2);
 }
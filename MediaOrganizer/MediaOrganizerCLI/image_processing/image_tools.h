@@ -9,26 +9,62 @@
 #define image_tools_h
 
 #include <stdio.h>
+#include <stdbool.h>
+#include <time.h>
+#include <setjmp.h>
 #include <libraw.h>
 #include <jpeglib.h>
 #include <jerror.h>
+#include "io_backend.h"
+#include "logger.h"
+#include "image_resize.h"
 
+//long edge of the main thumbnail in pixels, of the tiny one made alongside it by default, and their JPEG quality
+#define IMAGE_THUMB_SIZE 640
+#define IMAGE_THUMB_TINY_SIZE 64
+#define IMAGE_THUMB_QUALITY 90
+#define IMAGE_MAX_THUMB_SIZES 8
+//bitmap previews are encoded to JPEG at up to this long edge, like the embedded JPEG previews of most raws
+#define IMAGE_PREVIEW_SIZE 2048
+#define IMAGE_PREVIEW_QUALITY 90
+//first output buffer of a JPEG encode, doubled whenever it fills up
+#define IMAGE_JPEG_BUFFER_SIZE 65536
+
+typedef struct ImageContext *ImageContext;
 typedef struct ImageData *ImageData;
 typedef struct ImageDataParams *ImageDataParams;
+typedef struct ImageRendition *ImageRendition;
 
-struct ImageData {
-    char* prev_extension;
-    const char* name;
-    const char* original_path;
-    libraw_data_t *raw_data;
-    libraw_processed_image_t *preview;
-    ImageDataParams params;
+//libjpeg error manager whose error_exit longjmps back to jump instead of calling exit(), so a corrupt
+//preview fails that file and not the whole process. Set jump with setjmp before every libjpeg call
+struct ImageJPEGError {
+    struct jpeg_error_mgr manager;  //first, libjpeg only sees this part
+    jmp_buf jump;
 };
-extern ImageData new_ImageData(const char* name, const char* path);
-extern int RAW_initializeDataHolder(ImageData data_holder);
-extern void free_ImageData(ImageData data);
 
-extern void free_processed_image(libraw_processed_image_t* image);
+//libjpeg destination that encodes into a growing malloc'd buffer. Unlike jpeg_mem_dest's, the buffer it is
+//writing to is always known, so an encode that fails partway can free it
+struct ImageJPEGDestination {
+    struct jpeg_destination_mgr manager;    //first, libjpeg only sees this part
+    unsigned char* buffer;
+    size_t size;
+};
+
+//LibRAW and libjpeg state that is reused across files. Not thread safe: one per worker thread
+struct ImageContext {
+    libraw_data_t *raw_data;
+    struct jpeg_decompress_struct decompress;
+    struct ImageJPEGError decompress_err;
+    struct jpeg_compress_struct compress;
+    struct ImageJPEGError compress_err;
+    struct ImageJPEGDestination compress_dest;
+    IOBackend io;   //not owned. Output files are written through it, NULL writes them with blocking calls
+    int thumb_sizes[IMAGE_MAX_THUMB_SIZES];   //long edges, the first is the main thumbnail
+    int thumb_size_count;
+    int thumb_quality;
+};
+extern ImageContext new_ImageContext(void);
+extern void free_ImageContext(ImageContext context);
 
 struct ImageDataParams {
     //image data
@@ -37,13 +73,13 @@ struct ImageDataParams {
     uint16_t height;
     
     //lens data
-    char *lensname;
+    char lensname[128];
     float focal_length;
     float aperture;
     
     //camera data
-    char *make;
-    char *model;
+    char make[64];
+    char model[64];
     float shutter_speed;
     float iso_speed;
     
@@ -55,12 +91,60 @@ struct ImageDataParams {
     float altitude;
     char altitude_ref;
 };
-extern int RAW_setImageDataParams(ImageData data_holder);
 
-extern int RAW_createThumbFile(ImageData data_holder, const char* const_path);
-extern void RAW_createPreviewFile(ImageData data_holder, const char* output_path);
+//Embedded preview and EXIF params of one file. Holds no LibRAW state, so it can be handed between threads
+struct ImageData {
+    char* prev_extension;
+    const char* name;
+    const char* original_path;
+    libraw_processed_image_t *preview;
+    unsigned char *bitmap;  //8 bit RGB the preview was encoded from if LibRAW gave a bitmap, thumbnails skip the decode
+    int bitmap_width;
+    int bitmap_height;
+    ImageDataParams params;     //points at params_data once the params are read, NULL until then
+    struct ImageDataParams params_data;
+};
+extern ImageData new_ImageData(const char* name, const char* path);
+//CR3 files are read natively, see RAW_extractCR3Preview. Everything else goes through LibRAW
+extern int RAW_initializeDataHolder(ImageData data_holder, ImageContext context);
+extern void free_ImageData(ImageData data);
+//Frees the preview and bitmap once the thumbnails are made, keeping the params
+extern void RAW_releasePreview(ImageData data);
+
+extern void free_processed_image(libraw_processed_image_t* image);
+
+typedef struct CR3Layout *CR3Layout;
+
+//Byte ranges inside a Canon CR3 (ISO base media) file in memory. Pointers are NULL for boxes the file doesn't have
+struct CR3Layout {
+    const unsigned char *thumb;     //THMB JPEG, 160x120
+    size_t thumb_size;
+    const unsigned char *preview;   //PRVW JPEG, around 1620x1080
+    size_t preview_size;
+    const unsigned char *cmt[4];    //CMT1-CMT4 TIFF structures: IFD0, EXIF IFD, maker notes, GPS IFD
+    size_t cmt_size[4];
+};
+extern bool RAW_parseCR3(const unsigned char* data, size_t size, CR3Layout layout);
+extern int RAW_extractCR3Preview(ImageData data_holder);
+
+extern int RAW_readHeaderParams(ImageData data_holder, struct tm *capture_date, time_t *capture_time);
+extern int RAW_setImageDataParams(ImageData data_holder, libraw_data_t *raw_data);
+
+//Both return an error (NULL, -1) for data libjpeg can't handle
+extern unsigned char* RAW_decodeJPEGScaled(ImageContext context, const unsigned char* data, size_t size, int max_size, int *width, int *height);
+extern int RAW_encodeJPEG(ImageContext context, const unsigned char* pixels, int width, int height, int quality, unsigned char** out, unsigned long* out_size);
+//One thumbnail size of a file
+struct ImageRendition {
+    int size;   //configured long edge
+    int width;
+    int height;
+};
+extern int RAW_planThumbnails(ImageData data_holder, ImageContext context, struct ImageRendition renditions[IMAGE_MAX_THUMB_SIZES]);
+extern int RAW_createThumbFiles(ImageData data_holder, ImageContext context, struct ImageRendition *renditions, char** paths, int count);
+//Returns 0 once the preview file is written, -1 if there is no preview or it could not be written
+extern int RAW_createPreviewFile(ImageData data_holder, ImageContext context, const char* output_path);
 
-extern void write_prev(libraw_processed_image_t *img, const char *basename);
-extern void write_ppm(libraw_processed_image_t *img, const char *basename);
+extern int write_prev(libraw_processed_image_t *img, IOBackend io, const char *basename);
+extern int write_ppm(libraw_processed_image_t *img, IOBackend io, const char *basename);
 
 #endif /* image_tools_h */
@@ -0,0 +1,181 @@
+//
+//  device_limiter.c
+//  MediaOrganizerCLI
+//
+//  Created by John Bridge on 10/17/26.
+//
+
+#include "device_limiter.h"
+
+DeviceLimiter new_DeviceLimiter(int depth_override) {
+    DeviceLimiter limiter = malloc(sizeof(struct DeviceLimiter));
+    if(limiter == NULL)
+        return NULL;
+    limiter->queue_count = 0;
+    limiter->depth_override = depth_override;
+    limiter->wait_latency = NULL;
+    pthread_mutex_init(&limiter->lock, NULL);
+    return limiter;
+}
+
+void free_DeviceLimiter(DeviceLimiter limiter) {
+    for(int i=0; i<limiter->queue_count; i++)
+        pthread_cond_destroy(&limiter->queues[i].available);
+    pthread_mutex_destroy(&limiter->lock);
+    free(limiter);
+}
+
+#if !defined(__APPLE__) && !defined(__FreeBSD__)
+//Reads a sysfs attribute holding a number. false if there is none
+static bool deviceReadAttribute(const char* device_path, const char* attribute, int *value) {
+    char path[PATH_MAX];
+    if(snprintf(path, sizeof(path), "%s/%s", device_path, attribute) >= (int) sizeof(path))
+        return false;
+    FILE* file = fopen(path, "r");
+    if(file == NULL)
+        return false;
+    bool read = fscanf(file, "%d", value) == 1;
+    fclose(file);
+    return read;
+}
+
+//A partition has no queue/ or removable of its own, the disk it is on does
+static bool deviceReadDiskAttribute(char* device_path, const char* attribute, int *value) {
+    if(deviceReadAttribute(device_path, attribute, value))
+        return true;
+    char* last = strrchr(device_path, '/');
+    if(last == NULL || last == device_path)
+        return false;
+    *last = '\0';
+    bool read = deviceReadAttribute(device_path, attribute, value);
+    *last = '/';
+    return read;
+}
+#endif
+
+DeviceKind DeviceLimiter_kind(dev_t device) {
+#if !defined(__APPLE__) && !defined(__FreeBSD__)
+    char path[PATH_MAX], device_path[PATH_MAX];
+    snprintf(path, sizeof(path), "/sys/dev/block/%u:%u", major(device), minor(device));
+    //e.g. /sys/devices/pci0000:00/0000:00:14.0/usb2/2-1/2-1:1.0/host0/target0:0:0/0:0:0:0/block/sdb/sdb1
+    if(realpath(path, device_path) == NULL)
+        return DEVICE_OTHER;
+    if(strstr(device_path, "/mmc") != NULL)
+        return DEVICE_REMOVABLE;
+    int rotational = -1;
+    deviceReadDiskAttribute(device_path, "queue/rotational", &rotational);
+    if(rotational == 1)
+        return DEVICE_ROTATIONAL;
+    int removable = 0;
+    deviceReadDiskAttribute(device_path, "removable", &removable);
+    if(removable == 1 || strstr(device_path, "/usb") != NULL)
+        return DEVICE_REMOVABLE;
+    return rotational == 0 ? DEVICE_SOLID_STATE : DEVICE_OTHER;
+#else
+    return DEVICE_OTHER;
+#endif
+}
+
+const char* DeviceLimiter_kindName(DeviceKind kind) {
+    switch(kind) {
+        case DEVICE_ROTATIONAL:
+            return "rotational";
+        case DEVICE_REMOVABLE:
+            return "removable";
+        case DEVICE_SOLID_STATE:
+            return "solid state";
+        default:
+            return "other";
+    }
+}
+
+static int deviceDefaultDepth(DeviceKind kind) {
+    switch(kind) {
+        case DEVICE_ROTATIONAL:
+            return DEVICE_DEPTH_ROTATIONAL;
+        case DEVICE_REMOVABLE:
+            return DEVICE_DEPTH_REMOVABLE;
+        case DEVICE_SOLID_STATE:
+            return DEVICE_DEPTH_SOLID_STATE;
+        default:
+            return DEVICE_DEPTH_OTHER;
+    }
+}
+
+//Finds device's queue, setting it up the first time the device is seen. Call with the lock held
+static DeviceQueue deviceLimiterQueue(DeviceLimiter limiter, dev_t device) {
+    for(int i=0; i<limiter->queue_count; i++) {
+        if(limiter->queues[i].device == device)
+            return &limiter->queues[i];
+    }
+    if(limiter->queue_count == DEVICE_LIMITER_MAX_DEVICES)
+        return NULL;
+    DeviceQueue queue = &limiter->queues[limiter->queue_count++];
+    queue->device = device;
+    queue->kind = DeviceLimiter_kind(device);
+    queue->depth = limiter->depth_override > 0 ? limiter->depth_override : deviceDefaultDepth(queue->kind);
+    queue->in_flight = 0;
+    queue->peak_in_flight = 0;
+    queue->acquired = 0;
+    queue->waited = 0;
+    pthread_cond_init(&queue->available, NULL);
+    return queue;
+}
+
+DeviceQueue DeviceLimiter_acquire(DeviceLimiter limiter, dev_t device) {
+    if(limiter == NULL)
+        return NULL;
+    pthread_mutex_lock(&limiter->lock);
+    DeviceQueue queue = deviceLimiterQueue(limiter, device);
+    if(queue != NULL) {
+        if(queue->in_flight >= queue->depth) {
+            queue->waited++;
+            uint64_t started = Metrics_now();
+            while(queue->in_flight >= queue->depth)
+                pthread_cond_wait(&queue->available, &limiter->lock);
+            LatencyHistogram_record(limiter->wait_latency, Metrics_now()-started);
+        }
+        queue->in_flight++;
+        queue->acquired++;
+        if(queue->in_flight > queue->peak_in_flight)
+            queue->peak_in_flight = queue->in_flight;
+    }
+    pthread_mutex_unlock(&limiter->lock);
+    return queue;
+}
+
+void DeviceLimiter_release(DeviceLimiter limiter, DeviceQueue queue) {
+    if(limiter == NULL || queue == NULL)
+        return;
+    pthread_mutex_lock(&limiter->lock);
+    queue->in_flight--;
+    pthread_cond_signal(&queue->available);
+    pthread_mutex_unlock(&limiter->lock);
+}
+
+void DeviceLimiter_acquirePair(DeviceLimiter limiter, dev_t first, dev_t second, DeviceQueue *first_queue, DeviceQueue *second_queue) {
+    if(first == second) {
+        *first_queue = DeviceLimiter_acquire(limiter, first);
+        *second_queue = NULL;
+    } else if(first < second) {
+        *first_queue = DeviceLimiter_acquire(limiter, first);
+        *second_queue = DeviceLimiter_acquire(limiter, second);
+    } else {
+        *second_queue = DeviceLimiter_acquire(limiter, second);
+        *first_queue = DeviceLimiter_acquire(limiter, first);
+    }
+}
+
+void DeviceLimiter_printSummary(DeviceLimiter limiter, FILE* stream) {
+    pthread_mutex_lock(&limiter->lock);
+    for(int i=0; i<limiter->queue_count; i++) {
+        DeviceQueue queue = &limiter->queues[i];
+#if !defined(__APPLE__) && !defined(__FreeBSD__)
+        fprintf(stream, "device %u:%u", major(queue->device), minor(queue->device));
+#else
+        fprintf(stream, "device %d:%d", major(queue->device), minor(queue->device));
+#endif
+        fprintf(stream, " (%s) depth: %d peak: %d files: %zu waited: %zu\n", DeviceLimiter_kindName(queue->kind), queue->depth, queue->peak_in_flight, queue->acquired, queue->waited);
+    }
+    pthread_mutex_unlock(&limiter->lock);
+}
@@ -0,0 +1,80 @@
+//
+//  device_limiter.h
+//  MediaOrganizerCLI
+//
+//  Created by John Bridge on 10/17/26.
+//
+
+#ifndef device_limiter_h
+#define device_limiter_h
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <limits.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include "metrics.h"
+
+#if !defined(__APPLE__) && !defined(__FreeBSD__)
+#include <sys/sysmacros.h>
+#endif
+
+//devices tracked at once, I/O on any further device is not limited
+#define DEVICE_LIMITER_MAX_DEVICES 32
+//default queue depth per kind of device
+#define DEVICE_DEPTH_ROTATIONAL 1
+#define DEVICE_DEPTH_REMOVABLE 2
+#define DEVICE_DEPTH_SOLID_STATE 8
+#define DEVICE_DEPTH_OTHER 4
+
+typedef struct DeviceQueue *DeviceQueue;
+typedef struct DeviceLimiter *DeviceLimiter;
+
+//What a device is, read from sysfs (/sys/dev/block/MAJOR:MINOR) on Linux
+typedef enum {
+    DEVICE_ROTATIONAL,      //spinning disk, including USB hard drives: one stream at a time, anything more seeks
+    DEVICE_REMOVABLE,       //SD cards and USB flash, whose controllers fall over with more than a couple of requests
+    DEVICE_SOLID_STATE,     //SATA/NVMe SSDs, which need requests in parallel to reach their throughput
+    DEVICE_OTHER            //network shares, virtual filesystems, and every device on platforms without sysfs
+} DeviceKind;
+
+//One device's queue: at most depth files are read or written on it at once
+struct DeviceQueue {
+    dev_t device;
+    DeviceKind kind;
+    int depth;
+    int in_flight;
+    int peak_in_flight;
+    size_t acquired;
+    size_t waited;      //acquires that found the queue full
+    pthread_cond_t available;
+};
+
+//Per-device concurrency limits for the I/O bound pipeline stages. Only their threads ever wait here,
+//so a slow or saturated device holds up other work on the same device and never the CPU bound stages
+struct DeviceLimiter {
+    struct DeviceQueue queues[DEVICE_LIMITER_MAX_DEVICES];
+    int queue_count;
+    int depth_override;     //depth of every device when > 0, instead of the one for its kind
+    LatencyHistogram wait_latency;  //time spent waiting for a full queue, NULL to skip timing
+    pthread_mutex_t lock;
+};
+extern DeviceLimiter new_DeviceLimiter(int depth_override);
+extern void free_DeviceLimiter(DeviceLimiter limiter);
+
+extern DeviceKind DeviceLimiter_kind(dev_t device);
+extern const char* DeviceLimiter_kindName(DeviceKind kind);
+//Blocks until device's queue has room and takes a slot. Returns the queue to release, NULL if the device is not limited
+extern DeviceQueue DeviceLimiter_acquire(DeviceLimiter limiter, dev_t device);
+extern void DeviceLimiter_release(DeviceLimiter limiter, DeviceQueue queue);
+//Takes a slot on both devices, in device order so two threads taking the same pair never deadlock.
+//Only one slot when both are the same device. Either queue may come back NULL
+extern void DeviceLimiter_acquirePair(DeviceLimiter limiter, dev_t first, dev_t second, DeviceQueue *first_queue, DeviceQueue *second_queue);
+//Every device used so far with its kind, depth and how often I/O had to wait for it
+extern void DeviceLimiter_printSummary(DeviceLimiter limiter, FILE* stream);
+
+#endif /* device_limiter_h */
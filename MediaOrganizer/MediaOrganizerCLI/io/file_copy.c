@@ -0,0 +1,141 @@
+//
+//  file_copy.c
+//  MediaOrganizerCLI
+//
+//  Created by John Bridge on 10/17/26.
+//
+
+//copy_file_range and fallocate on Linux, defined before any system header is included
+#define _GNU_SOURCE
+#include "file_copy.h"
+
+#if !defined(__APPLE__) && !defined(__FreeBSD__)
+//Only works when both files are on the same btrfs/XFS (or other reflink capable) filesystem
+static bool fileCopyClone(int input, int output) {
+    return ioctl(output, FICLONE, input) == 0;
+}
+
+//errors that mean this method is not available for this pair of files, rather than a failed copy
+static bool fileCopyUnsupported(int error) {
+    return error == EXDEV || error == ENOSYS || error == EOPNOTSUPP || error == EINVAL;
+}
+
+//Returns bytes copied, or -1 if copy_file_range cannot be used before anything was copied
+static off_t fileCopyRange(int input, int output, off_t size, bool *failed) {
+    off_t copied = 0;
+    while(copied < size) {
+        ssize_t result = copy_file_range(input, NULL, output, NULL, size-copied, 0);
+        if(result < 0) {
+            if(errno == EINTR)
+                continue;
+            if(copied == 0 && fileCopyUnsupported(errno))
+                return -1;
+            *failed = true;
+            break;
+        }
+        //source got shorter
+        if(result == 0)
+            break;
+        copied += result;
+    }
+    return copied;
+}
+
+//sendfile may write less than asked, so keep going from where the last call stopped
+static off_t fileCopySendfile(int input, int output, off_t size, bool *failed) {
+    off_t copied = 0;
+    while(copied < size) {
+        off_t remaining = size-copied;
+        ssize_t result = sendfile(output, input, NULL, remaining < FILE_COPY_SENDFILE_CHUNK ? remaining : FILE_COPY_SENDFILE_CHUNK);
+        if(result < 0) {
+            if(errno == EINTR || errno == EAGAIN)
+                continue;
+            *failed = true;
+            break;
+        }
+        if(result == 0)
+            break;
+        copied += result;
+    }
+    return copied;
+}
+
+//copy_file_range stays in the kernel, or on the server for NFS/SMB, when both files are on one device.
+//Across devices it is a synchronous copy, and io_uring keeps the source and destination busier
+static bool fileCopyAcrossDevices(int input, int output) {
+    struct stat input_stat, output_stat;
+    if(fstat(input, &input_stat) != 0 || fstat(output, &output_stat) != 0)
+        return false;
+    return input_stat.st_dev != output_stat.st_dev;
+}
+#endif
+
+bool FileCopy_copy(IOBackend io, int input, int output, off_t size, FileCopyResult result) {
+    struct timespec start, end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    result->method = FILE_COPY_NONE;
+    result->bytes = 0;
+    bool failed = false;
+#if defined(__APPLE__) || defined(__FreeBSD__)
+    //fcopyfile works on FreeBSD and OS X 10.5+ and handles partial writes itself
+    result->method = FILE_COPY_COPYFILE;
+    if(fcopyfile(input, output, 0, COPYFILE_ALL) == 0)
+        result->bytes = size;
+    else
+        failed = true;
+#else
+    if(size > 0 && fileCopyClone(input, output)) {
+        result->method = FILE_COPY_CLONE;
+        result->bytes = size;
+    } else {
+        //reserve the whole file up front so a full disk fails here rather than partway through
+        if(size > 0 && fallocate(output, 0, 0, size) != 0 && errno == ENOSPC) {
+            failed = true;
+        } else {
+            off_t copied = -1;
+            if(IOBackend_canCopy(io) && fileCopyAcrossDevices(input, output)) {
+                result->method = FILE_COPY_URING;
+                copied = IOBackend_copy(io, input, output, size, &failed);
+            } else {
+                result->method = FILE_COPY_RANGE;
+                copied = fileCopyRange(input, output, size, &failed);
+            }
+            if(copied < 0) {
+                result->method = FILE_COPY_SENDFILE;
+                copied = fileCopySendfile(input, output, size, &failed);
+            }
+            result->bytes = copied;
+        }
+    }
+    if(result->bytes < size) {
+        //drop the preallocated tail so a short copy can't pass for a whole file
+        if(ftruncate(output, result->bytes) != 0)
+            Log(LOG_LEVEL_ERROR, "Could not truncate short copy: %s\n", strerror(errno));
+        failed = true;
+    }
+#endif
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    result->seconds = (end.tv_sec-start.tv_sec) + (end.tv_nsec-start.tv_nsec)/1e9;
+    return !failed;
+}
+
+const char* FileCopy_methodName(FileCopyMethod method) {
+    switch(method) {
+        case FILE_COPY_CLONE:
+            return "reflink";
+        case FILE_COPY_RANGE:
+            return "copy_file_range";
+        case FILE_COPY_URING:
+            return "io_uring";
+        case FILE_COPY_SENDFILE:
+            return "sendfile";
+        case FILE_COPY_COPYFILE:
+            return "fcopyfile";
+        default:
+            return "none";
+    }
+}
+
+double FileCopy_bytesPerSecond(FileCopyResult result) {
+    return result->seconds > 0 ? result->bytes/result->seconds : 0;
+}
@@ -0,0 +1,59 @@
+//
+//  file_copy.h
+//  MediaOrganizerCLI
+//
+//  Created by John Bridge on 10/17/26.
+//
+
+#ifndef file_copy_h
+#define file_copy_h
+
+#include <stdio.h>
+#include <stdbool.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include "io_backend.h"
+#include "logger.h"
+
+#if defined(__APPLE__) || defined(__FreeBSD__)
+#include <copyfile.h>
+#else
+#include <sys/ioctl.h>
+#include <sys/sendfile.h>
+#include <linux/fs.h>
+#endif
+
+//largest single sendfile call. Linux caps one call just under 2 GiB anyway
+#define FILE_COPY_SENDFILE_CHUNK (1L << 30)
+
+typedef struct FileCopyResult *FileCopyResult;
+
+typedef enum {
+    FILE_COPY_NONE,
+    FILE_COPY_CLONE,        //FICLONE reflink, no data copied
+    FILE_COPY_RANGE,        //copy_file_range, the filesystem may still share extents or copy server side
+    FILE_COPY_URING,        //io_uring reads and writes with registered buffers, several in flight
+    FILE_COPY_SENDFILE,     //in kernel copy
+    FILE_COPY_COPYFILE      //macOS fcopyfile
+} FileCopyMethod;
+
+struct FileCopyResult {
+    FileCopyMethod method;
+    off_t bytes;
+    double seconds;
+};
+
+//Copies size bytes from input to output, trying the cheapest method first:
+//reflink, then copy_file_range, then chunked sendfile. Loops until every byte is written.
+//Between two devices, io (if it can copy) is used instead of copy_file_range to keep several requests in flight.
+//Returns false, with output truncated to what was copied, if the copy fails or the source is shorter than size
+extern bool FileCopy_copy(IOBackend io, int input, int output, off_t size, FileCopyResult result);
+extern const char* FileCopy_methodName(FileCopyMethod method);
+extern double FileCopy_bytesPerSecond(FileCopyResult result);
+
+#endif /* file_copy_h */
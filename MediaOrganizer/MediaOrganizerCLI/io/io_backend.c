@@ -0,0 +1,294 @@
+//
+//  io_backend.c
+//  MediaOrganizerCLI
+//
+//  Created by John Bridge on 10/17/26.
+//
+
+#include "io_backend.h"
+
+//slot in the ring's file table used for the open -> write -> close chain
+#define IO_BACKEND_FILE_SLOT 0
+
+bool IOBackend_uringSupported(void) {
+#ifdef MEDIAORGANIZER_IO_URING
+    return true;
+#else
+    return false;
+#endif
+}
+
+IOBackend new_IOBackend(bool use_uring, unsigned buffer_count) {
+    IOBackend io = malloc(sizeof(struct IOBackend));
+    if(io==NULL)
+        return NULL;
+    io->uring = false;
+#ifdef MEDIAORGANIZER_IO_URING
+    io->buffers = NULL;
+    io->buffer_count = 0;
+    if(!use_uring)
+        return io;
+    int result = io_uring_queue_init(IO_BACKEND_QUEUE_DEPTH, &io->ring, 0);
+    if(result < 0) {
+        fprintf(stderr, "io_uring unavailable, using blocking I/O: %s\n", strerror(-result));
+        return io;
+    }
+    if(io_uring_register_files_sparse(&io->ring, 1) < 0) {
+        fprintf(stderr, "io_uring file table unavailable, using blocking I/O\n");
+        io_uring_queue_exit(&io->ring);
+        return io;
+    }
+    io->uring = true;
+    if(buffer_count == 0)
+        return io;
+    io->buffers = calloc(buffer_count, sizeof(struct iovec));
+    if(io->buffers == NULL)
+        return io;
+    for(unsigned i=0; i<buffer_count; i++) {
+        io->buffers[i].iov_base = malloc(IO_BACKEND_BUFFER_SIZE);
+        io->buffers[i].iov_len = IO_BACKEND_BUFFER_SIZE;
+        if(io->buffers[i].iov_base == NULL)
+            break;
+        io->buffer_count++;
+    }
+    //registered buffers are pinned once instead of on every request. Copies fall back to the kernel copy without them
+    if(io->buffer_count < buffer_count || io_uring_register_buffers(&io->ring, io->buffers, io->buffer_count) < 0) {
+        for(unsigned i=0; i<io->buffer_count; i++)
+            free(io->buffers[i].iov_base);
+        free(io->buffers);
+        io->buffers = NULL;
+        io->buffer_count = 0;
+    }
+#endif
+    return io;
+}
+
+void free_IOBackend(IOBackend io) {
+    if(io == NULL)
+        return;
+#ifdef MEDIAORGANIZER_IO_URING
+    if(io->uring)
+        io_uring_queue_exit(&io->ring);
+    for(unsigned i=0; i<io->buffer_count; i++)
+        free(io->buffers[i].iov_base);
+    free(io->buffers);
+#endif
+    free(io);
+}
+
+//Writes all of iov to fd starting at offset, picking up after short writes
+static bool ioBackendWriteAll(int fd, const struct iovec *iov, int iovcnt, off_t offset) {
+    struct iovec remaining[iovcnt];
+    memcpy(remaining, iov, sizeof(struct iovec)*iovcnt);
+    int first = 0;
+    while(first < iovcnt) {
+        ssize_t written = pwritev(fd, &remaining[first], iovcnt-first, offset);
+        if(written < 0) {
+            if(errno == EINTR)
+                continue;
+            return false;
+        }
+        offset += written;
+        while(first < iovcnt && (size_t) written >= remaining[first].iov_len) {
+            written -= remaining[first].iov_len;
+            first++;
+        }
+        if(first < iovcnt) {
+            remaining[first].iov_base = (char*) remaining[first].iov_base+written;
+            remaining[first].iov_len -= written;
+        }
+    }
+    return true;
+}
+
+static int ioBackendBlockingWriteFile(int dirfd, const char* path, const struct iovec *iov, int iovcnt) {
+    int fd = openat(dirfd, path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0666);
+    if(fd < 0)
+        return -1;
+    bool written = ioBackendWriteAll(fd, iov, iovcnt, 0);
+    if(close(fd) != 0)
+        written = false;
+    return written ? 0 : -1;
+}
+
+#ifdef MEDIAORGANIZER_IO_URING
+//Reaps count completions. results[user_data] gets each request's result
+static void ioBackendReap(IOBackend io, int count, int *results) {
+    for(int i=0; i<count; i++) {
+        struct io_uring_cqe *cqe;
+        if(io_uring_wait_cqe(&io->ring, &cqe) < 0)
+            break;
+        results[io_uring_cqe_get_data64(cqe)] = cqe->res;
+        io_uring_cqe_seen(&io->ring, cqe);
+    }
+}
+
+//Queues a close of the fixed file slot and waits for it
+static bool ioBackendUringClose(IOBackend io) {
+    struct io_uring_sqe *sqe = io_uring_get_sqe(&io->ring);
+    io_uring_prep_close_direct(sqe, IO_BACKEND_FILE_SLOT);
+    io_uring_sqe_set_data64(sqe, 0);
+    int results[1] = {-ECANCELED};
+    if(io_uring_submit_and_wait(&io->ring, 1) < 0)
+        return false;
+    ioBackendReap(io, 1, results);
+    return results[0] == 0;
+}
+
+//open -> writev -> close go out as one linked submission into the ring's fixed file slot
+static int ioBackendUringWriteFile(IOBackend io, int dirfd, const char* path, const struct iovec *iov, int iovcnt) {
+    size_t total = 0;
+    for(int i=0; i<iovcnt; i++)
+        total += iov[i].iov_len;
+    enum {OPEN, WRITE, CLOSE};
+    int results[3] = {-ECANCELED, -ECANCELED, -ECANCELED};
+    
+    struct io_uring_sqe *sqe = io_uring_get_sqe(&io->ring);
+    //direct descriptors are never inherited, and the kernel rejects O_CLOEXEC for them
+    io_uring_prep_openat_direct(sqe, dirfd, path, O_WRONLY | O_CREAT | O_TRUNC, 0666, IO_BACKEND_FILE_SLOT);
+    io_uring_sqe_set_data64(sqe, OPEN);
+    io_uring_sqe_set_flags(sqe, IOSQE_IO_LINK);
+    
+    sqe = io_uring_get_sqe(&io->ring);
+    io_uring_prep_writev(sqe, IO_BACKEND_FILE_SLOT, iov, iovcnt, 0);
+    io_uring_sqe_set_data64(sqe, WRITE);
+    io_uring_sqe_set_flags(sqe, IOSQE_FIXED_FILE | IOSQE_IO_LINK);
+    
+    sqe = io_uring_get_sqe(&io->ring);
+    io_uring_prep_close_direct(sqe, IO_BACKEND_FILE_SLOT);
+    io_uring_sqe_set_data64(sqe, CLOSE);
+    
+    int submitted = io_uring_submit_and_wait(&io->ring, 3);
+    if(submitted < 0)
+        return ioBackendBlockingWriteFile(dirfd, path, iov, iovcnt);
+    ioBackendReap(io, submitted, results);
+    if(results[OPEN] < 0)
+        return -1;
+    if(results[WRITE] >= 0 && (size_t) results[WRITE] == total)
+        return results[CLOSE] == 0 ? 0 : -1;
+    
+    //a short or failed write breaks the chain and cancels the close, finish the file one request at a time
+    size_t written = results[WRITE] > 0 ? results[WRITE] : 0;
+    bool failed = results[WRITE] < 0;
+    int first = 0;
+    size_t skip = written;
+    while(first < iovcnt && skip >= iov[first].iov_len)
+        skip -= iov[first++].iov_len;
+    while(!failed && first < iovcnt) {
+        sqe = io_uring_get_sqe(&io->ring);
+        io_uring_prep_write(sqe, IO_BACKEND_FILE_SLOT, (char*) iov[first].iov_base+skip, (unsigned) (iov[first].iov_len-skip), written);
+        io_uring_sqe_set_data64(sqe, WRITE);
+        io_uring_sqe_set_flags(sqe, IOSQE_FIXED_FILE);
+        results[WRITE] = -ECANCELED;
+        if(io_uring_submit_and_wait(&io->ring, 1) < 0)
+            break;
+        ioBackendReap(io, 1, results);
+        if(results[WRITE] <= 0) {
+            if(results[WRITE] != -EINTR && results[WRITE] != -EAGAIN)
+                failed = true;
+            continue;
+        }
+        written += results[WRITE];
+        skip += results[WRITE];
+        while(first < iovcnt && skip >= iov[first].iov_len)
+            skip -= iov[first++].iov_len;
+    }
+    bool closed = ioBackendUringClose(io);
+    return !failed && written == total && closed ? 0 : -1;
+}
+
+//blocking copy of one range, used when an io_uring read or write came back short
+static off_t ioBackendCopyRange(int input, int output, char* buffer, off_t offset, size_t length, bool *failed) {
+    size_t copied = 0;
+    while(copied < length) {
+        ssize_t got = pread(input, buffer, length-copied, offset+copied);
+        if(got < 0) {
+            if(errno == EINTR)
+                continue;
+            *failed = true;
+            break;
+        }
+        if(got == 0)
+            break;
+        struct iovec iov = {buffer, got};
+        if(!ioBackendWriteAll(output, &iov, 1, offset+copied)) {
+            *failed = true;
+            break;
+        }
+        copied += got;
+    }
+    return copied;
+}
+#endif
+
+int IOBackend_writeFile(IOBackend io, int dirfd, const char* path, const struct iovec *iov, int iovcnt) {
+#ifdef MEDIAORGANIZER_IO_URING
+    if(io != NULL && io->uring)
+        return ioBackendUringWriteFile(io, dirfd, path, iov, iovcnt);
+#endif
+    return ioBackendBlockingWriteFile(dirfd, path, iov, iovcnt);
+}
+
+bool IOBackend_canCopy(IOBackend io) {
+#ifdef MEDIAORGANIZER_IO_URING
+    return io != NULL && io->uring && io->buffer_count > 0;
+#else
+    return false;
+#endif
+}
+
+//Each round queues a linked read_fixed -> write_fixed pair per registered buffer and submits them together
+off_t IOBackend_copy(IOBackend io, int input, int output, off_t size, bool *failed) {
+#ifdef MEDIAORGANIZER_IO_URING
+    if(!IOBackend_canCopy(io)) {
+        *failed = true;
+        return 0;
+    }
+    unsigned count = io->buffer_count;
+    off_t offsets[count];
+    size_t lengths[count];
+    //user_data is buffer*2 for the read and buffer*2+1 for its write
+    int results[count*2];
+    off_t copied = 0;
+    while(copied < size && !*failed) {
+        unsigned queued = 0;
+        for(off_t offset = copied; queued < count && offset < size; queued++) {
+            offsets[queued] = offset;
+            lengths[queued] = size-offset < IO_BACKEND_BUFFER_SIZE ? (size_t) (size-offset) : IO_BACKEND_BUFFER_SIZE;
+            offset += lengths[queued];
+            results[queued*2] = results[queued*2+1] = -ECANCELED;
+            
+            struct io_uring_sqe *sqe = io_uring_get_sqe(&io->ring);
+            io_uring_prep_read_fixed(sqe, input, io->buffers[queued].iov_base, (unsigned) lengths[queued], offsets[queued], queued);
+            io_uring_sqe_set_data64(sqe, queued*2);
+            io_uring_sqe_set_flags(sqe, IOSQE_IO_LINK);
+            
+            sqe = io_uring_get_sqe(&io->ring);
+            io_uring_prep_write_fixed(sqe, output, io->buffers[queued].iov_base, (unsigned) lengths[queued], offsets[queued], queued);
+            io_uring_sqe_set_data64(sqe, queued*2+1);
+        }
+        int submitted = io_uring_submit_and_wait(&io->ring, queued*2);
+        if(submitted < 0) {
+            *failed = true;
+            break;
+        }
+        ioBackendReap(io, submitted, results);
+        //a short read cancels its write, and writes can come back short too: redo those ranges synchronously
+        for(unsigned i=0; i<queued; i++) {
+            if(results[i*2] == (int) lengths[i] && results[i*2+1] == (int) lengths[i]) {
+                copied += lengths[i];
+                continue;
+            }
+            off_t range_copied = ioBackendCopyRange(input, output, io->buffers[i].iov_base, offsets[i], lengths[i], failed);
+            copied += range_copied;
+            //source is shorter than size, nothing after this range exists
+            if(*failed || (size_t) range_copied < lengths[i])
+                return copied;
+        }
+    }
+    return copied;
+#else
+    *failed = true;
+    return 0;
+#endif
+}
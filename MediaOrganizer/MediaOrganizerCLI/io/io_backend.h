@@ -0,0 +1,56 @@
+//
+//  io_backend.h
+//  MediaOrganizerCLI
+//
+//  Created by John Bridge on 10/17/26.
+//
+
+#ifndef io_backend_h
+#define io_backend_h
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+
+//Build with -DMEDIAORGANIZER_IO_URING and link liburing (Linux 5.19+) to enable the io_uring backend
+#ifdef MEDIAORGANIZER_IO_URING
+#include <liburing.h>
+#endif
+
+#define IO_BACKEND_QUEUE_DEPTH 32
+//registered buffers used by IOBackend_copy. Each copy keeps this many reads/writes in flight
+#define IO_BACKEND_COPY_BUFFERS 8
+#define IO_BACKEND_BUFFER_SIZE (1 << 20)
+
+typedef struct IOBackend *IOBackend;
+
+//Output file I/O for one thread. With io_uring, a file write is a single submission of a linked
+//open -> write -> close chain, and copies keep several registered buffer reads and writes in flight.
+//Without it (or with a NULL IOBackend) the same calls use blocking syscalls
+struct IOBackend {
+    bool uring;
+#ifdef MEDIAORGANIZER_IO_URING
+    struct io_uring ring;
+    struct iovec *buffers;
+    unsigned buffer_count;
+#endif
+};
+extern bool IOBackend_uringSupported(void);
+extern IOBackend new_IOBackend(bool use_uring, unsigned buffer_count);
+extern void free_IOBackend(IOBackend io);
+
+//Creates (or truncates) dirfd/path and writes iov to it. Returns 0 or -1
+extern int IOBackend_writeFile(IOBackend io, int dirfd, const char* path, const struct iovec *iov, int iovcnt);
+
+//True if IOBackend_copy can be used, i.e. io_uring with registered buffers
+extern bool IOBackend_canCopy(IOBackend io);
+//Copies size bytes from the start of input to output. Returns bytes copied, less than size if the source is shorter
+extern off_t IOBackend_copy(IOBackend io, int input, int output, off_t size, bool *failed);
+
+#endif /* io_backend_h */
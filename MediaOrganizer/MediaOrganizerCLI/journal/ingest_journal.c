@@ -0,0 +1,148 @@
+//
+//  ingest_journal.c
+//  MediaOrganizerCLI
+//
+//  Created by John Bridge on 10/17/26.
+//
+
+#include "ingest_journal.h"
+#include "content_hash.h"
+
+static uint64_t ingestJournalHashKey(IngestJournalKey key) {
+    struct ContentHash hash;
+    ContentHash_init(&hash);
+    ContentHash_update(&hash, key, sizeof(struct IngestJournalKey));
+    return ContentHash_digest(&hash);
+}
+
+static bool ingestJournalKeyEqual(IngestJournalKey a, IngestJournalKey b) {
+    return a->device == b->device && a->inode == b->inode && a->size == b->size && a->modify_time == b->modify_time;
+}
+
+//open addressing, an empty slot has stage INGEST_STAGE_NONE
+static IngestJournalRecord ingestJournalSlot(IngestJournal journal, IngestJournalKey key) {
+    size_t mask = journal->table_size-1;
+    size_t i = ingestJournalHashKey(key) & mask;
+    while(journal->table[i].stage != INGEST_STAGE_NONE && !ingestJournalKeyEqual(&journal->table[i].key, key))
+        i = (i+1) & mask;
+    return &journal->table[i];
+}
+
+//Reads every record after the header and keeps the furthest stage per file
+static bool ingestJournalLoad(IngestJournal journal, off_t file_size) {
+    size_t count = (file_size-sizeof(struct IngestJournalHeader))/sizeof(struct IngestJournalRecord);
+    if(count == 0)
+        return true;
+    journal->table_size = 16;
+    while(journal->table_size < count*2)
+        journal->table_size *= 2;
+    journal->table = calloc(journal->table_size, sizeof(struct IngestJournalRecord));
+    if(journal->table == NULL)
+        return false;
+    struct IngestJournalRecord records[256];
+    while(true) {
+        ssize_t got = read(journal->fd, records, sizeof(records));
+        if(got < 0 && errno == EINTR)
+            continue;
+        if(got <= 0)
+            break;
+        //a torn record at the end (killed mid write) is ignored
+        for(size_t i=0; i<got/sizeof(struct IngestJournalRecord); i++) {
+            if(records[i].stage == INGEST_STAGE_NONE || records[i].stage > INGEST_STAGE_STORED)
+                continue;
+            IngestJournalRecord slot = ingestJournalSlot(journal, &records[i].key);
+            if(slot->stage == INGEST_STAGE_NONE)
+                journal->loaded++;
+            if(records[i].stage > slot->stage || (records[i].hashed && !slot->hashed)) {
+                IngestStage stage = slot->stage > records[i].stage ? slot->stage : records[i].stage;
+                *slot = records[i];
+                slot->stage = stage;
+            }
+        }
+    }
+    return true;
+}
+
+IngestJournal new_IngestJournal(const char* destination_path, const char* source_path, bool resume, unsigned char upload_id[INGEST_JOURNAL_UPLOAD_ID_SIZE]) {
+    IngestJournal journal = malloc(sizeof(struct IngestJournal));
+    if(journal==NULL)
+        return NULL;
+    size_t path_size = strlen(destination_path)+strlen(INGEST_JOURNAL_FILENAME)+2;
+    journal->path = malloc(path_size);
+    if(journal->path == NULL) {
+        free(journal);
+        return NULL;
+    }
+    snprintf(journal->path, path_size, "%s/%s", destination_path, INGEST_JOURNAL_FILENAME);
+    journal->resumed = false;
+    journal->table = NULL;
+    journal->table_size = 0;
+    journal->loaded = 0;
+    
+    struct ContentHash source_hash;
+    ContentHash_init(&source_hash);
+    ContentHash_update(&source_hash, source_path, strlen(source_path));
+    uint64_t source_digest = ContentHash_digest(&source_hash);
+    
+    journal->fd = open(journal->path, O_RDWR | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+    if(journal->fd < 0) {
+        Log(LOG_LEVEL_ERROR, "Could not open ingest journal %s: %s\n", journal->path, strerror(errno));
+        free(journal->path);
+        free(journal);
+        return NULL;
+    }
+    struct stat journal_stat;
+    if(resume && fstat(journal->fd, &journal_stat) == 0 && journal_stat.st_size >= (off_t) sizeof(struct IngestJournalHeader)
+       && read(journal->fd, &journal->header, sizeof(struct IngestJournalHeader)) == sizeof(struct IngestJournalHeader)
+       && memcmp(journal->header.magic, INGEST_JOURNAL_MAGIC, sizeof(journal->header.magic)) == 0
+       && journal->header.source_hash == source_digest) {
+        if(ingestJournalLoad(journal, journal_stat.st_size)) {
+            journal->resumed = true;
+            memcpy(upload_id, journal->header.upload_id, INGEST_JOURNAL_UPLOAD_ID_SIZE);
+            return journal;
+        }
+    }
+    
+    //no journal, one left by a different source, or not resuming: start over
+    if(ftruncate(journal->fd, 0) != 0) {
+        free_IngestJournal(journal);
+        return NULL;
+    }
+    memset(&journal->header, 0, sizeof(struct IngestJournalHeader));
+    memcpy(journal->header.magic, INGEST_JOURNAL_MAGIC, sizeof(journal->header.magic));
+    journal->header.source_hash = source_digest;
+    memcpy(journal->header.upload_id, upload_id, INGEST_JOURNAL_UPLOAD_ID_SIZE);
+    if(write(journal->fd, &journal->header, sizeof(struct IngestJournalHeader)) != sizeof(struct IngestJournalHeader)) {
+        free_IngestJournal(journal);
+        return NULL;
+    }
+    return journal;
+}
+
+void free_IngestJournal(IngestJournal journal) {
+    if(journal->fd >= 0)
+        close(journal->fd);
+    free(journal->table);
+    free(journal->path);
+    free(journal);
+}
+
+IngestStage IngestJournal_lookup(IngestJournal journal, IngestJournalKey key, IngestJournalRecord record) {
+    if(journal->table_size == 0)
+        return INGEST_STAGE_NONE;
+    IngestJournalRecord slot = ingestJournalSlot(journal, key);
+    if(record != NULL)
+        *record = *slot;
+    return slot->stage;
+}
+
+//Not fsync'd: after a system crash the last few records may be lost, which only means redoing those stages
+void IngestJournal_record(IngestJournal journal, IngestJournalRecord record) {
+    if(write(journal->fd, record, sizeof(struct IngestJournalRecord)) != sizeof(struct IngestJournalRecord))
+        Log(LOG_LEVEL_ERROR, "Could not write ingest journal: %s\n", strerror(errno));
+}
+
+void IngestJournal_finish(IngestJournal journal) {
+    if(unlink(journal->path) != 0)
+        Log(LOG_LEVEL_ERROR, "Could not remove ingest journal %s: %s\n", journal->path, strerror(errno));
+}
@@ -0,0 +1,88 @@
+//
+//  ingest_journal.h
+//  MediaOrganizerCLI
+//
+//  Created by John Bridge on 10/17/26.
+//
+
+#ifndef ingest_journal_h
+#define ingest_journal_h
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include "logger.h"
+
+#define INGEST_JOURNAL_FILENAME ".mediaorganizer_journal"
+#define INGEST_JOURNAL_MAGIC "MOJRNL01"
+#define INGEST_JOURNAL_UPLOAD_ID_SIZE 12
+
+typedef struct IngestJournalKey *IngestJournalKey;
+typedef struct IngestJournalRecord *IngestJournalRecord;
+typedef struct IngestJournalHeader *IngestJournalHeader;
+typedef struct IngestJournal *IngestJournal;
+
+//Furthest point a file got to. Each stage's output is on disk (or in the DB) once it is recorded
+typedef enum {
+    INGEST_STAGE_NONE = 0,
+    INGEST_STAGE_COPIED,
+    INGEST_STAGE_PREVIEWED,
+    INGEST_STAGE_THUMBNAILED,
+    INGEST_STAGE_STORED     //files document written
+} IngestStage;
+
+//Identifies a source file without reading it. A file that changed since it was journaled gets a new key
+struct IngestJournalKey {
+    uint64_t device;
+    uint64_t inode;
+    int64_t size;
+    int64_t modify_time;
+};
+
+//On disk record, appended every time a file reaches a stage. The journal is only read back on the same machine
+struct IngestJournalRecord {
+    struct IngestJournalKey key;
+    uint64_t content_hash;
+    uint8_t stage;
+    uint8_t hashed;
+    uint8_t reserved[6];
+};
+
+struct IngestJournalHeader {
+    char magic[8];
+    uint64_t source_hash;   //XXH64 of the source path, a journal from another source is not resumed
+    unsigned char upload_id[INGEST_JOURNAL_UPLOAD_ID_SIZE];
+    uint8_t reserved[4];
+};
+
+//Append-only progress log of an ingest, kept in the destination folder until the ingest completes.
+//Only an interrupted ingest leaves one behind, so loading it costs as much as what is left to redo
+struct IngestJournal {
+    int fd;
+    char* path;
+    bool resumed;
+    struct IngestJournalHeader header;
+    //furthest record per key, loaded at open. Read only afterwards, so lookups need no lock
+    struct IngestJournalRecord *table;
+    size_t table_size;      //power of two, 0 if nothing was loaded
+    size_t loaded;
+};
+//If resume is set and destination_path has a journal for the same source, it is loaded and upload_id is set to the
+//interrupted upload's id. Otherwise a new journal is started for upload_id
+extern IngestJournal new_IngestJournal(const char* destination_path, const char* source_path, bool resume, unsigned char upload_id[INGEST_JOURNAL_UPLOAD_ID_SIZE]);
+extern void free_IngestJournal(IngestJournal journal);
+
+extern IngestStage IngestJournal_lookup(IngestJournal journal, IngestJournalKey key, IngestJournalRecord record);
+//Thread safe: each record is a single O_APPEND write
+extern void IngestJournal_record(IngestJournal journal, IngestJournalRecord record);
+//Every file is done, the journal is removed
+extern void IngestJournal_finish(IngestJournal journal);
+
+#endif /* ingest_journal_h */
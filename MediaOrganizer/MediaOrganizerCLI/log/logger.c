@@ -0,0 +1,155 @@
+//
+//  logger.c
+//  MediaOrganizerCLI
+//
+//  Created by John Bridge on 10/17/26.
+//
+
+#include "logger.h"
+
+//A slot is free for the producer whose position equals its sequence, and holds a message for the
+//consumer once sequence is position+1. The consumer hands it back for position+LOGGER_SLOTS
+struct LogSlot {
+    atomic_size_t sequence;
+    LogLevel level;
+    char message[LOGGER_MESSAGE_SIZE];
+};
+
+static struct LogSlot log_slots[LOGGER_SLOTS];
+static atomic_size_t log_enqueue_position;
+static size_t log_dequeue_position;     //only touched by the background thread
+static atomic_int log_level = LOG_LEVEL_INFO;
+static atomic_bool log_running;
+static atomic_size_t log_dropped;
+static pthread_t log_drainer;
+
+static const char* log_level_names[] = {"error", "warning", "info", "debug"};
+
+static FILE* logStream(LogLevel level) {
+    return level <= LOG_LEVEL_WARNING ? stderr : stdout;
+}
+
+//Claims the next free slot, NULL if every slot holds a message that hasn't been written yet
+static struct LogSlot* logClaimSlot(size_t *position) {
+    size_t claimed = atomic_load_explicit(&log_enqueue_position, memory_order_relaxed);
+    while(true) {
+        struct LogSlot *slot = &log_slots[claimed & (LOGGER_SLOTS-1)];
+        size_t sequence = atomic_load_explicit(&slot->sequence, memory_order_acquire);
+        intptr_t difference = (intptr_t) sequence - (intptr_t) claimed;
+        if(difference == 0) {
+            if(atomic_compare_exchange_weak_explicit(&log_enqueue_position, &claimed, claimed+1, memory_order_relaxed, memory_order_relaxed)) {
+                *position = claimed;
+                return slot;
+            }
+        } else if(difference < 0) {
+            return NULL;
+        } else {
+            claimed = atomic_load_explicit(&log_enqueue_position, memory_order_relaxed);
+        }
+    }
+}
+
+//Writes every message queued so far. Returns how many there were
+static size_t logDrain(void) {
+    size_t written = 0;
+    bool wrote_stream[2] = {false, false};
+    while(true) {
+        struct LogSlot *slot = &log_slots[log_dequeue_position & (LOGGER_SLOTS-1)];
+        if(atomic_load_explicit(&slot->sequence, memory_order_acquire) != log_dequeue_position+1)
+            break;
+        fputs(slot->message, logStream(slot->level));
+        wrote_stream[slot->level <= LOG_LEVEL_WARNING ? 0 : 1] = true;
+        atomic_store_explicit(&slot->sequence, log_dequeue_position+LOGGER_SLOTS, memory_order_release);
+        log_dequeue_position++;
+        written++;
+    }
+    if(wrote_stream[0])
+        fflush(stderr);
+    if(wrote_stream[1])
+        fflush(stdout);
+    size_t dropped = atomic_exchange_explicit(&log_dropped, 0, memory_order_relaxed);
+    if(dropped > 0) {
+        fprintf(stderr, "%zu log messages dropped, the log buffer was full\n", dropped);
+        fflush(stderr);
+    }
+    return written;
+}
+
+static void* logDrainerThread(void* arg) {
+    struct timespec interval = {0, LOGGER_DRAIN_INTERVAL_MS*1000000L};
+    while(atomic_load_explicit(&log_running, memory_order_acquire)) {
+        if(logDrain() == 0)
+            nanosleep(&interval, NULL);
+    }
+    //whatever was queued before Logger_stop
+    logDrain();
+    return NULL;
+}
+
+bool Logger_start(LogLevel level) {
+    if(atomic_load(&log_running))
+        return true;
+    for(size_t i=0; i<LOGGER_SLOTS; i++)
+        atomic_store_explicit(&log_slots[i].sequence, i, memory_order_relaxed);
+    atomic_store(&log_enqueue_position, 0);
+    log_dequeue_position = 0;
+    atomic_store(&log_dropped, 0);
+    atomic_store(&log_level, level);
+    atomic_store(&log_running, true);
+    if(pthread_create(&log_drainer, NULL, logDrainerThread, NULL) != 0) {
+        atomic_store(&log_running, false);
+        fprintf(stderr, "Could not start the log thread, logging synchronously\n");
+        return false;
+    }
+    return true;
+}
+
+void Logger_stop(void) {
+    if(!atomic_exchange(&log_running, false))
+        return;
+    pthread_join(log_drainer, NULL);
+}
+
+void Logger_setLevel(LogLevel level) {
+    atomic_store(&log_level, level);
+}
+
+bool Logger_parseLevel(const char* name, LogLevel *level) {
+    for(int i=0; i<(int) (sizeof(log_level_names)/sizeof(log_level_names[0])); i++) {
+        if(strcasecmp(name, log_level_names[i]) == 0) {
+            *level = (LogLevel) i;
+            return true;
+        }
+    }
+    return false;
+}
+
+bool Log_enabled(LogLevel level) {
+    return level <= (LogLevel) atomic_load_explicit(&log_level, memory_order_relaxed);
+}
+
+void Log(LogLevel level, const char* format, ...) {
+    if(!Log_enabled(level))
+        return;
+    va_list args;
+    va_start(args, format);
+    size_t position;
+    struct LogSlot *slot = atomic_load_explicit(&log_running, memory_order_acquire) ? logClaimSlot(&position) : NULL;
+    if(slot == NULL) {
+        //not started, or full: only errors and warnings are worth blocking for
+        if(!atomic_load_explicit(&log_running, memory_order_acquire) || level <= LOG_LEVEL_WARNING)
+            vfprintf(logStream(level), format, args);
+        else
+            atomic_fetch_add_explicit(&log_dropped, 1, memory_order_relaxed);
+        va_end(args);
+        return;
+    }
+    int length = vsnprintf(slot->message, LOGGER_MESSAGE_SIZE, format, args);
+    va_end(args);
+    if(length >= LOGGER_MESSAGE_SIZE)
+        memcpy(slot->message+LOGGER_MESSAGE_SIZE-5, "...\n", 5);
+    else if(length < 0)
+        slot->message[0] = '\0';
+    slot->level = level;
+    atomic_store_explicit(&slot->sequence, position+1, memory_order_release);
+}
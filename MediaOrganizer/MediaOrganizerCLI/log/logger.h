@@ -0,0 +1,53 @@
+//
+//  logger.h
+//  MediaOrganizerCLI
+//
+//  Created by John Bridge on 10/17/26.
+//
+
+#ifndef logger_h
+#define logger_h
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdarg.h>
+#include <string.h>
+#include <strings.h>
+#include <time.h>
+#include <pthread.h>
+#include <stdatomic.h>
+
+//messages waiting to be written, a power of two
+#define LOGGER_SLOTS 1024
+//longer messages are cut short, ending in "..."
+#define LOGGER_MESSAGE_SIZE 512
+//how often the background thread looks for messages when there were none
+#define LOGGER_DRAIN_INTERVAL_MS 10
+
+//errors and warnings go to stderr, the rest to stdout
+typedef enum {
+    LOG_LEVEL_ERROR,
+    LOG_LEVEL_WARNING,
+    LOG_LEVEL_INFO,
+    LOG_LEVEL_DEBUG
+} LogLevel;
+
+//Process wide logger. Log only formats the message into a slot of a lock-free ring buffer, a background thread
+//does the writing, so a slow terminal or pipe never holds up the thread logging.
+//Until Logger_start and after Logger_stop messages are written straight away
+extern bool Logger_start(LogLevel level);
+//Writes every queued message, then stops the background thread. Call once nothing logs anymore
+extern void Logger_stop(void);
+extern void Logger_setLevel(LogLevel level);
+//"error", "warning", "info" or "debug". false if name is none of them
+extern bool Logger_parseLevel(const char* name, LogLevel *level);
+
+//Whether messages of level are written. Check before building an expensive message
+extern bool Log_enabled(LogLevel level);
+//printf style, format should end in "\n". When the buffer is full errors and warnings are written straight away,
+//info and debug messages are dropped and counted
+extern void Log(LogLevel level, const char* format, ...) __attribute__((format(printf, 2, 3)));
+
+#endif /* logger_h */
@@ -6,18 +6,300 @@
 //
 
 #include <stdio.h>
+#include <unistd.h>
+#include <signal.h>
 #include "organizer.h"
 
+#define MAX_MOUNT_ROOTS 16
+
+static Watcher daemon_watcher = NULL;
+
+static void stopDaemon(int signal) {
+    if(daemon_watcher != NULL)
+        Watcher_stop(daemon_watcher);
+}
+
+//Parses a comma separated list of positive sizes, e.g. "640,64,1600". Returns the count, 0 if invalid
+static int parseSizes(const char* list, int sizes[IMAGE_MAX_THUMB_SIZES]) {
+    int count = 0;
+    const char* position = list;
+    while(*position != '\0') {
+        char* end;
+        long size = strtol(position, &end, 10);
+        if(end == position || size < 1 || size > 65535 || count == IMAGE_MAX_THUMB_SIZES)
+            return 0;
+        sizes[count++] = (int) size;
+        if(*end == ',')
+            end++;
+        else if(*end != '\0')
+            return 0;
+        position = end;
+    }
+    return count;
+}
+
+//true if path is folder or inside it
+static bool isInside(const char* path, const char* folder) {
+    char* real_path = realpath(path, NULL);
+    char* real_folder = realpath(folder, NULL);
+    bool inside = false;
+    if(real_path != NULL && real_folder != NULL) {
+        size_t length = strlen(real_folder);
+        inside = strncmp(real_path, real_folder, length) == 0 && (real_path[length] == '\0' || real_path[length] == '/' || real_folder[length-1] == '/');
+    }
+    free(real_path);
+    free(real_folder);
+    return inside;
+}
+
+static void printUsage(void) {
+    printf("Run ./MediaOrganizerCLI [-j threads] [-J threads] [-c depth] [-s seconds] [-b files] [-t milliseconds] [-w writers] [-l documents] [-u] [-f] [-n] [-z pixels[,pixels...]] [-q quality] [-e directory [-i seconds]] [-v level] [-p files] [-d [-m mount root]...] <source directory> <destination directory> <mongodb server url (ex. mongodb://localhost:27017)> <mongodb database name>\n");
+    printf("  -j threads  threads for each CPU bound stage, preview extract and thumbnail encode (default: number of cores)\n");
+    printf("  -J threads  threads for each I/O bound stage, metadata, hash and copy (default: %d)\n", ORGANIZER_IO_THREADS);
+    printf("  -c depth    files read or written on one device at once. By default %d for spinning disks, %d for SD cards and\n", DEVICE_DEPTH_ROTATIONAL, DEVICE_DEPTH_REMOVABLE);
+    printf("              USB flash, %d for SSDs and %d for anything else, e.g. network shares\n", DEVICE_DEPTH_SOLID_STATE, DEVICE_DEPTH_OTHER);
+    printf("  -s seconds  print pipeline queue depths every interval, and a per-stage summary at the end\n");
+    printf("  -b files    number of files written to MongoDB per bulk write (default: %d)\n", ORGANIZER_DB_BATCH_SIZE);
+    printf("  -t milliseconds  longest a partial bulk write waits before it is sent (default: %d)\n", ORGANIZER_DB_FLUSH_INTERVAL_MS);
+    printf("  -w writers  number of threads sending bulk writes to MongoDB, each with its own pooled client (default: %d)\n", ORGANIZER_DB_THREADS);
+    printf("  -l documents  most documents waiting for MongoDB before processing is held back, 0 for no limit (default: %d)\n", ORGANIZER_DB_QUEUE_LIMIT);
+    printf("  -u          write output files and copy between devices with io_uring (Linux builds with MEDIAORGANIZER_IO_URING)\n");
+    printf("  -f          process every file, even ones whose content is already in the library, without hashing them\n");
+    printf("  -n          start over instead of resuming an interrupted ingest of the same source into the destination\n");
+    printf("  -z pixels[,pixels...]  long edges of the thumbnails made per file, all from one decode. The first is the main\n");
+    printf("              thumbnail, the others are skipped when the preview is not larger (default: %d,%d)\n", IMAGE_THUMB_SIZE, IMAGE_THUMB_TINY_SIZE);
+    printf("  -q quality  JPEG quality of thumbnails, 1-100 (default: %d)\n", IMAGE_THUMB_QUALITY);
+    printf("  -e directory  write a Prometheus textfile (%s.prom) and JSON snapshot of per-stage and per-call latencies there\n", METRICS_SNAPSHOT_NAME);
+    printf("              at the end of the run, and every -i seconds while it runs (default: %d, 0 for only at the end)\n", ORGANIZER_METRICS_INTERVAL);
+    printf("  -v level    error, warning, info or debug. debug also prints MongoDB's replies (default: info)\n");
+    printf("  -p files    read files in the order their data sits on the device, sorting this many at a time (e.g. %d),\n", ORGANIZER_READ_ORDER_WINDOW);
+    printf("              0 for the whole source at once. For spinning disks and fragmented cards\n");
+    printf("  -d          keep running: organize files as they are written to the source directory (Linux)\n");
+    printf("  -m folder   with -d, also organize storage mounted anywhere below folder (e.g. /media/user), can be repeated\n");
+}
+
 int main(int argc, char * argv[]) {
-    if(argc != 5) {
-        printf("Program requires four arguments.\nRun ./MediaOrganizerCLI <source directory> <destination directory> <mongodb server url (ex. mongodb://localhost:27017)> <mongodb database name>\n");
+    int thread_count = 0;
+    int io_thread_count = ORGANIZER_IO_THREADS;
+    int device_depth = 0;
+    int report_interval = 0;
+    int batch_size = ORGANIZER_DB_BATCH_SIZE;
+    int flush_interval_ms = ORGANIZER_DB_FLUSH_INTERVAL_MS;
+    int db_thread_count = ORGANIZER_DB_THREADS;
+    int db_queue_limit = ORGANIZER_DB_QUEUE_LIMIT;
+    bool use_io_uring = false;
+    bool skip_duplicates = true;
+    bool resume = true;
+    int thumb_sizes[IMAGE_MAX_THUMB_SIZES] = {IMAGE_THUMB_SIZE, IMAGE_THUMB_TINY_SIZE};
+    int thumb_size_count = 2;
+    int thumb_quality = IMAGE_THUMB_QUALITY;
+    char* metrics_directory = NULL;
+    struct stat metrics_stat;
+    int metrics_interval = ORGANIZER_METRICS_INTERVAL;
+    LogLevel log_level = LOG_LEVEL_INFO;
+    bool order_reads = false;
+    int read_order_window = ORGANIZER_READ_ORDER_WINDOW;
+    bool daemon_mode = false;
+    char* mount_roots[MAX_MOUNT_ROOTS];
+    int mount_root_count = 0;
+    int opt;
+    while((opt = getopt(argc, argv, "j:J:c:s:b:t:w:l:ufnz:q:e:i:v:p:dm:")) != -1) {
+        switch(opt) {
+            case 'j':
+                thread_count = atoi(optarg);
+                if(thread_count < 1) {
+                    printf("-j requires a positive thread count\n");
+                    return 1;
+                }
+                break;
+            case 'J':
+                io_thread_count = atoi(optarg);
+                if(io_thread_count < 1) {
+                    printf("-J requires a positive thread count\n");
+                    return 1;
+                }
+                break;
+            case 'c':
+                device_depth = atoi(optarg);
+                if(device_depth < 1) {
+                    printf("-c requires a positive number of files\n");
+                    return 1;
+                }
+                break;
+            case 's':
+                report_interval = atoi(optarg);
+                if(report_interval < 1) {
+                    printf("-s requires a positive interval in seconds\n");
+                    return 1;
+                }
+                break;
+            case 'b':
+                batch_size = atoi(optarg);
+                if(batch_size < 1) {
+                    printf("-b requires a positive number of files\n");
+                    return 1;
+                }
+                break;
+            case 't':
+                flush_interval_ms = atoi(optarg);
+                if(flush_interval_ms < 1) {
+                    printf("-t requires a positive interval in milliseconds\n");
+                    return 1;
+                }
+                break;
+            case 'w':
+                db_thread_count = atoi(optarg);
+                if(db_thread_count < 1) {
+                    printf("-w requires a positive thread count\n");
+                    return 1;
+                }
+                break;
+            case 'l':
+                db_queue_limit = atoi(optarg);
+                if(db_queue_limit < 0) {
+                    printf("-l requires a number of documents, or 0 for no limit\n");
+                    return 1;
+                }
+                break;
+            case 'u':
+                if(!IOBackend_uringSupported()) {
+                    printf("-u requires a build with MEDIAORGANIZER_IO_URING\n");
+                    return 1;
+                }
+                use_io_uring = true;
+                break;
+            case 'f':
+                skip_duplicates = false;
+                break;
+            case 'n':
+                resume = false;
+                break;
+            case 'z':
+                thumb_size_count = parseSizes(optarg, thumb_sizes);
+                if(thumb_size_count == 0) {
+                    printf("-z requires up to %d comma separated sizes in pixels\n", IMAGE_MAX_THUMB_SIZES);
+                    return 1;
+                }
+                break;
+            case 'q':
+                thumb_quality = atoi(optarg);
+                if(thumb_quality < 1 || thumb_quality > 100) {
+                    printf("-q requires a quality between 1 and 100\n");
+                    return 1;
+                }
+                break;
+            case 'e':
+                if(stat(optarg, &metrics_stat) != 0 || !S_ISDIR(metrics_stat.st_mode)) {
+                    printf("-e requires an existing directory\n");
+                    return 1;
+                }
+                metrics_directory = optarg;
+                break;
+            case 'i':
+                metrics_interval = atoi(optarg);
+                if(metrics_interval < 0) {
+                    printf("-i requires an interval in seconds, or 0 for only at the end\n");
+                    return 1;
+                }
+                break;
+            case 'v':
+                if(!Logger_parseLevel(optarg, &log_level)) {
+                    printf("-v requires error, warning, info or debug\n");
+                    return 1;
+                }
+                break;
+            case 'p':
+                read_order_window = atoi(optarg);
+                if(read_order_window < 0) {
+                    printf("-p requires a number of files, or 0 for the whole source\n");
+                    return 1;
+                }
+                order_reads = true;
+                break;
+            case 'd':
+                if(!Watcher_supported()) {
+                    printf("-d requires inotify (Linux)\n");
+                    return 1;
+                }
+                daemon_mode = true;
+                break;
+            case 'm':
+                if(mount_root_count == MAX_MOUNT_ROOTS) {
+                    printf("-m can be given at most %d times\n", MAX_MOUNT_ROOTS);
+                    return 1;
+                }
+                mount_roots[mount_root_count++] = optarg;
+                break;
+            default:
+                printUsage();
+                return 1;
+        }
+    }
+    if(argc - optind != 4) {
+        printf("Program requires four arguments.\n");
+        printUsage();
+        return 1;
+    }
+    if(mount_root_count > 0 && !daemon_mode) {
+        printf("-m requires -d\n");
+        return 1;
+    }
+    char** args = &argv[optind];
+    Logger_start(log_level);
+    MongoDBClientHolder mongo_holder = new_MongoDBClientHolder(args[2], args[3]);
+    if(mongo_holder == NULL) {
+        Logger_stop();
         return 1;
     }
-    MongoDBClientHolder mongo_holder = new_MongoDBClientHolder(argv[3], argv[4]);
     createDefaultMongoDBCollections(mongo_holder);
-    Organizer organizer = new_Organizer(argv[1], argv[2], mongo_holder);
-    organize(organizer);
+    Organizer organizer = new_Organizer(args[0], args[1], mongo_holder);
+    if(organizer == NULL) {
+        freeDBClientHolder(mongo_holder);
+        Logger_stop();
+        return 1;
+    }
+    if(thread_count > 0)
+        organizer->thread_count = thread_count;
+    organizer->io_thread_count = io_thread_count;
+    organizer->device_depth = device_depth;
+    organizer->report_interval = report_interval;
+    organizer->db_batch_size = batch_size;
+    organizer->db_flush_interval_ms = flush_interval_ms;
+    organizer->db_thread_count = db_thread_count;
+    organizer->db_queue_limit = db_queue_limit;
+    organizer->use_io_uring = use_io_uring;
+    organizer->skip_duplicates = skip_duplicates;
+    organizer->resume = resume;
+    memcpy(organizer->thumb_sizes, thumb_sizes, sizeof(thumb_sizes));
+    organizer->thumb_size_count = thumb_size_count;
+    organizer->thumb_quality = thumb_quality;
+    organizer->order_reads = order_reads;
+    organizer->read_order_window = (size_t) read_order_window;
+    organizer->metrics_directory = metrics_directory;
+    organizer->metrics_interval = (unsigned int) metrics_interval;
+    if(daemon_mode && isInside(organizer->destination_path, organizer->source_path)) {
+        //every copy would show up as a new file in the source
+        printf("-d requires a destination outside the source directory\n");
+    } else if(daemon_mode) {
+        //only files written from now on are organized, a one-shot run picks up anything older
+        daemon_watcher = new_Watcher();
+        bool watching = daemon_watcher != NULL && Watcher_addTree(daemon_watcher, organizer->source_path);
+        for(int i=0; i<mount_root_count && watching; i++)
+            watching = Watcher_addMountRoot(daemon_watcher, mount_roots[i]);
+        if(watching) {
+            signal(SIGINT, stopDaemon);
+            signal(SIGTERM, stopDaemon);
+            organizeWatch(organizer, daemon_watcher);
+        }
+        Watcher watcher = daemon_watcher;
+        daemon_watcher = NULL;
+        if(watcher != NULL)
+            free_Watcher(watcher);
+    } else {
+        organize(organizer);
+    }
     free_Organizer(organizer);
     freeDBClientHolder(mongo_holder);
+    Logger_stop();
     return 0;
 }
@@ -0,0 +1,117 @@
+//
+//  arena.c
+//  MediaOrganizerCLI
+//
+//  Created by John Bridge on 10/17/26.
+//
+
+#include "arena.h"
+
+static ArenaBlock new_ArenaBlock(size_t size) {
+    ArenaBlock block = malloc(sizeof(struct ArenaBlock)+size);
+    if(block == NULL)
+        return NULL;
+    block->next = NULL;
+    block->size = size;
+    block->used = 0;
+    return block;
+}
+
+Arena new_Arena(size_t block_size) {
+    Arena arena = malloc(sizeof(struct Arena));
+    if(arena == NULL)
+        return NULL;
+    arena->block_size = block_size > 0 ? block_size : ARENA_BLOCK_SIZE;
+    arena->blocks = NULL;
+    return arena;
+}
+
+void free_Arena(Arena arena) {
+    ArenaBlock block = arena->blocks;
+    while(block != NULL) {
+        ArenaBlock next = block->next;
+        free(block);
+        block = next;
+    }
+    free(arena);
+}
+
+void* Arena_alloc(Arena arena, size_t size) {
+    size = (size+ARENA_ALIGNMENT-1) & ~((size_t) ARENA_ALIGNMENT-1);
+    ArenaBlock block = arena->blocks;
+    if(block == NULL || block->size-block->used < size) {
+        //an oversized allocation gets a block of its own behind the current one, so the rest of it isn't wasted
+        if(size > arena->block_size/4 && block != NULL) {
+            ArenaBlock own = new_ArenaBlock(size);
+            if(own == NULL)
+                return NULL;
+            own->used = size;
+            own->next = block->next;
+            block->next = own;
+            return own->data;
+        }
+        block = new_ArenaBlock(size > arena->block_size ? size : arena->block_size);
+        if(block == NULL)
+            return NULL;
+        block->next = arena->blocks;
+        arena->blocks = block;
+    }
+    void* allocation = &block->data[block->used];
+    block->used += size;
+    return allocation;
+}
+
+char* Arena_strdup(Arena arena, const char* str) {
+    size_t size = strlen(str)+1;
+    char* copy = Arena_alloc(arena, size);
+    if(copy != NULL)
+        memcpy(copy, str, size);
+    return copy;
+}
+
+//StringPool functions
+StringPool new_StringPool(void) {
+    StringPool pool = calloc(1, sizeof(struct StringPool));
+    if(pool == NULL)
+        return NULL;
+    pool->arena = new_Arena(0);
+    if(pool->arena == NULL) {
+        free(pool);
+        return NULL;
+    }
+    pthread_mutex_init(&pool->lock, NULL);
+    return pool;
+}
+
+void free_StringPool(StringPool pool) {
+    //the entries live in the arena too
+    free_Arena(pool->arena);
+    pthread_mutex_destroy(&pool->lock);
+    free(pool);
+}
+
+const char* StringPool_intern(StringPool pool, const char* str) {
+    //FNV-1a
+    uint32_t hash = 2166136261u;
+    for(const unsigned char* c = (const unsigned char*) str; *c != '\0'; c++)
+        hash = (hash ^ *c)*16777619u;
+    StringPoolEntry *bucket = &pool->buckets[hash % STRING_POOL_BUCKETS];
+    pthread_mutex_lock(&pool->lock);
+    const char* interned = NULL;
+    for(StringPoolEntry entry = *bucket; entry != NULL && interned == NULL; entry = entry->next) {
+        if(strcmp(entry->str, str) == 0)
+            interned = entry->str;
+    }
+    if(interned == NULL) {
+        StringPoolEntry entry = Arena_alloc(pool->arena, sizeof(struct StringPoolEntry));
+        char* copy = entry != NULL ? Arena_strdup(pool->arena, str) : NULL;
+        if(copy != NULL) {
+            entry->str = copy;
+            entry->next = *bucket;
+            *bucket = entry;
+            interned = copy;
+        }
+    }
+    pthread_mutex_unlock(&pool->lock);
+    return interned;
+}
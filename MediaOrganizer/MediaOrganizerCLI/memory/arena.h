@@ -0,0 +1,61 @@
+//
+//  arena.h
+//  MediaOrganizerCLI
+//
+//  Created by John Bridge on 10/17/26.
+//
+
+#ifndef arena_h
+#define arena_h
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <pthread.h>
+
+#define ARENA_BLOCK_SIZE 16384
+#define ARENA_ALIGNMENT 16
+#define STRING_POOL_BUCKETS 256
+
+typedef struct ArenaBlock *ArenaBlock;
+typedef struct Arena *Arena;
+typedef struct StringPoolEntry *StringPoolEntry;
+typedef struct StringPool *StringPool;
+
+struct ArenaBlock {
+    ArenaBlock next;
+    size_t size;
+    size_t used;
+    unsigned char data[];
+};
+
+//Bump allocator: allocations are carved out of large blocks and only released all at once by free_Arena.
+//Not thread safe
+struct Arena {
+    ArenaBlock blocks;      //newest first, allocations come from the head
+    size_t block_size;
+};
+extern Arena new_Arena(size_t block_size);
+extern void free_Arena(Arena arena);
+extern void* Arena_alloc(Arena arena, size_t size);
+extern char* Arena_strdup(Arena arena, const char* str);
+
+struct StringPoolEntry {
+    const char* str;
+    StringPoolEntry next;
+};
+
+//Interned strings: each distinct string is stored once and handed out as the same pointer until the pool is freed.
+//Thread safe, for small sets of strings many records share (extensions, folder names)
+struct StringPool {
+    Arena arena;
+    StringPoolEntry buckets[STRING_POOL_BUCKETS];
+    pthread_mutex_t lock;
+};
+extern StringPool new_StringPool(void);
+extern void free_StringPool(StringPool pool);
+extern const char* StringPool_intern(StringPool pool, const char* str);
+
+#endif /* arena_h */
@@ -0,0 +1,359 @@
+//
+//  metrics.c
+//  MediaOrganizerCLI
+//
+//  Created by John Bridge on 10/17/26.
+//
+
+#include "metrics.h"
+
+//Shard of the calling thread, handed out round robin the first time a thread records
+static _Thread_local int metrics_thread_shard = -1;
+static int metrics_next_shard = 0;
+static pthread_mutex_t metrics_shard_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static int metricsThreadShard(void) {
+    if(metrics_thread_shard < 0) {
+        pthread_mutex_lock(&metrics_shard_lock);
+        metrics_thread_shard = metrics_next_shard;
+        metrics_next_shard = (metrics_next_shard+1) % LATENCY_HISTOGRAM_SHARDS;
+        pthread_mutex_unlock(&metrics_shard_lock);
+    }
+    return metrics_thread_shard;
+}
+
+//Sum of all shards of a histogram
+struct LatencyHistogramTotals {
+    uint64_t count;
+    uint64_t errors;
+    uint64_t sum;
+    uint64_t max;
+};
+
+//LatencyHistogram functions
+LatencyHistogram new_LatencyHistogram(const char* name) {
+    LatencyHistogram histogram = calloc(1, sizeof(struct LatencyHistogram));
+    if(histogram == NULL)
+        return NULL;
+    histogram->name = name;
+    for(int i=0; i<LATENCY_HISTOGRAM_SHARDS; i++)
+        pthread_mutex_init(&histogram->shards[i].lock, NULL);
+    return histogram;
+}
+
+void free_LatencyHistogram(LatencyHistogram histogram) {
+    for(int i=0; i<LATENCY_HISTOGRAM_SHARDS; i++)
+        pthread_mutex_destroy(&histogram->shards[i].lock);
+    free(histogram);
+}
+
+//Values below LATENCY_HISTOGRAM_SUB_BUCKETS get a bucket each, larger ones go by exponent then by their next SUB_BITS bits
+static int latencyHistogramIndex(uint64_t value) {
+    if(value < LATENCY_HISTOGRAM_SUB_BUCKETS)
+        return (int) value;
+    int exponent = 63-__builtin_clzll(value);
+    if(exponent >= LATENCY_HISTOGRAM_MAX_EXPONENT)
+        return LATENCY_HISTOGRAM_BUCKETS-1;
+    int sub_bucket = (int) (value >> (exponent-LATENCY_HISTOGRAM_SUB_BITS)) - LATENCY_HISTOGRAM_SUB_BUCKETS;
+    return (exponent-LATENCY_HISTOGRAM_SUB_BITS+1)*LATENCY_HISTOGRAM_SUB_BUCKETS + sub_bucket;
+}
+
+//Middle of the values that land in bucket index
+static uint64_t latencyHistogramValue(int index) {
+    if(index < LATENCY_HISTOGRAM_SUB_BUCKETS)
+        return (uint64_t) index;
+    int exponent = index/LATENCY_HISTOGRAM_SUB_BUCKETS - 1 + LATENCY_HISTOGRAM_SUB_BITS;
+    int shift = exponent-LATENCY_HISTOGRAM_SUB_BITS;
+    uint64_t lower = (uint64_t) (LATENCY_HISTOGRAM_SUB_BUCKETS + index%LATENCY_HISTOGRAM_SUB_BUCKETS) << shift;
+    return lower + (((uint64_t) 1 << shift) >> 1);
+}
+
+static void latencyHistogramAdd(LatencyHistogram histogram, uint64_t nanoseconds, uint64_t count, uint64_t errors) {
+    if(histogram == NULL || count == 0)
+        return;
+    int index = latencyHistogramIndex(nanoseconds);
+    struct LatencyHistogramShard *shard = &histogram->shards[metricsThreadShard()];
+    pthread_mutex_lock(&shard->lock);
+    shard->buckets[index] += count;
+    shard->count += count;
+    shard->errors += errors;
+    shard->sum += nanoseconds*count;
+    if(nanoseconds > shard->max)
+        shard->max = nanoseconds;
+    pthread_mutex_unlock(&shard->lock);
+}
+
+void LatencyHistogram_recordCount(LatencyHistogram histogram, uint64_t nanoseconds, uint64_t count) {
+    latencyHistogramAdd(histogram, nanoseconds, count, 0);
+}
+
+void LatencyHistogram_record(LatencyHistogram histogram, uint64_t nanoseconds) {
+    latencyHistogramAdd(histogram, nanoseconds, 1, 0);
+}
+
+void LatencyHistogram_recordCall(LatencyHistogram histogram, uint64_t started, bool succeeded) {
+    if(histogram == NULL)
+        return;
+    latencyHistogramAdd(histogram, Metrics_now()-started, 1, succeeded ? 0 : 1);
+}
+
+//Adds up the shards into totals, and into buckets unless it is NULL
+static void latencyHistogramTotals(LatencyHistogram histogram, uint64_t *buckets, struct LatencyHistogramTotals *totals) {
+    memset(totals, 0, sizeof(struct LatencyHistogramTotals));
+    if(buckets != NULL)
+        memset(buckets, 0, sizeof(uint64_t)*LATENCY_HISTOGRAM_BUCKETS);
+    for(int i=0; i<LATENCY_HISTOGRAM_SHARDS; i++) {
+        struct LatencyHistogramShard *shard = &histogram->shards[i];
+        pthread_mutex_lock(&shard->lock);
+        if(buckets != NULL && shard->count > 0) {
+            for(int j=0; j<LATENCY_HISTOGRAM_BUCKETS; j++)
+                buckets[j] += shard->buckets[j];
+        }
+        totals->count += shard->count;
+        totals->errors += shard->errors;
+        totals->sum += shard->sum;
+        if(shard->max > totals->max)
+            totals->max = shard->max;
+        pthread_mutex_unlock(&shard->lock);
+    }
+}
+
+static uint64_t latencyHistogramQuantile(const uint64_t *buckets, const struct LatencyHistogramTotals *totals, double percentile) {
+    if(totals->count == 0)
+        return 0;
+    //rank of the value asked for, 1 based
+    uint64_t rank = (uint64_t) (percentile/100.0*(double) totals->count + 0.5);
+    if(rank < 1)
+        rank = 1;
+    if(rank > totals->count)
+        rank = totals->count;
+    uint64_t value = 0;
+    uint64_t seen = 0;
+    for(int i=0; i<LATENCY_HISTOGRAM_BUCKETS; i++) {
+        seen += buckets[i];
+        if(seen >= rank) {
+            value = latencyHistogramValue(i);
+            break;
+        }
+    }
+    //the bucket middle can overshoot the largest value recorded
+    return value > totals->max ? totals->max : value;
+}
+
+uint64_t LatencyHistogram_percentile(LatencyHistogram histogram, double percentile) {
+    uint64_t buckets[LATENCY_HISTOGRAM_BUCKETS];
+    struct LatencyHistogramTotals totals;
+    latencyHistogramTotals(histogram, buckets, &totals);
+    return latencyHistogramQuantile(buckets, &totals, percentile);
+}
+
+uint64_t LatencyHistogram_count(LatencyHistogram histogram) {
+    struct LatencyHistogramTotals totals;
+    latencyHistogramTotals(histogram, NULL, &totals);
+    return totals.count;
+}
+
+uint64_t LatencyHistogram_errors(LatencyHistogram histogram) {
+    struct LatencyHistogramTotals totals;
+    latencyHistogramTotals(histogram, NULL, &totals);
+    return totals.errors;
+}
+
+double LatencyHistogram_mean(LatencyHistogram histogram) {
+    struct LatencyHistogramTotals totals;
+    latencyHistogramTotals(histogram, NULL, &totals);
+    return totals.count > 0 ? (double) totals.sum/(double) totals.count : 0;
+}
+
+uint64_t LatencyHistogram_max(LatencyHistogram histogram) {
+    struct LatencyHistogramTotals totals;
+    latencyHistogramTotals(histogram, NULL, &totals);
+    return totals.max;
+}
+
+//Metrics functions
+Metrics new_Metrics(void) {
+    Metrics metrics = malloc(sizeof(struct Metrics));
+    if(metrics == NULL)
+        return NULL;
+    metrics->histogram_count = 0;
+    pthread_mutex_init(&metrics->lock, NULL);
+    metrics->export_directory = NULL;
+    metrics->export_interval = 0;
+    metrics->exporter_running = false;
+    pthread_mutex_init(&metrics->exporter_lock, NULL);
+    pthread_cond_init(&metrics->exporter_cond, NULL);
+    return metrics;
+}
+
+void free_Metrics(Metrics metrics) {
+    Metrics_stopExport(metrics);
+    for(int i=0; i<metrics->histogram_count; i++)
+        free_LatencyHistogram(metrics->histograms[i]);
+    pthread_mutex_destroy(&metrics->lock);
+    pthread_mutex_destroy(&metrics->exporter_lock);
+    pthread_cond_destroy(&metrics->exporter_cond);
+    free(metrics);
+}
+
+LatencyHistogram Metrics_histogram(Metrics metrics, const char* name) {
+    if(metrics == NULL)
+        return NULL;
+    LatencyHistogram histogram = NULL;
+    pthread_mutex_lock(&metrics->lock);
+    for(int i=0; i<metrics->histogram_count && histogram == NULL; i++) {
+        if(strcmp(metrics->histograms[i]->name, name) == 0)
+            histogram = metrics->histograms[i];
+    }
+    if(histogram == NULL && metrics->histogram_count < METRICS_MAX_HISTOGRAMS) {
+        histogram = new_LatencyHistogram(name);
+        if(histogram != NULL)
+            metrics->histograms[metrics->histogram_count++] = histogram;
+    }
+    pthread_mutex_unlock(&metrics->lock);
+    return histogram;
+}
+
+//Histograms present when called, later ones are left out of the snapshot being written
+static int metricsHistogramCount(Metrics metrics) {
+    pthread_mutex_lock(&metrics->lock);
+    int count = metrics->histogram_count;
+    pthread_mutex_unlock(&metrics->lock);
+    return count;
+}
+
+void Metrics_writePrometheus(Metrics metrics, FILE* out) {
+    static const double quantiles[] = {0.5, 0.9, 0.99, 0.999};
+    uint64_t buckets[LATENCY_HISTOGRAM_BUCKETS];
+    struct LatencyHistogramTotals totals;
+    int count = metricsHistogramCount(metrics);
+    fprintf(out, "# HELP mediaorganizer_latency_seconds Time per file of each stage and per call of each instrumented function\n");
+    fprintf(out, "# TYPE mediaorganizer_latency_seconds summary\n");
+    for(int i=0; i<count; i++) {
+        LatencyHistogram histogram = metrics->histograms[i];
+        latencyHistogramTotals(histogram, buckets, &totals);
+        for(int q=0; q<(int) (sizeof(quantiles)/sizeof(quantiles[0])); q++)
+            fprintf(out, "mediaorganizer_latency_seconds{name=\"%s\",quantile=\"%g\"} %.9f\n", histogram->name, quantiles[q], latencyHistogramQuantile(buckets, &totals, quantiles[q]*100)/1e9);
+        fprintf(out, "mediaorganizer_latency_seconds_sum{name=\"%s\"} %.9f\n", histogram->name, totals.sum/1e9);
+        fprintf(out, "mediaorganizer_latency_seconds_count{name=\"%s\"} %llu\n", histogram->name, (unsigned long long) totals.count);
+    }
+    fprintf(out, "# HELP mediaorganizer_latency_max_seconds Longest value recorded\n");
+    fprintf(out, "# TYPE mediaorganizer_latency_max_seconds gauge\n");
+    for(int i=0; i<count; i++) {
+        latencyHistogramTotals(metrics->histograms[i], NULL, &totals);
+        fprintf(out, "mediaorganizer_latency_max_seconds{name=\"%s\"} %.9f\n", metrics->histograms[i]->name, totals.max/1e9);
+    }
+    fprintf(out, "# HELP mediaorganizer_errors_total Calls that failed\n");
+    fprintf(out, "# TYPE mediaorganizer_errors_total counter\n");
+    for(int i=0; i<count; i++) {
+        latencyHistogramTotals(metrics->histograms[i], NULL, &totals);
+        fprintf(out, "mediaorganizer_errors_total{name=\"%s\"} %llu\n", metrics->histograms[i]->name, (unsigned long long) totals.errors);
+    }
+    fprintf(out, "# HELP mediaorganizer_metrics_timestamp_seconds When this snapshot was written\n");
+    fprintf(out, "# TYPE mediaorganizer_metrics_timestamp_seconds gauge\n");
+    fprintf(out, "mediaorganizer_metrics_timestamp_seconds %lld\n", (long long) time(NULL));
+}
+
+void Metrics_writeJSON(Metrics metrics, FILE* out) {
+    uint64_t buckets[LATENCY_HISTOGRAM_BUCKETS];
+    struct LatencyHistogramTotals totals;
+    int count = metricsHistogramCount(metrics);
+    fprintf(out, "{\n  \"timestamp\": %lld,\n  \"histograms\": {\n", (long long) time(NULL));
+    for(int i=0; i<count; i++) {
+        LatencyHistogram histogram = metrics->histograms[i];
+        latencyHistogramTotals(histogram, buckets, &totals);
+        fprintf(out, "    \"%s\": {\"count\": %llu, \"errors\": %llu", histogram->name, (unsigned long long) totals.count, (unsigned long long) totals.errors);
+        if(totals.count > 0) {
+            fprintf(out, ", \"mean_ms\": %.3f, \"p50_ms\": %.3f, \"p90_ms\": %.3f, \"p99_ms\": %.3f, \"p999_ms\": %.3f, \"max_ms\": %.3f",
+                    (double) totals.sum/(double) totals.count/1e6, latencyHistogramQuantile(buckets, &totals, 50)/1e6,
+                    latencyHistogramQuantile(buckets, &totals, 90)/1e6, latencyHistogramQuantile(buckets, &totals, 99)/1e6,
+                    latencyHistogramQuantile(buckets, &totals, 99.9)/1e6, totals.max/1e6);
+        }
+        fprintf(out, "}%s\n", i == count-1 ? "" : ",");
+    }
+    fprintf(out, "  }\n}\n");
+}
+
+static bool metricsWriteFile(Metrics metrics, const char* directory, const char* extension, void (*write)(Metrics, FILE*)) {
+    char path[4096], temp_path[4096];
+    if(snprintf(path, sizeof(path), "%s/%s.%s", directory, METRICS_SNAPSHOT_NAME, extension) >= (int) sizeof(path)
+       || snprintf(temp_path, sizeof(temp_path), "%s.tmp", path) >= (int) sizeof(temp_path)) {
+        fprintf(stderr, "Metrics path too long in %s\n", directory);
+        return false;
+    }
+    FILE* out = fopen(temp_path, "w");
+    if(out == NULL) {
+        fprintf(stderr, "Could not write %s: %s\n", temp_path, strerror(errno));
+        return false;
+    }
+    write(metrics, out);
+    bool written = !ferror(out);
+    if(fclose(out) != 0)
+        written = false;
+    if(!written || rename(temp_path, path) != 0) {
+        fprintf(stderr, "Could not write %s: %s\n", path, strerror(errno));
+        remove(temp_path);
+        return false;
+    }
+    return true;
+}
+
+bool Metrics_writeSnapshot(Metrics metrics, const char* directory) {
+    bool prometheus = metricsWriteFile(metrics, directory, "prom", Metrics_writePrometheus);
+    bool json = metricsWriteFile(metrics, directory, "json", Metrics_writeJSON);
+    return prometheus && json;
+}
+
+static void* metricsExporterThread(void* arg) {
+    Metrics metrics = arg;
+    pthread_mutex_lock(&metrics->exporter_lock);
+    while(metrics->exporter_running) {
+        struct timespec deadline;
+        clock_gettime(CLOCK_REALTIME, &deadline);
+        deadline.tv_sec += metrics->export_interval;
+        int result = 0;
+        while(metrics->exporter_running && result != ETIMEDOUT)
+            result = pthread_cond_timedwait(&metrics->exporter_cond, &metrics->exporter_lock, &deadline);
+        if(metrics->exporter_running)
+            Metrics_writeSnapshot(metrics, metrics->export_directory);
+    }
+    pthread_mutex_unlock(&metrics->exporter_lock);
+    return NULL;
+}
+
+bool Metrics_startExport(Metrics metrics, const char* directory, unsigned int interval) {
+    Metrics_stopExport(metrics);
+    metrics->export_directory = strdup(directory);
+    if(metrics->export_directory == NULL)
+        return false;
+    metrics->export_interval = interval;
+    if(interval > 0) {
+        metrics->exporter_running = true;
+        if(pthread_create(&metrics->exporter, NULL, metricsExporterThread, metrics) != 0) {
+            metrics->exporter_running = false;
+            fprintf(stderr, "Could not start metrics export thread, metrics are only written at the end\n");
+        }
+    }
+    return true;
+}
+
+void Metrics_stopExport(Metrics metrics) {
+    pthread_mutex_lock(&metrics->exporter_lock);
+    bool exporter_running = metrics->exporter_running;
+    metrics->exporter_running = false;
+    pthread_cond_signal(&metrics->exporter_cond);
+    pthread_mutex_unlock(&metrics->exporter_lock);
+    if(exporter_running)
+        pthread_join(metrics->exporter, NULL);
+    if(metrics->export_directory != NULL) {
+        Metrics_writeSnapshot(metrics, metrics->export_directory);
+        free(metrics->export_directory);
+        metrics->export_directory = NULL;
+    }
+}
+
+uint64_t Metrics_now(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t) now.tv_sec*1000000000ULL + (uint64_t) now.tv_nsec;
+}
@@ -0,0 +1,98 @@
+//
+//  metrics.h
+//  MediaOrganizerCLI
+//
+//  Created by John Bridge on 10/17/26.
+//
+
+#ifndef metrics_h
+#define metrics_h
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <pthread.h>
+
+//Each power of two of nanoseconds is split into 2^LATENCY_HISTOGRAM_SUB_BITS linear buckets, so a recorded
+//value is off by at most 1/16th whatever its magnitude. Values from 2^LATENCY_HISTOGRAM_MAX_EXPONENT ns (~73 min) on share the last bucket
+#define LATENCY_HISTOGRAM_SUB_BITS 4
+#define LATENCY_HISTOGRAM_SUB_BUCKETS (1 << LATENCY_HISTOGRAM_SUB_BITS)
+#define LATENCY_HISTOGRAM_MAX_EXPONENT 42
+#define LATENCY_HISTOGRAM_BUCKETS ((LATENCY_HISTOGRAM_MAX_EXPONENT-LATENCY_HISTOGRAM_SUB_BITS+1)*LATENCY_HISTOGRAM_SUB_BUCKETS)
+//Threads record into one of this many shards, picked once per thread. Up to this many threads never share one
+#define LATENCY_HISTOGRAM_SHARDS 16
+#define METRICS_MAX_HISTOGRAMS 32
+//Snapshots are written to <directory>/METRICS_SNAPSHOT_NAME.prom and .json
+#define METRICS_SNAPSHOT_NAME "mediaorganizer"
+
+typedef struct LatencyHistogram *LatencyHistogram;
+typedef struct Metrics *Metrics;
+
+//One thread's share of a histogram. Its lock is only contended once more threads record than there are shards
+struct LatencyHistogramShard {
+    uint64_t buckets[LATENCY_HISTOGRAM_BUCKETS];
+    uint64_t count;
+    uint64_t errors;
+    uint64_t sum;
+    uint64_t max;
+    pthread_mutex_t lock;
+};
+
+//HDR style latency histogram with a fixed footprint, however many values are recorded, plus a count of failed calls.
+//Thread safe, readers add up the shards
+struct LatencyHistogram {
+    const char* name;
+    struct LatencyHistogramShard shards[LATENCY_HISTOGRAM_SHARDS];
+};
+extern LatencyHistogram new_LatencyHistogram(const char* name);
+extern void free_LatencyHistogram(LatencyHistogram histogram);
+
+//Recording functions ignore a NULL histogram
+extern void LatencyHistogram_record(LatencyHistogram histogram, uint64_t nanoseconds);
+//Records the same value count times, e.g. the per file share of work done for a batch of files
+extern void LatencyHistogram_recordCount(LatencyHistogram histogram, uint64_t nanoseconds, uint64_t count);
+//Records a call that started at started (Metrics_now), counting it as an error unless succeeded
+extern void LatencyHistogram_recordCall(LatencyHistogram histogram, uint64_t started, bool succeeded);
+//Value below which percentile (0-100) of the recorded values fall, 0 if nothing was recorded
+extern uint64_t LatencyHistogram_percentile(LatencyHistogram histogram, double percentile);
+extern uint64_t LatencyHistogram_count(LatencyHistogram histogram);
+extern uint64_t LatencyHistogram_errors(LatencyHistogram histogram);
+extern double LatencyHistogram_mean(LatencyHistogram histogram);
+extern uint64_t LatencyHistogram_max(LatencyHistogram histogram);
+
+//Named histograms that outlive the pipelines recording into them. Histograms are only added, never removed
+struct Metrics {
+    LatencyHistogram histograms[METRICS_MAX_HISTOGRAMS];
+    int histogram_count;
+    pthread_mutex_t lock;
+    //periodic snapshot files, see Metrics_startExport
+    char* export_directory;
+    unsigned int export_interval;
+    pthread_t exporter;
+    bool exporter_running;
+    pthread_mutex_t exporter_lock;
+    pthread_cond_t exporter_cond;
+};
+extern Metrics new_Metrics(void);
+extern void free_Metrics(Metrics metrics);
+//Returns the histogram called name, creating it on first use. NULL once METRICS_MAX_HISTOGRAMS exist. name must outlive metrics.
+//Takes a lock shared by all histograms, look histograms up once rather than per recorded value
+extern LatencyHistogram Metrics_histogram(Metrics metrics, const char* name);
+
+//Prometheus text exposition format: a summary (p50/p90/p99/p999, sum, count) plus max and error count per histogram
+extern void Metrics_writePrometheus(Metrics metrics, FILE* out);
+extern void Metrics_writeJSON(Metrics metrics, FILE* out);
+//Writes both formats into directory, each through a temporary file renamed into place so a scraper never reads half a file
+extern bool Metrics_writeSnapshot(Metrics metrics, const char* directory);
+//Writes a snapshot every interval seconds (0 for only the final one) until Metrics_stopExport, which writes the final one
+extern bool Metrics_startExport(Metrics metrics, const char* directory, unsigned int interval);
+extern void Metrics_stopExport(Metrics metrics);
+
+//Monotonic clock in nanoseconds, for timing the work that is recorded
+extern uint64_t Metrics_now(void);
+
+#endif /* metrics_h */
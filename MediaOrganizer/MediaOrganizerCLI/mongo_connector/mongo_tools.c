@@ -7,8 +7,11 @@
 
 #include "mongo_tools.h"
 
+//Clients for worker threads come from a mongoc_client_pool_t (see MongoDBClientHolder_popClient).
+//holder->client is popped from the same pool for use on the main thread
 MongoDBClientHolder new_MongoDBClientHolder(const char* uri_string, const char* db_name) {
     mongoc_uri_t *uri;
+    mongoc_client_pool_t *pool;
     mongoc_client_t *client;
     mongoc_server_api_t *api;
     bson_error_t error;
@@ -17,12 +20,19 @@ MongoDBClientHolder new_MongoDBClientHolder(const char* uri_string, const char*
     mongoc_init();
 
     uri = mongoc_uri_new_with_error (uri_string, &error);
-    client = mongoc_client_new_from_uri(uri);
+    if(uri == NULL) {
+        Log(LOG_LEVEL_ERROR, "Invalid MongoDB uri: %s\n", error.message);
+        return NULL;
+    }
+    pool = mongoc_client_pool_new(uri);
 
     api = mongoc_server_api_new (MONGOC_SERVER_API_V1);
-    mongoc_client_set_server_api (client, api, &error);
+    mongoc_client_pool_set_server_api (pool, api, &error);
+    mongoc_server_api_destroy(api);
+    
+    mongoc_client_pool_set_appname(pool, "MediaOrganizer");
     
-    mongoc_client_set_appname(client, "MediaOrganizer");
+    client = mongoc_client_pool_pop(pool);
 
     database = mongoc_client_get_database(client, db_name);
 
@@ -30,11 +40,16 @@ MongoDBClientHolder new_MongoDBClientHolder(const char* uri_string, const char*
     if(client_holder==NULL) {
     	return NULL;
     }
+    client_holder->uri = uri;
+    client_holder->pool = pool;
     client_holder->client = client;
     client_holder->database = database;
     client_holder->db_name = db_name;
     client_holder->files_collection=NULL;
     client_holder->uploads_collection=NULL;
+    client_holder->files_collection_name=NULL;
+    client_holder->uploads_collection_name=NULL;
+    pthread_mutex_init(&client_holder->lock, NULL);
     return client_holder;
 }
 
@@ -42,11 +57,23 @@ void freeDBClientHolder(MongoDBClientHolder holder) {
     mongoc_collection_destroy(holder->files_collection);
     mongoc_collection_destroy(holder->uploads_collection);
     mongoc_database_destroy(holder->database);
-    mongoc_client_destroy(holder->client);
+    mongoc_client_pool_push(holder->pool, holder->client);
+    mongoc_client_pool_destroy(holder->pool);
+    mongoc_uri_destroy(holder->uri);
     mongoc_cleanup();
+    pthread_mutex_destroy(&holder->lock);
     free(holder);
 }
 
+//Blocks until a pooled client is free. Each thread must use its own client and push it back when done
+mongoc_client_t* MongoDBClientHolder_popClient(MongoDBClientHolder holder) {
+    return mongoc_client_pool_pop(holder->pool);
+}
+
+void MongoDBClientHolder_pushClient(MongoDBClientHolder holder, mongoc_client_t *client) {
+    mongoc_client_pool_push(holder->pool, client);
+}
+
 int createDefaultMongoDBCollections(MongoDBClientHolder dbclient_holder) {
     return createMongoDBCollections(dbclient_holder, "files", "upload_groups", "events");
 }
@@ -92,14 +119,16 @@ int createMongoDBCollections(MongoDBClientHolder dbclient_holder, const char* fi
         bool r;
         r = mongoc_database_write_command_with_opts (
               dbclient_holder->database, create_indexes, NULL /* opts */, &reply, &error);
-        char* json_reply = bson_as_json(&reply, NULL);
-        printf ("%s\n", json_reply);
+        if(Log_enabled(LOG_LEVEL_DEBUG)) {
+            char* json_reply = bson_as_json(&reply, NULL);
+            Log(LOG_LEVEL_DEBUG, "%s\n", json_reply);
+            bson_free(json_reply);
+        }
         if(!r) {
-            fprintf (stderr, "Error in createIndexes for events collection: %s\n", error.message);
+            Log(LOG_LEVEL_ERROR, "Error in createIndexes for events collection: %s\n", error.message);
         }
         
         //free memory
-        bson_free(json_reply);
         bson_destroy(&reply);
         bson_destroy(create_indexes);
         bson_free(opts);
@@ -114,7 +143,10 @@ int createMongoDBCollections(MongoDBClientHolder dbclient_holder, const char* fi
         bson_t *opts = bson_new();
         
         mongoc_collection_t *uploads_collection = mongoc_database_create_collection(dbclient_holder->database, uploads_collection_name, opts, &error1);
-        fprintf (stderr, "Error in createIndexes for uploads collection: %s\n", error1.message);
+        //it already exists on every run after the first
+        if(uploads_collection == NULL && error1.code != MONGO_ERROR_NAMESPACE_EXISTS)
+            Log(LOG_LEVEL_ERROR, "Error creating uploads collection: %s\n", error1.message);
+        mongoc_collection_destroy(uploads_collection);
         
         //create indexes
         bson_t time_index_keys;
@@ -148,18 +180,20 @@ int createMongoDBCollections(MongoDBClientHolder dbclient_holder, const char* fi
         r = mongoc_database_write_command_with_opts (
               dbclient_holder->database, create_indexes, NULL /* opts */, &reply, &error);
         
-        char* json_reply = bson_as_json(&reply, NULL);
-        printf ("%s\n", json_reply);
+        if(Log_enabled(LOG_LEVEL_DEBUG)) {
+            char* json_reply = bson_as_json(&reply, NULL);
+            Log(LOG_LEVEL_DEBUG, "%s\n", json_reply);
+            bson_free(json_reply);
+        }
         if(!r) {
-            fprintf (stderr, "Error in createIndexes for uploads collection: %s\n", error.message);
+            Log(LOG_LEVEL_ERROR, "Error in createIndexes for uploads collection: %s\n", error.message);
         }
         
         //free memory
-        bson_free(json_reply);
         bson_destroy(&reply);
         bson_destroy(create_indexes);
         bson_free(opts);
-        mongoc_collection_destroy(uploads_collection);
+        dbclient_holder->uploads_collection_name = uploads_collection_name;
         dbclient_holder->uploads_collection = mongoc_client_get_collection(dbclient_holder->client, dbclient_holder->db_name, uploads_collection_name);
         //bson_free(error1);
     }
@@ -178,10 +212,14 @@ int createMongoDBCollections(MongoDBClientHolder dbclient_holder, const char* fi
         bson_t textattributes_index_keys;
         bson_t eventid_index_keys;
         bson_t uploadid_index_keys;
+        bson_t uploadids_index_keys;
+        bson_t contenthash_index_keys;
         
         bson_init(&textattributes_index_keys);
         bson_init(&eventid_index_keys);
         bson_init(&uploadid_index_keys);
+        bson_init(&uploadids_index_keys);
+        bson_init(&contenthash_index_keys);
         
         BSON_APPEND_UTF8(&textattributes_index_keys, "$**", "text");
         
@@ -189,6 +227,12 @@ int createMongoDBCollections(MongoDBClientHolder dbclient_holder, const char* fi
         
         BSON_APPEND_INT32(&uploadid_index_keys, "upload_id", 1);
         
+        BSON_APPEND_INT32(&uploadids_index_keys, "upload_ids", 1);
+        
+        //duplicate lookup before a file is copied
+        BSON_APPEND_INT32(&contenthash_index_keys, "content_hash", 1);
+        BSON_APPEND_INT32(&contenthash_index_keys, "size", 1);
+        
         bson_t *create_indexes = BCON_NEW("createIndexes",
                                           BCON_UTF8(files_collection_name),
                                           "indexes",
@@ -211,6 +255,18 @@ int createMongoDBCollections(MongoDBClientHolder dbclient_holder, const char* fi
                                           "name",
                                           BCON_UTF8("files_uploadid"),
                                           "}",
+                                          "{",
+                                          "key",
+                                          BCON_DOCUMENT(&uploadids_index_keys),
+                                          "name",
+                                          BCON_UTF8("files_uploadids"),
+                                          "}",
+                                          "{",
+                                          "key",
+                                          BCON_DOCUMENT(&contenthash_index_keys),
+                                          "name",
+                                          BCON_UTF8("files_contenthash"),
+                                          "}",
                                           "]");
         bson_t reply;
         bson_error_t error;
@@ -218,19 +274,356 @@ int createMongoDBCollections(MongoDBClientHolder dbclient_holder, const char* fi
         r = mongoc_database_write_command_with_opts (
               dbclient_holder->database, create_indexes, NULL /* opts */, &reply, &error);
         
-        char* json_reply = bson_as_json(&reply, NULL);
-        printf ("%s\n", json_reply);
+        if(Log_enabled(LOG_LEVEL_DEBUG)) {
+            char* json_reply = bson_as_json(&reply, NULL);
+            Log(LOG_LEVEL_DEBUG, "%s\n", json_reply);
+            bson_free(json_reply);
+        }
         if(!r) {
-            fprintf (stderr, "Error in createIndexes for files collection: %s\n", error.message);
+            Log(LOG_LEVEL_ERROR, "Error in createIndexes for files collection: %s\n", error.message);
         }
         
         //free memory
-        bson_free(json_reply);
         bson_destroy(&reply);
         bson_destroy(create_indexes);
         bson_free(opts);
         mongoc_collection_destroy(files_collection);
+        dbclient_holder->files_collection_name = files_collection_name;
         dbclient_holder->files_collection = mongoc_client_get_collection(dbclient_holder->client, dbclient_holder->db_name, files_collection_name);
     }
     return 0;
 }
+
+//MongoBatchWriter functions
+static void* mongoBatchWriterThread(void* arg);
+
+static MongoBatchWriter mongoBatchWriterStart(MongoDBClientHolder holder, const char* collection_name, MongoBatchWriterExecuteFn execute, void* execute_context, size_t batch_size, unsigned int flush_interval_ms, int thread_count) {
+    MongoBatchWriter writer = malloc(sizeof(struct MongoBatchWriter));
+    if(writer==NULL)
+        return NULL;
+    writer->holder = holder;
+    writer->collection_name = collection_name;
+    writer->execute = execute;
+    writer->execute_context = execute_context;
+    writer->latency = NULL;
+    writer->execute_latency = NULL;
+    writer->batch_size = batch_size > 0 ? batch_size : 1;
+    writer->flush_interval_ms = flush_interval_ms;
+    writer->head = NULL;
+    writer->tail = NULL;
+    writer->queued = 0;
+    writer->max_queued = 0;
+    writer->peak_queued = 0;
+    writer->next_seq = 1;
+    writer->flush_requests = 0;
+    writer->written_callback = NULL;
+    writer->callback_context = NULL;
+    writer->batches_written = 0;
+    writer->writes_written = 0;
+    writer->writes_failed = 0;
+    writer->running = true;
+    pthread_mutex_init(&writer->lock, NULL);
+    pthread_cond_init(&writer->has_work, NULL);
+    pthread_cond_init(&writer->progress, NULL);
+    
+    writer->thread_count = thread_count > 0 ? thread_count : 1;
+    writer->threads = malloc(sizeof(pthread_t)*writer->thread_count);
+    writer->inflight_min_seq = calloc(writer->thread_count, sizeof(uint64_t));
+    writer->thread_args = malloc(sizeof(struct MongoBatchWriterThreadArg)*writer->thread_count);
+    if(writer->threads == NULL || writer->inflight_min_seq == NULL || writer->thread_args == NULL) {
+        writer->thread_count = 0;
+        free_MongoBatchWriter(writer);
+        return NULL;
+    }
+    int started = 0;
+    for(int i=0; i<writer->thread_count; i++) {
+        writer->thread_args[i].writer = writer;
+        writer->thread_args[i].index = i;
+        if(pthread_create(&writer->threads[i], NULL, mongoBatchWriterThread, &writer->thread_args[i]) != 0)
+            break;
+        started++;
+    }
+    writer->thread_count = started;
+    if(started == 0) {
+        Log(LOG_LEVEL_ERROR, "Could not start any MongoDB writer threads\n");
+        free_MongoBatchWriter(writer);
+        return NULL;
+    }
+    return writer;
+}
+
+MongoBatchWriter new_MongoBatchWriter(MongoDBClientHolder holder, const char* collection_name, size_t batch_size, unsigned int flush_interval_ms, int thread_count) {
+    if(holder == NULL || collection_name == NULL)
+        return NULL;
+    return mongoBatchWriterStart(holder, collection_name, NULL, NULL, batch_size, flush_interval_ms, thread_count);
+}
+
+MongoBatchWriter new_MongoBatchWriterWithSink(MongoBatchWriterExecuteFn execute, void* execute_context, size_t batch_size, unsigned int flush_interval_ms, int thread_count) {
+    if(execute == NULL)
+        return NULL;
+    return mongoBatchWriterStart(NULL, NULL, execute, execute_context, batch_size, flush_interval_ms, thread_count);
+}
+
+//Drains everything still queued, then stops the writer threads
+void free_MongoBatchWriter(MongoBatchWriter writer) {
+    pthread_mutex_lock(&writer->lock);
+    writer->running = false;
+    pthread_cond_broadcast(&writer->has_work);
+    pthread_mutex_unlock(&writer->lock);
+    for(int i=0; i<writer->thread_count; i++)
+        pthread_join(writer->threads[i], NULL);
+    //only left over if no thread could be started
+    while(writer->head != NULL) {
+        MongoWriteOp op = writer->head;
+        writer->head = op->next;
+        if(op->tag != NULL && writer->written_callback != NULL)
+            writer->written_callback(writer->callback_context, op->tag, false);
+        free_MongoWriteOp(op);
+    }
+    free(writer->threads);
+    free(writer->inflight_min_seq);
+    free(writer->thread_args);
+    pthread_mutex_destroy(&writer->lock);
+    pthread_cond_destroy(&writer->has_work);
+    pthread_cond_destroy(&writer->progress);
+    free(writer);
+}
+
+void free_MongoWriteOp(MongoWriteOp op) {
+    if(op->document != NULL)
+        bson_destroy(op->document);
+    if(op->selector != NULL)
+        bson_destroy(op->selector);
+    free(op);
+}
+
+//Takes ownership of document and selector. Never blocks on the network, only on a full queue when max_queued is set
+static bool mongoBatchWriterEnqueue(MongoBatchWriter writer, MongoWriteOpType type, bson_t *document, bson_t *selector, void* tag) {
+    MongoWriteOp op = malloc(sizeof(struct MongoWriteOp));
+    if(op == NULL || document == NULL) {
+        if(op != NULL)
+            free(op);
+        if(document != NULL)
+            bson_destroy(document);
+        if(selector != NULL)
+            bson_destroy(selector);
+        return false;
+    }
+    op->type = type;
+    op->document = document;
+    op->selector = selector;
+    op->tag = tag;
+    op->failed = false;
+    op->next = NULL;
+    clock_gettime(CLOCK_REALTIME, &op->enqueued);
+    pthread_mutex_lock(&writer->lock);
+    //writer threads broadcast progress after every batch
+    while(writer->max_queued > 0 && writer->queued >= writer->max_queued && writer->thread_count > 0)
+        pthread_cond_wait(&writer->progress, &writer->lock);
+    op->seq = writer->next_seq++;
+    if(writer->tail != NULL)
+        writer->tail->next = op;
+    else
+        writer->head = op;
+    writer->tail = op;
+    writer->queued++;
+    if(writer->queued > writer->peak_queued)
+        writer->peak_queued = writer->queued;
+    if(writer->queued == 1 || writer->queued >= writer->batch_size)
+        pthread_cond_signal(&writer->has_work);
+    pthread_mutex_unlock(&writer->lock);
+    return true;
+}
+
+//the callback is never called for a write that could not be enqueued, the caller still owns its tag
+bool MongoBatchWriter_insert(MongoBatchWriter writer, const bson_t *document, void* tag) {
+    return mongoBatchWriterEnqueue(writer, MONGO_WRITE_INSERT, bson_copy(document), NULL, tag);
+}
+
+bool MongoBatchWriter_updateOne(MongoBatchWriter writer, const bson_t *selector, const bson_t *update, void* tag) {
+    return mongoBatchWriterEnqueue(writer, MONGO_WRITE_UPDATE_ONE, bson_copy(update), bson_copy(selector), tag);
+}
+
+//writer->lock must be held. True once no write enqueued at or before seq is queued or in flight
+static bool mongoBatchWriterReached(MongoBatchWriter writer, uint64_t seq) {
+    if(writer->head != NULL && writer->head->seq <= seq)
+        return false;
+    for(int i=0; i<writer->thread_count; i++) {
+        if(writer->inflight_min_seq[i] != 0 && writer->inflight_min_seq[i] <= seq)
+            return false;
+    }
+    return true;
+}
+
+//Barrier: returns once every write enqueued before the call has been executed
+bool MongoBatchWriter_flush(MongoBatchWriter writer) {
+    pthread_mutex_lock(&writer->lock);
+    uint64_t target = writer->next_seq-1;
+    size_t failed_before = writer->writes_failed;
+    writer->flush_requests++;
+    pthread_cond_broadcast(&writer->has_work);
+    while(!mongoBatchWriterReached(writer, target))
+        pthread_cond_wait(&writer->progress, &writer->lock);
+    writer->flush_requests--;
+    bool result = writer->writes_failed == failed_before;
+    pthread_mutex_unlock(&writer->lock);
+    return result;
+}
+
+//writer->lock must be held
+static bool mongoBatchWriterBatchDue(MongoBatchWriter writer, struct timespec *deadline) {
+    if(writer->queued == 0)
+        return false;
+    if(writer->queued >= writer->batch_size || writer->flush_requests > 0 || !writer->running || writer->flush_interval_ms == 0)
+        return true;
+    *deadline = writer->head->enqueued;
+    deadline->tv_sec += writer->flush_interval_ms/1000;
+    deadline->tv_nsec += (long)(writer->flush_interval_ms%1000)*1000000L;
+    if(deadline->tv_nsec >= 1000000000L) {
+        deadline->tv_sec++;
+        deadline->tv_nsec -= 1000000000L;
+    }
+    struct timespec now;
+    clock_gettime(CLOCK_REALTIME, &now);
+    return now.tv_sec > deadline->tv_sec || (now.tv_sec == deadline->tv_sec && now.tv_nsec >= deadline->tv_nsec);
+}
+
+//Marks the writes an unordered bulk reply lists in writeErrors, by their index in the batch. Returns false if the
+//reply doesn't say which writes failed, e.g. a write concern error, then all of them count as failed
+static bool mongoBatchWriterMarkFailed(MongoWriteOp batch, const bson_t *reply) {
+    bson_iter_t iter, errors, field;
+    if(bson_iter_init_find(&iter, reply, "writeConcernErrors") && BSON_ITER_HOLDS_ARRAY(&iter)
+       && bson_iter_recurse(&iter, &errors) && bson_iter_next(&errors))
+        return false;
+    if(!bson_iter_init_find(&iter, reply, "writeErrors") || !BSON_ITER_HOLDS_ARRAY(&iter) || !bson_iter_recurse(&iter, &errors))
+        return false;
+    bool marked = false;
+    while(bson_iter_next(&errors)) {
+        if(!BSON_ITER_HOLDS_DOCUMENT(&errors) || !bson_iter_recurse(&errors, &field) || !bson_iter_find(&field, "index")
+           || !BSON_ITER_HOLDS_NUMBER(&field))
+            return false;
+        int64_t index = bson_iter_as_int64(&field);
+        MongoWriteOp op = batch;
+        for(int64_t i=0; i<index && op != NULL; i++)
+            op = op->next;
+        if(op == NULL || index < 0)
+            return false;
+        op->failed = true;
+        marked = true;
+    }
+    return marked;
+}
+
+//Each writer thread owns a pooled client and sends up to batch_size queued writes per bulk operation
+static void* mongoBatchWriterThread(void* arg) {
+    MongoBatchWriterThreadArg thread_arg = arg;
+    MongoBatchWriter writer = thread_arg->writer;
+    mongoc_client_t *client = NULL;
+    mongoc_collection_t *collection = NULL;
+    if(writer->execute == NULL) {
+        client = MongoDBClientHolder_popClient(writer->holder);
+        collection = mongoc_client_get_collection(client, writer->holder->db_name, writer->collection_name);
+    }
+    //unordered so one bad document does not stop the rest of the batch
+    bson_t *bulk_opts = BCON_NEW("ordered", BCON_BOOL(false));
+    
+    pthread_mutex_lock(&writer->lock);
+    while(true) {
+        struct timespec deadline;
+        if(!mongoBatchWriterBatchDue(writer, &deadline)) {
+            if(!writer->running && writer->queued == 0)
+                break;
+            if(writer->queued == 0)
+                pthread_cond_wait(&writer->has_work, &writer->lock);
+            else
+                pthread_cond_timedwait(&writer->has_work, &writer->lock, &deadline);
+            continue;
+        }
+        //detach up to batch_size writes from the head of the queue
+        MongoWriteOp batch = writer->head;
+        MongoWriteOp last = batch;
+        size_t count = 1;
+        while(count < writer->batch_size && last->next != NULL) {
+            last = last->next;
+            count++;
+        }
+        writer->head = last->next;
+        if(writer->head == NULL)
+            writer->tail = NULL;
+        last->next = NULL;
+        writer->queued -= count;
+        writer->inflight_min_seq[thread_arg->index] = batch->seq;
+        pthread_mutex_unlock(&writer->lock);
+        
+        bson_error_t error;
+        bool result = true;
+        uint64_t started = Metrics_now();
+        if(writer->execute != NULL) {
+            result = writer->execute(writer->execute_context, batch, count, &error);
+        } else {
+            mongoc_bulk_operation_t *bulk = mongoc_collection_create_bulk_operation_with_opts(collection, bulk_opts);
+            for(MongoWriteOp op = batch; op != NULL && result; op = op->next) {
+                if(op->type == MONGO_WRITE_INSERT)
+                    result = mongoc_bulk_operation_insert_with_opts(bulk, op->document, NULL, &error);
+                else
+                    result = mongoc_bulk_operation_update_one_with_opts(bulk, op->selector, op->document, NULL, &error);
+            }
+            bson_t reply;
+            if(result) {
+                //bulk execute returns a reply (with writeErrors) as well when it fails
+                result = mongoc_bulk_operation_execute(bulk, &reply, &error) != 0;
+                //the reply is only serialized when it is going to be read
+                if(Log_enabled(LOG_LEVEL_DEBUG)) {
+                    char *str = bson_as_canonical_extended_json(&reply, NULL);
+                    Log(LOG_LEVEL_DEBUG, "%s\n", str);
+                    bson_free(str);
+                }
+                //an unordered bulk went on past the writes that failed, the rest are stored
+                if(!result && mongoBatchWriterMarkFailed(batch, &reply))
+                    result = true;
+                bson_destroy(&reply);
+            }
+            mongoc_bulk_operation_destroy(bulk);
+        }
+        size_t failed = 0;
+        for(MongoWriteOp op = batch; op != NULL; op = op->next) {
+            if(!result)
+                op->failed = true;
+            if(op->failed)
+                failed++;
+        }
+        LatencyHistogram_recordCall(writer->execute_latency, started, failed == 0);
+        if(!result)
+            Log(LOG_LEVEL_ERROR, "Error writing batch of %zu: %s\n", count, error.message);
+        else if(failed > 0)
+            Log(LOG_LEVEL_ERROR, "%zu of %zu writes failed: %s\n", failed, count, error.message);
+        struct timespec executed;
+        clock_gettime(CLOCK_REALTIME, &executed);
+        while(batch != NULL) {
+            MongoWriteOp next = batch->next;
+            int64_t waited = (int64_t) (executed.tv_sec-batch->enqueued.tv_sec)*1000000000LL + (executed.tv_nsec-batch->enqueued.tv_nsec);
+            if(writer->latency != NULL && waited >= 0)
+                LatencyHistogram_record(writer->latency, (uint64_t) waited);
+            if(batch->tag != NULL && writer->written_callback != NULL)
+                writer->written_callback(writer->callback_context, batch->tag, !batch->failed);
+            free_MongoWriteOp(batch);
+            batch = next;
+        }
+        
+        pthread_mutex_lock(&writer->lock);
+        writer->inflight_min_seq[thread_arg->index] = 0;
+        if(failed < count)
+            writer->batches_written++;
+        writer->writes_written += count-failed;
+        writer->writes_failed += failed;
+        pthread_cond_broadcast(&writer->progress);
+    }
+    pthread_mutex_unlock(&writer->lock);
+    
+    bson_destroy(bulk_opts);
+    if(client != NULL) {
+        mongoc_collection_destroy(collection);
+        MongoDBClientHolder_pushClient(writer->holder, client);
+    }
+    return NULL;
+}
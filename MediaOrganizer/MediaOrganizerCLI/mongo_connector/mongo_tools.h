@@ -9,21 +9,119 @@
 #define mongo_tools_h
 
 #include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <time.h>
+#include <errno.h>
+#include <stdint.h>
+#include <pthread.h>
 #include <mongoc/mongoc.h>
+#include "metrics.h"
+#include "logger.h"
+
+//server error code when the collection being created already exists
+#define MONGO_ERROR_NAMESPACE_EXISTS 48
 
 typedef struct MongoDBClientHolder *MongoDBClientHolder;
 struct MongoDBClientHolder {
+    mongoc_uri_t *uri;
+    mongoc_client_pool_t *pool;
     mongoc_database_t *database;
     mongoc_client_t *client;
     const char* db_name;
     mongoc_collection_t *files_collection;
     mongoc_collection_t *uploads_collection;
+    const char* files_collection_name;
+    const char* uploads_collection_name;
+    //client is not thread safe, hold this around any use of it or its collections from more than one thread
+    pthread_mutex_t lock;
 };
 extern void freeDBClientHolder(MongoDBClientHolder holder);
 
 extern MongoDBClientHolder new_MongoDBClientHolder(const char* uri_string, const char* db_name);
 
+extern mongoc_client_t* MongoDBClientHolder_popClient(MongoDBClientHolder holder);
+extern void MongoDBClientHolder_pushClient(MongoDBClientHolder holder, mongoc_client_t *client);
+
 extern int createDefaultMongoDBCollections(MongoDBClientHolder dbclient_holder);
 extern int createMongoDBCollections(MongoDBClientHolder dbclient_holder, const char* files_collection_name, const char* upload_group_name, const char* events_name);
 
+typedef struct MongoWriteOp *MongoWriteOp;
+typedef enum {
+    MONGO_WRITE_INSERT,
+    MONGO_WRITE_UPDATE_ONE
+} MongoWriteOpType;
+struct MongoWriteOp {
+    MongoWriteOpType type;
+    bson_t *document;   //document to insert, or the update
+    bson_t *selector;   //NULL for inserts
+    void* tag;  //handed to the writer's written callback, NULL for none
+    bool failed;    //set by the bulk execute for a write the server rejected
+    uint64_t seq;
+    struct timespec enqueued;
+    MongoWriteOp next;
+};
+extern void free_MongoWriteOp(MongoWriteOp op);
+
+//Write-behind queue for one collection. Callers enqueue writes and return immediately; thread_count
+//writer threads, each with its own pooled client, drain the queue in bulk operations of up to batch_size
+//writes. A partial batch is sent once its oldest write has waited flush_interval_ms. With max_queued set,
+//enqueueing blocks while that many writes are waiting, so a slow server holds back the callers instead of
+//the queue growing without bound
+typedef struct MongoBatchWriter *MongoBatchWriter;
+typedef struct MongoBatchWriterThreadArg *MongoBatchWriterThreadArg;
+//Called from a writer thread once the batch holding a tagged write has been executed (or failed)
+typedef void (*MongoBatchWriterCallback)(void* context, void* tag, bool written);
+//Stands in for the bulk operation: executes the count writes linked from batch. Called from the writer threads.
+//false fails every write of the batch, setting failed on some of them fails only those
+typedef bool (*MongoBatchWriterExecuteFn)(void* context, MongoWriteOp batch, size_t count, bson_error_t *error);
+struct MongoBatchWriterThreadArg {
+    MongoBatchWriter writer;
+    int index;
+};
+struct MongoBatchWriter {
+    MongoDBClientHolder holder;
+    const char* collection_name;
+    size_t batch_size;
+    unsigned int flush_interval_ms;
+    
+    MongoWriteOp head;
+    MongoWriteOp tail;
+    size_t queued;
+    size_t max_queued;  //0 for no limit, set before the first write
+    size_t peak_queued; //high water mark
+    uint64_t next_seq;
+    int flush_requests;
+    
+    int thread_count;
+    pthread_t *threads;
+    struct MongoBatchWriterThreadArg *thread_args;
+    uint64_t *inflight_min_seq;     //lowest seq in each thread's current batch, 0 when idle
+    
+    MongoBatchWriterCallback written_callback;  //NULL for none, set before the first tagged write
+    void* callback_context;
+    MongoBatchWriterExecuteFn execute;  //NULL to send bulk operations to the collection
+    void* execute_context;
+    LatencyHistogram latency;   //time from enqueue until a write's batch was executed, NULL to skip timing
+    LatencyHistogram execute_latency;   //time each bulk execute takes, failed ones count as errors. NULL to skip timing
+    
+    size_t batches_written;
+    size_t writes_written;
+    size_t writes_failed;
+    
+    pthread_mutex_t lock;
+    pthread_cond_t has_work;
+    pthread_cond_t progress;
+    bool running;
+};
+extern MongoBatchWriter new_MongoBatchWriter(MongoDBClientHolder holder, const char* collection_name, size_t batch_size, unsigned int flush_interval_ms, int thread_count);
+//Batches go to execute instead of a server, e.g. to measure the pipeline without MongoDB's latency
+extern MongoBatchWriter new_MongoBatchWriterWithSink(MongoBatchWriterExecuteFn execute, void* execute_context, size_t batch_size, unsigned int flush_interval_ms, int thread_count);
+extern void free_MongoBatchWriter(MongoBatchWriter writer);
+
+//tag is passed to written_callback once the write has been executed, it may be NULL
+extern bool MongoBatchWriter_insert(MongoBatchWriter writer, const bson_t *document, void* tag);
+extern bool MongoBatchWriter_updateOne(MongoBatchWriter writer, const bson_t *selector, const bson_t *update, void* tag);
+extern bool MongoBatchWriter_flush(MongoBatchWriter writer);
+
 #endif /* mongo_tools_h */
@@ -7,160 +7,638 @@
 
 #include "organizer.h"
 
+//Pipeline stages. Scan runs on the DirWalker threads in organizeDir and feeds:
+//metadata -> hash -> copy -> preview extract -> thumbnail encode -> DB writer
+//Each stage has its own bounded input queue so no stage can run ahead of the others without limit
+void* new_OrganizerThreadContext(void* organizer) {
+    OrganizerThreadContext context = new_OrganizerCopyThreadContext(organizer);
+    if(context==NULL)
+        return NULL;
+    context->image_context = new_ImageContext();
+    if(context->image_context == NULL) {
+        free_OrganizerThreadContext(context);
+        return NULL;
+    }
+    context->image_context->io = context->io;
+    memcpy(context->image_context->thumb_sizes, context->organizer->thumb_sizes, sizeof(context->organizer->thumb_sizes));
+    context->image_context->thumb_size_count = context->organizer->thumb_size_count;
+    context->image_context->thumb_quality = context->organizer->thumb_quality;
+    return context;
+}
+
+//Only the I/O backend, with registered buffers for copying
+void* new_OrganizerCopyThreadContext(void* organizer) {
+    OrganizerThreadContext context = malloc(sizeof(struct OrganizerThreadContext));
+    if(context==NULL)
+        return NULL;
+    context->organizer = organizer;
+    context->image_context = NULL;
+    context->io = new_IOBackend(context->organizer->use_io_uring, IO_BACKEND_COPY_BUFFERS);
+    if(context->io == NULL) {
+        free(context);
+        return NULL;
+    }
+    return context;
+}
+
+void free_OrganizerThreadContext(void* thread_context) {
+    OrganizerThreadContext context = thread_context;
+    if(context == NULL)
+        return;
+    if(context->image_context != NULL)
+        free_ImageContext(context->image_context);
+    free_IOBackend(context->io);
+    free(context);
+}
+
+void* new_OrganizerHashContext(void* organizer) {
+    OrganizerHashContext context = malloc(sizeof(struct OrganizerHashContext));
+    if(context==NULL)
+        return NULL;
+    context->organizer = organizer;
+    context->client = NULL;
+    context->files_collection = NULL;
+    context->buffer = malloc(CONTENT_HASH_BUFFER_SIZE);
+    if(context->buffer == NULL) {
+        free(context);
+        return NULL;
+    }
+    MongoDBClientHolder holder = context->organizer->dbclient_holder;
+    if(context->organizer->skip_duplicates && context->organizer->db_writer != NULL && holder != NULL) {
+        context->client = MongoDBClientHolder_popClient(holder);
+        context->files_collection = mongoc_client_get_collection(context->client, holder->db_name, holder->files_collection_name);
+    }
+    return context;
+}
+
+void free_OrganizerHashContext(void* thread_context) {
+    OrganizerHashContext context = thread_context;
+    if(context == NULL)
+        return;
+    if(context->client != NULL) {
+        mongoc_collection_destroy(context->files_collection);
+        MongoDBClientHolder_pushClient(context->organizer->dbclient_holder, context->client);
+    }
+    free(context->buffer);
+    free(context);
+}
+
+//Journal record for the stage a file just reached
+static void MediaFile_journalRecord(MediaFile file, IngestStage stage, IngestJournalRecord record) {
+    memset(record, 0, sizeof(struct IngestJournalRecord));
+    record->key.device = file->device;
+    record->key.inode = file->inode;
+    record->key.size = file->size;
+    record->key.modify_time = file->modify_time;
+    record->content_hash = file->content_hash;
+    record->hashed = file->hashed;
+    record->stage = stage;
+}
+
+static void organizerJournal(Organizer organizer, MediaFile file, IngestStage stage) {
+    if(organizer->journal == NULL)
+        return;
+    struct IngestJournalRecord record;
+    MediaFile_journalRecord(file, stage, &record);
+    IngestJournal_record(organizer->journal, &record);
+    file->journal_stage = stage;
+}
+
+//Tag for a MongoBatchWriter write that stores the file. NULL without a journal
+static IngestJournalRecord organizerStoredTag(Organizer organizer, MediaFile file) {
+    if(organizer->journal == NULL)
+        return NULL;
+    IngestJournalRecord record = malloc(sizeof(struct IngestJournalRecord));
+    if(record != NULL)
+        MediaFile_journalRecord(file, INGEST_STAGE_STORED, record);
+    return record;
+}
+
+//MongoBatchWriter callback: the file only counts as stored once its write has been executed.
+//Tags are only handed out while an upload has a journal, and the upload flushes the writer before closing it
+static void organizerJournalStored(void* organizer, void* tag, bool written) {
+    IngestJournal journal = ((Organizer) organizer)->journal;
+    if(written && journal != NULL)
+        IngestJournal_record(journal, tag);
+    free(tag);
+}
+
+void* OrganizerStage_metadata(void* thread_context, void* item) {
+    Organizer organizer = thread_context;
+    MediaFile file = item;
+    if(!MediaFile_setExtension(organizer, file)) {
+        Log(LOG_LEVEL_INFO, "Skipping %s\n", file->filepath);
+        free_MediaFile(file);
+        return NULL;
+    }
+    //EXIF params and capture date straight from the header pages, LibRAW only fills in what this can't read
+    struct tm capture_date;
+    time_t capture_time = 0;
+    capture_date.tm_mday = 0;
+    //files from the watcher are only stat'd below, their device isn't known yet
+    DeviceQueue source_queue = file->stat_known ? DeviceLimiter_acquire(organizer->devices, file->device) : NULL;
+    uint64_t started = Metrics_now();
+    ImageData image = new_ImageData(file->name, file->filepath);
+    if(image != NULL && RAW_readHeaderParams(image, &capture_date, &capture_time) == 0)
+        file->image = image;
+    else if(image != NULL)
+        free_ImageData(image);
+    LatencyHistogram_recordCall(organizer->timings.exif, started, file->image != NULL);
+    DeviceLimiter_release(organizer->devices, source_queue);
+    started = Metrics_now();
+    bool has_metadata = MediaFile_setMetadata(file, capture_date.tm_mday != 0 ? &capture_date : NULL, capture_time);
+    LatencyHistogram_recordCall(organizer->timings.set_metadata, started, has_metadata);
+    if(!has_metadata) {
+        Log(LOG_LEVEL_INFO, "Skipping %s\n", file->filepath);
+        free_MediaFile(file);
+        return NULL;
+    }
+    //an interrupted ingest already stored this file, or got part of the way
+    if(organizer->journal != NULL) {
+        struct IngestJournalKey key = {file->device, file->inode, file->size, file->modify_time};
+        struct IngestJournalRecord record;
+        file->journal_stage = IngestJournal_lookup(organizer->journal, &key, &record);
+        if(file->journal_stage == INGEST_STAGE_STORED) {
+            free_MediaFile(file);
+            return NULL;
+        }
+        if(file->journal_stage != INGEST_STAGE_NONE && record.hashed) {
+            file->content_hash = record.content_hash;
+            file->hashed = true;
+        }
+    }
+    if(!MediaFile_setDestinationPath(organizer, file)) {
+        Log(LOG_LEVEL_INFO, "Skipping %s\n", file->filepath);
+        free_MediaFile(file);
+        return NULL;
+    }
+    bson_oid_init (&file->mongo_objectID, NULL);
+    return file;
+}
+
+//Looks up a files document with the same content, and the upload that stored it (left unset if it has none).
+//Uses the hash stage thread's own pooled client
+static bool findExistingFile(OrganizerHashContext context, MediaFile file, bson_oid_t *existing_oid, bson_oid_t *existing_upload_oid, bool *has_upload) {
+    char hash_hex[CONTENT_HASH_HEX_SIZE];
+    ContentHash_toHex(file->content_hash, hash_hex);
+    bson_t *filter = BCON_NEW("content_hash", BCON_UTF8(hash_hex), "size", BCON_INT64(file->size));
+    bson_t *opts = BCON_NEW("projection", "{", "_id", BCON_BOOL(true), "upload_id", BCON_BOOL(true), "}", "limit", BCON_INT64(1));
+    mongoc_cursor_t *cursor = mongoc_collection_find_with_opts(context->files_collection, filter, opts, NULL);
+    const bson_t *doc;
+    bson_iter_t iter;
+    bool found = false;
+    if(mongoc_cursor_next(cursor, &doc) && bson_iter_init_find(&iter, doc, "_id") && BSON_ITER_HOLDS_OID(&iter)) {
+        bson_oid_copy(bson_iter_oid(&iter), existing_oid);
+        found = true;
+        *has_upload = bson_iter_init_find(&iter, doc, "upload_id") && BSON_ITER_HOLDS_OID(&iter);
+        if(*has_upload)
+            bson_oid_copy(bson_iter_oid(&iter), existing_upload_oid);
+    }
+    bson_error_t error;
+    if(mongoc_cursor_error(cursor, &error))
+        Log(LOG_LEVEL_ERROR, "Duplicate lookup failed for %s: %s\n", file->filepath, error.message);
+    mongoc_cursor_destroy(cursor);
+    bson_destroy(filter);
+    bson_destroy(opts);
+    return found;
+}
+
+//Streams the source once to hash it. A file already in the library is linked to this upload and goes no further
+//Files resumed from the journal keep their journaled hash, but are still looked up: their document may have been
+//stored just before the interruption. Nothing is read when duplicates aren't skipped, the copy is the only read then
+void* OrganizerStage_hash(void* thread_context, void* item) {
+    OrganizerHashContext context = thread_context;
+    MediaFile file = item;
+    if(context == NULL || !context->organizer->skip_duplicates)
+        return file;
+    if(!file->hashed) {
+        int fd = open(file->filepath, O_RDONLY);
+        if(fd < 0)
+            return file;
+#if !defined(__APPLE__) && !defined(__FreeBSD__)
+        posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+#endif
+        DeviceQueue source_queue = DeviceLimiter_acquire(context->organizer->devices, file->device);
+        file->hashed = ContentHash_file(fd, context->buffer, CONTENT_HASH_BUFFER_SIZE, &file->content_hash);
+        DeviceLimiter_release(context->organizer->devices, source_queue);
+        close(fd);
+    }
+    
+    bson_oid_t existing_oid, existing_upload_oid;
+    bool has_upload = false;
+    if(!file->hashed || context->files_collection == NULL || !findExistingFile(context, file, &existing_oid, &existing_upload_oid, &has_upload))
+        return file;
+    bson_t *selector = BCON_NEW("_id", BCON_OID(&existing_oid));
+    //documents stored before upload_ids existed only have upload_id, which goes into the array too so it lists every upload
+    bson_t *update = has_upload
+        ? BCON_NEW("$addToSet", "{", "upload_ids", "{", "$each", "[", BCON_OID(&existing_upload_oid), BCON_OID(&context->organizer->upload_oid), "]", "}", "}")
+        : BCON_NEW("$addToSet", "{", "upload_ids", BCON_OID(&context->organizer->upload_oid), "}");
+    IngestJournalRecord tag = organizerStoredTag(context->organizer, file);
+    if(!MongoBatchWriter_updateOne(context->organizer->db_writer, selector, update, tag))
+        free(tag);
+    bson_destroy(selector);
+    bson_destroy(update);
+    Log(LOG_LEVEL_INFO, "Already in library, skipping %s\n", file->filepath);
+    free_MediaFile(file);
+    return NULL;
+}
+
+void* OrganizerStage_copy(void* thread_context, void* item) {
+    OrganizerThreadContext context = thread_context;
+    MediaFile file = item;
+    if(file->journal_stage >= INGEST_STAGE_COPIED)
+        return file;
+    struct FileCopyResult copy;
+    DeviceLimiter devices = context != NULL ? context->organizer->devices : NULL;
+    DeviceQueue source_queue = NULL, destination_queue = NULL;
+    if(devices != NULL)
+        DeviceLimiter_acquirePair(devices, file->device, context->organizer->destination_device, &source_queue, &destination_queue);
+    //without a context the copy still happens, with blocking I/O
+    uint64_t started = Metrics_now();
+    bool copied = copyFile(context != NULL ? context->io : NULL, file->filepath, file->destination_dirfd, file->name, &copy);
+    if(context != NULL)
+        LatencyHistogram_recordCall(context->organizer->timings.copy_file, started, copied);
+    DeviceLimiter_release(devices, source_queue);
+    DeviceLimiter_release(devices, destination_queue);
+    if(!copied) {
+        Log(LOG_LEVEL_ERROR, "Could not copy %s to %s (%lld bytes copied)\n", file->filepath, file->destination_path, (long long) copy.bytes);
+        file->copy_failed = true;
+        return file;
+    }
+    if(context != NULL) {
+        organizerJournal(context->organizer, file, INGEST_STAGE_COPIED);
+        if(context->organizer->report_interval > 0)
+            Log(LOG_LEVEL_INFO, "copied %s: %lld bytes in %.3fs, %.1f MB/s (%s)\n", file->name, (long long) copy.bytes, copy.seconds, FileCopy_bytesPerSecond(&copy)/1e6, FileCopy_methodName(copy.method));
+    }
+    return file;
+}
+
+void* OrganizerStage_extractPreview(void* thread_context, void* item) {
+    OrganizerThreadContext context = thread_context;
+    MediaFile file = item;
+    if(context == NULL || file->copy_failed)
+        return file;
+    //files the metadata stage read EXIF params from already have their ImageData
+    ImageData previews_data = file->image != NULL ? file->image : new_ImageData(file->name,file->filepath);
+    if(previews_data == NULL)
+        return file;
+    uint64_t started = Metrics_now();
+    int result = RAW_initializeDataHolder(previews_data, context->image_context);
+    LatencyHistogram_recordCall(context->organizer->timings.raw_init, started, result == 0);
+    if(result != 0) {
+        if(file->image == NULL)
+            free_ImageData(previews_data);
+        return file;
+    }
+    file->image = previews_data;
+    //LibRAW is still opened above for files with a preview, it is where the preview comes from
+    if(file->journal_stage >= INGEST_STAGE_PREVIEWED)
+        file->prev_path = MediaFile_getPreviewPath(context->organizer, file, "prev", previews_data->prev_extension);
+    else if(generatePreviewForMediaFile(context->organizer, file, previews_data, context->image_context) == 0)
+        organizerJournal(context->organizer, file, INGEST_STAGE_PREVIEWED);
+    return file;
+}
+
+void* OrganizerStage_encodeThumbnail(void* thread_context, void* item) {
+    OrganizerThreadContext context = thread_context;
+    MediaFile file = item;
+    if(context == NULL || file->copy_failed || file->image == NULL || file->image->preview == NULL)
+        return file;
+    if(file->journal_stage >= INGEST_STAGE_THUMBNAILED)
+        MediaFile_setThumbnailPaths(context->organizer, file, file->image, context->image_context);
+    else if(generateThumbnailForMediaFile(context->organizer, file, file->image, context->image_context) == 0)
+        organizerJournal(context->organizer, file, INGEST_STAGE_THUMBNAILED);
+    //only the EXIF params are needed from here on, release the embedded preview
+    RAW_releasePreview(file->image);
+    return file;
+}
+
+//All of a file's fields go out as one document. The MongoBatchWriter only queues it, so this stage never waits on the network
+void* OrganizerStage_writeDB(void* thread_context, void* item) {
+    Organizer organizer = thread_context;
+    MediaFile file = item;
+    //a document would point at a missing or truncated copy. Left out, the file is processed again when the upload is resumed
+    if(file->copy_failed) {
+        atomic_fetch_add(&organizer->failed_files, 1);
+        free_MediaFile(file);
+        return NULL;
+    }
+    if(organizer->db_writer != NULL) {
+        uint64_t started = Metrics_now();
+        bson_t *file_doc = MediaFile_createDocument(organizer, file);
+        IngestJournalRecord tag = organizerStoredTag(organizer, file);
+        bool queued = MongoBatchWriter_insert(organizer->db_writer, file_doc, tag);
+        if(!queued)
+            free(tag);
+        bson_destroy(file_doc);
+        LatencyHistogram_recordCall(organizer->timings.upload_exif, started, queued);
+    } else {
+        organizerJournal(organizer, file, INGEST_STAGE_STORED);
+    }
+    free_MediaFile(file);
+    return NULL;
+}
+
+//DirWalker callback. Runs on the walker threads and blocks whenever the pipeline is full.
+//A directory's files become one MediaFileBatch
+static bool organizerSubmitFiles(void* context, DirWalkerEntry entries, size_t count) {
+    Organizer organizer = context;
+    MediaFileBatch batch = new_MediaFileBatch(count);
+    if(batch == NULL)
+        return false;
+    bool result = true;
+    for(size_t i=0; i<count && result; i++) {
+        MediaFile file = MediaFileBatch_add(batch, entries[i].name, entries[i].path);
+        if(file == NULL) {
+            result = false;
+            break;
+        }
+        file->size = entries[i].size;
+        file->birth_time = entries[i].birth_time;
+        file->modify_time = entries[i].modify_time;
+        file->device = entries[i].device;
+        file->inode = entries[i].inode;
+        file->stat_known = true;
+        if(organizer->read_scheduler != NULL) {
+            result = ReadScheduler_add(organizer->read_scheduler, file, entries[i].dirfd, entries[i].name, file->device, file->inode);
+        } else if(!Pipeline_submit(organizer->pipeline, file)) {
+            free_MediaFile(file);
+            result = false;
+        }
+    }
+    MediaFileBatch_release(batch);
+    return result;
+}
+
+//Submits one file found by the watcher, the metadata stage stats it
+bool organizeFile(Organizer organizer, char* file_path) {
+    const char* name = strrchr(file_path, '/');
+    MediaFileBatch batch = new_MediaFileBatch(1);
+    if(batch == NULL)
+        return false;
+    MediaFile file = MediaFileBatch_add(batch, name != NULL ? name+1 : file_path, file_path);
+    bool result = file != NULL && Pipeline_submit(organizer->pipeline, file);
+    if(file != NULL && !result)
+        free_MediaFile(file);
+    MediaFileBatch_release(batch);
+    return result;
+}
+
+//ReadSchedulerSubmitFn, files come in the order they are read from the device
+static bool organizerSubmitScheduled(void* organizer, void* file) {
+    if(Pipeline_submit(((Organizer) organizer)->pipeline, file))
+        return true;
+    free_MediaFile(file);
+    return false;
+}
+
+//ReadSchedulerDiscardFn, for files left once the pipeline stopped taking them
+static void organizerDiscardScheduled(void* organizer, void* file) {
+    free_MediaFile(file);
+}
+
+//Walks dir_path in parallel and submits every file to the pipeline
 bool organizeDir(Organizer organizer, char* dir_path) {
-    DIR* dir = opendir(dir_path);
+    DirWalker walker = new_DirWalker(organizer->scan_thread_count, organizerSubmitFiles, organizer);
+    if(walker == NULL)
+        return false;
+    walker->latency = Metrics_histogram(organizer->metrics, "scan");
+    if(organizer->order_reads) {
+        organizer->read_scheduler = new_ReadScheduler(organizer->read_order_window, organizerSubmitScheduled, organizerDiscardScheduled, organizer);
+        if(organizer->read_scheduler == NULL) {
+            free_DirWalker(walker);
+            return false;
+        }
+    }
+    bool result = DirWalker_walk(walker, dir_path);
+    free_DirWalker(walker);
+    if(organizer->read_scheduler != NULL) {
+        result = ReadScheduler_flush(organizer->read_scheduler) && result;
+        if(organizer->report_interval > 0)
+            Log(LOG_LEVEL_INFO, "read order: %zu files by device offset, %zu by inode number\n", organizer->read_scheduler->extent_positions, organizer->read_scheduler->inode_positions);
+        free_ReadScheduler(organizer->read_scheduler);
+        organizer->read_scheduler = NULL;
+    }
+    return result;
+}
+
+//Runs on the main thread once the MongoBatchWriter is flushed, so it uses the holder's own client
+static void markUploadComplete(Organizer organizer, bool completed) {
+    if(organizer->dbclient_holder == NULL)
+        return;
+    bson_error_t error;
+    bson_t *selector = BCON_NEW("_id", BCON_OID(&organizer->upload_oid));
+    bson_t *update = BCON_NEW("$set", "{", "completed", BCON_BOOL(completed), "}");
+    pthread_mutex_lock(&organizer->dbclient_holder->lock);
+    if(!mongoc_collection_update_one(organizer->dbclient_holder->uploads_collection, selector, update, NULL, NULL, &error)) {
+        Log(LOG_LEVEL_ERROR, "%s\n", error.message);
+    }
+    pthread_mutex_unlock(&organizer->dbclient_holder->lock);
+    bson_destroy(selector);
+    bson_destroy(update);
+}
 
-    MediaFileListNode node = new_MediaFileListNode(NULL);
-    MediaFileListNode first_node = node;
+//Creates the upload entry (or picks up an interrupted one from the journal) for the files submitted until organizerEndUpload
+static void organizerBeginUpload(Organizer organizer) {
+    bson_oid_init (&organizer->upload_oid, NULL);
+    atomic_store(&organizer->failed_files, 0);
+    //an interrupted ingest of the same source is continued under its upload id
+    organizer->journal = new_IngestJournal(organizer->destination_path, organizer->source_path, organizer->resume, organizer->upload_oid.bytes);
+    bool resumed = organizer->journal != NULL && organizer->journal->resumed;
+    if(resumed) {
+        char oid_string[25];
+        bson_oid_to_string(&organizer->upload_oid, oid_string);
+        Log(LOG_LEVEL_INFO, "Resuming upload %s, %zu files in its journal\n", oid_string, organizer->journal->loaded);
+    }
+    if(organizer->db_writer == NULL || organizer->dbclient_holder == NULL)
+        return;
+    //create upload entry
+    bson_error_t error;
+    bson_t reply;
+    
+    struct timeval tv;
+    gettimeofday(&tv, NULL);
     
-    mongoc_bulk_operation_t *bulk = NULL;
-    bson_oid_t upload_oid;
+    unsigned long long millisecondsSinceEpoch =
+        (unsigned long long)(tv.tv_sec) * 1000 +
+        (unsigned long long)(tv.tv_usec) / 1000;
     
-    if(organizer->dbclient_holder != NULL && organizer->dbclient_holder->uploads_collection != NULL && organizer->dbclient_holder->files_collection != NULL) {
-        //create upload entry
-        bson_error_t error;
-        bson_t reply;
-        
+    bool upload_created;
+    pthread_mutex_lock(&organizer->dbclient_holder->lock);
+    if(resumed) {
+        //the interrupted run normally created it already
+        bson_t *selector = BCON_NEW("_id", BCON_OID(&organizer->upload_oid));
+        bson_t *update = BCON_NEW("$setOnInsert", "{", "time", BCON_DATE_TIME(millisecondsSinceEpoch), "completed", BCON_BOOL(false), "}");
+        bson_t *opts = BCON_NEW("upsert", BCON_BOOL(true));
+        upload_created = mongoc_collection_update_one(organizer->dbclient_holder->uploads_collection, selector, update, opts, &reply, &error);
+        bson_destroy(selector);
+        bson_destroy(update);
+        bson_destroy(opts);
+    } else {
         bson_t *upload_doc = bson_new();
-        
-        bson_oid_init (&upload_oid, NULL);
-        BSON_APPEND_OID (upload_doc, "_id", &upload_oid);
-        
-        struct timeval tv;
-        gettimeofday(&tv, NULL);
-        
-        unsigned long long millisecondsSinceEpoch =
-            (unsigned long long)(tv.tv_sec) * 1000 +
-            (unsigned long long)(tv.tv_usec) / 1000;
+        BSON_APPEND_OID (upload_doc, "_id", &organizer->upload_oid);
         BSON_APPEND_DATE_TIME(upload_doc, "time", millisecondsSinceEpoch);
-        
-        if(!mongoc_collection_insert_one(organizer->dbclient_holder->uploads_collection, upload_doc, NULL, &reply, &error)) {
-            fprintf(stderr, "%s\n", error.message);
-        }
-
+        BSON_APPEND_BOOL(upload_doc, "completed", false);
+        upload_created = mongoc_collection_insert_one(organizer->dbclient_holder->uploads_collection, upload_doc, NULL, &reply, &error);
         bson_destroy(upload_doc);
-        
-        //begin bulk entry of files
-        bulk = mongoc_collection_create_bulk_operation_with_opts(organizer->dbclient_holder->files_collection, NULL);
     }
+    pthread_mutex_unlock(&organizer->dbclient_holder->lock);
+    if(!upload_created) {
+        Log(LOG_LEVEL_ERROR, "%s\n", error.message);
+    }
+    bson_destroy(&reply);
+}
+
+//Waits for every submitted file to be processed and stored, then closes the upload. Returns whether it completed
+static bool organizerEndUpload(Organizer organizer, bool result) {
+    Pipeline_drain(organizer->pipeline);
+    size_t failed_files = atomic_load(&organizer->failed_files);
+    if(failed_files > 0)
+        Log(LOG_LEVEL_WARNING, "%zu files could not be copied\n", failed_files);
+    bool completed = result && failed_files == 0;
+    if(organizer->db_writer != NULL) {
+        //every file document must be stored before the upload is marked complete
+        bool stored = MongoBatchWriter_flush(organizer->db_writer);
+        completed = stored && completed;
+        markUploadComplete(organizer, completed);
+    }
+    //an incomplete ingest keeps its journal so the next run picks up from it
+    if(organizer->journal != NULL) {
+        if(completed)
+            IngestJournal_finish(organizer->journal);
+        free_IngestJournal(organizer->journal);
+        organizer->journal = NULL;
+    }
+    return completed;
+}
+
+//Each stage records into the histogram of the same name, so the numbers add up across daemon batches
+static bool organizerTimeStages(Organizer organizer, Pipeline pipeline) {
+    for(int i=0; i<pipeline->stage_count; i++)
+        pipeline->stages[i].latency = Metrics_histogram(organizer->metrics, pipeline->stages[i].name);
+    return true;
+}
+
+//Starts the DB writer and the pipeline threads, with their per-thread LibRAW/libjpeg contexts and pooled clients.
+//They stay up across uploads until organizerStop
+static bool organizerStart(Organizer organizer) {
+    //copies are limited on the destination's device as well as the source's
+    struct stat destination_stat;
+    if(stat(organizer->destination_path, &destination_stat) != 0) {
+        Log(LOG_LEVEL_ERROR, "Could not stat %s: %s\n", organizer->destination_path, strerror(errno));
+        return false;
+    }
+    organizer->destination_device = destination_stat.st_dev;
+    organizer->devices = new_DeviceLimiter(organizer->device_depth);
+    if(organizer->devices == NULL)
+        return false;
+    organizer->devices->wait_latency = Metrics_histogram(organizer->metrics, "device_wait");
     
-    struct dirent *dp;
-    while((dp = readdir(dir)) != NULL) {
-        if(strcmp(dp->d_name, ".") != 0 && strcmp(dp->d_name, "..") != 0 && strcmp(dp->d_name, ".DS_Store") != 0) {
-            //if dir, organize subdirectory
-            DIR* o_dir = opendir(dp->d_name);
-            if(o_dir != NULL) {
-                size_t new_dir_path_size = strlen(dir_path)+strlen(dp->d_name)+2;
-                char new_dir_path[new_dir_path_size];
-                snprintf(new_dir_path, new_dir_path_size, "%s/%s", dir_path, dp->d_name);
-                if(!organizeDir(organizer, new_dir_path)) {
-                    printf("organize dir recursion failed");
-                    free_MediaFileListNode(first_node);
-                    //DO ERR Handling here
-                    return false;
-                }
-                closedir(o_dir);
-            }
-            size_t mediafile_path_size = strlen(dir_path)+strlen(dp->d_name)+2;
-            char mediafile_path[mediafile_path_size];
-            snprintf(mediafile_path, mediafile_path_size, "%s/%s", dir_path, dp->d_name);
-            //initialize MediaFile struct and set values properly
-            MediaFile file = new_MediaFile(dp->d_name, mediafile_path);
-            if(!MediaFile_setExtension(file)) {
-                //TODO: error handling
-                free_MediaFile(file);
-                free_MediaFileListNode(first_node);
-                return false;
-            }
-            if(!MediaFile_setMetadata(file)) {
-                free_MediaFile(file);
-                free_MediaFileListNode(first_node);
-                //TODO: error handling
-                return false;
-            }
-            if(!MediaFile_setDestinationPath(organizer, file)) {
-                free_MediaFile(file);
-                free_MediaFileListNode(first_node);
-                //TODO: error handling
-                return false;
-            }
-            MediaFileListNode new_node = new_MediaFileListNode(file);
-            if(new_node == NULL) {
-                printf("Fatal err: Could not allocate memory to create MediaFileListNode!");
-                
-                free_MediaFile(file);
-                free_MediaFileListNode(first_node);
-                return false;
-            }
-            node->next = new_node;
-            node = new_node;
-
-            if(organizer->dbclient_holder != NULL && bulk != NULL) {
-                bson_oid_init (&file->mongo_objectID, NULL);
-                bson_t *file_doc = BCON_NEW("_id",BCON_OID(&file->mongo_objectID),
-                                            "path",BCON_UTF8(file->destination_path),
-                                            "time",BCON_DATE_TIME(file->date->unix_time*1000),
-                                            "name",BCON_UTF8(file->name),
-                                            "extension",BCON_UTF8(file->extension),
-                                            "upload_id",BCON_OID(&upload_oid),
-                                            "size",BCON_INT64(file->size),
-                                            "upload_complete",BCON_BOOL(false));
-                mongoc_bulk_operation_insert(bulk,file_doc);
-                bson_destroy(file_doc);
-            }
-        }
+    if(organizer->db_sink != NULL)
+        organizer->db_writer = new_MongoBatchWriterWithSink(organizer->db_sink, organizer->db_sink_context, organizer->db_batch_size, organizer->db_flush_interval_ms, organizer->db_thread_count);
+    else if(organizer->dbclient_holder != NULL && organizer->dbclient_holder->uploads_collection != NULL && organizer->dbclient_holder->files_collection != NULL)
+        organizer->db_writer = new_MongoBatchWriter(organizer->dbclient_holder, organizer->dbclient_holder->files_collection_name, organizer->db_batch_size, organizer->db_flush_interval_ms, organizer->db_thread_count);
+    if(organizer->db_writer != NULL) {
+        organizer->db_writer->written_callback = organizerJournalStored;
+        organizer->db_writer->callback_context = organizer;
+        organizer->db_writer->latency = Metrics_histogram(organizer->metrics, "store");
+        organizer->db_writer->execute_latency = Metrics_histogram(organizer->metrics, "bulk_execute");
+        //a limit below one batch would leave every batch waiting out the flush interval
+        if(organizer->db_queue_limit > 0)
+            organizer->db_writer->max_queued = organizer->db_queue_limit > organizer->db_batch_size ? organizer->db_queue_limit : organizer->db_batch_size;
     }
-    if(bulk != NULL) {
-        bson_t reply;
-        bson_error_t error;
-        if(mongoc_bulk_operation_execute(bulk, &reply, &error)) {
-            char *str = bson_as_canonical_extended_json(&reply, NULL);
-               printf("%s\n", str);
-               bson_free(str);
-        } else {
-            fprintf (stderr, "Error: %s\n", error.message);
-            free_MediaFileListNode(first_node);
-            return false;
+    
+    Pipeline pipeline = new_Pipeline(ORGANIZER_QUEUE_CAPACITY);
+    if(pipeline == NULL) {
+        if(organizer->db_writer != NULL) {
+            free_MongoBatchWriter(organizer->db_writer);
+            organizer->db_writer = NULL;
         }
-        bson_destroy(&reply);
-        mongoc_bulk_operation_destroy(bulk);
+        free_DeviceLimiter(organizer->devices);
+        organizer->devices = NULL;
+        return false;
     }
-    closedir(dir);
-    //TODO: PROCESS THUMB+PREVIEW THREAD SPLIT HERE
-    MediaFileListNode original_holder_node = first_node;
-    first_node = first_node->next;
-    while(first_node != NULL) {
-        generatePreviewForMediaFile(organizer,first_node->file);
-        generateThumbnailForMediaFile(organizer,first_node->file);
-        copyFile(first_node->file->filepath, first_node->file->destination_path);
-        
-        //do mongo update
-        if(organizer->dbclient_holder != NULL) {
-            bson_error_t error;
-            bson_t reply;
-            bson_t *query = BCON_NEW("_id",BCON_OID(&first_node->file->mongo_objectID));
-            bson_t *update = BCON_NEW("$set",
-                                      "{",
-                                      "upload_complete",BCON_BOOL(true),
-                                      "}");
-            if(!mongoc_collection_update_one(organizer->dbclient_holder->files_collection, query, update, NULL, &reply, &error)) {
-                fprintf (stderr, "%s\n", error.message);
-            } else {
-                char *str = bson_as_canonical_extended_json(&reply, NULL);
-                printf("%s\n", str);
-                bson_free(str);
-            }
-            bson_destroy(query);
-            bson_destroy(update);
+    pipeline->report_interval = organizer->report_interval;
+    int thread_count = organizer->thread_count > 0 ? organizer->thread_count : 1;
+    int io_thread_count = organizer->io_thread_count > 0 ? organizer->io_thread_count : 1;
+    //every stage reading the source keeps to one thread, a second reader would seek away from the sweep the files were ordered for
+    int reader_count = organizer->order_reads ? 1 : io_thread_count;
+    if(!Pipeline_addStage(pipeline, "metadata", reader_count, OrganizerStage_metadata, NULL, NULL, organizer)
+       || !Pipeline_addStage(pipeline, "hash", reader_count, OrganizerStage_hash, new_OrganizerHashContext, free_OrganizerHashContext, organizer)
+       || !Pipeline_addStage(pipeline, "copy", reader_count, OrganizerStage_copy, new_OrganizerCopyThreadContext, free_OrganizerThreadContext, organizer)
+       || !Pipeline_addStage(pipeline, "preview", thread_count, OrganizerStage_extractPreview, new_OrganizerThreadContext, free_OrganizerThreadContext, organizer)
+       || !Pipeline_addStage(pipeline, "thumbnail", thread_count, OrganizerStage_encodeThumbnail, new_OrganizerThreadContext, free_OrganizerThreadContext, organizer)
+       || !Pipeline_addStage(pipeline, "db", 1, OrganizerStage_writeDB, NULL, NULL, organizer)
+       || !organizerTimeStages(organizer, pipeline)
+       || !Pipeline_start(pipeline)) {
+        fprintf(stderr, "Could not start processing pipeline\n");
+        if(organizer->db_writer != NULL) {
+            free_MongoBatchWriter(organizer->db_writer);
+            organizer->db_writer = NULL;
         }
-        first_node = first_node->next;
+        free_Pipeline(pipeline);
+        free_DeviceLimiter(organizer->devices);
+        organizer->devices = NULL;
+        return false;
     }
-    free_MediaFileListNode(original_holder_node);
+    organizer->pipeline = pipeline;
+    if(organizer->metrics_directory != NULL)
+        Metrics_startExport(organizer->metrics, organizer->metrics_directory, organizer->metrics_interval);
     return true;
 }
 
+static void organizerStop(Organizer organizer) {
+    Pipeline_finish(organizer->pipeline);
+    if(organizer->db_writer != NULL) {
+        if(organizer->report_interval > 0)
+            fprintf(stderr, "db writer: %zu documents in %zu bulk writes, %zu failed, at most %zu queued\n", organizer->db_writer->writes_written, organizer->db_writer->batches_written, organizer->db_writer->writes_failed, organizer->db_writer->peak_queued);
+        free_MongoBatchWriter(organizer->db_writer);
+        organizer->db_writer = NULL;
+    }
+    if(organizer->report_interval > 0) {
+        Pipeline_printSummary(organizer->pipeline, stderr);
+        DeviceLimiter_printSummary(organizer->devices, stderr);
+    }
+    free_Pipeline(organizer->pipeline);
+    organizer->pipeline = NULL;
+    free_DeviceLimiter(organizer->devices);
+    organizer->devices = NULL;
+    //final snapshot, with everything the run recorded
+    Metrics_stopExport(organizer->metrics);
+}
+
 bool organize(Organizer organizer) {
-    return organizeDir(organizer, organizer->source_path);
+    if(!organizerStart(organizer))
+        return false;
+    organizerBeginUpload(organizer);
+    bool result = organizeDir(organizer, organizer->source_path);
+    result = organizerEndUpload(organizer, result);
+    organizerStop(organizer);
+    return result;
+}
+
+//Daemon mode: every batch from the watcher is organized as its own upload, through the same pipeline threads
+bool organizeWatch(Organizer organizer, Watcher watcher) {
+    if(!organizerStart(organizer))
+        return false;
+    Log(LOG_LEVEL_INFO, "Watching for new files\n");
+    WatcherBatch batch;
+    while((batch = Watcher_next(watcher)) != NULL) {
+        Log(LOG_LEVEL_INFO, "Organizing %zu new files and folders\n", batch->count);
+        organizerBeginUpload(organizer);
+        bool result = true;
+        for(size_t i=0; i<batch->count; i++) {
+            if(batch->entries[i].is_directory)
+                result = organizeDir(organizer, batch->entries[i].path) && result;
+            else
+                result = organizeFile(organizer, batch->entries[i].path) && result;
+        }
+        if(!organizerEndUpload(organizer, result))
+            Log(LOG_LEVEL_WARNING, "Upload did not complete, it is resumed with the next batch\n");
+        free_WatcherBatch(batch);
+    }
+    organizerStop(organizer);
+    return true;
 }
 
 Organizer new_Organizer(char* source, char* destination, MongoDBClientHolder dbclient_holder) {
@@ -178,9 +656,68 @@ Organizer new_Organizer(char* source, char* destination, MongoDBClientHolder dbc
         free(organizer);
         return NULL;
     }
+    organizer->destination_dirs = new_DirCache(destination);
+    if(organizer->destination_dirs == NULL) {
+        closedir(organizer->source);
+        closedir(organizer->destination);
+        free(organizer);
+        return NULL;
+    }
+    organizer->strings = new_StringPool();
+    if(organizer->strings == NULL) {
+        free_DirCache(organizer->destination_dirs);
+        closedir(organizer->source);
+        closedir(organizer->destination);
+        free(organizer);
+        return NULL;
+    }
+    organizer->metrics = new_Metrics();
+    if(organizer->metrics == NULL) {
+        free_StringPool(organizer->strings);
+        free_DirCache(organizer->destination_dirs);
+        closedir(organizer->source);
+        closedir(organizer->destination);
+        free(organizer);
+        return NULL;
+    }
+    organizer->timings.exif = Metrics_histogram(organizer->metrics, "exif");
+    organizer->timings.set_metadata = Metrics_histogram(organizer->metrics, "set_metadata");
+    organizer->timings.copy_file = Metrics_histogram(organizer->metrics, "copy_file");
+    organizer->timings.raw_init = Metrics_histogram(organizer->metrics, "raw_init");
+    organizer->timings.raw_thumbs = Metrics_histogram(organizer->metrics, "raw_thumbs");
+    organizer->timings.upload_exif = Metrics_histogram(organizer->metrics, "upload_exif");
+    organizer->metrics_directory = NULL;
+    organizer->metrics_interval = ORGANIZER_METRICS_INTERVAL;
     organizer->source_path = strdup(source);
     organizer->destination_path = strdup(destination);
     organizer->dbclient_holder = dbclient_holder;
+    organizer->db_sink = NULL;
+    organizer->db_sink_context = NULL;
+    long cores = sysconf(_SC_NPROCESSORS_ONLN);
+    organizer->thread_count = cores > 0 ? (int) cores : 1;
+    organizer->io_thread_count = ORGANIZER_IO_THREADS;
+    organizer->device_depth = 0;
+    organizer->devices = NULL;
+    organizer->report_interval = 0;
+    organizer->pipeline = NULL;
+    organizer->db_writer = NULL;
+    organizer->db_batch_size = ORGANIZER_DB_BATCH_SIZE;
+    organizer->db_flush_interval_ms = ORGANIZER_DB_FLUSH_INTERVAL_MS;
+    organizer->db_thread_count = ORGANIZER_DB_THREADS;
+    organizer->db_queue_limit = ORGANIZER_DB_QUEUE_LIMIT;
+    organizer->scan_thread_count = ORGANIZER_SCAN_THREADS;
+    organizer->order_reads = false;
+    organizer->read_order_window = ORGANIZER_READ_ORDER_WINDOW;
+    organizer->read_scheduler = NULL;
+    organizer->use_io_uring = false;
+    organizer->skip_duplicates = true;
+    organizer->resume = true;
+    organizer->thumb_sizes[0] = IMAGE_THUMB_SIZE;
+    organizer->thumb_sizes[1] = IMAGE_THUMB_TINY_SIZE;
+    organizer->thumb_size_count = 2;
+    organizer->thumb_quality = IMAGE_THUMB_QUALITY;
+    organizer->journal = NULL;
+    atomic_init(&organizer->failed_files, 0);
     return organizer;
 }
 void free_Organizer(Organizer organizer) {
@@ -188,74 +725,143 @@ void free_Organizer(Organizer organizer) {
     closedir(organizer->source);
     free(organizer->destination_path);
     closedir(organizer->destination);
+    free_DirCache(organizer->destination_dirs);
+    free_StringPool(organizer->strings);
+    free_Metrics(organizer->metrics);
     //assuming dbclientholder freed elsewhere
     free(organizer);
 }
 
-//MediaFile functions
-MediaFile new_MediaFile(char* name, char* filepath) {
-    MediaFile file = (MediaFile) malloc(sizeof(struct MediaFile));
-    if(file==NULL) {
-        //TODO: DO ERROR HANDLING HERE
-        printf("MEDIAFILE NULL");
+//MediaFileBatch functions
+//The batch struct, the records and their strings all come out of one arena
+MediaFileBatch new_MediaFileBatch(size_t capacity) {
+    Arena arena = new_Arena(sizeof(struct MediaFileBatch)+capacity*(sizeof(struct MediaFile)+ORGANIZER_FILE_STRING_BYTES));
+    if(arena == NULL)
+        return NULL;
+    MediaFileBatch batch = Arena_alloc(arena, sizeof(struct MediaFileBatch));
+    MediaFile files = batch != NULL ? Arena_alloc(arena, capacity*sizeof(struct MediaFile)) : NULL;
+    if(files == NULL) {
+        free_Arena(arena);
         return NULL;
     }
-    file->name = strdup(name);
-    file->filepath = strdup(filepath);
-    file->date = NULL;
+    batch->arena = arena;
+    batch->files = files;
+    batch->count = 0;
+    batch->capacity = capacity;
+    batch->refs = 1;
+    pthread_mutex_init(&batch->lock, NULL);
+    return batch;
+}
+
+void MediaFileBatch_release(MediaFileBatch batch) {
+    pthread_mutex_lock(&batch->lock);
+    bool last = --batch->refs == 0;
+    pthread_mutex_unlock(&batch->lock);
+    if(last) {
+        pthread_mutex_destroy(&batch->lock);
+        free_Arena(batch->arena);
+    }
+}
+
+//Next record of the batch, NULL once it is full. The metadata stage sets the rest of its values
+MediaFile MediaFileBatch_add(MediaFileBatch batch, const char* name, const char* filepath) {
+    if(batch->count == batch->capacity)
+        return NULL;
+    MediaFile file = &batch->files[batch->count];
+    file->batch = batch;
+    file->name = MediaFile_strdup(file, name);
+    file->filepath = MediaFile_strdup(file, filepath);
+    if(file->name == NULL || file->filepath == NULL)
+        return NULL;
+    file->destination_dir = NULL;
     file->destination_path = NULL;
+    file->destination_dirfd = -1;
     file->extension = NULL;
+    file->prev_path = NULL;
+    file->thumb_count = 0;
+    file->image = NULL;
+    file->size = 0;
+    file->birth_time = 0;
+    file->stat_known = false;
+    file->device = 0;
+    file->inode = 0;
+    file->modify_time = 0;
+    file->journal_stage = INGEST_STAGE_NONE;
+    file->content_hash = 0;
+    file->hashed = false;
+    file->copy_failed = false;
+    pthread_mutex_lock(&batch->lock);
+    batch->count++;
+    batch->refs++;
+    pthread_mutex_unlock(&batch->lock);
     return file;
 }
 
+//MediaFile functions
+//Copies str into the file's batch. Any stage may call it, files of the same batch are in several stages at once
+char* MediaFile_strdup(MediaFile file, const char* str) {
+    pthread_mutex_lock(&file->batch->lock);
+    char* copy = Arena_strdup(file->batch->arena, str);
+    pthread_mutex_unlock(&file->batch->lock);
+    return copy;
+}
+
+//The record and its strings stay in the batch until its last file is freed
 void free_MediaFile(MediaFile file) {
     if(file != NULL) {
-        if(file->date != NULL)
-            free_MediaFileDate(file->date);
-        free(file->name);
-        free(file->filepath);
-        if(file->destination_path != NULL)
-            free(file->destination_path);
-        if(file->extension != NULL)
-            free(file->extension);
-        free(file);
-    }
-}
-
-bool MediaFile_setExtension(MediaFile file) {
-    int length = (int) strlen(file->name);
-    int dot_location = -1;
-    for(int i=length-1; i>=0; i--) {
-        if (file->name[i]=='.') {
-            dot_location = i;
-            break;
-        }
-    }
-    if(dot_location == -1) {
-        return false;
+        if(file->image != NULL)
+            free_ImageData(file->image);
+        file->image = NULL;
+        MediaFileBatch_release(file->batch);
     }
-    file->extension = malloc(length-dot_location);
-    memcpy(file->extension, &file->name[dot_location+1], length-dot_location);
-    file->extension[length-dot_location-1] = '\0';
-    str_tolower(file->extension);
-    return true;
 }
 
-bool MediaFile_setMetadata(MediaFile file) {
-    struct stat filestat;
-    if(stat(file->filepath, &filestat)) {
-        printf("stat error at %s",file->filepath);
-        //TODO: DO ERROR HANDLING HERE
-        printf("%s",strerror(errno));
+//Extensions are interned, every file of a kind shares one lower case copy
+bool MediaFile_setExtension(Organizer organizer, MediaFile file) {
+    const char* dot = strrchr(file->name, '.');
+    if(dot == NULL)
         return false;
+    char extension[strlen(dot)];
+    memcpy(extension, dot+1, sizeof(extension));
+    str_tolower(extension);
+    file->extension = StringPool_intern(organizer->strings, extension);
+    return file->extension != NULL;
+}
+
+//capture_date is the EXIF capture date if the file has one, else the folders follow the file's birth time
+bool MediaFile_setMetadata(MediaFile file, const struct tm *capture_date, time_t capture_time) {
+    //files found by the directory walk were already stat'd there
+    if(!file->stat_known) {
+        struct stat filestat;
+        if(stat(file->filepath, &filestat)) {
+            Log(LOG_LEVEL_WARNING, "stat error at %s: %s\n", file->filepath, strerror(errno));
+            return false;
+        }
+        file->size = filestat.st_size;
+#if defined(__APPLE__) || defined(__FreeBSD__)
+        file->birth_time = filestat.st_birthtimespec.tv_sec;
+#else
+        //stat has no birth time on Linux, the same fallback as the directory walk
+        file->birth_time = filestat.st_mtime;
+#endif
+        file->modify_time = filestat.st_mtime;
+        file->device = filestat.st_dev;
+        file->inode = filestat.st_ino;
+        file->stat_known = true;
+    }
+    //localtime_r since files are stat'd from several pipeline threads
+    struct tm time_buf;
+    struct tm *time = &time_buf;
+    time_t unix_time = file->birth_time;
+    if(capture_date != NULL) {
+        time_buf = *capture_date;
+        unix_time = capture_time;
+    } else {
+        time = localtime_r(&file->birth_time, &time_buf);
     }
-    struct tm *time = localtime(&filestat.st_birthtimespec.tv_sec);
-    size_t day_size = (int)log10(time->tm_mday)+2;
-    char day[day_size];
-    char year[5];
     const char* month = "Unknown";
-    snprintf(day, day_size, "%d", time->tm_mday);
-    snprintf(year, 5, "%d", time->tm_year+1900);
+    snprintf(file->date.day, sizeof(file->date.day), "%d", time->tm_mday);
+    snprintf(file->date.year, sizeof(file->date.year), "%d", time->tm_year+1900);
     switch(time->tm_mon) {
         case 0:
             month="January";
@@ -296,81 +902,27 @@ bool MediaFile_setMetadata(MediaFile file) {
         default:
             month="Unknown";
     }
-    char* day_copy = strdup(day);
-    char* year_copy = strdup(year);
-    file->date = new_MediaFileDate(month, day_copy, year_copy, filestat.st_birthtimespec.tv_sec);
-    if(file->date == NULL) {
-        free(day_copy);
-        free(year_copy);
-        return false;
-    }
-    file->size = filestat.st_size;
+    file->date.month = month;
+    file->date.unix_time = unix_time;
     return true;
 }
 
+//The Year/Month/Day/ext folder comes from the organizer's DirCache, so it is only created (and opened) for the first file in it
 bool MediaFile_setDestinationPath(Organizer organizer, MediaFile file) {
-    if(!createSubDirIfNotExist(organizer->destination_path,file->date->year))
-        return NULL;
-    //+2 1 for '/' char and 1 for '\0' char
-    size_t year_dir_path_size = strlen(organizer->destination_path)+strlen(file->date->year)+2;
-    char year_dir_path[year_dir_path_size];
-    snprintf(year_dir_path, year_dir_path_size, "%s/%s", organizer->destination_path, file->date->year);
-    if(!createSubDirIfNotExist(year_dir_path, file->date->month))
-        return NULL;
-    size_t month_dir_path_size = strlen(year_dir_path)+strlen(file->date->month)+2;
-    char month_dir_path[month_dir_path_size];
-    snprintf(month_dir_path, month_dir_path_size, "%s/%s", year_dir_path, file->date->month);
-    if(!createSubDirIfNotExist(month_dir_path, file->date->day))
-        return NULL;
-    size_t day_dir_path_size = strlen(month_dir_path)+strlen(file->date->day)+2;
-    char day_dir_path[day_dir_path_size];
-    snprintf(day_dir_path,day_dir_path_size, "%s/%s", month_dir_path, file->date->day);
-    
-    createSubDirIfNotExist(day_dir_path, file->extension);
-    size_t ext_dir_path_size = strlen(day_dir_path)+strlen(file->extension)+2;
-    char ext_dir_path[ext_dir_path_size];
-    snprintf(ext_dir_path,ext_dir_path_size, "%s/%s", day_dir_path, file->extension);
+    //+4 for the three '/' chars and '\0'
+    size_t ext_dir_size = strlen(file->date.year)+strlen(file->date.month)+strlen(file->date.day)+strlen(file->extension)+4;
+    char ext_dir[ext_dir_size];
+    snprintf(ext_dir, ext_dir_size, "%s/%s/%s/%s", file->date.year, file->date.month, file->date.day, file->extension);
+    file->destination_dir = StringPool_intern(organizer->strings, ext_dir);
+    file->destination_dirfd = DirCache_get(organizer->destination_dirs, ext_dir);
+    if(file->destination_dir == NULL || file->destination_dirfd < 0)
+        return false;
     
-    size_t destination_path_size = strlen(ext_dir_path)+strlen(file->name)+2;
+    size_t destination_path_size = strlen(organizer->destination_path)+strlen(ext_dir)+strlen(file->name)+3;
     char destination_path[destination_path_size];
-    snprintf(destination_path,destination_path_size, "%s/%s", ext_dir_path, file->name);
-    file->destination_path = strdup(destination_path);
-    return true;
-}
-
-MediaFileDate new_MediaFileDate(const char* month, char* day, char* year, __darwin_time_t unix_time) {
-    MediaFileDate date = (MediaFileDate) malloc(sizeof(struct MediaFileDate));
-    if(date==NULL) {
-        printf("DATE NULL");
-        return NULL;
-    }
-    date->month = month;
-    date->day = day;
-    date->year = year;
-    date->unix_time = unix_time;
-    return date;
-}
-void free_MediaFileDate(MediaFileDate date) {
-    free(date->day);
-    free(date->year);
-    free(date);
-}
-
-MediaFileListNode new_MediaFileListNode(MediaFile value) {
-    MediaFileListNode node = (MediaFileListNode) malloc(sizeof(struct MediaFileListNode));
-    if(node==NULL) {
-        printf("node NULL");
-        return NULL;
-    }
-    node->file = value;
-    node->next = NULL;
-    return node;
-}
-void free_MediaFileListNode(MediaFileListNode node) {
-    free_MediaFile(node->file);
-    if(node->next != NULL)
-        free_MediaFileListNode(node->next);
-    free(node);
+    snprintf(destination_path,destination_path_size, "%s/%s/%s", organizer->destination_path, ext_dir, file->name);
+    file->destination_path = MediaFile_strdup(file, destination_path);
+    return file->destination_path != NULL;
 }
 
 //Directory helper functions
@@ -410,31 +962,33 @@ bool createSubDirIfNotExist(const char* parent_folder_path, const char* path) {
     return true;
 }
 
-//copyfile function with different fns fir macos and linux
-bool copyFile(char* source, char* destination) {
-        //Here we use kernel-space copying for performance reasons
-    #if defined(__APPLE__) || defined(__FreeBSD__)
-        //fcopyfile works on FreeBSD and OS X 10.5+
-        //int result = fcopyfile(input, output, 0, COPYFILE_ALL);
-        int result = copyfile(source, destination, 0, COPYFILE_ALL);
-    #else
-        //sendfile will work with non-socket output (i.e. regular file) on Linux 2.6.33+
-        int input, output;
-        if ((input = open(source, O_RDONLY)) == -1) {
-            return -1;
-        }
-        if ((output = creat(destination, 0777)) == -1) {
-            close(input);
-            return -1;
-        }
-        off_t bytesCopied = 0;
-        struct stat fileinfo = {0};
-        fstat(input, &fileinfo);
-        int result = sendfile(output, input, &bytesCopied, fileinfo.st_size);
+//copyfile function with different fns fir macos and linux, see FileCopy_copy
+//destination is opened relative to its already open folder
+bool copyFile(IOBackend io, char* source, int destination_dirfd, const char* destination_name, FileCopyResult result) {
+    result->method = FILE_COPY_NONE;
+    result->bytes = 0;
+    result->seconds = 0;
+    int input, output;
+    if ((input = open(source, O_RDONLY)) == -1) {
+        return false;
+    }
+    struct stat fileinfo;
+    if(fstat(input, &fileinfo) != 0) {
         close(input);
-        close(output);
-    #endif
-        return !result;
+        return false;
+    }
+    if ((output = openat(destination_dirfd, destination_name, O_WRONLY | O_CREAT | O_TRUNC, 0777)) == -1) {
+        close(input);
+        return false;
+    }
+    bool copied = FileCopy_copy(io, input, output, fileinfo.st_size, result);
+    close(input);
+    if(close(output) != 0)
+        copied = false;
+    //a partial copy would look like the real file to the next run
+    if(!copied)
+        unlinkat(destination_dirfd, destination_name, 0);
+    return copied;
 }
 
 
@@ -445,205 +999,170 @@ void str_tolower(char* str) {
     }
 }
 
-int generatePreviewForMediaFile(Organizer organizer, MediaFile file) {
-    ImageData previews_data = new_ImageData(file->name,file->filepath);
-    RAW_initializeDataHolder(previews_data);
-    if(previews_data==NULL)
-        return -1;
+//Returns "<destination folder>/preview/<name>.<kind>.<extension>", creating the preview folder if needed.
+//The path belongs to the file's batch
+char* MediaFile_getPreviewPath(Organizer organizer, MediaFile file, const char* kind, const char* extension) {
+    //preview folder relative to the destination root, resolved through the DirCache
+    size_t preview_dir_size = strlen(file->destination_dir)+strlen("/preview")+1;
+    char preview_dir[preview_dir_size];
+    snprintf(preview_dir, preview_dir_size, "%s/preview", file->destination_dir);
+    if(DirCache_get(organizer->destination_dirs, preview_dir) < 0)
+        return NULL;
+    
+    //-1 for '.'
+    size_t name_noextension_length = strlen(file->name)-1-strlen(file->extension);
+    //3 for '/' after the root and '.' around kind, 2 for '/' and '.' before extension, 1 for '\0'
+    size_t output_path_size = strlen(organizer->destination_path)+preview_dir_size+name_noextension_length+strlen(kind)+strlen(extension)+6;
+    char output_path[output_path_size];
+    snprintf(output_path, output_path_size, "%s/%s/%.*s.%s.%s", organizer->destination_path, preview_dir, (int)name_noextension_length, file->name, kind, extension);
+    return MediaFile_strdup(file, output_path);
+}
 
-    int length = (int) strlen(file->destination_path);
-    int slash_location = -1;
-    for(int i=length-1; i>=0; i--) {
-        if (file->destination_path[i]=='/') {
-            slash_location = i;
-            break;
-        }
-    }
-    if(slash_location == -1) {
-        return -1;
-    }
-    char *containing_folder = malloc(sizeof(char)*(slash_location+2));
-    memcpy(containing_folder, &file->destination_path[0], slash_location+1);
-    containing_folder[slash_location+1] = '\0';
-    if(!createSubDirIfNotExist(containing_folder, "preview")) {
-        free(containing_folder);
+int generatePreviewForMediaFile(Organizer organizer, MediaFile file, ImageData previews_data, ImageContext context) {
+    char* prev_output_path = MediaFile_getPreviewPath(organizer, file, "prev", previews_data->prev_extension);
+    if(prev_output_path == NULL)
         return -2;
+    //no prev_path for a preview that isn't there, it would be stored and journaled as written
+    if(RAW_createPreviewFile(previews_data, context, prev_output_path) != 0) {
+        Log(LOG_LEVEL_ERROR, "Could not write preview %s\n", prev_output_path);
+        return -3;
     }
-        
-    //-1 for '.' +1 for '\0'
-    char* name_noextension = malloc(sizeof(char)*(strlen(file->name)-strlen(file->extension)));
-    memcpy(name_noextension,&file->name[0],strlen(file->name)-1-strlen(file->extension));
-    //-1 for . +1 for '\0'
-    name_noextension[strlen(file->name)-1-strlen(file->extension)] = '\0';
-    
-    //8=strlen("preview/")
-    //5=strlen(".prev")
-    //1=strlen(".") then strlen(previews_data->prev_extension)
-    //1 +1 for ending
-    size_t prev_output_path_size = strlen(containing_folder)+strlen(name_noextension)+strlen(previews_data->prev_extension)+15;
-    char prev_output_path[prev_output_path_size];
-
-    snprintf(prev_output_path, prev_output_path_size, "%spreview/%s.prev.%s",containing_folder,name_noextension, previews_data->prev_extension);
-    RAW_createPreviewFile(previews_data, prev_output_path);
-    
-    //Insert path into MongoDB
-    if(organizer->dbclient_holder != NULL) {
-        bson_error_t error;
-        bson_t reply;
-        bson_t *query = BCON_NEW("_id",BCON_OID(&file->mongo_objectID));
-        bson_t *update = BCON_NEW("$set",
-                                  "{",
-                                  "prev_path",BCON_UTF8(prev_output_path),
-                                  "}");
-        if(!mongoc_collection_update_one(organizer->dbclient_holder->files_collection, query, update, NULL, &reply, &error)) {
-            fprintf (stderr, "%s\n", error.message);
-        } else {
-            char *str = bson_as_canonical_extended_json(&reply, NULL);
-            printf("%s\n", str);
-            bson_free(str);
+    file->prev_path = prev_output_path;
+    return 0;
+}
+
+//the paths stay in the batch's arena until it is released
+static void MediaFile_clearThumbnails(MediaFile file) {
+    file->thumb_count = 0;
+}
+
+//Works out which thumbnail sizes the file gets and their paths, without encoding anything.
+//The main thumbnail is "<name>.thumb.<ext>", the other sizes "<name>.thumb<size>.<ext>"
+int MediaFile_setThumbnailPaths(Organizer organizer, MediaFile file, ImageData previews_data, ImageContext context) {
+    //bitmap previews were encoded to JPEG when they were extracted, only one that failed to convert is still a PPM
+    int count = RAW_planThumbnails(previews_data, context, file->thumbs);
+    if(count <= 0)
+        return -3;
+    for(int i=0; i<count; i++) {
+        char kind[16] = "thumb";
+        if(i > 0)
+            snprintf(kind, sizeof(kind), "thumb%d", file->thumbs[i].size);
+        file->thumb_paths[i] = MediaFile_getPreviewPath(organizer, file, kind, previews_data->prev_extension);
+        if(file->thumb_paths[i] == NULL) {
+            MediaFile_clearThumbnails(file);
+            return -2;
         }
-        bson_destroy(query);
-        bson_destroy(update);
+        file->thumb_count = i+1;
     }
-    
-    free(containing_folder);
-    free(name_noextension);
-    free_ImageData(previews_data);
     return 0;
 }
 
-int generateThumbnailForMediaFile(Organizer organizer, MediaFile file) {
-    ImageData previews_data = new_ImageData(file->name,file->filepath);
-    RAW_initializeDataHolder(previews_data);
-    if(previews_data==NULL)
-        return -1;
+int generateThumbnailForMediaFile(Organizer organizer, MediaFile file, ImageData previews_data, ImageContext context) {
+    int result = MediaFile_setThumbnailPaths(organizer, file, previews_data, context);
+    if(result != 0)
+        return result;
+    uint64_t started = Metrics_now();
+    result = RAW_createThumbFiles(previews_data, context, file->thumbs, file->thumb_paths, file->thumb_count);
+    LatencyHistogram_recordCall(organizer->timings.raw_thumbs, started, result == 0);
+    if(result != 0) {
+        MediaFile_clearThumbnails(file);
+        return -3;
+    }
+    return 0;
+}
 
-    int length = (int) strlen(file->destination_path);
-    int slash_location = -1;
-    for(int i=length-1; i>=0; i--) {
-        if (file->destination_path[i]=='/') {
-            slash_location = i;
-            break;
-        }
+//Full files collection document for a processed file. Caller destroys
+bson_t* MediaFile_createDocument(Organizer organizer, MediaFile file) {
+    bson_t *file_doc = BCON_NEW("_id",BCON_OID(&file->mongo_objectID),
+                                "path",BCON_UTF8(file->destination_path),
+                                "time",BCON_DATE_TIME(file->date.unix_time*1000),
+                                "name",BCON_UTF8(file->name),
+                                "extension",BCON_UTF8(file->extension),
+                                "upload_id",BCON_OID(&organizer->upload_oid),
+                                "upload_ids","[",BCON_OID(&organizer->upload_oid),"]",
+                                "size",BCON_INT64(file->size),
+                                "upload_complete",BCON_BOOL(true));
+    if(file->hashed) {
+        char hash_hex[CONTENT_HASH_HEX_SIZE];
+        ContentHash_toHex(file->content_hash, hash_hex);
+        BSON_APPEND_UTF8(file_doc, "content_hash", hash_hex);
     }
-    if(slash_location == -1) {
-        return -1;
+    if(file->prev_path != NULL)
+        BSON_APPEND_UTF8(file_doc, "prev_path", file->prev_path);
+    if(file->thumb_count > 0) {
+        BSON_APPEND_UTF8(file_doc, "thumb_path", file->thumb_paths[0]);
+        bson_t *thumbs_array = createThumbnailsArray(file);
+        BSON_APPEND_ARRAY(file_doc, "thumbnails", thumbs_array);
+        bson_destroy(thumbs_array);
     }
-    
-    char *containing_folder = malloc(sizeof(char)*(slash_location+2));
-    memcpy(containing_folder, &file->destination_path[0], slash_location+1);
-    containing_folder[slash_location+1] = '\0';
-    if(!createSubDirIfNotExist(containing_folder, "preview")) {
-        free(containing_folder);
-        return -2;
+    if(file->image != NULL && file->image->params != NULL) {
+        bson_t *exif_doc = createExifDocument(file->image->params);
+        BSON_APPEND_DOCUMENT(file_doc, "exif_data", exif_doc);
+        bson_destroy(exif_doc);
     }
-    // -1 for '.' +1 for '\0'
-    char* name_noextension = malloc(sizeof(char)*(strlen(file->name)-strlen(file->extension)));
-    memcpy(name_noextension,&file->name[0],strlen(file->name)-1-strlen(file->extension));
-    name_noextension[strlen(file->name)-1-strlen(file->extension)] = '\0';
-    
-    //8=strlen("preview/")
-    //6=strlen(".thumb")
-    //1=. then strlen(previews_data->prev_extension)
-    //1 +1 for '\0'
-    size_t prev_output_path_size = strlen(containing_folder)+strlen(name_noextension)+strlen(previews_data->prev_extension)+16;
-    char prev_output_path[prev_output_path_size];
-    if(strcmp(previews_data->prev_extension, "ppm")==0) {
-        free_ImageData(previews_data);
-        printf("No PPM thumb functionality yet\n");
-        free(name_noextension);
-        free(containing_folder);
-        //NO PPM THUMB FUNC YET;
-        return -1;
-    }
-    snprintf(prev_output_path, prev_output_path_size, "%spreview/%s.thumb.%s",containing_folder,name_noextension, previews_data->prev_extension);
-    RAW_createThumbFile(previews_data, prev_output_path);
-
-    //Insert path into MongoDB
-    if(organizer->dbclient_holder != NULL) {
-        bson_error_t error;
-        bson_t reply;
-        bson_t *query = BCON_NEW("_id",BCON_OID(&file->mongo_objectID));
-        bson_t *update = BCON_NEW("$set",
-                                  "{",
-                                  "thumb_path",BCON_UTF8(prev_output_path),
-                                  "}");
-        if(!mongoc_collection_update_one(organizer->dbclient_holder->files_collection, query, update, NULL, &reply, &error)) {
-            fprintf (stderr, "%s\n", error.message);
-        } else {
-            char *str = bson_as_canonical_extended_json(&reply, NULL);
-            printf("%s\n", str);
-            bson_free(str);
+    return file_doc;
+}
+
+//thumbnails array: every size with its dimensions and path, smallest first so clients can take the first that fits.
+//Caller destroys
+bson_t* createThumbnailsArray(MediaFile file) {
+    int order[IMAGE_MAX_THUMB_SIZES];
+    for(int i=0; i<file->thumb_count; i++) {
+        int j = i;
+        while(j > 0 && file->thumbs[order[j-1]].width > file->thumbs[i].width) {
+            order[j] = order[j-1];
+            j--;
         }
-        bson_destroy(query);
-        bson_destroy(update);
+        order[j] = i;
     }
-    uploadExifData(organizer, file, previews_data);
-    free(containing_folder);
-    free(name_noextension);
-    free_ImageData(previews_data);
-    return 0;
+    bson_t *array = bson_new();
+    for(int i=0; i<file->thumb_count; i++) {
+        ImageRendition thumb = &file->thumbs[order[i]];
+        const char *key;
+        char key_buffer[16];
+        bson_uint32_to_string(i, &key, key_buffer, sizeof(key_buffer));
+        bson_t entry;
+        BSON_APPEND_DOCUMENT_BEGIN(array, key, &entry);
+        BSON_APPEND_INT32(&entry, "size", thumb->size);
+        BSON_APPEND_INT32(&entry, "width", thumb->width);
+        BSON_APPEND_INT32(&entry, "height", thumb->height);
+        BSON_APPEND_UTF8(&entry, "path", file->thumb_paths[order[i]]);
+        bson_append_document_end(array, &entry);
+    }
+    return array;
 }
 
-int uploadExifData(Organizer organizer, MediaFile file, ImageData image) {
-    if(image->params == NULL)
-        return -1;
-    bson_error_t error;
-    bson_t reply;
-    
-    char latref_string[2] = {image->params->latitude_ref,'\0'};
-    char longref_string[2] = {image->params->longitude_ref,'\0'};
-    char altref_string[2] = {image->params->altitude_ref, '\0'};
+//exif_data subdocument. Caller destroys
+bson_t* createExifDocument(ImageDataParams params) {
+    char latref_string[2] = {params->latitude_ref,'\0'};
+    char longref_string[2] = {params->longitude_ref,'\0'};
+    char altref_string[2] = {params->altitude_ref, '\0'};
     
-    bson_t *lat_doc = BCON_NEW("degrees",BCON_DOUBLE(image->params->latitude[0]),"minutes",BCON_DOUBLE(image->params->latitude[1]),"seconds",BCON_DOUBLE(image->params->latitude[2]));
+    bson_t *lat_doc = BCON_NEW("degrees",BCON_DOUBLE(params->latitude[0]),"minutes",BCON_DOUBLE(params->latitude[1]),"seconds",BCON_DOUBLE(params->latitude[2]));
     
-    bson_t *long_doc = BCON_NEW("degrees",BCON_DOUBLE(image->params->longitude[0]),"minutes",BCON_DOUBLE(image->params->longitude[1]),"seconds",BCON_DOUBLE(image->params->longitude[2]));
+    bson_t *long_doc = BCON_NEW("degrees",BCON_DOUBLE(params->longitude[0]),"minutes",BCON_DOUBLE(params->longitude[1]),"seconds",BCON_DOUBLE(params->longitude[2]));
     
     bson_t *gps_doc = BCON_NEW(
                                "latitude",BCON_DOCUMENT(lat_doc),
                                "latitude_ref",BCON_UTF8(latref_string),
                                "longitude",BCON_DOCUMENT(long_doc),
                                "longitude_ref",BCON_UTF8(longref_string),
-                               "altitude",BCON_DOUBLE(image->params->altitude),
+                               "altitude",BCON_DOUBLE(params->altitude),
                                "altitude_ref",BCON_UTF8(altref_string));
-    bson_t *doc = BCON_NEW("width",BCON_INT32(image->params->width),
-                           "height",BCON_INT32(image->params->height),
-                           "make",BCON_UTF8(image->params->make),
-                           "model",BCON_UTF8(image->params->model),
-                           "shutter_speed",BCON_DOUBLE(image->params->shutter_speed),
-                           "iso_speed", BCON_DOUBLE(image->params->iso_speed),
-                           "lens",BCON_UTF8(image->params->lensname),
-                           "focal_length",BCON_DOUBLE(image->params->focal_length),
-                           "aperture",BCON_DOUBLE(image->params->aperture),
-                           "flip",BCON_INT32(image->params->flip),
+    bson_t *doc = BCON_NEW("width",BCON_INT32(params->width),
+                           "height",BCON_INT32(params->height),
+                           "make",BCON_UTF8(params->make),
+                           "model",BCON_UTF8(params->model),
+                           "shutter_speed",BCON_DOUBLE(params->shutter_speed),
+                           "iso_speed", BCON_DOUBLE(params->iso_speed),
+                           "lens",BCON_UTF8(params->lensname),
+                           "focal_length",BCON_DOUBLE(params->focal_length),
+                           "aperture",BCON_DOUBLE(params->aperture),
+                           "flip",BCON_INT32(params->flip),
                            "gps_data",BCON_DOCUMENT(gps_doc));
     
-    bson_t *query = BCON_NEW("_id",BCON_OID(&file->mongo_objectID));
-    bson_t *update = BCON_NEW("$set",
-                              "{",
-                              "exif_data",BCON_DOCUMENT(doc),
-                              "}");
-    if(!mongoc_collection_update_one(organizer->dbclient_holder->files_collection, query, update, NULL, &reply, &error)) {
-        fprintf (stderr, "%s\n", error.message);
-        bson_destroy(lat_doc);
-        bson_destroy(long_doc);
-        bson_destroy(gps_doc);
-        bson_destroy(doc);
-        bson_destroy(query);
-        bson_destroy(update);
-        return -2;
-    }
-    
-    char *str = bson_as_canonical_extended_json(&reply, NULL);
-    printf("%s\n", str);
-    bson_free(str);
-    
     bson_destroy(lat_doc);
     bson_destroy(long_doc);
     bson_destroy(gps_doc);
-    bson_destroy(doc);
-    bson_destroy(query);
-    bson_destroy(update);
-    
-    return 0;
+    return doc;
 }
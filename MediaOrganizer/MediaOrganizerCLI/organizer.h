@@ -19,85 +19,219 @@
 #include <dirent.h>
 #include <sys/errno.h>
 #include <ctype.h>
-
-#if defined(__APPLE__) || defined(__FreeBSD__)
-#include <copyfile.h>
-#else
-#include <sys/sendfile.h>
-#endif
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <stdatomic.h>
 
 #include "mongo_tools.h"
 #include "image_tools.h"
+#include "pipeline.h"
+#include "dir_walker.h"
+#include "dir_cache.h"
+#include "read_scheduler.h"
+#include "file_copy.h"
+#include "device_limiter.h"
+#include "content_hash.h"
+#include "ingest_journal.h"
+#include "watcher.h"
+#include "arena.h"
+#include "metrics.h"
+#include "logger.h"
+
+//bounded queue size between pipeline stages
+#define ORGANIZER_QUEUE_CAPACITY 64
+//threads walking the source tree. Directory reads and stats are latency bound, more threads hide it on network shares
+#define ORGANIZER_SCAN_THREADS 4
+//threads per I/O bound stage (metadata, hash, copy). How many of them touch one device at once is up to its
+//DeviceLimiter depth, preview extract and thumbnail encode use Organizer.thread_count
+#define ORGANIZER_IO_THREADS 4
+//files whose reads are ordered together with -p. Larger windows sweep further but hold more files before the first is processed
+#define ORGANIZER_READ_ORDER_WINDOW 4096
+//files per bulk write, and the longest a partial batch waits before it is sent anyway
+#define ORGANIZER_DB_BATCH_SIZE 100
+#define ORGANIZER_DB_FLUSH_INTERVAL_MS 500
+//threads sending bulk writes, each with its own pooled client
+#define ORGANIZER_DB_THREADS 2
+//documents waiting for MongoDB before the pipeline is held back. With the bounded queues between stages this
+//caps the files in flight, however large the source
+#define ORGANIZER_DB_QUEUE_LIMIT 2000
+//seconds between metrics snapshots, e.g. for a long ingest or in daemon mode
+#define ORGANIZER_METRICS_INTERVAL 60
+//arena space planned per file for its name, paths and preview/thumbnail paths. More is chained on if needed
+#define ORGANIZER_FILE_STRING_BYTES 768
 
 typedef struct Organizer *Organizer;
 typedef struct MediaFile *MediaFile;
 typedef struct MediaFileDate *MediaFileDate;
 typedef struct Upload *Upload;
-typedef struct MediaFileListNode *MediaFileListNode;
+typedef struct MediaFileBatch *MediaFileBatch;
+typedef struct OrganizerThreadContext *OrganizerThreadContext;
+typedef struct OrganizerHashContext *OrganizerHashContext;
 
 //path variables must not end in "/"
 
+//Per call timing of the functions on the ingest path, each a histogram in Organizer.metrics looked up once
+struct OrganizerTimings {
+    LatencyHistogram exif;          //EXIF header read (RAW_readHeaderParams)
+    LatencyHistogram set_metadata;  //MediaFile_setMetadata
+    LatencyHistogram copy_file;     //copyFile
+    LatencyHistogram raw_init;      //RAW_initializeDataHolder
+    LatencyHistogram raw_thumbs;    //RAW_createThumbFiles
+    LatencyHistogram upload_exif;   //building a file's document and queueing it for MongoDB
+};
+
 //Organizer struct and functions
 struct Organizer {
     char *source_path;
     DIR* source;
     char *destination_path;
     DIR* destination;
-    MongoDBClientHolder dbclient_holder;
+    DirCache destination_dirs;  //Year/Month/Day/ext(/preview) folders created so far
+    StringPool strings;     //extensions and Year/Month/Day/ext folders, interned for every file
+    MongoDBClientHolder dbclient_holder;   //NULL with db_sink, or to organize without a database
+    MongoBatchWriterExecuteFn db_sink;  //stands in for the files collection when set, e.g. in benchmarks
+    void* db_sink_context;
+    Metrics metrics;    //per file latency of the scan, each stage and the DB writes, kept across runs
+    struct OrganizerTimings timings;
+    char* metrics_directory;    //where Prometheus/JSON snapshots of metrics are written, NULL for none
+    unsigned int metrics_interval;  //seconds between snapshots while organizing, 0 for only one at the end
+    int thread_count;   //threads per CPU bound pipeline stage, defaults to the core count
+    int io_thread_count;    //threads per I/O bound pipeline stage
+    int device_depth;   //files read or written on one device at once, 0 for a depth by the kind of device
+    DeviceLimiter devices;  //set while organizing
+    dev_t destination_device;
+    unsigned int report_interval;   //seconds between queue depth readouts, 0 disables them
+    Pipeline pipeline;
+    bson_oid_t upload_oid;
+    MongoBatchWriter db_writer;
+    size_t db_batch_size;
+    unsigned int db_flush_interval_ms;
+    int db_thread_count;
+    size_t db_queue_limit;  //at least db_batch_size, 0 for no limit
+    int scan_thread_count;
+    bool order_reads;   //submit files in the order their data sits on the device instead of directory order
+    size_t read_order_window;   //files sorted at a time with order_reads, 0 for the whole walk
+    ReadScheduler read_scheduler;   //set while organizeDir walks with order_reads
+    bool use_io_uring;  //output files and cross-device copies go through io_uring when it is compiled in
+    bool skip_duplicates;   //files whose content is already in the library are linked to this upload instead of processed
+    bool resume;    //continue an interrupted ingest from its journal instead of starting over
+    IngestJournal journal;  //progress of the current ingest, NULL if it could not be opened
+    atomic_size_t failed_files;     //files of the current upload that could not be copied, it is not complete while any did
+    int thumb_sizes[IMAGE_MAX_THUMB_SIZES];    //long edges of the thumbnails made per file, the first is the main one
+    int thumb_size_count;
+    int thumb_quality;
 };
 extern Organizer new_Organizer(char* source, char* destination, MongoDBClientHolder dbclient_holder);
 extern void free_Organizer(Organizer organizer);
 
 extern bool organize(Organizer organizer);
 extern bool organizeDir(Organizer organizer, char* dir_path);
+extern bool organizeFile(Organizer organizer, char* file_path);
+extern bool organizeWatch(Organizer organizer, Watcher watcher);
+
+//Pipeline stage functions, see organize()
+struct OrganizerThreadContext {
+    Organizer organizer;
+    ImageContext image_context;     //NULL for the copy stage
+    IOBackend io;
+};
+extern void* new_OrganizerThreadContext(void* organizer);
+extern void* new_OrganizerCopyThreadContext(void* organizer);
+extern void free_OrganizerThreadContext(void* context);
+
+//hash stage state: a read buffer, and a pooled client for the duplicate lookup
+struct OrganizerHashContext {
+    Organizer organizer;
+    unsigned char* buffer;
+    mongoc_client_t *client;
+    mongoc_collection_t *files_collection;
+};
+extern void* new_OrganizerHashContext(void* organizer);
+extern void free_OrganizerHashContext(void* context);
+
+extern void* OrganizerStage_metadata(void* organizer, void* file);
+extern void* OrganizerStage_hash(void* context, void* file);
+extern void* OrganizerStage_copy(void* context, void* file);
+extern void* OrganizerStage_extractPreview(void* context, void* file);
+extern void* OrganizerStage_encodeThumbnail(void* context, void* file);
+extern void* OrganizerStage_writeDB(void* organizer, void* file);
 
 //MediaFile related structs and functions
+struct MediaFileDate {
+    const char *month;
+    char day[3];
+    char year[12];
+    time_t unix_time;
+};
+
+//Strings are owned by the file's batch, or interned in Organizer.strings
 struct MediaFile {
+    MediaFileBatch batch;
     char *name;
     char *filepath;
-    char *extension;
-    MediaFileDate date;
+    const char *extension;  //lower case, interned
+    struct MediaFileDate date;
+    const char *destination_dir;    //"Year/Month/Day/ext" relative to the destination, interned
     char *destination_path;
+    int destination_dirfd;  //owned by Organizer.destination_dirs
     off_t size;
+    time_t birth_time;
+    bool stat_known;    //size, birth_time and the journal key fields were filled in by the directory walk
+    dev_t device;
+    ino_t inode;
+    time_t modify_time;
+    IngestStage journal_stage;  //furthest stage reached, by this run or an interrupted one
+    uint64_t content_hash;  //XXH64 of the file, set by the hash stage
+    bool hashed;
+    bool copy_failed;   //no complete copy was made, the file gets no previews and is not stored
     bson_oid_t mongo_objectID;
+    char *prev_path;    //set by the preview stage
+    char *thumb_paths[IMAGE_MAX_THUMB_SIZES];  //set by the thumbnail stage, the main thumbnail first
+    struct ImageRendition thumbs[IMAGE_MAX_THUMB_SIZES];
+    int thumb_count;
+    ImageData image;    //set by the metadata or preview stage
 };
-extern MediaFile new_MediaFile(char* name, char* sourceDirectory);
+extern char* MediaFile_strdup(MediaFile file, const char* str);
 extern void free_MediaFile(MediaFile file);
 
-extern bool MediaFile_setExtension(struct MediaFile *file);
-extern bool MediaFile_setMetadata(MediaFile file);
+extern bool MediaFile_setExtension(Organizer organizer, MediaFile file);
+extern bool MediaFile_setMetadata(MediaFile file, const struct tm *capture_date, time_t capture_time);
 extern bool MediaFile_setDestinationPath(Organizer organizer, MediaFile file);
 
-struct MediaFileDate {
-    const char *month;
-    char *day;
-    char *year;
-    __darwin_time_t unix_time;
-};
-
-extern MediaFileDate new_MediaFileDate(const char* month, char* day, char* year, __darwin_time_t unix_time);
-extern void free_MediaFileDate(MediaFileDate date);
-
-struct MediaFileListNode {
-    MediaFile file;
-    MediaFileListNode next;
+//Files submitted together, e.g. one directory of the walk. The records are one contiguous array, and they and their
+//strings are carved out of one arena, so the whole batch goes with a single free_Arena once its last file is freed
+struct MediaFileBatch {
+    Arena arena;
+    struct MediaFile *files;
+    size_t count;
+    size_t capacity;
+    int refs;   //files not freed yet, plus one while the batch is being filled
+    pthread_mutex_t lock;   //refs and the arena: strings are added by whichever stage holds a file
 };
-extern MediaFileListNode new_MediaFileListNode(MediaFile value);
-extern void free_MediaFileListNode(MediaFileListNode node);
+extern MediaFileBatch new_MediaFileBatch(size_t capacity);
+extern MediaFile MediaFileBatch_add(MediaFileBatch batch, const char* name, const char* filepath);
+//Drops the reference held while filling the batch
+extern void MediaFileBatch_release(MediaFileBatch batch);
 
 //Directory helper functions
 extern bool validateFolder(char* folder);
 extern bool createSubDirIfNotExist(const char* parent_folder_path, const char* path);
 
 //copyfile function accounting for macOS and Linux
-extern bool copyFile(char* source, char* destination);
+extern bool copyFile(IOBackend io, char* source, int destination_dirfd, const char* destination_name, FileCopyResult result);
 
 //string helper functions
 extern void str_tolower(char* str);
 
-extern int generatePreviewForMediaFile(Organizer organizer, MediaFile file);
-extern int generateThumbnailForMediaFile(Organizer organizer, MediaFile file);
+extern char* MediaFile_getPreviewPath(Organizer organizer, MediaFile file, const char* kind, const char* extension);
+
+extern int generatePreviewForMediaFile(Organizer organizer, MediaFile file, ImageData previews_data, ImageContext context);
+extern int MediaFile_setThumbnailPaths(Organizer organizer, MediaFile file, ImageData previews_data, ImageContext context);
+extern int generateThumbnailForMediaFile(Organizer organizer, MediaFile file, ImageData previews_data, ImageContext context);
 
-extern int uploadExifData(Organizer organizer, MediaFile file, ImageData image);
+extern bson_t* MediaFile_createDocument(Organizer organizer, MediaFile file);
+extern bson_t* createThumbnailsArray(MediaFile file);
+extern bson_t* createExifDocument(ImageDataParams params);
 
 #endif /* organizer_h */
@@ -0,0 +1,312 @@
+//
+//  pipeline.c
+//  MediaOrganizerCLI
+//
+//  Created by John Bridge on 10/17/26.
+//
+
+#include "pipeline.h"
+
+//BoundedQueue functions
+BoundedQueue new_BoundedQueue(size_t capacity) {
+    if(capacity == 0)
+        return NULL;
+    BoundedQueue queue = malloc(sizeof(struct BoundedQueue));
+    if(queue==NULL)
+        return NULL;
+    queue->items = malloc(sizeof(void*)*capacity);
+    if(queue->items==NULL) {
+        free(queue);
+        return NULL;
+    }
+    queue->capacity = capacity;
+    queue->head = 0;
+    queue->count = 0;
+    queue->max_count = 0;
+    queue->closed = false;
+    pthread_mutex_init(&queue->lock, NULL);
+    pthread_cond_init(&queue->not_empty, NULL);
+    pthread_cond_init(&queue->not_full, NULL);
+    return queue;
+}
+
+void free_BoundedQueue(BoundedQueue queue) {
+    pthread_mutex_destroy(&queue->lock);
+    pthread_cond_destroy(&queue->not_empty);
+    pthread_cond_destroy(&queue->not_full);
+    free(queue->items);
+    free(queue);
+}
+
+//returns false if the queue was closed before the item could be added
+bool BoundedQueue_push(BoundedQueue queue, void* item) {
+    pthread_mutex_lock(&queue->lock);
+    while(queue->count == queue->capacity && !queue->closed)
+        pthread_cond_wait(&queue->not_full, &queue->lock);
+    if(queue->closed) {
+        pthread_mutex_unlock(&queue->lock);
+        return false;
+    }
+    queue->items[(queue->head+queue->count)%queue->capacity] = item;
+    queue->count++;
+    if(queue->count > queue->max_count)
+        queue->max_count = queue->count;
+    pthread_cond_signal(&queue->not_empty);
+    pthread_mutex_unlock(&queue->lock);
+    return true;
+}
+
+//returns NULL once the queue is closed and drained
+void* BoundedQueue_pop(BoundedQueue queue) {
+    pthread_mutex_lock(&queue->lock);
+    while(queue->count == 0 && !queue->closed)
+        pthread_cond_wait(&queue->not_empty, &queue->lock);
+    if(queue->count == 0) {
+        pthread_mutex_unlock(&queue->lock);
+        return NULL;
+    }
+    void* item = queue->items[queue->head];
+    queue->head = (queue->head+1)%queue->capacity;
+    queue->count--;
+    pthread_cond_signal(&queue->not_full);
+    pthread_mutex_unlock(&queue->lock);
+    return item;
+}
+
+//no more pushes are accepted, consumers drain what is left
+void BoundedQueue_close(BoundedQueue queue) {
+    pthread_mutex_lock(&queue->lock);
+    queue->closed = true;
+    pthread_cond_broadcast(&queue->not_empty);
+    pthread_cond_broadcast(&queue->not_full);
+    pthread_mutex_unlock(&queue->lock);
+}
+
+size_t BoundedQueue_depth(BoundedQueue queue) {
+    pthread_mutex_lock(&queue->lock);
+    size_t depth = queue->count;
+    pthread_mutex_unlock(&queue->lock);
+    return depth;
+}
+
+//Pipeline functions
+Pipeline new_Pipeline(size_t queue_capacity) {
+    Pipeline pipeline = malloc(sizeof(struct Pipeline));
+    if(pipeline==NULL)
+        return NULL;
+    pipeline->stage_count = 0;
+    pipeline->queue_capacity = queue_capacity > 0 ? queue_capacity : 1;
+    pipeline->started = false;
+    pipeline->in_flight = 0;
+    pthread_mutex_init(&pipeline->idle_lock, NULL);
+    pthread_cond_init(&pipeline->idle, NULL);
+    pipeline->report_interval = 0;
+    pipeline->report_stream = stderr;
+    pipeline->reporter_running = false;
+    pthread_mutex_init(&pipeline->reporter_lock, NULL);
+    pthread_cond_init(&pipeline->reporter_cond, NULL);
+    return pipeline;
+}
+
+void free_Pipeline(Pipeline pipeline) {
+    for(int i=0; i<pipeline->stage_count; i++) {
+        PipelineStage stage = &pipeline->stages[i];
+        free_BoundedQueue(stage->input);
+        free(stage->threads);
+        pthread_mutex_destroy(&stage->lock);
+    }
+    pthread_mutex_destroy(&pipeline->reporter_lock);
+    pthread_cond_destroy(&pipeline->reporter_cond);
+    pthread_mutex_destroy(&pipeline->idle_lock);
+    pthread_cond_destroy(&pipeline->idle);
+    free(pipeline);
+}
+
+//Stages are connected in the order they are added. Each stage gets its own input queue
+bool Pipeline_addStage(Pipeline pipeline, const char* name, int thread_count, PipelineStageFn process, PipelineThreadInitFn thread_init, PipelineThreadFreeFn thread_free, void* shared) {
+    if(pipeline->started || pipeline->stage_count == PIPELINE_MAX_STAGES || process == NULL)
+        return false;
+    PipelineStage stage = &pipeline->stages[pipeline->stage_count];
+    stage->input = new_BoundedQueue(pipeline->queue_capacity);
+    if(stage->input == NULL)
+        return false;
+    stage->pipeline = pipeline;
+    stage->name = name;
+    stage->thread_count = thread_count > 0 ? thread_count : 1;
+    stage->process = process;
+    stage->thread_init = thread_init;
+    stage->thread_free = thread_free;
+    stage->shared = shared;
+    stage->output = NULL;
+    stage->threads = NULL;
+    stage->running_threads = 0;
+    stage->processed = 0;
+    stage->latency = NULL;
+    pthread_mutex_init(&stage->lock, NULL);
+    if(pipeline->stage_count > 0)
+        pipeline->stages[pipeline->stage_count-1].output = stage->input;
+    pipeline->stage_count++;
+    return true;
+}
+
+//An item was consumed by a stage or came out of the last one
+static void pipelineItemDone(Pipeline pipeline) {
+    pthread_mutex_lock(&pipeline->idle_lock);
+    pipeline->in_flight--;
+    if(pipeline->in_flight == 0)
+        pthread_cond_broadcast(&pipeline->idle);
+    pthread_mutex_unlock(&pipeline->idle_lock);
+}
+
+static void* pipelineStageThread(void* arg) {
+    PipelineStage stage = arg;
+    void* thread_context = stage->thread_init != NULL ? stage->thread_init(stage->shared) : stage->shared;
+    void* item;
+    while((item = BoundedQueue_pop(stage->input)) != NULL) {
+        uint64_t started = stage->latency != NULL ? Metrics_now() : 0;
+        void* result = stage->process(thread_context, item);
+        if(stage->latency != NULL)
+            LatencyHistogram_record(stage->latency, Metrics_now()-started);
+        pthread_mutex_lock(&stage->lock);
+        stage->processed++;
+        pthread_mutex_unlock(&stage->lock);
+        if(result == NULL || stage->output == NULL || !BoundedQueue_push(stage->output, result))
+            pipelineItemDone(stage->pipeline);
+    }
+    if(stage->thread_free != NULL)
+        stage->thread_free(thread_context);
+    //the last thread out closes the next queue so the downstream stage can drain and exit
+    pthread_mutex_lock(&stage->lock);
+    stage->running_threads--;
+    bool last = stage->running_threads == 0;
+    pthread_mutex_unlock(&stage->lock);
+    if(last && stage->output != NULL)
+        BoundedQueue_close(stage->output);
+    return NULL;
+}
+
+static void* pipelineReporterThread(void* arg) {
+    Pipeline pipeline = arg;
+    pthread_mutex_lock(&pipeline->reporter_lock);
+    while(pipeline->reporter_running) {
+        struct timespec deadline;
+        clock_gettime(CLOCK_REALTIME, &deadline);
+        deadline.tv_sec += pipeline->report_interval;
+        int result = 0;
+        while(pipeline->reporter_running && result != ETIMEDOUT)
+            result = pthread_cond_timedwait(&pipeline->reporter_cond, &pipeline->reporter_lock, &deadline);
+        if(pipeline->reporter_running)
+            Pipeline_printQueueDepths(pipeline, pipeline->report_stream);
+    }
+    pthread_mutex_unlock(&pipeline->reporter_lock);
+    return NULL;
+}
+
+//Tears down a partially started pipeline: closing every queue makes all running threads exit
+static void pipelineAbort(Pipeline pipeline, int started_stages) {
+    for(int i=0; i<pipeline->stage_count; i++)
+        BoundedQueue_close(pipeline->stages[i].input);
+    for(int i=0; i<started_stages; i++) {
+        PipelineStage stage = &pipeline->stages[i];
+        for(int t=0; t<stage->thread_count; t++)
+            pthread_join(stage->threads[t], NULL);
+    }
+}
+
+bool Pipeline_start(Pipeline pipeline) {
+    if(pipeline->started || pipeline->stage_count == 0)
+        return false;
+    for(int i=0; i<pipeline->stage_count; i++) {
+        PipelineStage stage = &pipeline->stages[i];
+        stage->threads = malloc(sizeof(pthread_t)*stage->thread_count);
+        if(stage->threads == NULL) {
+            pipelineAbort(pipeline, i);
+            return false;
+        }
+        stage->running_threads = stage->thread_count;
+        for(int t=0; t<stage->thread_count; t++) {
+            if(pthread_create(&stage->threads[t], NULL, pipelineStageThread, stage) != 0) {
+                fprintf(stderr, "Could not start %s thread: %s\n", stage->name, strerror(errno));
+                pthread_mutex_lock(&stage->lock);
+                stage->running_threads -= stage->thread_count-t;
+                pthread_mutex_unlock(&stage->lock);
+                stage->thread_count = t;
+                break;
+            }
+        }
+        if(stage->thread_count == 0) {
+            fprintf(stderr, "Pipeline stage %s has no threads\n", stage->name);
+            pipelineAbort(pipeline, i);
+            return false;
+        }
+    }
+    pipeline->started = true;
+    if(pipeline->report_interval > 0) {
+        pipeline->reporter_running = true;
+        if(pthread_create(&pipeline->reporter, NULL, pipelineReporterThread, pipeline) != 0)
+            pipeline->reporter_running = false;
+    }
+    return true;
+}
+
+//Blocks while the first stage's queue is full
+bool Pipeline_submit(Pipeline pipeline, void* item) {
+    if(!pipeline->started)
+        return false;
+    pthread_mutex_lock(&pipeline->idle_lock);
+    pipeline->in_flight++;
+    pthread_mutex_unlock(&pipeline->idle_lock);
+    if(!BoundedQueue_push(pipeline->stages[0].input, item)) {
+        pipelineItemDone(pipeline);
+        return false;
+    }
+    return true;
+}
+
+//Waits until everything submitted so far has gone through every stage. Unlike Pipeline_finish the
+//threads (and their per-thread contexts) keep running, so more items can be submitted afterwards
+void Pipeline_drain(Pipeline pipeline) {
+    pthread_mutex_lock(&pipeline->idle_lock);
+    while(pipeline->in_flight > 0)
+        pthread_cond_wait(&pipeline->idle, &pipeline->idle_lock);
+    pthread_mutex_unlock(&pipeline->idle_lock);
+}
+
+//Closes the input and waits for every stage to drain
+void Pipeline_finish(Pipeline pipeline) {
+    if(!pipeline->started)
+        return;
+    BoundedQueue_close(pipeline->stages[0].input);
+    for(int i=0; i<pipeline->stage_count; i++) {
+        PipelineStage stage = &pipeline->stages[i];
+        for(int t=0; t<stage->thread_count; t++)
+            pthread_join(stage->threads[t], NULL);
+    }
+    pthread_mutex_lock(&pipeline->reporter_lock);
+    bool reporter_running = pipeline->reporter_running;
+    pipeline->reporter_running = false;
+    pthread_cond_signal(&pipeline->reporter_cond);
+    pthread_mutex_unlock(&pipeline->reporter_lock);
+    if(reporter_running)
+        pthread_join(pipeline->reporter, NULL);
+    pipeline->started = false;
+}
+
+void Pipeline_printQueueDepths(Pipeline pipeline, FILE* stream) {
+    fprintf(stream, "queue depth:");
+    for(int i=0; i<pipeline->stage_count; i++) {
+        PipelineStage stage = &pipeline->stages[i];
+        fprintf(stream, " %s %zu/%zu", stage->name, BoundedQueue_depth(stage->input), stage->input->capacity);
+    }
+    fprintf(stream, "\n");
+}
+
+void Pipeline_printSummary(Pipeline pipeline, FILE* stream) {
+    for(int i=0; i<pipeline->stage_count; i++) {
+        PipelineStage stage = &pipeline->stages[i];
+        fprintf(stream, "%-10s threads: %d processed: %zu max queue depth: %zu/%zu", stage->name, stage->thread_count, stage->processed, stage->input->max_count, stage->input->capacity);
+        if(stage->latency != NULL && LatencyHistogram_count(stage->latency) > 0)
+            fprintf(stream, " p50: %.2fms p99: %.2fms", LatencyHistogram_percentile(stage->latency, 50)/1e6, LatencyHistogram_percentile(stage->latency, 99)/1e6);
+        fprintf(stream, "\n");
+    }
+}
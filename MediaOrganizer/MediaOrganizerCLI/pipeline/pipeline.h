@@ -0,0 +1,101 @@
+//
+//  pipeline.h
+//  MediaOrganizerCLI
+//
+//  Created by John Bridge on 10/17/26.
+//
+
+#ifndef pipeline_h
+#define pipeline_h
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <pthread.h>
+#include <time.h>
+#include <errno.h>
+#include <string.h>
+#include "metrics.h"
+
+#define PIPELINE_MAX_STAGES 8
+
+typedef struct BoundedQueue *BoundedQueue;
+typedef struct PipelineStage *PipelineStage;
+typedef struct Pipeline *Pipeline;
+
+//Fixed capacity FIFO. push blocks while full and pop blocks while empty, which is what gives the pipeline backpressure
+struct BoundedQueue {
+    void **items;
+    size_t capacity;
+    size_t head;
+    size_t count;
+    size_t max_count;   //high water mark
+    bool closed;
+    pthread_mutex_t lock;
+    pthread_cond_t not_empty;
+    pthread_cond_t not_full;
+};
+extern BoundedQueue new_BoundedQueue(size_t capacity);
+extern void free_BoundedQueue(BoundedQueue queue);
+
+extern bool BoundedQueue_push(BoundedQueue queue, void* item);
+extern void* BoundedQueue_pop(BoundedQueue queue);
+extern void BoundedQueue_close(BoundedQueue queue);
+extern size_t BoundedQueue_depth(BoundedQueue queue);
+
+//Returns the item to hand to the next stage, or NULL if the stage consumed (freed) it
+typedef void* (*PipelineStageFn)(void* thread_context, void* item);
+//Creates/frees per-thread state (e.g. LibRAW contexts). Both are optional
+typedef void* (*PipelineThreadInitFn)(void* shared);
+typedef void (*PipelineThreadFreeFn)(void* thread_context);
+
+struct PipelineStage {
+    Pipeline pipeline;
+    const char* name;
+    int thread_count;
+    PipelineStageFn process;
+    PipelineThreadInitFn thread_init;
+    PipelineThreadFreeFn thread_free;
+    void* shared;
+    
+    BoundedQueue input;
+    BoundedQueue output;    //NULL for the last stage
+    pthread_t *threads;
+    int running_threads;
+    size_t processed;
+    LatencyHistogram latency;   //time process takes per item, NULL to skip timing
+    pthread_mutex_t lock;
+};
+
+struct Pipeline {
+    struct PipelineStage stages[PIPELINE_MAX_STAGES];
+    int stage_count;
+    size_t queue_capacity;
+    bool started;
+    
+    //items submitted that have not left the last stage (or been consumed) yet
+    size_t in_flight;
+    pthread_mutex_t idle_lock;
+    pthread_cond_t idle;
+    
+    //periodic queue depth readout, disabled when report_interval is 0
+    unsigned int report_interval;
+    FILE* report_stream;
+    pthread_t reporter;
+    bool reporter_running;
+    pthread_mutex_t reporter_lock;
+    pthread_cond_t reporter_cond;
+};
+extern Pipeline new_Pipeline(size_t queue_capacity);
+extern void free_Pipeline(Pipeline pipeline);
+
+extern bool Pipeline_addStage(Pipeline pipeline, const char* name, int thread_count, PipelineStageFn process, PipelineThreadInitFn thread_init, PipelineThreadFreeFn thread_free, void* shared);
+extern bool Pipeline_start(Pipeline pipeline);
+extern bool Pipeline_submit(Pipeline pipeline, void* item);
+extern void Pipeline_drain(Pipeline pipeline);
+extern void Pipeline_finish(Pipeline pipeline);
+
+extern void Pipeline_printQueueDepths(Pipeline pipeline, FILE* stream);
+extern void Pipeline_printSummary(Pipeline pipeline, FILE* stream);
+
+#endif /* pipeline_h */
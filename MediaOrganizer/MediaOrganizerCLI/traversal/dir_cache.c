@@ -0,0 +1,123 @@
+//
+//  dir_cache.c
+//  MediaOrganizerCLI
+//
+//  Created by John Bridge on 10/17/26.
+//
+
+#include "dir_cache.h"
+
+DirCache new_DirCache(const char* root_path) {
+    DirCache cache = malloc(sizeof(struct DirCache));
+    if(cache==NULL)
+        return NULL;
+    cache->root_fd = open(root_path, O_RDONLY|O_DIRECTORY|O_CLOEXEC);
+    if(cache->root_fd < 0) {
+        Log(LOG_LEVEL_ERROR, "Could not open directory \"%s\"\n", root_path);
+        free(cache);
+        return NULL;
+    }
+    for(int i=0; i<DIR_CACHE_BUCKETS; i++)
+        cache->buckets[i] = NULL;
+    cache->count = 0;
+    pthread_rwlock_init(&cache->lock, NULL);
+    return cache;
+}
+
+void free_DirCache(DirCache cache) {
+    for(int i=0; i<DIR_CACHE_BUCKETS; i++) {
+        DirCacheEntry entry = cache->buckets[i];
+        while(entry != NULL) {
+            DirCacheEntry next = entry->next;
+            close(entry->fd);
+            free(entry->path);
+            free(entry);
+            entry = next;
+        }
+    }
+    close(cache->root_fd);
+    pthread_rwlock_destroy(&cache->lock);
+    free(cache);
+}
+
+//FNV-1a over the first length bytes
+static unsigned int dirCacheHash(const char* path, size_t length) {
+    unsigned int hash = 2166136261u;
+    for(size_t i=0; i<length; i++) {
+        hash ^= (unsigned char) path[i];
+        hash *= 16777619u;
+    }
+    return hash % DIR_CACHE_BUCKETS;
+}
+
+//cache->lock must be held
+static DirCacheEntry dirCacheFind(DirCache cache, unsigned int bucket, const char* path, size_t length) {
+    for(DirCacheEntry entry = cache->buckets[bucket]; entry != NULL; entry = entry->next) {
+        if(strncmp(entry->path, path, length) == 0 && entry->path[length] == '\0')
+            return entry;
+    }
+    return NULL;
+}
+
+//Resolves the first length bytes of path. Parents are resolved (and cached) first, so a miss costs
+//one mkdirat and one openat per missing component and nothing for the components already cached
+static int dirCacheResolve(DirCache cache, const char* path, size_t length) {
+    if(length == 0)
+        return cache->root_fd;
+    unsigned int bucket = dirCacheHash(path, length);
+    pthread_rwlock_rdlock(&cache->lock);
+    DirCacheEntry entry = dirCacheFind(cache, bucket, path, length);
+    int fd = entry != NULL ? entry->fd : -1;
+    pthread_rwlock_unlock(&cache->lock);
+    if(fd >= 0)
+        return fd;
+    
+    size_t slash = length;
+    while(slash > 0 && path[slash-1] != '/')
+        slash--;
+    int parent_fd = dirCacheResolve(cache, path, slash > 0 ? slash-1 : 0);
+    if(parent_fd < 0)
+        return -1;
+    size_t name_length = length-slash;
+    char name[name_length+1];
+    memcpy(name, &path[slash], name_length);
+    name[name_length] = '\0';
+    if(mkdirat(parent_fd, name, S_IRWXU | S_IRWXG | S_IRWXO) && (errno != EEXIST)) {
+        Log(LOG_LEVEL_ERROR, "Could not create directory \"%.*s\": %s\n", (int) length, path, strerror(errno));
+        return -1;
+    }
+    fd = openat(parent_fd, name, O_RDONLY|O_DIRECTORY|O_CLOEXEC);
+    if(fd < 0) {
+        Log(LOG_LEVEL_ERROR, "Could not open directory \"%.*s\": %s\n", (int) length, path, strerror(errno));
+        return -1;
+    }
+    
+    pthread_rwlock_wrlock(&cache->lock);
+    //another thread may have resolved the same directory in the meantime, keep the first fd
+    entry = dirCacheFind(cache, bucket, path, length);
+    if(entry != NULL) {
+        pthread_rwlock_unlock(&cache->lock);
+        close(fd);
+        return entry->fd;
+    }
+    entry = malloc(sizeof(struct DirCacheEntry));
+    char* entry_path = strndup(path, length);
+    if(entry == NULL || entry_path == NULL) {
+        pthread_rwlock_unlock(&cache->lock);
+        free(entry);
+        free(entry_path);
+        close(fd);
+        return -1;
+    }
+    entry->path = entry_path;
+    entry->fd = fd;
+    entry->next = cache->buckets[bucket];
+    cache->buckets[bucket] = entry;
+    cache->count++;
+    pthread_rwlock_unlock(&cache->lock);
+    return fd;
+}
+
+int DirCache_get(DirCache cache, const char* path) {
+    return dirCacheResolve(cache, path, strlen(path));
+}
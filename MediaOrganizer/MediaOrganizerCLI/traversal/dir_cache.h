@@ -0,0 +1,48 @@
+//
+//  dir_cache.h
+//  MediaOrganizerCLI
+//
+//  Created by John Bridge on 10/17/26.
+//
+
+#ifndef dir_cache_h
+#define dir_cache_h
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <errno.h>
+#include <pthread.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include "logger.h"
+
+#define DIR_CACHE_BUCKETS 1024
+
+typedef struct DirCacheEntry *DirCacheEntry;
+typedef struct DirCache *DirCache;
+
+struct DirCacheEntry {
+    char* path;     //relative to the cache root, no leading or trailing "/"
+    int fd;
+    DirCacheEntry next;
+};
+
+//Directories under root that have been created (or found to exist), kept open for the cache's lifetime.
+//A path is only resolved the first time it is asked for, after that it is a hash lookup under a read lock
+struct DirCache {
+    int root_fd;
+    DirCacheEntry buckets[DIR_CACHE_BUCKETS];
+    size_t count;
+    pthread_rwlock_t lock;
+};
+extern DirCache new_DirCache(const char* root_path);
+extern void free_DirCache(DirCache cache);
+
+//Returns an fd for root/path, creating every missing component. The fd belongs to the cache. -1 on failure
+extern int DirCache_get(DirCache cache, const char* path);
+
+#endif /* dir_cache_h */
@@ -0,0 +1,430 @@
+//
+//  dir_walker.c
+//  MediaOrganizerCLI
+//
+//  Created by John Bridge on 10/17/26.
+//
+
+//statx on Linux, defined before any system header is included
+#define _GNU_SOURCE
+#include "dir_walker.h"
+
+#if !defined(__APPLE__) && !defined(__FreeBSD__)
+#include <sys/sysmacros.h>
+
+//glibc has no declaration for the raw getdents64 record
+struct linux_dirent64 {
+    ino_t d_ino;
+    off_t d_off;
+    unsigned short d_reclen;
+    unsigned char d_type;
+    char d_name[];
+};
+#endif
+
+typedef struct DirWalkerThreadArg *DirWalkerThreadArg;
+struct DirWalkerThreadArg {
+    DirWalker walker;
+    int index;
+};
+
+//DirWalkerHandle functions
+static DirWalkerHandle new_DirWalkerHandle(int fd) {
+    DirWalkerHandle handle = malloc(sizeof(struct DirWalkerHandle));
+    if(handle==NULL)
+        return NULL;
+    handle->fd = fd;
+    handle->refs = 1;
+    pthread_mutex_init(&handle->lock, NULL);
+    return handle;
+}
+
+static void dirWalkerHandleRetain(DirWalkerHandle handle) {
+    pthread_mutex_lock(&handle->lock);
+    handle->refs++;
+    pthread_mutex_unlock(&handle->lock);
+}
+
+static void dirWalkerHandleRelease(DirWalkerHandle handle) {
+    pthread_mutex_lock(&handle->lock);
+    bool last = --handle->refs == 0;
+    pthread_mutex_unlock(&handle->lock);
+    if(last) {
+        close(handle->fd);
+        pthread_mutex_destroy(&handle->lock);
+        free(handle);
+    }
+}
+
+static void free_DirWalkerTask(DirWalkerTask task) {
+    if(task->parent != NULL)
+        dirWalkerHandleRelease(task->parent);
+    free(task->name);
+    free(task->path);
+    free(task);
+}
+
+//DirWalkerDeque functions
+static bool dirWalkerDequePush(DirWalkerDeque deque, DirWalkerTask task) {
+    pthread_mutex_lock(&deque->lock);
+    if(deque->count == deque->capacity) {
+        size_t capacity = deque->capacity > 0 ? deque->capacity*2 : 64;
+        DirWalkerTask *tasks = malloc(sizeof(DirWalkerTask)*capacity);
+        if(tasks == NULL) {
+            pthread_mutex_unlock(&deque->lock);
+            return false;
+        }
+        for(size_t i=0; i<deque->count; i++)
+            tasks[i] = deque->tasks[(deque->head+i)%deque->capacity];
+        free(deque->tasks);
+        deque->tasks = tasks;
+        deque->capacity = capacity;
+        deque->head = 0;
+    }
+    deque->tasks[(deque->head+deque->count)%deque->capacity] = task;
+    deque->count++;
+    pthread_mutex_unlock(&deque->lock);
+    return true;
+}
+
+static DirWalkerTask dirWalkerDequePopTail(DirWalkerDeque deque) {
+    DirWalkerTask task = NULL;
+    pthread_mutex_lock(&deque->lock);
+    if(deque->count > 0) {
+        deque->count--;
+        task = deque->tasks[(deque->head+deque->count)%deque->capacity];
+    }
+    pthread_mutex_unlock(&deque->lock);
+    return task;
+}
+
+static DirWalkerTask dirWalkerDequeStealHead(DirWalkerDeque deque) {
+    DirWalkerTask task = NULL;
+    pthread_mutex_lock(&deque->lock);
+    if(deque->count > 0) {
+        task = deque->tasks[deque->head];
+        deque->head = (deque->head+1)%deque->capacity;
+        deque->count--;
+    }
+    pthread_mutex_unlock(&deque->lock);
+    return task;
+}
+
+//DirWalker functions
+DirWalker new_DirWalker(int thread_count, DirWalkerFilesFn callback, void* context) {
+    if(callback == NULL)
+        return NULL;
+    DirWalker walker = malloc(sizeof(struct DirWalker));
+    if(walker==NULL)
+        return NULL;
+    walker->thread_count = thread_count > 0 ? thread_count : 1;
+    walker->deques = calloc(walker->thread_count, sizeof(struct DirWalkerDeque));
+    if(walker->deques == NULL) {
+        free(walker);
+        return NULL;
+    }
+    for(int i=0; i<walker->thread_count; i++)
+        pthread_mutex_init(&walker->deques[i].lock, NULL);
+    walker->callback = callback;
+    walker->context = context;
+    walker->pending = 0;
+    walker->available = 0;
+    walker->aborted = false;
+    walker->directories = 0;
+    walker->files = 0;
+    walker->latency = NULL;
+    pthread_mutex_init(&walker->lock, NULL);
+    pthread_cond_init(&walker->work, NULL);
+    return walker;
+}
+
+void free_DirWalker(DirWalker walker) {
+    for(int i=0; i<walker->thread_count; i++) {
+        DirWalkerTask task;
+        while((task = dirWalkerDequePopTail(&walker->deques[i])) != NULL)
+            free_DirWalkerTask(task);
+        free(walker->deques[i].tasks);
+        pthread_mutex_destroy(&walker->deques[i].lock);
+    }
+    free(walker->deques);
+    pthread_mutex_destroy(&walker->lock);
+    pthread_cond_destroy(&walker->work);
+    free(walker);
+}
+
+//Counted before the task is visible so the walk can never look finished while it is being queued
+static void dirWalkerSchedule(DirWalker walker, int index, DirWalkerHandle parent, const char* name, const char* path) {
+    DirWalkerTask task = malloc(sizeof(struct DirWalkerTask));
+    if(task==NULL)
+        return;
+    task->name = strdup(name);
+    task->path = strdup(path);
+    task->parent = parent;
+    if(parent != NULL)
+        dirWalkerHandleRetain(parent);
+    pthread_mutex_lock(&walker->lock);
+    walker->pending++;
+    walker->available++;
+    pthread_mutex_unlock(&walker->lock);
+    if(!dirWalkerDequePush(&walker->deques[index], task)) {
+        Log(LOG_LEVEL_ERROR, "Could not queue directory \"%s\"\n", path);
+        free_DirWalkerTask(task);
+        pthread_mutex_lock(&walker->lock);
+        walker->pending--;
+        walker->available--;
+        pthread_mutex_unlock(&walker->lock);
+        return;
+    }
+    pthread_cond_signal(&walker->work);
+}
+
+static bool dirWalkerAborted(DirWalker walker) {
+    pthread_mutex_lock(&walker->lock);
+    bool aborted = walker->aborted;
+    pthread_mutex_unlock(&walker->lock);
+    return aborted;
+}
+
+//Only the fields the organizer uses are requested, and network filesystems may answer from cache.
+//follow stats what a symlink points to instead of the link
+static int dirWalkerStat(int dirfd, const char* name, bool follow, DirWalkerEntry entry, mode_t *mode) {
+#if defined(__APPLE__) || defined(__FreeBSD__)
+    struct stat filestat;
+    if(fstatat(dirfd, name, &filestat, follow ? 0 : AT_SYMLINK_NOFOLLOW) != 0)
+        return -1;
+    *mode = filestat.st_mode;
+    entry->size = filestat.st_size;
+    entry->birth_time = filestat.st_birthtimespec.tv_sec;
+    entry->modify_time = filestat.st_mtimespec.tv_sec;
+    entry->device = filestat.st_dev;
+    entry->inode = filestat.st_ino;
+#else
+    struct statx filestat;
+    if(statx(dirfd, name, AT_STATX_DONT_SYNC | (follow ? 0 : AT_SYMLINK_NOFOLLOW), STATX_TYPE|STATX_SIZE|STATX_MTIME|STATX_BTIME|STATX_INO, &filestat) != 0)
+        return -1;
+    *mode = filestat.stx_mode;
+    entry->size = filestat.stx_size;
+    entry->modify_time = filestat.stx_mtime.tv_sec;
+    entry->birth_time = filestat.stx_mask & STATX_BTIME ? filestat.stx_btime.tv_sec : entry->modify_time;
+    entry->device = makedev(filestat.stx_dev_major, filestat.stx_dev_minor);
+    entry->inode = filestat.stx_ino;
+#endif
+    return 0;
+}
+
+//Hands the collected files to the callback. Returns false once the walk has been stopped
+static bool dirWalkerFlush(DirWalker walker, DirWalkerBatch batch) {
+    size_t count = batch->count;
+    batch->count = 0;
+    batch->used = 0;
+    if(walker->latency != NULL && count > 0)
+        LatencyHistogram_recordCount(walker->latency, (Metrics_now()-batch->started)/count, count);
+    bool result = count == 0 || walker->callback(walker->context, batch->entries, count);
+    //time the callback spends blocked on a full pipeline is not scan time
+    batch->started = Metrics_now();
+    if(result)
+        return true;
+    pthread_mutex_lock(&walker->lock);
+    walker->aborted = true;
+    pthread_mutex_unlock(&walker->lock);
+    return false;
+}
+
+//Returns false once the walk has been stopped
+static bool dirWalkerVisit(DirWalker walker, int index, DirWalkerHandle handle, const char* dir_path, const char* name, unsigned char type, DirWalkerBatch batch, size_t *files) {
+    if(strcmp(name, ".") == 0 || strcmp(name, "..") == 0 || strcmp(name, ".DS_Store") == 0)
+        return true;
+    size_t name_size = strlen(name)+1;
+    size_t path_size = strlen(dir_path)+name_size+1;
+    if(name_size+path_size > DIR_WALKER_BATCH_BYTES) {
+        Log(LOG_LEVEL_WARNING, "Path too long, skipping %s/%s\n", dir_path, name);
+        return true;
+    }
+    //both strings go straight into the batch, it is flushed first if they don't fit
+    if(batch->count == DIR_WALKER_BATCH_FILES || batch->used+name_size+path_size > DIR_WALKER_BATCH_BYTES) {
+        if(!dirWalkerFlush(walker, batch))
+            return false;
+    }
+    char* path = &batch->strings[batch->used];
+    snprintf(path, path_size, "%s/%s", dir_path, name);
+    //d_type already tells directories apart, only files (and entries the filesystem could not type) are stat'd
+    if(type == DT_DIR) {
+        dirWalkerSchedule(walker, index, handle, name, path);
+        return true;
+    }
+    if(type != DT_REG && type != DT_LNK && type != DT_UNKNOWN)
+        return true;
+    DirWalkerEntry entry = &batch->entries[batch->count];
+    mode_t mode;
+    bool link = type == DT_LNK;
+    int stat_result = dirWalkerStat(handle->fd, name, link, entry, &mode);
+    //without d_type a link only shows up in the stat, the file it points to is what gets organized
+    if(stat_result == 0 && S_ISLNK(mode)) {
+        link = true;
+        stat_result = dirWalkerStat(handle->fd, name, true, entry, &mode);
+    }
+    if(stat_result != 0) {
+        Log(LOG_LEVEL_WARNING, "stat error at %s: %s\n", path, strerror(errno));
+        return true;
+    }
+    if(S_ISDIR(mode)) {
+        //links to directories are not followed, one back to an ancestor would walk the same files forever
+        if(link) {
+            Log(LOG_LEVEL_INFO, "Not following link to directory %s\n", path);
+            return true;
+        }
+        dirWalkerSchedule(walker, index, handle, name, path);
+        return true;
+    }
+    if(!S_ISREG(mode))
+        return true;
+    char* entry_name = &batch->strings[batch->used+path_size];
+    memcpy(entry_name, name, name_size);
+    entry->dirfd = handle->fd;
+    entry->name = entry_name;
+    entry->path = path;
+    batch->used += path_size+name_size;
+    batch->count++;
+    (*files)++;
+    return true;
+}
+
+static void dirWalkerProcess(DirWalker walker, int index, DirWalkerTask task, char* buffer, DirWalkerBatch batch) {
+    int fd;
+    if(task->parent == NULL)
+        fd = open(task->path, O_RDONLY|O_DIRECTORY|O_CLOEXEC);
+    else
+        fd = openat(task->parent->fd, task->name, O_RDONLY|O_DIRECTORY|O_CLOEXEC);
+    if(fd < 0) {
+        Log(LOG_LEVEL_ERROR, "Could not open directory \"%s\"\n", task->path);
+        return;
+    }
+    DirWalkerHandle handle = new_DirWalkerHandle(fd);
+    if(handle == NULL) {
+        close(fd);
+        return;
+    }
+    //our own fd is open, the parent is no longer needed for this task
+    if(task->parent != NULL) {
+        dirWalkerHandleRelease(task->parent);
+        task->parent = NULL;
+    }
+    size_t files = 0;
+    batch->started = Metrics_now();
+#if defined(__APPLE__) || defined(__FreeBSD__)
+    //closedir closes the fd it is given, so read through a duplicate
+    int dir_fd = dup(fd);
+    DIR* dir = dir_fd >= 0 ? fdopendir(dir_fd) : NULL;
+    if(dir == NULL) {
+        if(dir_fd >= 0)
+            close(dir_fd);
+        Log(LOG_LEVEL_ERROR, "Could not open directory \"%s\"\n", task->path);
+    } else {
+        struct dirent *dp;
+        while((dp = readdir(dir)) != NULL) {
+            if(!dirWalkerVisit(walker, index, handle, task->path, dp->d_name, dp->d_type, batch, &files))
+                break;
+        }
+        closedir(dir);
+    }
+#else
+    //one getdents64 call returns a whole buffer of entries, where readdir would go through libc's smaller one
+    bool reading = true;
+    while(reading) {
+        long nread = syscall(SYS_getdents64, fd, buffer, DIR_WALKER_DENTS_BUFFER);
+        if(nread < 0)
+            Log(LOG_LEVEL_ERROR, "Could not read directory \"%s\": %s\n", task->path, strerror(errno));
+        if(nread <= 0)
+            break;
+        for(long offset = 0; offset < nread;) {
+            struct linux_dirent64 *dp = (struct linux_dirent64*) (buffer+offset);
+            offset += dp->d_reclen;
+            if(!dirWalkerVisit(walker, index, handle, task->path, dp->d_name, dp->d_type, batch, &files)) {
+                reading = false;
+                break;
+            }
+        }
+    }
+#endif
+    //the entries' dirfd is only open until the handle is released
+    dirWalkerFlush(walker, batch);
+    dirWalkerHandleRelease(handle);
+    pthread_mutex_lock(&walker->lock);
+    walker->directories++;
+    walker->files += files;
+    pthread_mutex_unlock(&walker->lock);
+}
+
+static void* dirWalkerThread(void* arg) {
+    DirWalkerThreadArg thread_arg = arg;
+    DirWalker walker = thread_arg->walker;
+    int index = thread_arg->index;
+    char* buffer = NULL;
+#if !defined(__APPLE__) && !defined(__FreeBSD__)
+    buffer = malloc(DIR_WALKER_DENTS_BUFFER);
+    if(buffer == NULL)
+        return NULL;
+#endif
+    DirWalkerBatch batch = malloc(sizeof(struct DirWalkerBatch));
+    if(batch == NULL) {
+        free(buffer);
+        return NULL;
+    }
+    batch->count = 0;
+    batch->used = 0;
+    while(true) {
+        //own deque first, newest task, then steal the oldest task of another thread
+        DirWalkerTask task = dirWalkerDequePopTail(&walker->deques[index]);
+        for(int i=1; task == NULL && i<walker->thread_count; i++)
+            task = dirWalkerDequeStealHead(&walker->deques[(index+i)%walker->thread_count]);
+        if(task != NULL) {
+            pthread_mutex_lock(&walker->lock);
+            walker->available--;
+            pthread_mutex_unlock(&walker->lock);
+            if(!dirWalkerAborted(walker))
+                dirWalkerProcess(walker, index, task, buffer, batch);
+            free_DirWalkerTask(task);
+            pthread_mutex_lock(&walker->lock);
+            walker->pending--;
+            if(walker->pending == 0)
+                pthread_cond_broadcast(&walker->work);
+            pthread_mutex_unlock(&walker->lock);
+            continue;
+        }
+        pthread_mutex_lock(&walker->lock);
+        while(walker->available == 0 && walker->pending > 0)
+            pthread_cond_wait(&walker->work, &walker->lock);
+        bool done = walker->pending == 0;
+        pthread_mutex_unlock(&walker->lock);
+        if(done)
+            break;
+    }
+    free(buffer);
+    free(batch);
+    return NULL;
+}
+
+//The calling thread works as thread 0, so the walk still completes if no extra thread can be started
+bool DirWalker_walk(DirWalker walker, const char* root) {
+    walker->aborted = false;
+    walker->directories = 0;
+    walker->files = 0;
+    dirWalkerSchedule(walker, 0, NULL, "", root);
+    
+    pthread_t threads[walker->thread_count];
+    struct DirWalkerThreadArg args[walker->thread_count];
+    int started = 0;
+    for(int i=0; i<walker->thread_count; i++) {
+        args[i].walker = walker;
+        args[i].index = i;
+    }
+    for(int i=1; i<walker->thread_count; i++) {
+        if(pthread_create(&threads[i], NULL, dirWalkerThread, &args[i]) != 0)
+            break;
+        started = i;
+    }
+    dirWalkerThread(&args[0]);
+    for(int i=1; i<=started; i++)
+        pthread_join(threads[i], NULL);
+    return walker->directories > 0 && !walker->aborted;
+}
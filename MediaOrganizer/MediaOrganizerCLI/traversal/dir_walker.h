@@ -0,0 +1,112 @@
+//
+//  dir_walker.h
+//  MediaOrganizerCLI
+//
+//  Created by John Bridge on 10/17/26.
+//
+
+#ifndef dir_walker_h
+#define dir_walker_h
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <errno.h>
+#include <pthread.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include "metrics.h"
+#include "logger.h"
+
+#if !defined(__APPLE__) && !defined(__FreeBSD__)
+#include <sys/syscall.h>
+#endif
+
+//bytes of directory entries read per getdents64 call
+#define DIR_WALKER_DENTS_BUFFER 32768
+//files of one directory handed to the callback at once, and the bytes their names and paths may take
+#define DIR_WALKER_BATCH_FILES 256
+#define DIR_WALKER_BATCH_BYTES 65536
+
+typedef struct DirWalkerEntry *DirWalkerEntry;
+typedef struct DirWalkerBatch *DirWalkerBatch;
+typedef struct DirWalkerHandle *DirWalkerHandle;
+typedef struct DirWalkerTask *DirWalkerTask;
+typedef struct DirWalkerDeque *DirWalkerDeque;
+typedef struct DirWalker *DirWalker;
+
+//One regular file found by the walk. Only valid for the duration of the callback
+struct DirWalkerEntry {
+    int dirfd;              //open directory containing the file
+    const char* name;
+    const char* path;
+    off_t size;
+    time_t birth_time;      //creation time where the filesystem records it, otherwise modification time
+    time_t modify_time;
+    dev_t device;
+    ino_t inode;
+};
+//Called from the walker threads with up to DIR_WALKER_BATCH_FILES files of one directory, so it must be thread safe.
+//Return false to stop the walk
+typedef bool (*DirWalkerFilesFn)(void* context, DirWalkerEntry entries, size_t count);
+
+//Files of the directory a thread is reading, collected until the batch or its string space is full or the directory ends
+struct DirWalkerBatch {
+    struct DirWalkerEntry entries[DIR_WALKER_BATCH_FILES];
+    size_t count;
+    char strings[DIR_WALKER_BATCH_BYTES];   //names and paths of the entries
+    size_t used;
+    uint64_t started;   //when collecting the batch began, for DirWalker.latency
+};
+
+//An open directory shared by the tasks for its subdirectories. Closed when the last of them has opened its own fd
+struct DirWalkerHandle {
+    int fd;
+    int refs;
+    pthread_mutex_t lock;
+};
+
+//A subdirectory that has not been read yet: opened with openat(parent->fd, name) when a thread picks it up
+struct DirWalkerTask {
+    DirWalkerHandle parent;     //NULL for the root
+    char* name;
+    char* path;
+};
+
+//Per-thread task deque. The owner pushes and pops at the tail (depth first),
+//idle threads steal from the head, which holds the shallowest and so largest subtrees
+struct DirWalkerDeque {
+    DirWalkerTask *tasks;
+    size_t capacity;
+    size_t head;
+    size_t count;
+    pthread_mutex_t lock;
+};
+
+struct DirWalker {
+    int thread_count;
+    DirWalkerDeque deques;
+    DirWalkerFilesFn callback;
+    void* context;
+    
+    size_t pending;         //tasks queued or being read. The walk is done when this reaches 0
+    size_t available;       //tasks sitting in a deque
+    bool aborted;
+    pthread_mutex_t lock;
+    pthread_cond_t work;
+    
+    size_t directories;
+    size_t files;
+    LatencyHistogram latency;   //per file share of the time spent reading directories and stat'ing, NULL to skip timing
+};
+
+extern DirWalker new_DirWalker(int thread_count, DirWalkerFilesFn callback, void* context);
+extern void free_DirWalker(DirWalker walker);
+//Walks root on the walker's threads and blocks until every file has been handed to the callback
+extern bool DirWalker_walk(DirWalker walker, const char* root);
+
+#endif /* dir_walker_h */
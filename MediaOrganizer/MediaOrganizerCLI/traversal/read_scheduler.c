@@ -0,0 +1,179 @@
+//
+//  read_scheduler.c
+//  MediaOrganizerCLI
+//
+//  Created by John Bridge on 10/17/26.
+//
+
+#include "read_scheduler.h"
+
+ReadScheduler new_ReadScheduler(size_t window, ReadSchedulerSubmitFn submit, ReadSchedulerDiscardFn discard, void* context) {
+    ReadScheduler scheduler = malloc(sizeof(struct ReadScheduler));
+    if(scheduler == NULL)
+        return NULL;
+    scheduler->window = window;
+    scheduler->capacity = window > 0 ? window : READ_SCHEDULER_INITIAL_CAPACITY;
+    scheduler->items = malloc(sizeof(struct ReadSchedulerItem)*scheduler->capacity);
+    if(scheduler->items == NULL) {
+        free(scheduler);
+        return NULL;
+    }
+    scheduler->submit = submit;
+    scheduler->discard = discard;
+    scheduler->context = context;
+    scheduler->count = 0;
+    scheduler->failed = false;
+    scheduler->extent_positions = 0;
+    scheduler->inode_positions = 0;
+    pthread_mutex_init(&scheduler->lock, NULL);
+    pthread_mutex_init(&scheduler->submit_lock, NULL);
+    return scheduler;
+}
+
+void free_ReadScheduler(ReadScheduler scheduler) {
+    pthread_mutex_destroy(&scheduler->lock);
+    pthread_mutex_destroy(&scheduler->submit_lock);
+    free(scheduler->items);
+    free(scheduler);
+}
+
+//Device offset of the first byte of fd's data. false if the filesystem can't tell, or the file has no data yet
+static bool readSchedulerExtent(int fd, uint64_t *position) {
+#if defined(__APPLE__)
+    struct log2phys mapping;
+    mapping.l2p_flags = 0;
+    mapping.l2p_contigbytes = 1;
+    mapping.l2p_devoffset = 0;  //file offset in, device offset out
+    if(fcntl(fd, F_LOG2PHYS_EXT, &mapping) == -1)
+        return false;
+    *position = (uint64_t) mapping.l2p_devoffset;
+    return true;
+#elif !defined(__FreeBSD__)
+    //room for the header and the one extent asked for
+    uint64_t buffer[(sizeof(struct fiemap)+sizeof(struct fiemap_extent))/sizeof(uint64_t)+1];
+    memset(buffer, 0, sizeof(buffer));
+    struct fiemap *map = (struct fiemap*) buffer;
+    map->fm_start = 0;
+    map->fm_length = FIEMAP_MAX_OFFSET;
+    map->fm_extent_count = 1;
+    if(ioctl(fd, FS_IOC_FIEMAP, map) != 0 || map->fm_mapped_extents == 0)
+        return false;
+    //delayed allocation and inline data have no place on the device yet
+    if(map->fm_extents[0].fe_flags & (FIEMAP_EXTENT_UNKNOWN | FIEMAP_EXTENT_DELALLOC | FIEMAP_EXTENT_DATA_INLINE))
+        return false;
+    *position = map->fm_extents[0].fe_physical;
+    return true;
+#else
+    return false;
+#endif
+}
+
+static int readSchedulerCompare(const void* a, const void* b) {
+    ReadSchedulerItem first = (ReadSchedulerItem) a;
+    ReadSchedulerItem second = (ReadSchedulerItem) b;
+    if(first->device != second->device)
+        return first->device < second->device ? -1 : 1;
+    if(first->kind != second->kind)
+        return first->kind < second->kind ? -1 : 1;
+    if(first->position != second->position)
+        return first->position < second->position ? -1 : 1;
+    return 0;
+}
+
+static bool readSchedulerFailed(ReadScheduler scheduler) {
+    pthread_mutex_lock(&scheduler->lock);
+    bool failed = scheduler->failed;
+    pthread_mutex_unlock(&scheduler->lock);
+    return failed;
+}
+
+//Sorts and submits items, then frees the array. Windows go out one at a time, so a window never interleaves with the next.
+//Once a submit has failed, the rest are discarded
+static bool readSchedulerSubmit(ReadScheduler scheduler, ReadSchedulerItem items, size_t count) {
+    qsort(items, count, sizeof(struct ReadSchedulerItem), readSchedulerCompare);
+    pthread_mutex_lock(&scheduler->submit_lock);
+    bool result = !readSchedulerFailed(scheduler);
+    for(size_t i=0; i<count; i++) {
+        if(result)
+            result = scheduler->submit(scheduler->context, items[i].item);
+        else
+            scheduler->discard(scheduler->context, items[i].item);
+    }
+    pthread_mutex_unlock(&scheduler->submit_lock);
+    free(items);
+    if(!result) {
+        pthread_mutex_lock(&scheduler->lock);
+        scheduler->failed = true;
+        pthread_mutex_unlock(&scheduler->lock);
+    }
+    return result;
+}
+
+bool ReadScheduler_add(ReadScheduler scheduler, void* item, int dirfd, const char* name, dev_t device, ino_t inode) {
+    struct ReadSchedulerItem entry = {item, device, READ_POSITION_INODE, (uint64_t) inode};
+    int fd = openat(dirfd, name, O_RDONLY | O_CLOEXEC | O_NOFOLLOW);
+    if(fd >= 0) {
+        if(readSchedulerExtent(fd, &entry.position))
+            entry.kind = READ_POSITION_EXTENT;
+        close(fd);
+    }
+
+    ReadSchedulerItem full = NULL;
+    size_t full_count = 0;
+    pthread_mutex_lock(&scheduler->lock);
+    if(scheduler->failed) {
+        pthread_mutex_unlock(&scheduler->lock);
+        scheduler->discard(scheduler->context, item);
+        return false;
+    }
+    if(entry.kind == READ_POSITION_EXTENT)
+        scheduler->extent_positions++;
+    else
+        scheduler->inode_positions++;
+    if(scheduler->count == scheduler->capacity) {
+        //only when the whole walk is one window, a full window is taken away below
+        ReadSchedulerItem items = realloc(scheduler->items, sizeof(struct ReadSchedulerItem)*scheduler->capacity*2);
+        if(items == NULL) {
+            pthread_mutex_unlock(&scheduler->lock);
+            Log(LOG_LEVEL_ERROR, "Out of memory ordering reads\n");
+            if(scheduler->submit(scheduler->context, item))
+                return true;
+            pthread_mutex_lock(&scheduler->lock);
+            scheduler->failed = true;
+            pthread_mutex_unlock(&scheduler->lock);
+            return false;
+        }
+        scheduler->items = items;
+        scheduler->capacity *= 2;
+    }
+    scheduler->items[scheduler->count++] = entry;
+    if(scheduler->window > 0 && scheduler->count == scheduler->window) {
+        //the next window goes into a fresh array while this thread sorts and submits the full one
+        ReadSchedulerItem items = malloc(sizeof(struct ReadSchedulerItem)*scheduler->capacity);
+        if(items != NULL) {
+            full = scheduler->items;
+            full_count = scheduler->count;
+            scheduler->items = items;
+            scheduler->count = 0;
+        }
+    }
+    pthread_mutex_unlock(&scheduler->lock);
+    if(full != NULL)
+        return readSchedulerSubmit(scheduler, full, full_count);
+    return true;
+}
+
+bool ReadScheduler_flush(ReadScheduler scheduler) {
+    pthread_mutex_lock(&scheduler->lock);
+    ReadSchedulerItem items = scheduler->items;
+    size_t count = scheduler->count;
+    scheduler->items = malloc(sizeof(struct ReadSchedulerItem)*scheduler->capacity);
+    scheduler->count = 0;
+    if(scheduler->items == NULL) {
+        //nothing can be added without memory, the scheduler is only freed from here
+        scheduler->capacity = 0;
+        scheduler->failed = true;
+    }
+    pthread_mutex_unlock(&scheduler->lock);
+    return readSchedulerSubmit(scheduler, items, count);
+}
@@ -0,0 +1,83 @@
+//
+//  read_scheduler.h
+//  MediaOrganizerCLI
+//
+//  Created by John Bridge on 10/17/26.
+//
+
+#ifndef read_scheduler_h
+#define read_scheduler_h
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <errno.h>
+#include <pthread.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include "logger.h"
+
+#if !defined(__APPLE__) && !defined(__FreeBSD__)
+#include <sys/ioctl.h>
+#include <linux/fs.h>
+#include <linux/fiemap.h>
+#endif
+
+//items collected before the first window is sorted when the whole walk is one window
+#define READ_SCHEDULER_INITIAL_CAPACITY 1024
+
+typedef struct ReadSchedulerItem *ReadSchedulerItem;
+typedef struct ReadScheduler *ReadScheduler;
+
+//How an item's position was found. Positions are only comparable between items of the same device and kind
+typedef enum {
+    READ_POSITION_EXTENT,   //device offset of the file's first byte (FIEMAP on Linux, F_LOG2PHYS_EXT on macOS)
+    READ_POSITION_INODE     //the filesystem doesn't map files to device offsets, inode numbers roughly follow allocation order
+} ReadPositionKind;
+
+struct ReadSchedulerItem {
+    void* item;
+    dev_t device;
+    ReadPositionKind kind;
+    uint64_t position;
+};
+
+//Called in read order, from whichever thread completed the window. Takes ownership of item even when it returns false.
+//After a false every item not submitted yet, of this window and any later one, goes to the ReadSchedulerDiscardFn
+typedef bool (*ReadSchedulerSubmitFn)(void* context, void* item);
+//Frees an item that is not going to be submitted
+typedef void (*ReadSchedulerDiscardFn)(void* context, void* item);
+
+//Collects items from the walker threads and submits them sorted by where their data sits on the device, so reads sweep
+//across it instead of seeking back and forth in directory order. Items are sorted window files at a time, or all at
+//once when window is 0, which holds every file of the walk in memory before the first one is submitted
+struct ReadScheduler {
+    size_t window;
+    ReadSchedulerSubmitFn submit;
+    ReadSchedulerDiscardFn discard;
+    void* context;
+    ReadSchedulerItem items;
+    size_t count;
+    size_t capacity;
+    bool failed;    //a submit returned false, nothing more is submitted
+    pthread_mutex_t lock;
+    pthread_mutex_t submit_lock;    //a window is submitted in full before the next one starts
+
+    size_t extent_positions;
+    size_t inode_positions;
+};
+extern ReadScheduler new_ReadScheduler(size_t window, ReadSchedulerSubmitFn submit, ReadSchedulerDiscardFn discard, void* context);
+//Call ReadScheduler_flush first, items still queued are not freed
+extern void free_ReadScheduler(ReadScheduler scheduler);
+
+//Looks up where name (in dirfd) starts on its device and queues item. Submits the window once it is full.
+//Without memory to queue it, item is submitted straight away, out of order. Thread safe. false once a submit has
+//failed, item is discarded then
+extern bool ReadScheduler_add(ReadScheduler scheduler, void* item, int dirfd, const char* name, dev_t device, ino_t inode);
+//Submits whatever is queued, in order
+extern bool ReadScheduler_flush(ReadScheduler scheduler);
+
+#endif /* read_scheduler_h */
@@ -0,0 +1,456 @@
+//
+//  watcher.c
+//  MediaOrganizerCLI
+//
+//  Created by John Bridge on 10/17/26.
+//
+
+//pipe2 on Linux, defined before any system header is included
+#define _GNU_SOURCE
+#include "watcher.h"
+
+#if !defined(__APPLE__) && !defined(__FreeBSD__)
+#include <sys/inotify.h>
+#include <mntent.h>
+
+//IN_CREATE is only acted on for folders: a file is batched once it has been closed after writing, or moved in
+#define WATCHER_EVENTS (IN_CLOSE_WRITE | IN_MOVED_TO | IN_CREATE)
+#endif
+
+void free_WatcherBatch(WatcherBatch batch) {
+    for(size_t i=0; i<batch->count; i++)
+        free(batch->entries[i].path);
+    free(batch->entries);
+    free(batch);
+}
+
+#if defined(__APPLE__) || defined(__FreeBSD__)
+bool Watcher_supported(void) {
+    return false;
+}
+
+Watcher new_Watcher(void) {
+    fprintf(stderr, "Watch mode requires inotify (Linux)\n");
+    return NULL;
+}
+
+void free_Watcher(Watcher watcher) {
+}
+
+bool Watcher_addTree(Watcher watcher, const char* path) {
+    return false;
+}
+
+bool Watcher_addMountRoot(Watcher watcher, const char* path) {
+    return false;
+}
+
+WatcherBatch Watcher_next(Watcher watcher) {
+    return NULL;
+}
+
+void Watcher_stop(Watcher watcher) {
+}
+#else
+bool Watcher_supported(void) {
+    return true;
+}
+
+static uint64_t watcherNowMs(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t) now.tv_sec*1000 + (uint64_t) now.tv_nsec/1000000;
+}
+
+static bool watcherQueue(Watcher watcher, const char* path, bool is_directory) {
+    if(watcher->pending == NULL) {
+        watcher->pending = calloc(1, sizeof(struct WatcherBatch));
+        if(watcher->pending == NULL)
+            return false;
+    }
+    WatcherBatch batch = watcher->pending;
+    if(batch->count == batch->capacity) {
+        size_t capacity = batch->capacity > 0 ? batch->capacity*2 : 64;
+        struct WatcherEntry *entries = realloc(batch->entries, sizeof(struct WatcherEntry)*capacity);
+        if(entries == NULL)
+            return false;
+        batch->entries = entries;
+        batch->capacity = capacity;
+    }
+    char* copy = strdup(path);
+    if(copy == NULL)
+        return false;
+    batch->entries[batch->count].path = copy;
+    batch->entries[batch->count].is_directory = is_directory;
+    batch->count++;
+    return true;
+}
+
+//'/' sorts before every other character, so a folder's contents always come right after it
+static int watcherComparePaths(const void* a, const void* b) {
+    const unsigned char* x = (const unsigned char*) ((const struct WatcherEntry*) a)->path;
+    const unsigned char* y = (const unsigned char*) ((const struct WatcherEntry*) b)->path;
+    while(*x != '\0' && *x == *y) {
+        x++;
+        y++;
+    }
+    int cx = *x == '/' ? 1 : *x;
+    int cy = *y == '/' ? 1 : *y;
+    return cx-cy;
+}
+
+//Drops repeated paths, and paths inside a folder that is organized as a whole anyway
+static void watcherBatchNormalize(WatcherBatch batch) {
+    qsort(batch->entries, batch->count, sizeof(struct WatcherEntry), watcherComparePaths);
+    size_t kept = 0;
+    const char* folder = NULL;
+    size_t folder_length = 0;
+    for(size_t i=0; i<batch->count; i++) {
+        struct WatcherEntry entry = batch->entries[i];
+        bool drop = false;
+        if(kept > 0 && strcmp(batch->entries[kept-1].path, entry.path) == 0) {
+            drop = true;
+            if(entry.is_directory && !batch->entries[kept-1].is_directory) {
+                batch->entries[kept-1].is_directory = true;
+                folder = batch->entries[kept-1].path;
+                folder_length = strlen(folder);
+            }
+        } else if(folder != NULL && strncmp(entry.path, folder, folder_length) == 0 && entry.path[folder_length] == '/') {
+            drop = true;
+        }
+        if(drop) {
+            free(entry.path);
+            continue;
+        }
+        batch->entries[kept++] = entry;
+        if(entry.is_directory) {
+            folder = entry.path;
+            folder_length = strlen(folder);
+        }
+    }
+    batch->count = kept;
+}
+
+//Index of the first watch with a wd >= wd
+static size_t watcherWatchIndex(Watcher watcher, int wd) {
+    size_t low = 0;
+    size_t high = watcher->watch_count;
+    while(low < high) {
+        size_t middle = (low+high)/2;
+        if(watcher->watches[middle].wd < wd)
+            low = middle+1;
+        else
+            high = middle;
+    }
+    return low;
+}
+
+static WatcherWatch watcherFindWatch(Watcher watcher, int wd) {
+    size_t index = watcherWatchIndex(watcher, wd);
+    if(index < watcher->watch_count && watcher->watches[index].wd == wd)
+        return &watcher->watches[index];
+    return NULL;
+}
+
+static bool watcherAddWatch(Watcher watcher, const char* path) {
+    int wd = inotify_add_watch(watcher->inotify_fd, path, WATCHER_EVENTS);
+    if(wd < 0) {
+        Log(LOG_LEVEL_ERROR, "Could not watch %s: %s\n", path, strerror(errno));
+        return false;
+    }
+    char* copy = strdup(path);
+    if(copy == NULL)
+        return false;
+    //adding a folder that is already watched returns its existing wd
+    WatcherWatch existing = watcherFindWatch(watcher, wd);
+    if(existing != NULL) {
+        free(existing->path);
+        existing->path = copy;
+        return true;
+    }
+    if(watcher->watch_count == watcher->watch_capacity) {
+        size_t capacity = watcher->watch_capacity > 0 ? watcher->watch_capacity*2 : 64;
+        struct WatcherWatch *watches = realloc(watcher->watches, sizeof(struct WatcherWatch)*capacity);
+        if(watches == NULL) {
+            free(copy);
+            return false;
+        }
+        watcher->watches = watches;
+        watcher->watch_capacity = capacity;
+    }
+    size_t index = watcherWatchIndex(watcher, wd);
+    memmove(&watcher->watches[index+1], &watcher->watches[index], sizeof(struct WatcherWatch)*(watcher->watch_count-index));
+    watcher->watches[index].wd = wd;
+    watcher->watches[index].path = copy;
+    watcher->watch_count++;
+    return true;
+}
+
+//the kernel already dropped the watch (IN_IGNORED), only our record of it is left
+static void watcherRemoveWatch(Watcher watcher, int wd) {
+    size_t index = watcherWatchIndex(watcher, wd);
+    if(index >= watcher->watch_count || watcher->watches[index].wd != wd)
+        return;
+    free(watcher->watches[index].path);
+    memmove(&watcher->watches[index], &watcher->watches[index+1], sizeof(struct WatcherWatch)*(watcher->watch_count-index-1));
+    watcher->watch_count--;
+}
+
+//Adds watches to path and its subfolders. Files already in them are not batched
+static bool watcherAddTree(Watcher watcher, const char* path) {
+    if(!watcherAddWatch(watcher, path))
+        return false;
+    DIR* dir = opendir(path);
+    if(dir == NULL)
+        return false;
+    struct dirent* entry;
+    while((entry = readdir(dir)) != NULL) {
+        if(strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0)
+            continue;
+        bool is_directory = entry->d_type == DT_DIR;
+        if(entry->d_type == DT_UNKNOWN) {
+            struct stat st;
+            is_directory = fstatat(dirfd(dir), entry->d_name, &st, AT_SYMLINK_NOFOLLOW) == 0 && S_ISDIR(st.st_mode);
+        }
+        if(!is_directory)
+            continue;
+        size_t child_size = strlen(path)+strlen(entry->d_name)+2;
+        char child[child_size];
+        snprintf(child, child_size, "%s/%s", path, entry->d_name);
+        //a subfolder that cannot be watched is reported, the rest of the tree still is
+        watcherAddTree(watcher, child);
+    }
+    closedir(dir);
+    return true;
+}
+
+static char* watcherTrimmedCopy(const char* path) {
+    char* copy = strdup(path);
+    if(copy == NULL)
+        return NULL;
+    size_t length = strlen(copy);
+    while(length > 0 && copy[length-1] == '/')
+        copy[--length] = '\0';
+    return copy;
+}
+
+static bool watcherAppendPath(char*** paths, size_t *count, const char* path) {
+    char** grown = realloc(*paths, sizeof(char*)*(*count+1));
+    if(grown == NULL)
+        return false;
+    *paths = grown;
+    grown[*count] = strdup(path);
+    if(grown[*count] == NULL)
+        return false;
+    (*count)++;
+    return true;
+}
+
+static void watcherFreePaths(char** paths, size_t count) {
+    for(size_t i=0; i<count; i++)
+        free(paths[i]);
+    free(paths);
+}
+
+//Mount points strictly below one of the mount roots
+static char** watcherReadMounts(Watcher watcher, size_t *count) {
+    *count = 0;
+    char** mounts = NULL;
+    FILE* table = setmntent("/proc/self/mounts", "r");
+    if(table == NULL)
+        return NULL;
+    struct mntent entry;
+    char buffer[4096];
+    while(getmntent_r(table, &entry, buffer, sizeof(buffer)) != NULL) {
+        for(size_t i=0; i<watcher->mount_root_count; i++) {
+            size_t root_length = strlen(watcher->mount_roots[i]);
+            if(strncmp(entry.mnt_dir, watcher->mount_roots[i], root_length) == 0 && entry.mnt_dir[root_length] == '/') {
+                watcherAppendPath(&mounts, count, entry.mnt_dir);
+                break;
+            }
+        }
+    }
+    endmntent(table);
+    return mounts;
+}
+
+//Batches every mount point that was not there at the previous change. Unmounted ones are forgotten,
+//so storage that is attached again is organized again
+static void watcherMountsChanged(Watcher watcher) {
+    size_t count;
+    char** mounts = watcherReadMounts(watcher, &count);
+    for(size_t i=0; i<count; i++) {
+        bool known = false;
+        for(size_t j=0; j<watcher->mount_count && !known; j++)
+            known = strcmp(mounts[i], watcher->mounts[j]) == 0;
+        if(!known) {
+            Log(LOG_LEVEL_INFO, "Storage attached at %s\n", mounts[i]);
+            watcherQueue(watcher, mounts[i], true);
+        }
+    }
+    watcherFreePaths(watcher->mounts, watcher->mount_count);
+    watcher->mounts = mounts;
+    watcher->mount_count = count;
+}
+
+static void watcherReadEvents(Watcher watcher) {
+    char buffer[64*1024] __attribute__((aligned(__alignof__(struct inotify_event))));
+    while(true) {
+        ssize_t length = read(watcher->inotify_fd, buffer, sizeof(buffer));
+        if(length < 0 && errno == EINTR)
+            continue;
+        if(length <= 0)
+            return;
+        for(char* position = buffer; position < buffer+length; ) {
+            struct inotify_event *event = (struct inotify_event*) position;
+            position += sizeof(struct inotify_event)+event->len;
+            if(event->mask & IN_Q_OVERFLOW) {
+                Log(LOG_LEVEL_WARNING, "Watch events were lost, rescanning watched folders\n");
+                for(size_t i=0; i<watcher->tree_root_count; i++)
+                    watcherQueue(watcher, watcher->tree_roots[i], true);
+                continue;
+            }
+            if(event->mask & IN_IGNORED) {
+                watcherRemoveWatch(watcher, event->wd);
+                continue;
+            }
+            WatcherWatch watch = watcherFindWatch(watcher, event->wd);
+            if(watch == NULL || event->len == 0 || strcmp(event->name, ".DS_Store") == 0)
+                continue;
+            size_t path_size = strlen(watch->path)+strlen(event->name)+2;
+            char path[path_size];
+            snprintf(path, path_size, "%s/%s", watch->path, event->name);
+            if(event->mask & IN_ISDIR) {
+                //anything written to it before its watch was added is picked up by organizing the whole folder
+                watcherAddTree(watcher, path);
+                watcherQueue(watcher, path, true);
+            } else if(event->mask & (IN_CLOSE_WRITE | IN_MOVED_TO)) {
+                watcherQueue(watcher, path, false);
+            }
+        }
+    }
+}
+
+Watcher new_Watcher(void) {
+    Watcher watcher = calloc(1, sizeof(struct Watcher));
+    if(watcher==NULL)
+        return NULL;
+    watcher->mounts_fd = -1;
+    watcher->debounce_ms = WATCHER_DEBOUNCE_MS;
+    watcher->max_delay_ms = WATCHER_MAX_DELAY_MS;
+    watcher->inotify_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    if(watcher->inotify_fd < 0) {
+        Log(LOG_LEVEL_ERROR, "Could not start watching: %s\n", strerror(errno));
+        free(watcher);
+        return NULL;
+    }
+    if(pipe2(watcher->stop_pipe, O_CLOEXEC) != 0) {
+        close(watcher->inotify_fd);
+        free(watcher);
+        return NULL;
+    }
+    return watcher;
+}
+
+void free_Watcher(Watcher watcher) {
+    close(watcher->inotify_fd);
+    if(watcher->mounts_fd >= 0)
+        close(watcher->mounts_fd);
+    close(watcher->stop_pipe[0]);
+    close(watcher->stop_pipe[1]);
+    for(size_t i=0; i<watcher->watch_count; i++)
+        free(watcher->watches[i].path);
+    free(watcher->watches);
+    watcherFreePaths(watcher->tree_roots, watcher->tree_root_count);
+    watcherFreePaths(watcher->mount_roots, watcher->mount_root_count);
+    watcherFreePaths(watcher->mounts, watcher->mount_count);
+    if(watcher->pending != NULL)
+        free_WatcherBatch(watcher->pending);
+    free(watcher);
+}
+
+bool Watcher_addTree(Watcher watcher, const char* path) {
+    char* root = watcherTrimmedCopy(path);
+    if(root == NULL)
+        return false;
+    bool added = watcherAddTree(watcher, root) && watcherAppendPath(&watcher->tree_roots, &watcher->tree_root_count, root);
+    free(root);
+    return added;
+}
+
+bool Watcher_addMountRoot(Watcher watcher, const char* path) {
+    char* root = watcherTrimmedCopy(path);
+    if(root == NULL)
+        return false;
+    bool added = watcherAppendPath(&watcher->mount_roots, &watcher->mount_root_count, root);
+    free(root);
+    if(!added)
+        return false;
+    //polling the mount table for POLLPRI reports every mount and unmount
+    if(watcher->mounts_fd < 0) {
+        watcher->mounts_fd = open("/proc/self/mounts", O_RDONLY | O_CLOEXEC);
+        if(watcher->mounts_fd < 0) {
+            Log(LOG_LEVEL_ERROR, "Could not watch mounts: %s\n", strerror(errno));
+            return false;
+        }
+    }
+    watcherFreePaths(watcher->mounts, watcher->mount_count);
+    watcher->mounts = watcherReadMounts(watcher, &watcher->mount_count);
+    return true;
+}
+
+WatcherBatch Watcher_next(Watcher watcher) {
+    uint64_t first_event = 0;
+    uint64_t last_event = 0;
+    if(watcher->pending != NULL && watcher->pending->count > 0)
+        first_event = last_event = watcherNowMs();
+    while(true) {
+        int timeout = -1;
+        if(watcher->pending != NULL && watcher->pending->count > 0) {
+            uint64_t now = watcherNowMs();
+            uint64_t due = last_event+watcher->debounce_ms;
+            if(first_event+watcher->max_delay_ms < due)
+                due = first_event+watcher->max_delay_ms;
+            if(now >= due) {
+                WatcherBatch batch = watcher->pending;
+                watcher->pending = NULL;
+                watcherBatchNormalize(batch);
+                return batch;
+            }
+            timeout = (int) (due-now);
+        }
+        struct pollfd fds[3] = {
+            {watcher->stop_pipe[0], POLLIN, 0},
+            {watcher->inotify_fd, POLLIN, 0},
+            {watcher->mounts_fd, POLLPRI, 0}
+        };
+        int ready = poll(fds, watcher->mounts_fd >= 0 ? 3 : 2, timeout);
+        if(ready < 0) {
+            if(errno == EINTR)
+                continue;
+            Log(LOG_LEVEL_ERROR, "Waiting for watch events failed: %s\n", strerror(errno));
+            return NULL;
+        }
+        if(fds[0].revents != 0)
+            return NULL;
+        size_t before = watcher->pending != NULL ? watcher->pending->count : 0;
+        if(fds[1].revents & POLLIN)
+            watcherReadEvents(watcher);
+        if(watcher->mounts_fd >= 0 && (fds[2].revents & (POLLPRI | POLLERR)))
+            watcherMountsChanged(watcher);
+        size_t after = watcher->pending != NULL ? watcher->pending->count : 0;
+        if(after > before) {
+            last_event = watcherNowMs();
+            if(before == 0)
+                first_event = last_event;
+        }
+    }
+}
+
+//the stop pipe is never drained, so every later Watcher_next returns NULL right away too
+void Watcher_stop(Watcher watcher) {
+    char byte = 0;
+    ssize_t written = write(watcher->stop_pipe[1], &byte, 1);
+    (void) written;
+}
+#endif
@@ -0,0 +1,88 @@
+//
+//  watcher.h
+//  MediaOrganizerCLI
+//
+//  Created by John Bridge on 10/17/26.
+//
+
+#ifndef watcher_h
+#define watcher_h
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <poll.h>
+#include <time.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include "logger.h"
+
+//a batch is handed out once no new file has shown up for WATCHER_DEBOUNCE_MS,
+//or WATCHER_MAX_DELAY_MS after its first file if they keep coming
+#define WATCHER_DEBOUNCE_MS 2000
+#define WATCHER_MAX_DELAY_MS 30000
+
+typedef struct WatcherEntry *WatcherEntry;
+typedef struct WatcherBatch *WatcherBatch;
+typedef struct WatcherWatch *WatcherWatch;
+typedef struct Watcher *Watcher;
+
+//A finished file, or a directory (new folder, newly attached storage) to organize as a whole
+struct WatcherEntry {
+    char* path;
+    bool is_directory;
+};
+
+//Sorted, with duplicates and paths inside a batched directory removed
+struct WatcherBatch {
+    struct WatcherEntry *entries;
+    size_t count;
+    size_t capacity;
+};
+extern void free_WatcherBatch(WatcherBatch batch);
+
+struct WatcherWatch {
+    int wd;
+    char* path;
+};
+
+//Watches source trees for files that have been written and closed, and mount roots (e.g. /media/user)
+//for storage being attached. Linux only: inotify, plus /proc/self/mounts for mount changes
+struct Watcher {
+    int inotify_fd;
+    int mounts_fd;          //-1 until a mount root is added
+    int stop_pipe[2];       //Watcher_stop wakes Watcher_next through it
+    struct WatcherWatch *watches;   //sorted by wd
+    size_t watch_count;
+    size_t watch_capacity;
+    char** tree_roots;      //rescanned if the kernel drops events
+    size_t tree_root_count;
+    char** mount_roots;
+    size_t mount_root_count;
+    char** mounts;          //mount points under the mount roots, as of the last mount change
+    size_t mount_count;
+    unsigned int debounce_ms;
+    unsigned int max_delay_ms;
+    WatcherBatch pending;
+};
+extern bool Watcher_supported(void);
+extern Watcher new_Watcher(void);
+extern void free_Watcher(Watcher watcher);
+
+//Watches path and every folder below it, including ones created later
+extern bool Watcher_addTree(Watcher watcher, const char* path);
+//Storage mounted anywhere below path is batched as a directory. What is mounted already is not
+extern bool Watcher_addMountRoot(Watcher watcher, const char* path);
+
+//Blocks until a batch is ready. Returns NULL once Watcher_stop was called, or on error
+extern WatcherBatch Watcher_next(Watcher watcher);
+//Async signal safe
+extern void Watcher_stop(Watcher watcher);
+
+#endif /* watcher_h */
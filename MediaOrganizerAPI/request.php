@@ -12,6 +12,15 @@ if($_SERVER['REQUEST_METHOD']=="GET") {
 		if($cursor->valid()) {
 			$current = $cursor->current();
 		    $thumbnail_path = $current->thumb_path;
+		    //optional size: the smallest rendition at least that large on its long edge
+		    if(isset($_GET['size']) && isset($current->thumbnails)) {
+		        foreach($current->thumbnails as $thumbnail) {
+		            if(max($thumbnail->width, $thumbnail->height) >= intval($_GET['size'])) {
+		                $thumbnail_path = $thumbnail->path;
+		                break;
+		            }
+		        }
+		    }
 		    header("Content-Type: image/jpeg");
 		    header("Content-Length: ".filesize($thumbnail_path));
 		    $fp = fopen($thumbnail_path, 'rb');